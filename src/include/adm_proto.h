@@ -55,6 +55,7 @@ int krb5_klog_syslog(int, const char *, ...)
 #endif
     ;
 void krb5_klog_reopen (krb5_context);
+krb5_error_code krb5_klog_start_async(krb5_context);
 
 /* alt_prof.c */
 krb5_error_code krb5_aprof_init(char *, char *, krb5_pointer *);
@@ -235,13 +235,27 @@ typedef unsigned char   u_char;
 #define KRB5_CONF_KDCDEFAULTS                  "kdcdefaults"
 #define KRB5_CONF_KDC_DEFAULT_OPTIONS          "kdc_default_options"
 #define KRB5_CONF_KDC_LISTEN                   "kdc_listen"
+#define KRB5_CONF_KDC_LOOKASIDE_BUCKETS        "kdc_lookaside_buckets"
+#define KRB5_CONF_KDC_LOOKASIDE_DIGEST         "kdc_lookaside_digest"
+#define KRB5_CONF_KDC_LOOKASIDE_SHARDS         "kdc_lookaside_shards"
+#define KRB5_CONF_KDC_LOOKASIDE_SIZE           "kdc_lookaside_size"
 #define KRB5_CONF_KDC_MAX_DGRAM_REPLY_SIZE     "kdc_max_dgram_reply_size"
+#define KRB5_CONF_KDC_METRICS_SOCKET           "kdc_metrics_socket"
+#define KRB5_CONF_KDC_OVERLOAD_LATENCY         "kdc_overload_latency"
+#define KRB5_CONF_KDC_OVERLOAD_QUEUE_DEPTH     "kdc_overload_queue_depth"
+#define KRB5_CONF_KDC_OVERLOAD_SOURCE_RATE     "kdc_overload_source_rate"
 #define KRB5_CONF_KDC_PORTS                    "kdc_ports"
+#define KRB5_CONF_KDC_PREAUTH_THREADS          "kdc_preauth_threads"
 #define KRB5_CONF_KDC_REQ_CHECKSUM_TYPE        "kdc_req_checksum_type"
+#define KRB5_CONF_KDC_REUSEPORT                "kdc_reuseport"
 #define KRB5_CONF_KDC_TCP_PORTS                "kdc_tcp_ports"
+#define KRB5_CONF_KDC_TCP_IDLE_TIMEOUT         "kdc_tcp_idle_timeout"
 #define KRB5_CONF_KDC_TCP_LISTEN               "kdc_tcp_listen"
 #define KRB5_CONF_KDC_TCP_LISTEN_BACKLOG       "kdc_tcp_listen_backlog"
 #define KRB5_CONF_KDC_TIMESYNC                 "kdc_timesync"
+#define KRB5_CONF_KEEP_OPEN                    "keep_open"
+#define KRB5_CONF_KDC_UDP_BATCH_SIZE           "kdc_udp_batch_size"
+#define KRB5_CONF_KEY_CACHE_SIZE               "key_cache_size"
 #define KRB5_CONF_KEY_STASH_FILE               "key_stash_file"
 #define KRB5_CONF_KPASSWD_LISTEN               "kpasswd_listen"
 #define KRB5_CONF_KPASSWD_PORT                 "kpasswd_port"
@@ -262,6 +276,7 @@ typedef unsigned char   u_char;
 #define KRB5_CONF_LDAP_SERVERS                 "ldap_servers"
 #define KRB5_CONF_LDAP_SERVICE_PASSWORD_FILE   "ldap_service_password_file"
 #define KRB5_CONF_LIBDEFAULTS                  "libdefaults"
+#define KRB5_CONF_LOCKOUT_FLUSH_INTERVAL       "lockout_flush_interval"
 #define KRB5_CONF_LOGGING                      "logging"
 #define KRB5_CONF_MASTER_KDC                   "master_kdc"
 #define KRB5_CONF_MASTER_KEY_NAME              "master_key_name"
@@ -275,7 +290,12 @@ typedef unsigned char   u_char;
 #define KRB5_CONF_PLUGINS                      "plugins"
 #define KRB5_CONF_PLUGIN_BASE_DIR              "plugin_base_dir"
 #define KRB5_CONF_PREFERRED_PREAUTH_TYPES      "preferred_preauth_types"
+#define KRB5_CONF_PRINCIPAL_BLOOM_FILTER       "principal_bloom_filter"
+#define KRB5_CONF_PRINCIPAL_CACHE_SIZE         "principal_cache_size"
+#define KRB5_CONF_PRINCIPAL_CACHE_TTL          "principal_cache_ttl"
+#define KRB5_CONF_PRINCIPAL_NEGATIVE_CACHE_SIZE "principal_negative_cache_size"
 #define KRB5_CONF_PROXIABLE                    "proxiable"
+#define KRB5_CONF_QUEUE_SIZE                   "queue_size"
 #define KRB5_CONF_RDNS                         "rdns"
 #define KRB5_CONF_REALMS                       "realms"
 #define KRB5_CONF_REALM_TRY_DOMAINS            "realm_try_domains"
@@ -1758,6 +1778,18 @@ krb5int_ldap_decode_sequence_of_keys(const krb5_data *in,
 krb5_error_code
 krb5_encrypt_tkt_part(krb5_context, const krb5_keyblock *, krb5_ticket *);
 
+krb5_error_code
+k5_encrypt_tkt_part_key(krb5_context context, krb5_key srv_key,
+                        krb5_ticket *dec_ticket);
+
+krb5_error_code
+k5_decrypt_tkt_part_key(krb5_context context, krb5_key srv_key,
+                        krb5_ticket *ticket);
+
+krb5_error_code
+k5_auth_con_setuseruserkey_k(krb5_context context,
+                             krb5_auth_context auth_context, krb5_key key);
+
 krb5_error_code
 krb5_encode_kdc_rep(krb5_context, krb5_msgtype, const krb5_enc_kdc_rep_part *,
                     int using_subkey, const krb5_keyblock *, krb5_kdc_rep *,
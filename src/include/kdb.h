@@ -136,6 +136,7 @@
 #define KRB5_DB_ITER_WRITE      0x00000001
 #define KRB5_DB_ITER_REV        0x00000002
 #define KRB5_DB_ITER_RECURSE    0x00000004
+#define KRB5_DB_ITER_UNLOCKED   0x00000008
 
 /* String attribute names recognized by krb5 */
 #define KRB5_KDB_SK_SESSION_ENCTYPES            "session_enctypes"
@@ -375,6 +376,29 @@ krb5_error_code krb5_db_get_principal ( krb5_context kcontext,
                                         krb5_const_principal search_for,
                                         unsigned int flags,
                                         krb5_db_entry **entry );
+
+/*
+ * Callback for krb5_db_get_principal_async.  On success, code is 0 and the
+ * callback owns entry, which it must free with krb5_db_free_principal.
+ */
+typedef void
+(*krb5_db_get_principal_cb)(krb5_context kcontext, void *arg,
+                            krb5_error_code code, krb5_db_entry *entry);
+
+struct verto_ctx;
+
+/*
+ * Look up a principal as krb5_db_get_principal does, invoking respond with
+ * the result.  If the module supports it, the lookup is performed using
+ * events on vctx and respond is invoked from the event loop; otherwise
+ * respond is invoked before this function returns.
+ */
+void krb5_db_get_principal_async ( krb5_context kcontext,
+                                   struct verto_ctx *vctx,
+                                   krb5_const_principal search_for,
+                                   unsigned int flags,
+                                   krb5_db_get_principal_cb respond,
+                                   void *arg );
 void krb5_db_free_principal ( krb5_context kcontext, krb5_db_entry *entry );
 krb5_error_code krb5_db_put_principal ( krb5_context kcontext,
                                         krb5_db_entry *entry );
@@ -867,6 +891,13 @@ krb5_error_code krb5_db_register_keytab(krb5_context context);
  */
 #define KRB5_KDB_DAL_MAJOR_VERSION 6
 
+/*
+ * Modules may set the min_ver field of the vtable to this value to indicate
+ * that they provide the methods added in that minor version.  Methods of
+ * minor versions greater than min_ver are treated as NULL.
+ */
+#define KRB5_KDB_DAL_MINOR_VERSION 1
+
 /*
  * A krb5_context can hold one database object.  Modules should use
  * krb5_db_set_context and krb5_db_get_context to store state associated with
@@ -949,8 +980,10 @@ typedef struct _kdb_vftabl {
                                char **db_args);
 
     /*
-     * Deprecated: No longer used as of krb5 1.10; can be removed in the next
-     * DAL revision.  Modules should leave as NULL.
+     * Optional: Set *age to a time which changes whenever the contents of the
+     * database change.  Used by the KDC to invalidate its principal cache.
+     * Changes made by the audit_as_req method (lockout and last-success
+     * updates) need not change the age.
      */
     krb5_error_code (*get_age)(krb5_context kcontext, char *db_name,
                                time_t *age);
@@ -1073,7 +1106,10 @@ typedef struct _kdb_vftabl {
      * Optional: For each principal entry in the database, invoke func with the
      * argments func_arg and the entry data.  If match_entry is specified, the
      * module may narrow the iteration to principal names matching that regular
-     * expression; a module may alternatively ignore match_entry.
+     * expression; a module may alternatively ignore match_entry.  If
+     * iterflags contains KRB5_DB_ITER_UNLOCKED, the module must not hold
+     * database locks while func runs, and must return an error if it cannot
+     * iterate that way.
      */
     krb5_error_code (*iterate)(krb5_context kcontext,
                                char *match_entry,
@@ -1382,6 +1418,26 @@ typedef struct _kdb_vftabl {
                                                  krb5_const_principal client,
                                                  const krb5_db_entry *server,
                                                  krb5_const_principal proxy);
+
+    /* End of minor version 0. */
+
+    /*
+     * Optional: Begin a lookup of search_for, with the same semantics as
+     * get_principal, whose result will be delivered by calling respond (with
+     * arg as its argument) from a callback on the event loop vctx.  The
+     * module may also call respond before returning.  The callback owns any
+     * entry passed to it.
+     *
+     * This method lets modules which talk to a remote database keep many
+     * lookups in flight without blocking the KDC's event loop.  It is only
+     * called from the thread which runs vctx.
+     */
+    void (*get_principal_async)(krb5_context kcontext, struct verto_ctx *vctx,
+                                krb5_const_principal search_for,
+                                unsigned int flags,
+                                krb5_db_get_principal_cb respond, void *arg);
+
+    /* End of minor version 1. */
 } kdb_vftabl;
 
 #endif /* !defined(_WIN32) */
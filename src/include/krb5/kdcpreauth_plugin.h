@@ -118,6 +118,19 @@ typedef struct krb5_kdcpreauth_modreq_st *krb5_kdcpreauth_modreq;
  * header dependency for the moment). */
 struct verto_ctx;
 
+/*
+ * A function to be run on a KDC preauth thread by the offload callback.  It
+ * must use the supplied context rather than the request's context, and must
+ * not use the rock or call any other callback.
+ */
+typedef krb5_error_code
+(*krb5_kdcpreauth_work_fn)(krb5_context context, void *arg);
+
+/* A function called on the KDC's main thread when offloaded work is done, with
+ * the result of the work function. */
+typedef void
+(*krb5_kdcpreauth_work_done_fn)(void *arg, krb5_error_code code);
+
 /* Before using a callback after version 1, modules must check the vers
  * field of the callback structure. */
 typedef struct krb5_kdcpreauth_callbacks_st {
@@ -221,6 +234,21 @@ typedef struct krb5_kdcpreauth_callbacks_st {
 
     /* End of version 3 kdcpreauth callbacks. */
 
+    /*
+     * Run work(thread_context, arg) on a KDC preauth thread, and then call
+     * done(arg, code) on the KDC's main thread with the result.  If work
+     * returns an error with an extended message, the message is copied to
+     * context before done is called.  This may only be used by an asynchronous
+     * verify method, which should call its respond function from done.  If
+     * the KDC has no preauth threads, work is called with context and done is
+     * called before this callback returns.
+     */
+    void (*offload)(krb5_context context, krb5_kdcpreauth_rock rock,
+                    krb5_kdcpreauth_work_fn work,
+                    krb5_kdcpreauth_work_done_fn done, void *arg);
+
+    /* End of version 4 kdcpreauth callbacks. */
+
 } *krb5_kdcpreauth_callbacks;
 
 /* Optional: preauth plugin initialization function. */
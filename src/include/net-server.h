@@ -69,10 +69,83 @@ krb5_error_code loop_add_rpc_service(int default_port, const char *addresses,
 krb5_error_code loop_setup_network(verto_ctx *ctx, void *handle,
                                    const char *progname,
                                    int tcp_listen_backlog);
+
+/*
+ * If value is true, set SO_REUSEPORT on the listener sockets subsequently
+ * created by loop_setup_network(), so that several processes can each bind
+ * their own sockets to the same addresses.  Return ENOTSUP if the platform
+ * does not support SO_REUSEPORT.
+ */
+krb5_error_code loop_set_reuseport(krb5_boolean value);
+
+/*
+ * Receive up to n datagrams from a UDP socket each time it becomes readable,
+ * and send the replies produced while processing them together, using one
+ * system call for each where the platform supports it.  n is limited to 64.
+ * The default is 1, which receives and sends one datagram at a time.
+ */
+void loop_set_udp_batch_size(int n);
+
+/*
+ * Close TCP and RPC data connections which have seen no activity for the given
+ * number of seconds.  The default is 0, which leaves idle connections open
+ * until they are displaced by newer ones.
+ */
+void loop_set_tcp_idle_timeout(int seconds);
+
+/*
+ * Arrange for sent(data, ok) to be called once the response passed to the very
+ * next call of a respond function has been written to the network, with ok
+ * true, or has been abandoned, with ok false.  Only one notification may be
+ * pending, and it must be requested on the main loop thread.
+ */
+typedef void (*loop_sent_fn)(void *data, krb5_boolean ok);
+void loop_notify_sent(loop_sent_fn sent, void *data);
+
+/* Close the sockets created by loop_setup_network(). */
+void loop_close_network(void);
+
 krb5_error_code loop_setup_signals(verto_ctx *ctx, void *handle,
                                    void (*reset)());
 void loop_free(verto_ctx *ctx);
 
+/*
+ * A free list of fixed-size objects, for per-request structures which are
+ * allocated and released frequently by the main loop thread.  Released
+ * objects are kept for reuse, up to max_idle of them.  The statistics record
+ * how many objects were obtained from the heap and from the free list, and the
+ * most objects in use at once.  A pool is not safe for use by multiple
+ * threads.
+ */
+struct loop_pool {
+    size_t objsize;
+    unsigned int max_idle;
+    void *free_list;
+    unsigned int idle;
+    unsigned int in_use;
+    unsigned int high_water;
+    unsigned long heap_allocs;
+    unsigned long reuses;
+};
+
+#define LOOP_POOL_INITIALIZER(type, max_idle)   \
+    { sizeof(type), max_idle, NULL, 0, 0, 0, 0, 0 }
+
+/* Return an uninitialized object from pool, or NULL if out of memory. */
+void *loop_pool_get(struct loop_pool *pool);
+
+/* Release an object obtained from pool.  obj may be NULL. */
+void loop_pool_put(struct loop_pool *pool, void *obj);
+
+/* Make sure at least n objects are available without heap allocation. */
+krb5_error_code loop_pool_prealloc(struct loop_pool *pool, unsigned int n);
+
+/* Free the idle objects in pool. */
+void loop_pool_drain(struct loop_pool *pool);
+
+/* Log the statistics for pool, identified by name. */
+void loop_pool_log_stats(struct loop_pool *pool, const char *name);
+
 /* to be supplied by the server application */
 
 /*
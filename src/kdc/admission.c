@@ -0,0 +1,257 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/admission.c - Admission control for an overloaded KDC */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * When admission control is enabled, the KDC watches three signs of overload:
+ * the number of requests in progress (waiting for a request thread or a
+ * database lookup), the smoothed time taken to answer requests, and the
+ * fraction of time the main loop spends dispatching requests.  The last is
+ * needed because requests waiting in a UDP socket buffer are invisible to the
+ * KDC; a main loop which is almost never idle means that they are piling up.
+ *
+ * While overloaded, the KDC continues to process TGS requests and AS requests
+ * carrying FAST armor, which come from clients already holding tickets.  Other
+ * AS requests are refused after decoding, before any database or cryptographic
+ * work is done, unless a per-source rate is configured and the source address
+ * of the request has not exceeded it.  The armor itself is verified only if
+ * the request is processed.
+ *
+ * All of this state is used only by the main loop thread.
+ */
+
+#include "k5-int.h"
+#include "kdc_util.h"
+#include "adm_proto.h"
+#include <syslog.h>
+
+/* The interval over which the main loop's busy time is measured. */
+#define WINDOW_US 100000
+
+/* The number of per-source token buckets.  Sources which hash to the same
+ * bucket replace each other, each starting with a full bucket. */
+#define NBUCKETS 4096
+
+/* Tokens are counted in millionths, so that each microsecond adds rate. */
+#define TOKEN 1000000
+
+struct source_bucket {
+    unsigned char addr[16];
+    unsigned int addrlen;
+    uint64_t updated;
+    uint64_t tokens;
+};
+
+static krb5_boolean enabled;
+static uint64_t latency_limit;
+static unsigned int depth_limit;
+static unsigned int source_rate;
+
+static krb5_boolean overloaded;
+static unsigned int in_progress;
+static uint64_t latency_avg;
+static uint64_t window_start, window_busy;
+static uint64_t current_time;
+static unsigned long refused;
+
+static struct source_bucket *buckets;
+static uint32_t hash_seed;
+
+/*
+ * Enable admission control if latency_ms or queue_depth is positive.  The KDC
+ * is considered overloaded if the smoothed request latency reaches latency_ms
+ * milliseconds or more than queue_depth requests are in progress.  While
+ * overloaded, admit up to source_rate unauthenticated AS requests per second
+ * from each source address.
+ */
+krb5_error_code
+kdc_init_admission(krb5_context context, int latency_ms, int queue_depth,
+                   int rate)
+{
+    krb5_data seed = make_data(&hash_seed, sizeof(hash_seed));
+
+    if (latency_ms <= 0 && queue_depth <= 0)
+        return 0;
+    latency_limit = (latency_ms > 0) ? (uint64_t)latency_ms * 1000 : 0;
+    depth_limit = (queue_depth > 0) ? queue_depth : 0;
+    source_rate = (rate > 0) ? rate : 0;
+    if (source_rate > 0) {
+        buckets = calloc(NBUCKETS, sizeof(*buckets));
+        if (buckets == NULL)
+            return ENOMEM;
+        (void)krb5_c_random_make_octets(context, &seed);
+    }
+    enabled = TRUE;
+    return 0;
+}
+
+void
+kdc_free_admission(void)
+{
+    free(buckets);
+    buckets = NULL;
+    enabled = FALSE;
+}
+
+/* At the end of each measurement window, decide whether the KDC is overloaded,
+ * with some hysteresis so that it does not flap between states. */
+static void
+update_state(uint64_t now)
+{
+    uint64_t elapsed = now - window_start;
+    krb5_boolean high, low;
+
+    if (window_start == 0) {
+        window_start = now;
+        return;
+    }
+    if (elapsed < WINDOW_US)
+        return;
+
+    high = window_busy * 10 >= elapsed * 9 ||
+        (latency_limit && latency_avg >= latency_limit) ||
+        (depth_limit && in_progress > depth_limit);
+    low = window_busy * 2 < elapsed &&
+        (!latency_limit || latency_avg < latency_limit / 2) &&
+        (!depth_limit || in_progress <= depth_limit / 2);
+    if (!overloaded && high) {
+        krb5_klog_syslog(LOG_WARNING, _("KDC is overloaded; refusing "
+                                        "unauthenticated AS requests"));
+        overloaded = TRUE;
+    } else if (overloaded && low) {
+        krb5_klog_syslog(LOG_NOTICE, _("KDC is no longer overloaded; %lu "
+                                       "requests were refused"), refused);
+        overloaded = FALSE;
+        refused = 0;
+    }
+    window_start = now;
+    window_busy = 0;
+}
+
+/* Note the arrival of a request.  Return a timestamp to be passed to
+ * kdc_admission_busy() and kdc_admission_end(), or 0 if admission control is
+ * not enabled. */
+uint64_t
+kdc_admission_begin(void)
+{
+    if (!enabled)
+        return 0;
+    current_time = kdc_monotonic_time();
+    in_progress++;
+    return current_time;
+}
+
+/* Note that the main loop has finished its synchronous processing of a
+ * request which began at start. */
+void
+kdc_admission_busy(uint64_t start)
+{
+    uint64_t now;
+
+    if (start == 0)
+        return;
+    now = kdc_monotonic_time();
+    window_busy += now - start;
+    update_state(now);
+}
+
+/* Note that the request which began at start has been answered. */
+void
+kdc_admission_end(uint64_t start)
+{
+    uint64_t sample;
+
+    if (start == 0)
+        return;
+    sample = kdc_monotonic_time() - start;
+    in_progress--;
+    /* Keep an exponentially weighted moving average with weight 1/8. */
+    if (sample > latency_avg)
+        latency_avg += (sample - latency_avg) / 8;
+    else
+        latency_avg -= (latency_avg - sample) / 8;
+}
+
+static unsigned int
+hash_address(const krb5_address *addr)
+{
+    uint32_t h = 2166136261U ^ hash_seed;
+    unsigned int i;
+
+    for (i = 0; i < addr->length; i++)
+        h = (h ^ addr->contents[i]) * 16777619U;
+    return h % NBUCKETS;
+}
+
+/* Take a token from the bucket for addr if one is available. */
+static krb5_boolean
+take_token(const krb5_address *addr)
+{
+    struct source_bucket *b = &buckets[hash_address(addr)];
+    uint64_t full = (uint64_t)source_rate * TOKEN;
+    unsigned int len = (addr->length < sizeof(b->addr)) ? addr->length :
+        sizeof(b->addr);
+
+    if (b->addrlen != len || memcmp(b->addr, addr->contents, len) != 0) {
+        memcpy(b->addr, addr->contents, len);
+        b->addrlen = len;
+        b->tokens = full;
+    } else {
+        b->tokens += (current_time - b->updated) * source_rate;
+        if (b->tokens > full)
+            b->tokens = full;
+    }
+    b->updated = current_time;
+    if (b->tokens < TOKEN)
+        return FALSE;
+    b->tokens -= TOKEN;
+    return TRUE;
+}
+
+/* Return true if the AS request req from the address from should be processed,
+ * false if it should be refused because the KDC is overloaded. */
+krb5_boolean
+kdc_admit_as_req(krb5_context context, krb5_kdc_req *req,
+                 const krb5_fulladdr *from)
+{
+    if (!enabled)
+        return TRUE;
+    if (!overloaded && !(depth_limit && in_progress > depth_limit))
+        return TRUE;
+    if (krb5int_find_pa_data(context, req->padata,
+                             KRB5_PADATA_FX_FAST) != NULL)
+        return TRUE;
+    if (buckets != NULL && take_token(from->address))
+        return TRUE;
+    refused++;
+    kdc_metrics_shed();
+    return FALSE;
+}
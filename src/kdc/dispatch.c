@@ -35,8 +35,8 @@
 
 static krb5_int32 last_usec = 0, last_os_random = 0;
 
-static krb5_error_code make_too_big_error(kdc_realm_t *kdc_active_realm,
-                                          krb5_data **out);
+static krb5_error_code make_error(kdc_realm_t *kdc_active_realm,
+                                  krb5_int32 error, krb5_data **out);
 
 struct dispatch_state {
     loop_respond_fn respond;
@@ -45,8 +45,28 @@ struct dispatch_state {
     int is_tcp;
     kdc_realm_t *active_realm;
     krb5_context kdc_err_context;
+    enum kdc_metrics_type mtype;
+    uint64_t start;
+    uint64_t admit_start;
 };
 
+/* Dispatch states are reused rather than allocated for each request.  They
+ * are only allocated and released on the main loop thread. */
+static struct loop_pool dispatch_pool =
+    LOOP_POOL_INITIALIZER(struct dispatch_state, 256);
+
+/* Record how long the main loop took to send a response, and release the
+ * dispatch state kept for it. */
+static void
+finish_send(void *data, krb5_boolean ok)
+{
+    struct dispatch_state *state = data;
+
+    if (ok)
+        kdc_metrics_stage(state->mtype, KDC_METRICS_SEND, state->start);
+    loop_pool_put(&dispatch_pool, state);
+}
+
 static void
 finish_dispatch(struct dispatch_state *state, krb5_error_code code,
                 krb5_data *response)
@@ -59,14 +79,24 @@ finish_dispatch(struct dispatch_state *state, krb5_error_code code,
         response->length > (unsigned int)max_dgram_reply_size) {
         krb5_free_data(kdc_context, response);
         response = NULL;
-        code = make_too_big_error(kdc_active_realm, &response);
+        code = make_error(kdc_active_realm, KRB_ERR_RESPONSE_TOO_BIG,
+                          &response);
         if (code)
             krb5_klog_syslog(LOG_ERR, "error constructing "
                              "KRB_ERR_RESPONSE_TOO_BIG error: %s",
                              error_message(code));
     }
 
-    free(state);
+    kdc_metrics_request(state->mtype, state->is_tcp, state->start);
+    kdc_admission_end(state->admit_start);
+
+    /* If metrics are enabled, keep the state until the response has been
+     * sent. */
+    state->start = kdc_metrics_now();
+    if (state->start != 0 && code == 0 && response != NULL)
+        loop_notify_sent(finish_send, state);
+    else
+        loop_pool_put(&dispatch_pool, state);
     (*oldrespond)(oldarg, code, response);
 }
 
@@ -90,6 +120,26 @@ finish_dispatch_cache(void *arg, krb5_error_code code, krb5_data *response)
     finish_dispatch(state, code, response);
 }
 
+/*
+ * Answer a request refused by admission control without processing it.  Over
+ * TCP, send an error which tells the client to try another KDC.  Over UDP,
+ * where the source address may be forged, just drop the request.
+ */
+static void
+refuse_request(struct dispatch_state *state)
+{
+    krb5_data *response = NULL;
+
+#ifndef NOCACHE
+    kdc_remove_lookaside(state->kdc_err_context, state->request);
+#endif
+    if (state->is_tcp) {
+        (void)make_error(state->active_realm, KDC_ERR_SVC_UNAVAILABLE,
+                         &response);
+    }
+    finish_dispatch(state, 0, response);
+}
+
 static void
 reseed_random(krb5_context kdc_err_context)
 {
@@ -118,10 +168,11 @@ reseed_random(krb5_context kdc_err_context)
     }
 }
 
-void
-dispatch(void *cb, struct sockaddr *local_saddr,
-         const krb5_fulladdr *from, krb5_data *pkt, int is_tcp,
-         verto_ctx *vctx, loop_respond_fn respond, void *arg)
+static void
+dispatch_request(void *cb, struct sockaddr *local_saddr,
+                 const krb5_fulladdr *from, krb5_data *pkt, int is_tcp,
+                 verto_ctx *vctx, loop_respond_fn respond, void *arg,
+                 uint64_t admit_start)
 {
     krb5_error_code retval;
     krb5_kdc_req *as_req;
@@ -129,17 +180,28 @@ dispatch(void *cb, struct sockaddr *local_saddr,
     struct dispatch_state *state;
     struct server_handle *handle = cb;
     krb5_context kdc_err_context = handle->kdc_err_context;
+    uint64_t start = kdc_metrics_now();
 
-    state = k5alloc(sizeof(*state), &retval);
+    state = loop_pool_get(&dispatch_pool);
     if (state == NULL) {
-        (*respond)(arg, retval, NULL);
+        kdc_admission_end(admit_start);
+        (*respond)(arg, ENOMEM, NULL);
         return;
     }
+    memset(state, 0, sizeof(*state));
     state->respond = respond;
     state->arg = arg;
     state->request = pkt;
     state->is_tcp = is_tcp;
     state->kdc_err_context = kdc_err_context;
+    state->start = start;
+    state->admit_start = admit_start;
+    if (krb5_is_tgs_req(pkt))
+        state->mtype = KDC_METRICS_TGS;
+    else if (krb5_is_as_req(pkt))
+        state->mtype = KDC_METRICS_AS;
+    else
+        state->mtype = KDC_METRICS_OTHER;
 
     /* decode incoming packet, and dispatch */
 
@@ -150,6 +212,7 @@ dispatch(void *cb, struct sockaddr *local_saddr,
         const char *name = 0;
         char buf[46];
 
+        kdc_metrics_lookaside_hit();
         name = inet_ntop (ADDRTYPE2FAMILY (from->address->addrtype),
                           from->address->contents, buf, sizeof (buf));
         if (name == 0)
@@ -176,10 +239,16 @@ dispatch(void *cb, struct sockaddr *local_saddr,
 
     /* try TGS_REQ first; they are more common! */
 
-    if (krb5_is_tgs_req(pkt)) {
+    if (state->mtype == KDC_METRICS_TGS) {
+        /* Hand the request to a request thread if we have them. */
+        if (kdc_queue_tgs_req(pkt, from, finish_dispatch_cache, state))
+            return;
         retval = process_tgs_req(handle, pkt, from, &response);
-    } else if (krb5_is_as_req(pkt)) {
-        if (!(retval = decode_krb5_as_req(pkt, &as_req))) {
+    } else if (state->mtype == KDC_METRICS_AS) {
+        start = kdc_metrics_now();
+        retval = decode_krb5_as_req(pkt, &as_req);
+        kdc_metrics_stage(KDC_METRICS_AS, KDC_METRICS_DECODE, start);
+        if (!retval) {
             /*
              * setup_server_realm() sets up the global realm-specific data
              * pointer.
@@ -187,6 +256,13 @@ dispatch(void *cb, struct sockaddr *local_saddr,
              */
             state->active_realm = setup_server_realm(handle, as_req->server);
             if (state->active_realm != NULL) {
+                /* Refuse the request now if the KDC is overloaded, before
+                 * any database or cryptographic work is done. */
+                if (!kdc_admit_as_req(kdc_err_context, as_req, from)) {
+                    krb5_free_kdc_req(kdc_err_context, as_req);
+                    refuse_request(state);
+                    return;
+                }
                 process_as_req(as_req, pkt, from, state->active_realm, vctx,
                                finish_dispatch_cache, state);
                 return;
@@ -201,8 +277,21 @@ dispatch(void *cb, struct sockaddr *local_saddr,
     finish_dispatch_cache(state, retval, response);
 }
 
+void
+dispatch(void *cb, struct sockaddr *local_saddr,
+         const krb5_fulladdr *from, krb5_data *pkt, int is_tcp,
+         verto_ctx *vctx, loop_respond_fn respond, void *arg)
+{
+    uint64_t admit_start = kdc_admission_begin();
+
+    dispatch_request(cb, local_saddr, from, pkt, is_tcp, vctx, respond, arg,
+                     admit_start);
+    kdc_admission_busy(admit_start);
+}
+
+/* Encode a KRB-ERROR message with the given protocol error code. */
 static krb5_error_code
-make_too_big_error(kdc_realm_t *kdc_active_realm, krb5_data **out)
+make_error(kdc_realm_t *kdc_active_realm, krb5_int32 error, krb5_data **out)
 {
     krb5_error errpkt;
     krb5_error_code retval;
@@ -214,7 +303,7 @@ make_too_big_error(kdc_realm_t *kdc_active_realm, krb5_data **out)
     retval = krb5_us_timeofday(kdc_context, &errpkt.stime, &errpkt.susec);
     if (retval)
         return retval;
-    errpkt.error = KRB_ERR_RESPONSE_TOO_BIG;
+    errpkt.error = error;
     errpkt.server = tgs_server;
     errpkt.client = NULL;
     errpkt.text.length = 0;
@@ -234,6 +323,14 @@ make_too_big_error(kdc_realm_t *kdc_active_realm, krb5_data **out)
     return 0;
 }
 
+/* Log the dispatch state pool statistics and free the idle states. */
+void
+kdc_free_dispatch_pool(void)
+{
+    loop_pool_log_stats(&dispatch_pool, "KDC request");
+    loop_pool_drain(&dispatch_pool);
+}
+
 krb5_context get_context(void *handle)
 {
     struct server_handle *sh = handle;
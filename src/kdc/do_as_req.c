@@ -139,6 +139,7 @@ struct as_req_state {
     krb5_enc_kdc_rep_part reply_encpart;
     krb5_ticket ticket_reply;
     krb5_keyblock server_keyblock;
+    krb5_key server_key;
     krb5_keyblock client_keyblock;
     krb5_db_entry *client;
     krb5_db_entry *server;
@@ -167,6 +168,9 @@ struct as_req_state {
 
     kdc_realm_t *active_realm;
     krb5_audit_state *au_state;
+
+    /* When the database lookup or preauth stage began, for metrics. */
+    uint64_t stage_start;
 };
 
 static void
@@ -181,6 +185,7 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
     void *oldarg;
     kdc_realm_t *kdc_active_realm = state->active_realm;
     krb5_audit_state *au_state = state->au_state;
+    uint64_t start;
 
     assert(state);
     oldrespond = state->respond;
@@ -225,10 +230,9 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
      *
      *  server_keyblock is later used to generate auth data signatures
      */
-    if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                             server_key,
-                                             &state->server_keyblock,
-                                             NULL))) {
+    if ((errcode = kdc_decrypt_server_key(kdc_active_realm, state->server,
+                                          server_key, &state->server_keyblock,
+                                          &state->server_key))) {
         state->status = "DECRYPT_SERVER_KEY";
         goto egress;
     }
@@ -298,8 +302,10 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
         goto egress;
     }
 
-    errcode = krb5_encrypt_tkt_part(kdc_context, &state->server_keyblock,
-                                    &state->ticket_reply);
+    start = kdc_metrics_now();
+    errcode = k5_encrypt_tkt_part_key(kdc_context, state->server_key,
+                                      &state->ticket_reply);
+    kdc_metrics_stage(KDC_METRICS_AS, KDC_METRICS_CRYPTO, start);
     if (errcode) {
         state->status = "ENCRYPT_TICKET";
         goto egress;
@@ -342,10 +348,12 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
 
     if (kdc_fast_hide_client(state->rstate))
         state->reply.client = (krb5_principal)krb5_anonymous_principal();
+    start = kdc_metrics_now();
     errcode = krb5_encode_kdc_rep(kdc_context, KRB5_AS_REP,
                                   &state->reply_encpart, 0,
                                   as_encrypting_key,
                                   &state->reply, &response);
+    kdc_metrics_stage(KDC_METRICS_AS, KDC_METRICS_ENCODE, start);
     if (state->client_key != NULL)
         state->reply.enc_part.kvno = state->client_key->key_data_kvno;
     if (errcode) {
@@ -377,6 +385,7 @@ egress:
     free_padata_context(kdc_context, state->pa_context);
     if (as_encrypting_key)
         krb5_free_keyblock(kdc_context, as_encrypting_key);
+    kdc_metrics_result(KDC_METRICS_AS, errcode);
     if (errcode)
         emsg = krb5_get_error_message(kdc_context, errcode);
 
@@ -413,6 +422,7 @@ egress:
                            state->enc_tkt_reply.authorization_data);
     if (state->server_keyblock.contents != NULL)
         krb5_free_keyblock_contents(kdc_context, &state->server_keyblock);
+    krb5_k_free_key(kdc_context, state->server_key);
     if (state->client_keyblock.contents != NULL)
         krb5_free_keyblock_contents(kdc_context, &state->client_keyblock);
     if (state->reply.padata != NULL)
@@ -460,6 +470,10 @@ finish_preauth(void *arg, krb5_error_code code)
     struct as_req_state *state = arg;
     krb5_error_code real_code = code;
 
+    if (state->request->padata != NULL) {
+        kdc_metrics_stage(KDC_METRICS_AS, KDC_METRICS_PREAUTH,
+                          state->stage_start);
+    }
     if (code) {
         if (vague_errors)
             code = KRB5KRB_ERR_GENERIC;
@@ -489,133 +503,23 @@ finish_preauth(void *arg, krb5_error_code code)
     finish_process_as_req(state, code);
 }
 
-/*ARGSUSED*/
-void
-process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
-               const krb5_fulladdr *from, kdc_realm_t *kdc_active_realm,
-               verto_ctx *vctx, loop_respond_fn respond, void *arg)
+/* Continue processing an AS request once the client lookup completes. */
+static void
+lookup_client_done(krb5_context context, void *arg, krb5_error_code errcode,
+                   krb5_db_entry *client)
 {
-    krb5_error_code errcode;
+    struct as_req_state *state = arg;
+    kdc_realm_t *kdc_active_realm = state->active_realm;
+    krb5_audit_state *au_state = state->au_state;
     unsigned int s_flags = 0;
-    krb5_data encoded_req_body;
     krb5_enctype useenctype;
-    struct as_req_state *state;
-    krb5_audit_state *au_state = NULL;
-
-    state = k5alloc(sizeof(*state), &errcode);
-    if (state == NULL) {
-        (*respond)(arg, errcode, NULL);
-        return;
-    }
-    state->respond = respond;
-    state->arg = arg;
-    state->request = request;
-    state->req_pkt = req_pkt;
-    state->from = from;
-    state->active_realm = kdc_active_realm;
-
-    errcode = kdc_make_rstate(kdc_active_realm, &state->rstate);
-    if (errcode != 0) {
-        (*respond)(arg, errcode, NULL);
-        free(state);
-        return;
-    }
-
-    /* Initialize audit state. */
-    errcode = kau_init_kdc_req(kdc_context, state->request, from, &au_state);
-    if (errcode) {
-        (*respond)(arg, errcode, NULL);
-        kdc_free_rstate(state->rstate);
-        free(state);
-        return;
-    }
-    state->au_state = au_state;
-
-    if (state->request->msg_type != KRB5_AS_REQ) {
-        state->status = "VALIDATE_MESSAGE_TYPE";
-        errcode = KRB5_BADMSGTYPE;
-        goto errout;
-    }
-
-    /* Seed the audit trail with the request ID and basic information. */
-    kau_as_req(kdc_context, TRUE, au_state);
-
-    if (fetch_asn1_field((unsigned char *) req_pkt->data,
-                         1, 4, &encoded_req_body) != 0) {
-        errcode = ASN1_BAD_ID;
-        state->status = "FETCH_REQ_BODY";
-        goto errout;
-    }
-    errcode = kdc_find_fast(&state->request, &encoded_req_body, NULL, NULL,
-                            state->rstate, &state->inner_body);
-    if (errcode) {
-        state->status = "FIND_FAST";
-        goto errout;
-    }
-    if (state->inner_body == NULL) {
-        /* Not a FAST request; copy the encoded request body. */
-        errcode = krb5_copy_data(kdc_context, &encoded_req_body,
-                                 &state->inner_body);
-        if (errcode) {
-            state->status = "COPY_REQ_BODY";
-            goto errout;
-        }
-    }
-    au_state->request = state->request;
-    state->rock.request = state->request;
-    state->rock.inner_body = state->inner_body;
-    state->rock.rstate = state->rstate;
-    state->rock.vctx = vctx;
-    state->rock.auth_indicators = &state->auth_indicators;
-    if (!state->request->client) {
-        state->status = "NULL_CLIENT";
-        errcode = KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN;
-        goto errout;
-    }
-    if ((errcode = krb5_unparse_name(kdc_context,
-                                     state->request->client,
-                                     &state->cname))) {
-        state->status = "UNPARSE_CLIENT";
-        goto errout;
-    }
-    limit_string(state->cname);
 
-    if (!state->request->server) {
-        state->status = "NULL_SERVER";
-        errcode = KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
-        goto errout;
-    }
-    if ((errcode = krb5_unparse_name(kdc_context,
-                                     state->request->server,
-                                     &state->sname))) {
-        state->status = "UNPARSE_SERVER";
-        goto errout;
-    }
-    limit_string(state->sname);
-
-    /*
-     * We set KRB5_KDB_FLAG_CLIENT_REFERRALS_ONLY as a hint
-     * to the backend to return naming information in lieu
-     * of cross realm TGS entries.
-     */
-    setflag(state->c_flags, KRB5_KDB_FLAG_CLIENT_REFERRALS_ONLY);
-    /*
-     * Note that according to the referrals draft we should
-     * always canonicalize enterprise principal names.
-     */
-    if (isflagset(state->request->kdc_options, KDC_OPT_CANONICALIZE) ||
-        state->request->client->type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
-        setflag(state->c_flags, KRB5_KDB_FLAG_CANONICALIZE);
-        setflag(state->c_flags, KRB5_KDB_FLAG_ALIAS_OK);
-    }
-    if (include_pac_p(kdc_context, state->request)) {
-        setflag(state->c_flags, KRB5_KDB_FLAG_INCLUDE_PAC);
-    }
-    errcode = krb5_db_get_principal(kdc_context, state->request->client,
-                                    state->c_flags, &state->client);
+    state->client = client;
     if (errcode == KRB5_KDB_CANTLOCK_DB)
         errcode = KRB5KDC_ERR_SVC_UNAVAILABLE;
     if (errcode == KRB5_KDB_NOENTRY) {
+        kdc_note_unknown_principal(kdc_active_realm, state->request->client,
+                                   state->c_flags);
         state->status = "CLIENT_NOT_FOUND";
         if (vague_errors)
             errcode = KRB5KRB_ERR_GENERIC;
@@ -647,8 +551,10 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
     if (isflagset(state->request->kdc_options, KDC_OPT_CANONICALIZE)) {
         setflag(s_flags, KRB5_KDB_FLAG_CANONICALIZE);
     }
-    errcode = krb5_db_get_principal(kdc_context, state->request->server,
-                                    s_flags, &state->server);
+    errcode = kdc_get_principal(kdc_active_realm, state->request->server,
+                                s_flags, &state->server);
+    /* The client and server lookups make up the database stage. */
+    kdc_metrics_stage(KDC_METRICS_AS, KDC_METRICS_DB, state->stage_start);
     if (errcode == KRB5_KDB_CANTLOCK_DB)
         errcode = KRB5KDC_ERR_SVC_UNAVAILABLE;
     if (errcode == KRB5_KDB_NOENTRY) {
@@ -660,7 +566,7 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
         goto errout;
     }
 
-    errcode = get_local_tgt(kdc_context, &state->request->server->realm,
+    errcode = get_local_tgt(kdc_active_realm, &state->request->server->realm,
                             state->server, &state->local_tgt,
                             &state->local_tgt_storage);
     if (errcode) {
@@ -816,6 +722,7 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
      * Check the preauthentication if it is there.
      */
     if (state->request->padata) {
+        state->stage_start = kdc_metrics_now();
         check_padata(kdc_context, &state->rock, state->req_pkt,
                      state->request, &state->enc_tkt_reply, &state->pa_context,
                      &state->e_data, &state->typed_e_data, finish_preauth,
@@ -828,6 +735,140 @@ errout:
     finish_process_as_req(state, errcode);
 }
 
+/*ARGSUSED*/
+void
+process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
+               const krb5_fulladdr *from, kdc_realm_t *kdc_active_realm,
+               verto_ctx *vctx, loop_respond_fn respond, void *arg)
+{
+    krb5_error_code errcode;
+    krb5_data encoded_req_body;
+    struct as_req_state *state;
+    krb5_audit_state *au_state = NULL;
+
+    state = k5alloc(sizeof(*state), &errcode);
+    if (state == NULL) {
+        (*respond)(arg, errcode, NULL);
+        return;
+    }
+    state->respond = respond;
+    state->arg = arg;
+    state->request = request;
+    state->req_pkt = req_pkt;
+    state->from = from;
+    state->active_realm = kdc_active_realm;
+
+    errcode = kdc_make_rstate(kdc_active_realm, &state->rstate);
+    if (errcode != 0) {
+        (*respond)(arg, errcode, NULL);
+        free(state);
+        return;
+    }
+
+    /* Initialize audit state. */
+    errcode = kau_init_kdc_req(kdc_context, state->request, from, &au_state);
+    if (errcode) {
+        (*respond)(arg, errcode, NULL);
+        kdc_free_rstate(state->rstate);
+        free(state);
+        return;
+    }
+    state->au_state = au_state;
+
+    if (state->request->msg_type != KRB5_AS_REQ) {
+        state->status = "VALIDATE_MESSAGE_TYPE";
+        errcode = KRB5_BADMSGTYPE;
+        goto errout;
+    }
+
+    /* Seed the audit trail with the request ID and basic information. */
+    kau_as_req(kdc_context, TRUE, au_state);
+
+    if (fetch_asn1_field((unsigned char *) req_pkt->data,
+                         1, 4, &encoded_req_body) != 0) {
+        errcode = ASN1_BAD_ID;
+        state->status = "FETCH_REQ_BODY";
+        goto errout;
+    }
+    errcode = kdc_find_fast(&state->request, &encoded_req_body, NULL, NULL,
+                            state->rstate, &state->inner_body);
+    if (errcode) {
+        state->status = "FIND_FAST";
+        goto errout;
+    }
+    if (state->inner_body == NULL) {
+        /* Not a FAST request; copy the encoded request body. */
+        errcode = krb5_copy_data(kdc_context, &encoded_req_body,
+                                 &state->inner_body);
+        if (errcode) {
+            state->status = "COPY_REQ_BODY";
+            goto errout;
+        }
+    }
+    au_state->request = state->request;
+    state->rock.request = state->request;
+    state->rock.inner_body = state->inner_body;
+    state->rock.rstate = state->rstate;
+    state->rock.vctx = vctx;
+    state->rock.auth_indicators = &state->auth_indicators;
+    if (!state->request->client) {
+        state->status = "NULL_CLIENT";
+        errcode = KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN;
+        goto errout;
+    }
+    if ((errcode = krb5_unparse_name(kdc_context,
+                                     state->request->client,
+                                     &state->cname))) {
+        state->status = "UNPARSE_CLIENT";
+        goto errout;
+    }
+    limit_string(state->cname);
+
+    if (!state->request->server) {
+        state->status = "NULL_SERVER";
+        errcode = KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
+        goto errout;
+    }
+    if ((errcode = krb5_unparse_name(kdc_context,
+                                     state->request->server,
+                                     &state->sname))) {
+        state->status = "UNPARSE_SERVER";
+        goto errout;
+    }
+    limit_string(state->sname);
+
+    /*
+     * We set KRB5_KDB_FLAG_CLIENT_REFERRALS_ONLY as a hint
+     * to the backend to return naming information in lieu
+     * of cross realm TGS entries.
+     */
+    setflag(state->c_flags, KRB5_KDB_FLAG_CLIENT_REFERRALS_ONLY);
+    /*
+     * Note that according to the referrals draft we should
+     * always canonicalize enterprise principal names.
+     */
+    if (isflagset(state->request->kdc_options, KDC_OPT_CANONICALIZE) ||
+        state->request->client->type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
+        setflag(state->c_flags, KRB5_KDB_FLAG_CANONICALIZE);
+        setflag(state->c_flags, KRB5_KDB_FLAG_ALIAS_OK);
+    }
+    if (include_pac_p(kdc_context, state->request)) {
+        setflag(state->c_flags, KRB5_KDB_FLAG_INCLUDE_PAC);
+    }
+    state->stage_start = kdc_metrics_now();
+    if (kdc_principal_unknown(kdc_active_realm, state->request->client,
+                              state->c_flags)) {
+        lookup_client_done(kdc_context, state, KRB5_KDB_NOENTRY, NULL);
+        return;
+    }
+    krb5_db_get_principal_async(kdc_context, vctx, state->request->client,
+                                state->c_flags, lookup_client_done, state);
+    return;
+
+errout:
+    finish_process_as_req(state, errcode);
+}
+
 static krb5_error_code
 prepare_error_as(struct kdc_request_state *rstate, krb5_kdc_req *request,
                  krb5_db_entry *local_tgt, int error, krb5_pa_data **e_data_in,
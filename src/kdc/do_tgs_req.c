@@ -89,7 +89,7 @@ static krb5_int32
 find_referral_tgs(kdc_realm_t *, krb5_kdc_req *, krb5_principal *);
 
 static krb5_error_code
-db_get_svc_princ(krb5_context, krb5_principal, krb5_flags,
+db_get_svc_princ(kdc_realm_t *, krb5_principal, krb5_flags,
                  krb5_db_entry **, const char **);
 
 static krb5_error_code
@@ -114,6 +114,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     int newtransited = 0;
     krb5_error_code retval = 0;
     krb5_keyblock encrypting_key;
+    krb5_key server_kkey = NULL;
     krb5_timestamp kdc_time, authtime = 0;
     krb5_keyblock session_key;
     krb5_keyblock *reply_key = NULL;
@@ -139,6 +140,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     kdc_realm_t *kdc_active_realm = NULL;
     krb5_audit_state *au_state = NULL;
     krb5_data **auth_indicators = NULL;
+    uint64_t start;
 
     memset(&reply, 0, sizeof(reply));
     memset(&reply_encpart, 0, sizeof(reply_encpart));
@@ -146,7 +148,9 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     memset(&enc_tkt_reply, 0, sizeof(enc_tkt_reply));
     session_key.contents = NULL;
 
+    start = kdc_metrics_now();
     retval = decode_krb5_tgs_req(pkt, &request);
+    kdc_metrics_stage(KDC_METRICS_TGS, KDC_METRICS_DECODE, start);
     if (retval)
         return retval;
     /* Save pointer to client-requested service principal, in case of
@@ -181,10 +185,14 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     /* Seed the audit trail with the request ID and basic information. */
     kau_tgs_req(kdc_context, TRUE, au_state);
 
+    /* Verifying the TGS-REQ authenticator and decrypting the header ticket
+     * is counted as crypto time. */
+    start = kdc_metrics_now();
     errcode = kdc_process_tgs_req(kdc_active_realm,
                                   request, from, pkt, &header_ticket,
                                   &header_server, &header_key, &subkey,
                                   &pa_tgs_req);
+    kdc_metrics_stage(KDC_METRICS_TGS, KDC_METRICS_CRYPTO, start);
     if (header_ticket && header_ticket->enc_part2)
         cprinc = header_ticket->enc_part2->client;
 
@@ -216,7 +224,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
         goto cleanup;
     }
 
-    errcode = get_local_tgt(kdc_context, &sprinc->realm, header_server,
+    errcode = get_local_tgt(kdc_active_realm, &sprinc->realm, header_server,
                             &local_tgt, &local_tgt_storage);
     if (errcode) {
         status = "GET_LOCAL_TGT";
@@ -251,8 +259,10 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
         setflag(s_flags, KRB5_KDB_FLAG_CANONICALIZE);
     }
 
+    start = kdc_metrics_now();
     errcode = search_sprinc(kdc_active_realm, request, s_flags, &server,
                             &status);
+    kdc_metrics_stage(KDC_METRICS_TGS, KDC_METRICS_DB, start);
     if (errcode != 0)
         goto cleanup;
     sprinc = server->princ;
@@ -555,9 +565,9 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
          * Convert server.key into a real key
          * (it may be encrypted in the database)
          */
-        if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                                 server_key, &encrypting_key,
-                                                 NULL))) {
+        if ((errcode = kdc_decrypt_server_key(kdc_active_realm, server,
+                                              server_key, &encrypting_key,
+                                              &server_kkey))) {
             status = "DECRYPT_SERVER_KEY";
             goto cleanup;
         }
@@ -719,8 +729,15 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
         ticket_kvno = server_key->key_data_kvno;
     }
 
-    errcode = krb5_encrypt_tkt_part(kdc_context, &encrypting_key,
-                                    &ticket_reply);
+    start = kdc_metrics_now();
+    if (server_kkey != NULL) {
+        errcode = k5_encrypt_tkt_part_key(kdc_context, server_kkey,
+                                          &ticket_reply);
+    } else {
+        errcode = krb5_encrypt_tkt_part(kdc_context, &encrypting_key,
+                                        &ticket_reply);
+    }
+    kdc_metrics_stage(KDC_METRICS_TGS, KDC_METRICS_CRYPTO, start);
     if (!isflagset(request->kdc_options, KDC_OPT_ENC_TKT_IN_SKEY))
         krb5_free_keyblock_contents(kdc_context, &encrypting_key);
     if (errcode) {
@@ -803,10 +820,12 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
 
     if (kdc_fast_hide_client(state))
         reply.client = (krb5_principal)krb5_anonymous_principal();
+    start = kdc_metrics_now();
     errcode = krb5_encode_kdc_rep(kdc_context, KRB5_TGS_REP, &reply_encpart,
                                   subkey ? 1 : 0,
                                   reply_key,
                                   &reply, response);
+    kdc_metrics_stage(KDC_METRICS_TGS, KDC_METRICS_ENCODE, start);
     if (errcode) {
         status = "ENCODE_KDC_REP";
     } else {
@@ -824,6 +843,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
 
 cleanup:
     assert(status != NULL);
+    krb5_k_free_key(kdc_context, server_kkey);
     if (reply_key)
         krb5_free_keyblock(kdc_context, reply_key);
     if (errcode)
@@ -838,6 +858,7 @@ cleanup:
     log_tgs_req(kdc_context, from, request, &reply, cprinc,
                 sprinc, altcprinc, authtime,
                 c_flags, status, errcode, emsg);
+    kdc_metrics_result(KDC_METRICS_TGS, errcode);
     if (errcode) {
         krb5_free_error_message (kdc_context, emsg);
         emsg = NULL;
@@ -985,7 +1006,7 @@ decrypt_2ndtkt(kdc_realm_t *kdc_active_realm, krb5_kdc_req *req,
         return 0;
 
     stkt = req->second_ticket[0];
-    retval = kdc_get_server_key(kdc_context, stkt,
+    retval = kdc_get_server_key(kdc_active_realm, stkt,
                                 flags,
                                 TRUE, /* match_enctype */
                                 &server,
@@ -1106,7 +1127,7 @@ find_alternate_tgs(kdc_realm_t *kdc_active_realm, krb5_principal princ,
         tmp = *krb5_princ_realm(kdc_context, *pl2);
         krb5_princ_set_realm(kdc_context, *pl2,
                              krb5_princ_realm(kdc_context, princ));
-        retval = db_get_svc_princ(kdc_context, *pl2, 0, &server, status);
+        retval = db_get_svc_princ(kdc_active_realm, *pl2, 0, &server, status);
         krb5_princ_set_realm(kdc_context, *pl2, &tmp);
         if (retval == KRB5_KDB_NOENTRY)
             continue;
@@ -1239,13 +1260,13 @@ cleanup:
 }
 
 static krb5_error_code
-db_get_svc_princ(krb5_context ctx, krb5_principal princ,
+db_get_svc_princ(kdc_realm_t *kdc_active_realm, krb5_principal princ,
                  krb5_flags flags, krb5_db_entry **server,
                  const char **status)
 {
     krb5_error_code ret;
 
-    ret = krb5_db_get_principal(ctx, princ, flags, server);
+    ret = kdc_get_principal(kdc_active_realm, princ, flags, server);
     if (ret == KRB5_KDB_CANTLOCK_DB)
         ret = KRB5KDC_ERR_SVC_UNAVAILABLE;
     if (ret != 0) {
@@ -1269,7 +1290,7 @@ search_sprinc(kdc_realm_t *kdc_active_realm, krb5_kdc_req *req,
     if (!allow_referral)
         flags &= ~KRB5_KDB_FLAG_CANONICALIZE;
 
-    ret = db_get_svc_princ(kdc_context, princ, flags, server, status);
+    ret = db_get_svc_princ(kdc_active_realm, princ, flags, server, status);
     if (ret == 0 || ret != KRB5_KDB_NOENTRY || !allow_referral)
         goto cleanup;
 
@@ -1277,7 +1298,7 @@ search_sprinc(kdc_realm_t *kdc_active_realm, krb5_kdc_req *req,
         ret = find_referral_tgs(kdc_active_realm, req, &reftgs);
         if (ret != 0)
             goto cleanup;
-        ret = db_get_svc_princ(kdc_context, reftgs, flags, server, status);
+        ret = db_get_svc_princ(kdc_active_realm, reftgs, flags, server, status);
         if (ret == 0 || ret != KRB5_KDB_NOENTRY)
             goto cleanup;
 
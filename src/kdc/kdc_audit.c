@@ -45,6 +45,9 @@ typedef struct audit_module_handle_st *audit_module_handle;
 
 static audit_module_handle *handles = NULL;
 
+/* Serializes audit module calls, which may come from request threads. */
+static k5_mutex_t audit_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+
 static void
 free_handles(audit_module_handle *list)
 {
@@ -80,6 +83,10 @@ load_audit_modules(krb5_context context)
     if (context == NULL || handles != NULL)
         return EINVAL;
 
+    ret = k5_mutex_finish_init(&audit_lock);
+    if (ret)
+        return ret;
+
     /* Get audit plugin vtable. */
     ret = k5_plugin_load_all(context, PLUGIN_INTERFACE_AUDIT, &modules);
     if (ret)
@@ -255,11 +262,13 @@ kau_as_req(krb5_context context, const krb5_boolean ev_success,
     if (handles == NULL)
         return;
 
+    k5_mutex_lock(&audit_lock);
     for (hp = handles; *hp != NULL; hp++) {
         hdl = *hp;
         if (hdl->vt.as_req != NULL)
             hdl->vt.as_req(hdl->auctx, ev_success, state);
     }
+    k5_mutex_unlock(&audit_lock);
 }
 
 /* Call the TGS-REQ audit plugin entry point. */
@@ -272,11 +281,13 @@ kau_tgs_req(krb5_context context, const krb5_boolean ev_success,
     if (handles == NULL)
         return;
 
+    k5_mutex_lock(&audit_lock);
     for (hp = handles; *hp != NULL; hp++) {
         hdl = *hp;
         if (hdl->vt.tgs_req != NULL)
             hdl->vt.tgs_req(hdl->auctx, ev_success, state);
     }
+    k5_mutex_unlock(&audit_lock);
 }
 
 /* Call the S4U2Self audit plugin entry point. */
@@ -289,11 +300,13 @@ kau_s4u2self(krb5_context context, const krb5_boolean ev_success,
     if (handles == NULL)
         return;
 
+    k5_mutex_lock(&audit_lock);
     for (hp = handles; *hp != NULL; hp++) {
         hdl = *hp;
         if (hdl->vt.tgs_s4u2self != NULL)
             hdl->vt.tgs_s4u2self(hdl->auctx, ev_success, state);
     }
+    k5_mutex_unlock(&audit_lock);
 }
 
 /* Call the S4U2Proxy audit plugin entry point. */
@@ -306,11 +319,13 @@ kau_s4u2proxy(krb5_context context,const krb5_boolean ev_success,
     if (handles == NULL)
         return;
 
+    k5_mutex_lock(&audit_lock);
     for (hp = handles; *hp != NULL; hp++) {
         hdl = *hp;
         if (hdl->vt.tgs_s4u2proxy != NULL)
             hdl->vt.tgs_s4u2proxy(hdl->auctx, ev_success, state);
     }
+    k5_mutex_unlock(&audit_lock);
 }
 
 /* Call the U2U audit plugin entry point. */
@@ -323,9 +338,11 @@ kau_u2u(krb5_context context, const krb5_boolean ev_success,
     if (handles == NULL)
         return;
 
+    k5_mutex_lock(&audit_lock);
     for (hp = handles; *hp != NULL; hp++) {
         hdl = *hp;
         if (hdl->vt.tgs_u2u != NULL)
             hdl->vt.tgs_u2u(hdl->auctx, ev_success, state);
     }
+    k5_mutex_unlock(&audit_lock);
 }
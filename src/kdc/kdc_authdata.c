@@ -43,6 +43,10 @@ typedef struct kdcauthdata_handle_st {
 static kdcauthdata_handle *authdata_modules;
 static size_t n_authdata_modules;
 
+/* Serializes module handler invocations, which may come from request
+ * threads. */
+static k5_mutex_t authdata_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+
 /* Load authdata plugin modules. */
 krb5_error_code
 load_authdata_plugins(krb5_context context)
@@ -52,6 +56,10 @@ load_authdata_plugins(krb5_context context)
     kdcauthdata_handle *list, *h;
     size_t count;
 
+    ret = k5_mutex_finish_init(&authdata_lock);
+    if (ret)
+        return ret;
+
     ret = k5_plugin_load_all(context, PLUGIN_INTERFACE_KDCAUTHDATA, &modules);
     if (ret)
         return ret;
@@ -849,10 +857,12 @@ handle_authdata(krb5_context context, unsigned int flags,
     if (!isflagset(enc_tkt_reply->flags, TKT_FLG_ANONYMOUS)) {
         for (i = 0; i < n_authdata_modules; i++) {
             h = &authdata_modules[i];
+            k5_mutex_lock(&authdata_lock);
             ret = h->vt.handle(context, h->data, flags, client, server,
                                header_server, client_key, server_key,
                                header_key, req_pkt, req, for_user_princ,
                                enc_tkt_req, enc_tkt_reply);
+            k5_mutex_unlock(&authdata_lock);
             if (ret)
                 kdc_err(context, ret, "from authdata module %s", h->vt.name);
         }
@@ -568,8 +568,17 @@ set_cookie(krb5_context context, krb5_kdcpreauth_rock rock,
     return kdc_fast_set_cookie(rock->rstate, pa_type, data);
 }
 
+static void
+offload(krb5_context context, krb5_kdcpreauth_rock rock,
+        krb5_kdcpreauth_work_fn work, krb5_kdcpreauth_work_done_fn done,
+        void *arg)
+{
+    if (!kdc_queue_preauth_work(context, work, done, arg))
+        (*done)(arg, (*work)(context, arg));
+}
+
 static struct krb5_kdcpreauth_callbacks_st callbacks = {
-    3,
+    4,
     max_time_skew,
     client_keys,
     free_keys,
@@ -583,7 +592,8 @@ static struct krb5_kdcpreauth_callbacks_st callbacks = {
     client_keyblock,
     add_auth_indicator,
     get_cookie,
-    set_cookie
+    set_cookie,
+    offload
 };
 
 static krb5_error_code
@@ -942,6 +952,9 @@ struct padata_state {
 
     krb5_pa_data ***e_data_out;
     krb5_boolean *typed_e_data_out;
+
+    /* When the current verify_padata call began, for metrics. */
+    uint64_t verify_start;
 };
 
 /* Return code if it is 0 or one of the codes we pass through to the client.
@@ -1081,6 +1094,7 @@ finish_verify_padata(void *arg, krb5_error_code code,
 
     assert(state);
     *state->modreq_ptr = modreq;
+    kdc_metrics_preauth(state->pa_sys->type, code, state->verify_start);
 
     if (code) {
         emsg = krb5_get_error_message(state->context, code);
@@ -1175,6 +1189,7 @@ next_padata(struct padata_state *state)
         goto next;
 
     state->pa_found++;
+    state->verify_start = kdc_metrics_now();
     state->pa_sys->verify_padata(state->context, state->req_pkt,
                                  state->request, state->enc_tkt_reply,
                                  *state->padata, &callbacks, state->rock,
@@ -73,10 +73,10 @@ static krb5_error_code kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
                                      krb5_auth_context auth_context,
                                      krb5_db_entry **server,
                                      krb5_keyblock **tgskey);
-static krb5_error_code find_server_key(krb5_context,
+static krb5_error_code find_server_key(kdc_realm_t *,
                                        krb5_db_entry *, krb5_enctype,
                                        krb5_kvno, krb5_keyblock **,
-                                       krb5_kvno *);
+                                       krb5_key *, krb5_kvno *);
 
 /*
  * concatenate first two authdata arrays, returning an allocated replacement.
@@ -382,6 +382,7 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
     krb5_enctype        search_enctype = apreq->ticket->enc_part.enctype;
     krb5_boolean        match_enctype = 1;
     krb5_kvno           kvno;
+    krb5_key            tgskey_k = NULL;
     size_t              tries = 3;
 
     /*
@@ -396,7 +397,7 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
         match_enctype = 0;
     }
 
-    retval = kdc_get_server_key(kdc_context, apreq->ticket,
+    retval = kdc_get_server_key(kdc_active_realm, apreq->ticket,
                                 KRB5_KDB_FLAG_ALIAS_OK, match_enctype, server,
                                 NULL, NULL);
     if (retval)
@@ -406,16 +407,27 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
     kvno = apreq->ticket->enc_part.kvno;
     do {
         krb5_free_keyblock(kdc_context, *tgskey);
-        retval = find_server_key(kdc_context,
-                                 *server, search_enctype, kvno, tgskey, &kvno);
+        krb5_k_free_key(kdc_context, tgskey_k);
+        tgskey_k = NULL;
+        retval = find_server_key(kdc_active_realm, *server, search_enctype,
+                                 kvno, tgskey, &tgskey_k, &kvno);
         if (retval)
             continue;
 
-        /* Make the TGS key available to krb5_rd_req_decoded_anyflag() */
-        retval = krb5_auth_con_setuseruserkey(kdc_context, auth_context,
-                                              *tgskey);
+        /*
+         * Make the TGS key available to krb5_rd_req_decoded_anyflag().  Use
+         * the key object from find_server_key() if we have one, so that its
+         * derived keys are reused.
+         */
+        if (tgskey_k != NULL) {
+            retval = k5_auth_con_setuseruserkey_k(kdc_context, auth_context,
+                                                  tgskey_k);
+        } else {
+            retval = krb5_auth_con_setuseruserkey(kdc_context, auth_context,
+                                                  *tgskey);
+        }
         if (retval)
-            return retval;
+            break;
 
         retval = krb5_rd_req_decoded_anyflag(kdc_context, &auth_context, apreq,
                                              apreq->ticket->server,
@@ -429,9 +441,85 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
     } while (retval && apreq->ticket->enc_part.kvno == 0 && kvno-- > 1 &&
              --tries > 0);
 
+    krb5_k_free_key(kdc_context, tgskey_k);
     return retval;
 }
 
+/* At most this many UNKNOWN SERVER lines are logged per interval, so that a
+ * flood of requests for unknown services cannot flood the log.  The limit is
+ * shared by all realms and request threads of the process. */
+#define UNKNOWN_SERVER_LOG_INTERVAL 10
+#define UNKNOWN_SERVER_LOG_BURST 10
+
+static k5_mutex_t unknown_server_log_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+static time_t unknown_server_log_start;
+static unsigned int unknown_server_log_count;
+
+/* If the current interval has ended, or if force is true, log a summary of
+ * the lines suppressed in it and begin a new one.  unknown_server_log_lock
+ * must be held. */
+static void
+end_unknown_server_log_interval(time_t now, krb5_boolean force)
+{
+    if (!force && now - unknown_server_log_start < UNKNOWN_SERVER_LOG_INTERVAL)
+        return;
+    if (unknown_server_log_count > UNKNOWN_SERVER_LOG_BURST) {
+        krb5_klog_syslog(LOG_ERR, _("TGS_REQ: suppressed %u UNKNOWN SERVER "
+                                    "messages"),
+                         unknown_server_log_count - UNKNOWN_SERVER_LOG_BURST);
+    }
+    unknown_server_log_start = now;
+    unknown_server_log_count = 0;
+}
+
+/* Return true if an UNKNOWN SERVER line may be logged now. */
+static krb5_boolean
+unknown_server_log_ok(void)
+{
+    krb5_boolean ok;
+
+    k5_mutex_lock(&unknown_server_log_lock);
+    end_unknown_server_log_interval(time(NULL), FALSE);
+    ok = unknown_server_log_count++ < UNKNOWN_SERVER_LOG_BURST;
+    k5_mutex_unlock(&unknown_server_log_lock);
+    return ok;
+}
+
+static void
+unknown_server_log_timer(verto_ctx *ctx, verto_ev *ev)
+{
+    k5_mutex_lock(&unknown_server_log_lock);
+    end_unknown_server_log_interval(time(NULL), FALSE);
+    k5_mutex_unlock(&unknown_server_log_lock);
+}
+
+/* Arrange for the summary of suppressed UNKNOWN SERVER lines to be logged
+ * through ctx soon after each interval ends, rather than only when another
+ * line is attempted. */
+krb5_error_code
+kdc_start_unknown_server_log(verto_ctx *ctx)
+{
+    krb5_error_code ret;
+
+    ret = k5_mutex_finish_init(&unknown_server_log_lock);
+    if (ret)
+        return ret;
+    if (verto_add_timeout(ctx, VERTO_EV_FLAG_PERSIST, unknown_server_log_timer,
+                          UNKNOWN_SERVER_LOG_INTERVAL * 1000) == NULL)
+        return ENOMEM;
+    return 0;
+}
+
+/* Log the summary of any UNKNOWN SERVER lines suppressed in the current
+ * interval, at shutdown. */
+void
+kdc_flush_unknown_server_log(void)
+{
+    k5_mutex_lock(&unknown_server_log_lock);
+    end_unknown_server_log_interval(time(NULL), TRUE);
+    k5_mutex_unlock(&unknown_server_log_lock);
+}
+
 /*
  * The KDC should take the keytab associated with the realm and pass
  * that to the krb5_rd_req_decoded_anyflag(), but we still need to use
@@ -441,12 +529,13 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
  * This is also used by do_tgs_req() for u2u auth.
  */
 krb5_error_code
-kdc_get_server_key(krb5_context context,
+kdc_get_server_key(kdc_realm_t *kdc_active_realm,
                    krb5_ticket *ticket, unsigned int flags,
                    krb5_boolean match_enctype, krb5_db_entry **server_ptr,
                    krb5_keyblock **key, krb5_kvno *kvno)
 {
     krb5_error_code       retval;
+    krb5_context          context = kdc_context;
     krb5_db_entry       * server = NULL;
     krb5_enctype          search_enctype = -1;
     krb5_kvno             search_kvno = -1;
@@ -458,11 +547,12 @@ kdc_get_server_key(krb5_context context,
 
     *server_ptr = NULL;
 
-    retval = krb5_db_get_principal(context, ticket->server, flags,
-                                   &server);
+    retval = kdc_get_principal(kdc_active_realm, ticket->server, flags,
+                               &server);
     if (retval == KRB5_KDB_NOENTRY) {
         char *sname;
-        if (!krb5_unparse_name(context, ticket->server, &sname)) {
+        if (unknown_server_log_ok() &&
+            !krb5_unparse_name(context, ticket->server, &sname)) {
             limit_string(sname);
             krb5_klog_syslog(LOG_ERR,
                              _("TGS_REQ: UNKNOWN SERVER: server='%s'"), sname);
@@ -478,8 +568,8 @@ kdc_get_server_key(krb5_context context,
     }
 
     if (key) {
-        retval = find_server_key(context, server, search_enctype, search_kvno,
-                                 key, kvno);
+        retval = find_server_key(kdc_active_realm, server, search_enctype,
+                                 search_kvno, key, NULL, kvno);
         if (retval)
             goto errout;
     }
@@ -494,19 +584,26 @@ errout:
 
 /*
  * A utility function to get the right key from a KDB entry.  Used in handling
- * of kvno 0 TGTs, for example.
+ * of kvno 0 TGTs, for example.  If kkey_out is not NULL, also return a
+ * krb5_key for the server key in *kkey_out, or NULL if the key's enctype had
+ * to be changed to match the requested one.
  */
 static
 krb5_error_code
-find_server_key(krb5_context context,
+find_server_key(kdc_realm_t *kdc_active_realm,
                 krb5_db_entry *server, krb5_enctype enctype, krb5_kvno kvno,
-                krb5_keyblock **key_out, krb5_kvno *kvno_out)
+                krb5_keyblock **key_out, krb5_key *kkey_out,
+                krb5_kvno *kvno_out)
 {
     krb5_error_code       retval;
+    krb5_context          context = kdc_context;
     krb5_key_data       * server_key;
     krb5_keyblock       * key;
+    krb5_key              kkey = NULL;
 
     *key_out = NULL;
+    if (kkey_out != NULL)
+        *kkey_out = NULL;
     retval = krb5_dbe_find_enctype(context, server, enctype, -1,
                                    kvno ? (krb5_int32)kvno : -1, &server_key);
     if (retval)
@@ -515,10 +612,12 @@ find_server_key(krb5_context context,
         return KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
     if ((key = (krb5_keyblock *)malloc(sizeof *key)) == NULL)
         return ENOMEM;
-    retval = krb5_dbe_decrypt_key_data(context, NULL, server_key,
-                                       key, NULL);
-    if (retval)
-        goto errout;
+    retval = kdc_decrypt_server_key(kdc_active_realm, server, server_key, key,
+                                    (kkey_out != NULL) ? &kkey : NULL);
+    if (retval) {
+        free(key);
+        return retval;
+    }
     if (enctype != -1) {
         krb5_boolean similar;
         retval = krb5_c_enctype_compare(context, enctype, key->enctype,
@@ -529,14 +628,24 @@ find_server_key(krb5_context context,
             retval = KRB5_KDB_NO_PERMITTED_KEY;
             goto errout;
         }
+        /* The key object can only be used with its own enctype. */
+        if (key->enctype != enctype) {
+            krb5_k_free_key(context, kkey);
+            kkey = NULL;
+        }
         key->enctype = enctype;
     }
     *key_out = key;
     key = NULL;
+    if (kkey_out != NULL) {
+        *kkey_out = kkey;
+        kkey = NULL;
+    }
     if (kvno_out)
         *kvno_out = server_key->key_data_kvno;
 errout:
     krb5_free_keyblock(context, key);
+    krb5_k_free_key(context, kkey);
     return retval;
 }
 
@@ -550,11 +659,12 @@ errout:
  * server or TGS header ticket server is the local TGT.
  */
 krb5_error_code
-get_local_tgt(krb5_context context, const krb5_data *realm,
+get_local_tgt(kdc_realm_t *kdc_active_realm, const krb5_data *realm,
               krb5_db_entry *candidate, krb5_db_entry **alias_out,
               krb5_db_entry **storage_out)
 {
     krb5_error_code ret;
+    krb5_context context = kdc_context;
     krb5_principal princ;
     krb5_db_entry *tgt;
 
@@ -568,7 +678,7 @@ get_local_tgt(krb5_context context, const krb5_data *realm,
         return ret;
 
     if (!krb5_principal_compare(context, candidate->princ, princ)) {
-        ret = krb5_db_get_principal(context, princ, 0, &tgt);
+        ret = kdc_get_principal(kdc_active_realm, princ, 0, &tgt);
         if (!ret)
             *storage_out = *alias_out = tgt;
     } else {
@@ -1923,4 +2033,5 @@ void reset_for_hangup(void *ctx)
 
     for (k = 0; k < h->kdc_numrealms; k++)
         krb5_db_refresh_config(h->kdc_realmlist[k]->realm_context);
+    kdc_threads_hangup();
 }
@@ -71,12 +71,15 @@ kdc_process_tgs_req (kdc_realm_t *, krb5_kdc_req *,
                      krb5_pa_data **pa_tgs_req);
 
 krb5_error_code
-kdc_get_server_key (krb5_context, krb5_ticket *, unsigned int,
+kdc_get_server_key (kdc_realm_t *, krb5_ticket *, unsigned int,
                     krb5_boolean match_enctype,
                     krb5_db_entry **, krb5_keyblock **, krb5_kvno *);
 
+krb5_error_code kdc_start_unknown_server_log(verto_ctx *ctx);
+void kdc_flush_unknown_server_log(void);
+
 krb5_error_code
-get_local_tgt(krb5_context context, const krb5_data *realm,
+get_local_tgt(kdc_realm_t *kdc_active_realm, const krb5_data *realm,
               krb5_db_entry *candidate, krb5_db_entry **alias_out,
               krb5_db_entry **storage_out);
 
@@ -159,6 +162,9 @@ dispatch (void *,
           loop_respond_fn,
           void *);
 
+void
+kdc_free_dispatch_pool(void);
+
 void
 kdc_err(krb5_context call_context, errcode_t code, const char *fmt, ...)
 #if !defined(__cplusplus) && (__GNUC__ > 2)
@@ -257,12 +263,105 @@ handle_authdata (krb5_context context,
                  krb5_enc_tkt_part *enc_tkt_reply);
 
 /* replay.c */
-krb5_error_code kdc_init_lookaside(krb5_context context);
+krb5_error_code kdc_init_lookaside(krb5_context context, size_t size,
+                                   unsigned int nbuckets, unsigned int nshards,
+                                   krb5_boolean digest);
+krb5_error_code kdc_share_lookaside(krb5_context context);
 krb5_boolean kdc_check_lookaside (krb5_context, krb5_data *, krb5_data **);
 void kdc_insert_lookaside (krb5_context, krb5_data *, krb5_data *);
 void kdc_remove_lookaside (krb5_context kcontext, krb5_data *);
+void kdc_log_lookaside_stats(void);
 void kdc_free_lookaside(krb5_context);
 
+/* threads.c */
+krb5_error_code kdc_start_threads(verto_ctx *ctx, int num);
+void kdc_stop_threads(void);
+void kdc_threads_hangup(void);
+krb5_boolean kdc_queue_tgs_req(krb5_data *pkt, const krb5_fulladdr *from,
+                               loop_respond_fn respond, void *arg);
+krb5_error_code kdc_start_preauth_threads(verto_ctx *ctx, int num);
+krb5_boolean kdc_queue_preauth_work(krb5_context context,
+                                    krb5_kdcpreauth_work_fn work,
+                                    krb5_kdcpreauth_work_done_fn done,
+                                    void *arg);
+
+/* admission.c */
+krb5_error_code kdc_init_admission(krb5_context context, int latency_ms,
+                                   int queue_depth, int rate);
+void kdc_free_admission(void);
+uint64_t kdc_admission_begin(void);
+void kdc_admission_busy(uint64_t start);
+void kdc_admission_end(uint64_t start);
+krb5_boolean kdc_admit_as_req(krb5_context context, krb5_kdc_req *req,
+                              const krb5_fulladdr *from);
+
+/* metrics.c */
+enum kdc_metrics_type {
+    KDC_METRICS_AS,
+    KDC_METRICS_TGS,
+    KDC_METRICS_OTHER,
+    KDC_METRICS_NTYPES
+};
+enum kdc_metrics_stage {
+    KDC_METRICS_DECODE,
+    KDC_METRICS_DB,
+    KDC_METRICS_PREAUTH,
+    KDC_METRICS_CRYPTO,
+    KDC_METRICS_ENCODE,
+    KDC_METRICS_SEND,
+    KDC_METRICS_NSTAGES
+};
+krb5_error_code kdc_init_metrics(const char *path);
+void kdc_set_metrics_owner(void);
+krb5_error_code kdc_start_metrics(verto_ctx *ctx);
+void kdc_free_metrics(void);
+uint64_t kdc_monotonic_time(void);
+uint64_t kdc_metrics_now(void);
+void kdc_metrics_stage(enum kdc_metrics_type type,
+                       enum kdc_metrics_stage stage, uint64_t start);
+void kdc_metrics_request(enum kdc_metrics_type type, int is_tcp,
+                         uint64_t start);
+void kdc_metrics_lookaside_hit(void);
+void kdc_metrics_shed(void);
+void kdc_metrics_result(enum kdc_metrics_type type, krb5_error_code code);
+void kdc_metrics_preauth(krb5_preauthtype pa_type, krb5_error_code code,
+                         uint64_t start);
+
+/* princ_cache.c */
+krb5_error_code kdc_create_princ_cache(krb5_context context,
+                                       const char *realm, char **db_args,
+                                       size_t max_entries,
+                                       size_t max_neg_entries,
+                                       krb5_boolean use_bloom,
+                                       krb5_deltat ttl,
+                                       struct kdc_princ_cache *share,
+                                       struct kdc_princ_cache **cache_out);
+void kdc_free_princ_cache(krb5_context context,
+                          struct kdc_princ_cache *cache);
+void kdc_log_princ_cache_stats(kdc_realm_t *realm);
+uint32_t kdc_hash_princ(krb5_const_principal princ, unsigned int val);
+krb5_error_code kdc_get_principal(kdc_realm_t *kdc_active_realm,
+                                  krb5_const_principal princ,
+                                  unsigned int flags,
+                                  krb5_db_entry **entry_out);
+krb5_boolean kdc_principal_unknown(kdc_realm_t *kdc_active_realm,
+                                   krb5_const_principal princ,
+                                   unsigned int flags);
+void kdc_note_unknown_principal(kdc_realm_t *kdc_active_realm,
+                                krb5_const_principal princ,
+                                unsigned int flags);
+
+/* key_cache.c */
+krb5_error_code kdc_create_key_cache(krb5_context context, size_t max_entries,
+                                     struct kdc_key_cache **cache_out);
+void kdc_free_key_cache(krb5_context context, struct kdc_key_cache *cache);
+void kdc_log_key_cache_stats(kdc_realm_t *realm);
+krb5_error_code kdc_decrypt_server_key(kdc_realm_t *kdc_active_realm,
+                                       krb5_db_entry *server,
+                                       const krb5_key_data *kd,
+                                       krb5_keyblock *keyblock_out,
+                                       krb5_key *key_out);
+
 /* kdc_util.c */
 void reset_for_hangup(void *);
 
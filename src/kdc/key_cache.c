@@ -0,0 +1,302 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/key_cache.c - Cache of decrypted server keys */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Each TGS request decrypts the key of the TGT's server from the database
+ * with the master key, and then decrypts the TGT and encrypts the new ticket,
+ * each of which sets up a key schedule and derives usage keys from the
+ * server key.  When key_cache_size is set for a realm, decrypted server keys
+ * are kept in a bounded LRU cache keyed on the principal, kvno, enctype, and
+ * master key version, together with a krb5_key object for the same key.  The
+ * krb5_key caches its derived keys, so repeated use of a hot server key skips
+ * the master key decryption and all of the derivations.
+ *
+ * A cache entry also records the encrypted key data it was decrypted from,
+ * and is only used if the database entry still holds the same encrypted key
+ * data; any change to the key (including a re-encryption under a new master
+ * key) therefore replaces the cached key.
+ *
+ * Each realm structure owns its own cache, and krb5_key objects are only
+ * shared with the request thread which owns the realm, so no locking is
+ * needed.
+ */
+
+#include "k5-int.h"
+#include "k5-queue.h"
+#include "kdc_util.h"
+#include "adm_proto.h"
+#include <syslog.h>
+
+struct kcache_entry {
+    K5_TAILQ_ENTRY(kcache_entry) lru_links;
+    K5_LIST_ENTRY(kcache_entry) hash_links;
+    uint32_t hash;
+    krb5_principal princ;
+    krb5_kvno kvno;
+    krb5_enctype enctype;
+    krb5_kvno mkvno;
+    krb5_data enc_key;          /* encrypted key data from the entry */
+    krb5_keyblock keyblock;
+    krb5_key key;
+};
+
+K5_TAILQ_HEAD(kcache_lru, kcache_entry);
+K5_LIST_HEAD(kcache_bucket, kcache_entry);
+
+struct kdc_key_cache {
+    size_t max_entries;
+    size_t num_entries;
+
+    /* Least recently used entries are at the tail. */
+    struct kcache_lru lru;
+    struct kcache_bucket *buckets;
+    size_t nbuckets;            /* always a power of two */
+
+    unsigned long hits, misses;
+};
+
+static void
+free_kcache_entry(krb5_context context, struct kcache_entry *ent)
+{
+    krb5_free_principal(context, ent->princ);
+    zapfree(ent->enc_key.data, ent->enc_key.length);
+    krb5_free_keyblock_contents(context, &ent->keyblock);
+    krb5_k_free_key(context, ent->key);
+    free(ent);
+}
+
+static void
+remove_kcache_entry(krb5_context context, struct kdc_key_cache *cache,
+                    struct kcache_entry *ent)
+{
+    K5_TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    K5_LIST_REMOVE(ent, hash_links);
+    cache->num_entries--;
+    free_kcache_entry(context, ent);
+}
+
+krb5_error_code
+kdc_create_key_cache(krb5_context context, size_t max_entries,
+                     struct kdc_key_cache **cache_out)
+{
+    krb5_error_code ret;
+    struct kdc_key_cache *cache;
+    size_t i;
+
+    *cache_out = NULL;
+
+    cache = k5alloc(sizeof(*cache), &ret);
+    if (cache == NULL)
+        return ret;
+    cache->max_entries = max_entries;
+    K5_TAILQ_INIT(&cache->lru);
+
+    cache->nbuckets = 16;
+    while (cache->nbuckets < max_entries)
+        cache->nbuckets <<= 1;
+    cache->buckets = k5calloc(cache->nbuckets, sizeof(*cache->buckets), &ret);
+    if (cache->buckets == NULL) {
+        free(cache);
+        return ret;
+    }
+    for (i = 0; i < cache->nbuckets; i++)
+        K5_LIST_INIT(&cache->buckets[i]);
+
+    *cache_out = cache;
+    return 0;
+}
+
+void
+kdc_free_key_cache(krb5_context context, struct kdc_key_cache *cache)
+{
+    struct kcache_entry *ent;
+
+    if (cache == NULL)
+        return;
+    while ((ent = K5_TAILQ_FIRST(&cache->lru)) != NULL)
+        remove_kcache_entry(context, cache, ent);
+    free(cache->buckets);
+    free(cache);
+}
+
+void
+kdc_log_key_cache_stats(kdc_realm_t *realm)
+{
+    struct kdc_key_cache *cache = realm->realm_key_cache;
+
+    if (cache == NULL)
+        return;
+    krb5_klog_syslog(LOG_INFO, _("key cache for realm %s: %lu hits, "
+                                 "%lu misses"),
+                     realm->realm_name, cache->hits, cache->misses);
+}
+
+/* Return true if ent was decrypted from the key data kd. */
+static krb5_boolean
+enc_key_matches(const struct kcache_entry *ent, const krb5_key_data *kd)
+{
+    return ent->enc_key.length == kd->key_data_length[0] &&
+        memcmp(ent->enc_key.data, kd->key_data_contents[0],
+               ent->enc_key.length) == 0;
+}
+
+/* Make a new cache entry for kd, whose decrypted contents are in keyblock. */
+static krb5_error_code
+make_kcache_entry(krb5_context context, const krb5_db_entry *server,
+                  const krb5_key_data *kd, krb5_kvno mkvno,
+                  const krb5_keyblock *keyblock, struct kcache_entry **ent_out)
+{
+    krb5_error_code ret;
+    struct kcache_entry *ent;
+
+    *ent_out = NULL;
+    ent = k5alloc(sizeof(*ent), &ret);
+    if (ent == NULL)
+        return ret;
+    ent->kvno = kd->key_data_kvno;
+    ent->enctype = kd->key_data_type[0];
+    ent->mkvno = mkvno;
+    ret = krb5_copy_principal(context, server->princ, &ent->princ);
+    if (ret)
+        goto cleanup;
+    ent->enc_key.data = k5memdup(kd->key_data_contents[0],
+                                 kd->key_data_length[0], &ret);
+    if (ent->enc_key.data == NULL)
+        goto cleanup;
+    ent->enc_key.length = kd->key_data_length[0];
+    ret = krb5_copy_keyblock_contents(context, keyblock, &ent->keyblock);
+    if (ret)
+        goto cleanup;
+    ret = krb5_k_create_key(context, keyblock, &ent->key);
+    if (ret)
+        goto cleanup;
+
+    *ent_out = ent;
+    ent = NULL;
+
+cleanup:
+    if (ent != NULL)
+        free_kcache_entry(context, ent);
+    return ret;
+}
+
+/*
+ * Decrypt the key data kd of server into *keyblock_out, using the realm's key
+ * cache if it has one.  If key_out is not NULL, also set *key_out to a
+ * krb5_key for the same key, which the caller must release with
+ * krb5_k_free_key().
+ */
+krb5_error_code
+kdc_decrypt_server_key(kdc_realm_t *kdc_active_realm, krb5_db_entry *server,
+                       const krb5_key_data *kd, krb5_keyblock *keyblock_out,
+                       krb5_key *key_out)
+{
+    krb5_error_code ret;
+    struct kdc_key_cache *cache = kdc_active_realm->realm_key_cache;
+    struct kcache_bucket *bucket;
+    struct kcache_entry *ent;
+    krb5_kvno mkvno;
+    uint32_t hash;
+
+    memset(keyblock_out, 0, sizeof(*keyblock_out));
+    if (key_out != NULL)
+        *key_out = NULL;
+
+    if (cache == NULL ||
+        krb5_dbe_lookup_mkvno(kdc_context, server, &mkvno) != 0) {
+        ret = krb5_dbe_decrypt_key_data(kdc_context, NULL, kd, keyblock_out,
+                                        NULL);
+        if (ret || key_out == NULL)
+            return ret;
+        ret = krb5_k_create_key(kdc_context, keyblock_out, key_out);
+        if (ret)
+            krb5_free_keyblock_contents(kdc_context, keyblock_out);
+        return ret;
+    }
+
+    hash = kdc_hash_princ(server->princ, kd->key_data_kvno);
+    hash = (hash ^ (uint32_t)kd->key_data_type[0]) * 16777619U;
+    hash = (hash ^ mkvno) * 16777619U;
+    bucket = &cache->buckets[hash & (cache->nbuckets - 1)];
+    K5_LIST_FOREACH(ent, bucket, hash_links) {
+        if (ent->hash == hash && ent->kvno == kd->key_data_kvno &&
+            ent->enctype == kd->key_data_type[0] && ent->mkvno == mkvno &&
+            krb5_principal_compare(kdc_context, ent->princ, server->princ))
+            break;
+    }
+
+    /* Discard the cached key if the entry's key has changed. */
+    if (ent != NULL && !enc_key_matches(ent, kd)) {
+        remove_kcache_entry(kdc_context, cache, ent);
+        ent = NULL;
+    }
+
+    if (ent == NULL) {
+        cache->misses++;
+        ret = krb5_dbe_decrypt_key_data(kdc_context, NULL, kd, keyblock_out,
+                                        NULL);
+        if (ret)
+            return ret;
+        /* Failure to cache the key is not an error for the caller. */
+        if (make_kcache_entry(kdc_context, server, kd, mkvno, keyblock_out,
+                              &ent) != 0) {
+            if (key_out == NULL)
+                return 0;
+            ret = krb5_k_create_key(kdc_context, keyblock_out, key_out);
+            if (ret)
+                krb5_free_keyblock_contents(kdc_context, keyblock_out);
+            return ret;
+        }
+        ent->hash = hash;
+        if (cache->num_entries >= cache->max_entries) {
+            remove_kcache_entry(kdc_context, cache,
+                                K5_TAILQ_LAST(&cache->lru, kcache_lru));
+        }
+        K5_LIST_INSERT_HEAD(bucket, ent, hash_links);
+        K5_TAILQ_INSERT_HEAD(&cache->lru, ent, lru_links);
+        cache->num_entries++;
+    } else {
+        ret = krb5_copy_keyblock_contents(kdc_context, &ent->keyblock,
+                                          keyblock_out);
+        if (ret)
+            return ret;
+        cache->hits++;
+        K5_TAILQ_REMOVE(&cache->lru, ent, lru_links);
+        K5_TAILQ_INSERT_HEAD(&cache->lru, ent, lru_links);
+    }
+
+    if (key_out != NULL) {
+        krb5_k_reference_key(kdc_context, ent->key);
+        *key_out = ent->key;
+    }
+    return 0;
+}
@@ -61,6 +61,19 @@ static void finish_realms (void);
 
 static int nofork = 0;
 static int workers = 0;
+static krb5_boolean reuseport = FALSE;
+static int udp_batch_size = 1;
+static krb5_deltat tcp_idle_timeout = 0;
+static int lookaside_size = 0;
+static int lookaside_buckets = 0;
+static int lookaside_shards = 0;
+static krb5_boolean lookaside_digest = FALSE;
+static char *metrics_socket = NULL;
+static int overload_latency = 0;
+static int overload_queue_depth = 0;
+static int overload_source_rate = 0;
+static int preauth_threads = 0;
+static int threads = 0;
 static int time_offset = 0;
 static const char *pid_file = NULL;
 static int rkey_init_done = 0;
@@ -87,16 +100,21 @@ static struct server_handle shandle;
  * context known by krb5_klog.  call_context can be NULL if the error
  * code did not come from a krb5 library function.
  */
+static k5_mutex_t kdc_err_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+
 void
 kdc_err(krb5_context call_context, errcode_t code, const char *fmt, ...)
 {
     va_list ap;
 
+    /* Request threads may call this concurrently. */
+    k5_mutex_lock(&kdc_err_lock);
     if (call_context)
         krb5_copy_error_message(shandle.kdc_err_context, call_context);
     va_start(ap, fmt);
     com_err_va(kdc_progname, code, fmt, ap);
     va_end(ap);
+    k5_mutex_unlock(&kdc_err_lock);
 }
 
 /*
@@ -138,13 +156,55 @@ setup_server_realm(struct server_handle *handle, krb5_principal sprinc)
         return kdc_realmlist[0];
 }
 
+void
+kdc_free_db_args(char **db_args)
+{
+    char **p;
+
+    if (db_args == NULL)
+        return;
+    for (p = db_args; *p != NULL; p++)
+        free(*p);
+    free(db_args);
+}
+
+/* Make a copy of a null-terminated list of database arguments. */
+krb5_error_code
+kdc_copy_db_args(char **db_args, char ***copy_out)
+{
+    char **copy;
+    size_t i, count;
+
+    *copy_out = NULL;
+    if (db_args == NULL)
+        return 0;
+    for (count = 0; db_args[count] != NULL; count++);
+    copy = calloc(count + 1, sizeof(*copy));
+    if (copy == NULL)
+        return ENOMEM;
+    for (i = 0; i < count; i++) {
+        copy[i] = strdup(db_args[i]);
+        if (copy[i] == NULL) {
+            kdc_free_db_args(copy);
+            return ENOMEM;
+        }
+    }
+    *copy_out = copy;
+    return 0;
+}
+
 static void
 finish_realm(kdc_realm_t *rdp)
 {
+    if (rdp->realm_princ_cache != NULL)
+        kdc_free_princ_cache(rdp->realm_context, rdp->realm_princ_cache);
+    if (rdp->realm_key_cache != NULL)
+        kdc_free_key_cache(rdp->realm_context, rdp->realm_key_cache);
     if (rdp->realm_name)
         free(rdp->realm_name);
     if (rdp->realm_mpname)
         free(rdp->realm_mpname);
+    kdc_free_db_args(rdp->realm_db_args);
     if (rdp->realm_stash)
         free(rdp->realm_stash);
     if (rdp->realm_listen)
@@ -314,6 +374,33 @@ init_realm(kdc_realm_t * rdp, krb5_pointer aprof, char *realm,
     if (krb5_aprof_get_deltat(aprof, hierarchy, TRUE, &rdp->realm_maxrlife))
         rdp->realm_maxrlife = KRB5_KDB_MAX_RLIFE;
 
+    /* Handle the server principal cache */
+    hierarchy[2] = KRB5_CONF_PRINCIPAL_CACHE_SIZE;
+    if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                             &rdp->realm_princ_cache_size) ||
+        rdp->realm_princ_cache_size < 0)
+        rdp->realm_princ_cache_size = 0;
+    hierarchy[2] = KRB5_CONF_PRINCIPAL_CACHE_TTL;
+    if (krb5_aprof_get_deltat(aprof, hierarchy, TRUE,
+                              &rdp->realm_princ_cache_ttl))
+        rdp->realm_princ_cache_ttl = 60;
+    hierarchy[2] = KRB5_CONF_PRINCIPAL_NEGATIVE_CACHE_SIZE;
+    if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                             &rdp->realm_princ_neg_cache_size) ||
+        rdp->realm_princ_neg_cache_size < 0)
+        rdp->realm_princ_neg_cache_size = 0;
+    hierarchy[2] = KRB5_CONF_PRINCIPAL_BLOOM_FILTER;
+    if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE,
+                               &rdp->realm_princ_bloom_filter))
+        rdp->realm_princ_bloom_filter = FALSE;
+
+    /* Handle the server key cache */
+    hierarchy[2] = KRB5_CONF_KEY_CACHE_SIZE;
+    if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                             &rdp->realm_key_cache_size) ||
+        rdp->realm_key_cache_size < 0)
+        rdp->realm_key_cache_size = 0;
+
     /* Handle KDC referrals */
     hierarchy[2] = KRB5_CONF_NO_HOST_REFERRAL;
     (void)krb5_aprof_get_string_all(aprof, hierarchy, &svalue);
@@ -342,6 +429,10 @@ init_realm(kdc_realm_t * rdp, krb5_pointer aprof, char *realm,
         goto whoops;
     }
 
+    kret = kdc_copy_db_args(db_args, &rdp->realm_db_args);
+    if (kret)
+        goto whoops;
+
     /* first open the database  before doing anything */
     kdb_open_flags = KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_KDC;
     if ((kret = krb5_db_open(rdp->realm_context, db_args, kdb_open_flags))) {
@@ -398,6 +489,33 @@ init_realm(kdc_realm_t * rdp, krb5_pointer aprof, char *realm,
         goto whoops;
     }
 
+    if (rdp->realm_princ_cache_size > 0 ||
+        rdp->realm_princ_neg_cache_size > 0 || rdp->realm_princ_bloom_filter) {
+        kret = kdc_create_princ_cache(rdp->realm_context, realm,
+                                      rdp->realm_db_args,
+                                      rdp->realm_princ_cache_size,
+                                      rdp->realm_princ_neg_cache_size,
+                                      rdp->realm_princ_bloom_filter,
+                                      rdp->realm_princ_cache_ttl, NULL,
+                                      &rdp->realm_princ_cache);
+        if (kret) {
+            kdc_err(rdp->realm_context, kret,
+                    _("while creating principal cache for realm %s"), realm);
+            goto whoops;
+        }
+    }
+
+    if (rdp->realm_key_cache_size > 0) {
+        kret = kdc_create_key_cache(rdp->realm_context,
+                                    rdp->realm_key_cache_size,
+                                    &rdp->realm_key_cache);
+        if (kret) {
+            kdc_err(rdp->realm_context, kret,
+                    _("while creating key cache for realm %s"), realm);
+            goto whoops;
+        }
+    }
+
     if (!rkey_init_done) {
         krb5_data seed;
         /*
@@ -425,6 +543,167 @@ whoops:
     return(kret);
 }
 
+/*
+ * Initialize rdp as a copy of the already-initialized realm src, with its own
+ * krb5 context, database handle, and keytab, so that it can be used by a
+ * request thread independently of src.
+ */
+static krb5_error_code
+copy_realm(kdc_realm_t *rdp, const kdc_realm_t *src)
+{
+    krb5_error_code kret;
+    krb5_context ctx;
+
+    memset(rdp, 0, sizeof(*rdp));
+    rdp->realm_name = strdup(src->realm_name);
+    if (rdp->realm_name == NULL) {
+        kret = ENOMEM;
+        goto whoops;
+    }
+    if (src->realm_hostbased != NULL) {
+        rdp->realm_hostbased = strdup(src->realm_hostbased);
+        if (rdp->realm_hostbased == NULL) {
+            kret = ENOMEM;
+            goto whoops;
+        }
+    }
+    if (src->realm_no_referral != NULL) {
+        rdp->realm_no_referral = strdup(src->realm_no_referral);
+        if (rdp->realm_no_referral == NULL) {
+            kret = ENOMEM;
+            goto whoops;
+        }
+    }
+    kret = kdc_copy_db_args(src->realm_db_args, &rdp->realm_db_args);
+    if (kret)
+        goto whoops;
+    rdp->realm_maxlife = src->realm_maxlife;
+    rdp->realm_maxrlife = src->realm_maxrlife;
+    rdp->realm_reject_bad_transit = src->realm_reject_bad_transit;
+    rdp->realm_restrict_anon = src->realm_restrict_anon;
+    rdp->realm_assume_des_crc_sess = src->realm_assume_des_crc_sess;
+
+    kret = krb5int_init_context_kdc(&rdp->realm_context);
+    if (kret) {
+        kdc_err(NULL, kret, _("while getting context for realm %s"),
+                src->realm_name);
+        goto whoops;
+    }
+    ctx = rdp->realm_context;
+    if (time_offset != 0)
+        (void)krb5_set_time_offsets(ctx, time_offset, 0);
+    kret = krb5_set_default_realm(ctx, src->realm_name);
+    if (kret)
+        goto whoops;
+    kret = krb5_db_open(ctx, rdp->realm_db_args,
+                        KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_KDC);
+    if (kret) {
+        kdc_err(ctx, kret, _("while initializing database for realm %s"),
+                src->realm_name);
+        goto whoops;
+    }
+    kret = krb5_copy_principal(ctx, src->realm_mprinc, &rdp->realm_mprinc);
+    if (kret)
+        goto whoops;
+    kret = krb5_copy_keyblock_contents(ctx, &src->realm_mkey,
+                                       &rdp->realm_mkey);
+    if (kret)
+        goto whoops;
+    kret = krb5_db_fetch_mkey_list(ctx, rdp->realm_mprinc, &rdp->realm_mkey);
+    if (kret) {
+        kdc_err(ctx, kret, _("while fetching master keys list for realm %s"),
+                src->realm_name);
+        goto whoops;
+    }
+    kret = krb5_ktkdb_resolve(ctx, NULL, &rdp->realm_keytab);
+    if (kret)
+        goto whoops;
+    kret = krb5_copy_principal(ctx, src->realm_tgsprinc,
+                               &rdp->realm_tgsprinc);
+    if (kret)
+        goto whoops;
+    rdp->realm_princ_cache_size = src->realm_princ_cache_size;
+    rdp->realm_princ_cache_ttl = src->realm_princ_cache_ttl;
+    rdp->realm_princ_neg_cache_size = src->realm_princ_neg_cache_size;
+    rdp->realm_princ_bloom_filter = src->realm_princ_bloom_filter;
+    if (rdp->realm_princ_cache_size > 0 ||
+        rdp->realm_princ_neg_cache_size > 0 || rdp->realm_princ_bloom_filter) {
+        kret = kdc_create_princ_cache(ctx, src->realm_name,
+                                      rdp->realm_db_args,
+                                      rdp->realm_princ_cache_size,
+                                      rdp->realm_princ_neg_cache_size,
+                                      rdp->realm_princ_bloom_filter,
+                                      rdp->realm_princ_cache_ttl,
+                                      src->realm_princ_cache,
+                                      &rdp->realm_princ_cache);
+        if (kret)
+            goto whoops;
+    }
+    rdp->realm_key_cache_size = src->realm_key_cache_size;
+    if (rdp->realm_key_cache_size > 0) {
+        kret = kdc_create_key_cache(ctx, rdp->realm_key_cache_size,
+                                    &rdp->realm_key_cache);
+    }
+
+whoops:
+    return kret;
+}
+
+/*
+ * Fill in handle with copies of the realms in the global server handle, for
+ * use by a request thread.  Release the result with kdc_free_server_handle().
+ */
+krb5_error_code
+kdc_copy_server_handle(struct server_handle *handle)
+{
+    krb5_error_code kret;
+    kdc_realm_t *rdp;
+    int i;
+
+    memset(handle, 0, sizeof(*handle));
+    handle->kdc_realmlist = calloc(shandle.kdc_numrealms,
+                                   sizeof(*handle->kdc_realmlist));
+    if (handle->kdc_realmlist == NULL)
+        return ENOMEM;
+    kret = krb5int_init_context_kdc(&handle->kdc_err_context);
+    if (kret)
+        goto cleanup;
+    for (i = 0; i < shandle.kdc_numrealms; i++) {
+        rdp = malloc(sizeof(*rdp));
+        if (rdp == NULL) {
+            kret = ENOMEM;
+            goto cleanup;
+        }
+        kret = copy_realm(rdp, shandle.kdc_realmlist[i]);
+        if (kret) {
+            finish_realm(rdp);
+            goto cleanup;
+        }
+        handle->kdc_realmlist[handle->kdc_numrealms++] = rdp;
+    }
+
+cleanup:
+    if (kret)
+        kdc_free_server_handle(handle);
+    return kret;
+}
+
+void
+kdc_free_server_handle(struct server_handle *handle)
+{
+    int i;
+
+    for (i = 0; i < handle->kdc_numrealms; i++) {
+        kdc_log_princ_cache_stats(handle->kdc_realmlist[i]);
+        kdc_log_key_cache_stats(handle->kdc_realmlist[i]);
+        finish_realm(handle->kdc_realmlist[i]);
+    }
+    free(handle->kdc_realmlist);
+    if (handle->kdc_err_context != NULL)
+        krb5_free_context(handle->kdc_err_context);
+    memset(handle, 0, sizeof(*handle));
+}
+
 static krb5_sigtype
 on_monitor_signal(int signo)
 {
@@ -586,6 +865,10 @@ create_workers(verto_ctx *ctx, int num)
 
     terminate_workers(pids, num);
     free(pids);
+#ifndef NOCACHE
+    kdc_log_lookaside_stats();
+#endif
+    kdc_free_metrics();
     exit(0);
 }
 
@@ -603,7 +886,7 @@ usage(char *name)
             _("usage: %s [-x db_args]* [-d dbpathname] [-r dbrealmname]\n"
               "\t\t[-R replaycachename] [-m] [-k masterenctype]\n"
               "\t\t[-M masterkeyname] [-p port] [-P pid_file]\n"
-              "\t\t[-n] [-w numworkers] [/]\n\n"
+              "\t\t[-n] [-w numworkers] [-t numthreads] [/]\n\n"
               "where,\n"
               "\t[-x db_args]* - Any number of database specific arguments.\n"
               "\t\t\tLook at each database module documentation for "
@@ -661,6 +944,49 @@ initialize_realms(krb5_context kcontext, int argc, char **argv,
                                      tcp_listen_backlog_out))
                 *tcp_listen_backlog_out = DEFAULT_TCP_LISTEN_BACKLOG;
         }
+        hierarchy[1] = KRB5_CONF_KDC_TCP_IDLE_TIMEOUT;
+        if (krb5_aprof_get_deltat(aprof, hierarchy, TRUE, &tcp_idle_timeout) ||
+            tcp_idle_timeout < 0)
+            tcp_idle_timeout = 0;
+        hierarchy[1] = KRB5_CONF_KDC_REUSEPORT;
+        if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE, &reuseport))
+            reuseport = FALSE;
+        hierarchy[1] = KRB5_CONF_KDC_UDP_BATCH_SIZE;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &udp_batch_size))
+            udp_batch_size = 1;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_SIZE;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &lookaside_size) ||
+            lookaside_size < 0)
+            lookaside_size = 0;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_BUCKETS;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                                 &lookaside_buckets) || lookaside_buckets < 0)
+            lookaside_buckets = 0;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_SHARDS;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &lookaside_shards) ||
+            lookaside_shards < 0)
+            lookaside_shards = 0;
+        hierarchy[1] = KRB5_CONF_KDC_LOOKASIDE_DIGEST;
+        if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE, &lookaside_digest))
+            lookaside_digest = FALSE;
+        free(metrics_socket);
+        hierarchy[1] = KRB5_CONF_KDC_METRICS_SOCKET;
+        if (krb5_aprof_get_string(aprof, hierarchy, TRUE, &metrics_socket))
+            metrics_socket = NULL;
+        hierarchy[1] = KRB5_CONF_KDC_OVERLOAD_LATENCY;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &overload_latency))
+            overload_latency = 0;
+        hierarchy[1] = KRB5_CONF_KDC_OVERLOAD_QUEUE_DEPTH;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                                 &overload_queue_depth))
+            overload_queue_depth = 0;
+        hierarchy[1] = KRB5_CONF_KDC_OVERLOAD_SOURCE_RATE;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE,
+                                 &overload_source_rate))
+            overload_source_rate = 0;
+        hierarchy[1] = KRB5_CONF_KDC_PREAUTH_THREADS;
+        if (krb5_aprof_get_int32(aprof, hierarchy, TRUE, &preauth_threads))
+            preauth_threads = 0;
         hierarchy[1] = KRB5_CONF_RESTRICT_ANONYMOUS_TO_TGT;
         if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE, &def_restrict_anon))
             def_restrict_anon = FALSE;
@@ -693,7 +1019,7 @@ initialize_realms(krb5_context kcontext, int argc, char **argv,
      * twice if worker processes are used, so we must initialize optind.
      */
     optind = 1;
-    while ((c = getopt(argc, argv, "x:r:d:mM:k:R:e:P:p:s:nw:4:T:X3")) != -1) {
+    while ((c = getopt(argc, argv, "x:r:d:mM:k:R:e:P:p:s:nw:t:4:T:X3")) != -1) {
         switch(c) {
         case 'x':
             db_args_size++;
@@ -781,6 +1107,11 @@ initialize_realms(krb5_context kcontext, int argc, char **argv,
             if (workers <= 0)
                 usage(argv[0]);
             break;
+        case 't':                       /* create request threads */
+            threads = atoi(optarg);
+            if (threads <= 0)
+                usage(argv[0]);
+            break;
         case 'k':                       /* enctype for master key */
             if (krb5_string_to_enctype(optarg, &menctype))
                 com_err(argv[0], 0, _("invalid enctype %s"), optarg);
@@ -930,6 +1261,10 @@ int main(int argc, char **argv)
     int i;
 
     setlocale(LC_ALL, "");
+    if (k5_mutex_finish_init(&kdc_err_lock) != 0) {
+        fprintf(stderr, _("%s: cannot initialize mutex\n"), argv[0]);
+        exit(1);
+    }
     if (strrchr(argv[0], '/'))
         argv[0] = strrchr(argv[0], '/')+1;
 
@@ -969,7 +1304,8 @@ int main(int argc, char **argv)
     initialize_realms(kcontext, argc, argv, &tcp_listen_backlog);
 
 #ifndef NOCACHE
-    retval = kdc_init_lookaside(kcontext);
+    retval = kdc_init_lookaside(kcontext, lookaside_size, lookaside_buckets,
+                                lookaside_shards, lookaside_digest);
     if (retval) {
         kdc_err(kcontext, retval, _("while initializing lookaside cache"));
         finish_realms();
@@ -977,6 +1313,24 @@ int main(int argc, char **argv)
     }
 #endif
 
+    retval = kdc_init_admission(kcontext, overload_latency,
+                                overload_queue_depth, overload_source_rate);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while initializing admission control"));
+        finish_realms();
+        return 1;
+    }
+
+    if (metrics_socket != NULL) {
+        retval = kdc_init_metrics(metrics_socket);
+        if (retval) {
+            kdc_err(kcontext, retval, _("while creating metrics socket %s"),
+                    metrics_socket);
+            finish_realms();
+            return 1;
+        }
+    }
+
     ctx = loop_init(VERTO_EV_TYPE_NONE);
     if (!ctx) {
         kdc_err(kcontext, ENOMEM, _("while creating main loop"));
@@ -1019,6 +1373,17 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+    loop_set_udp_batch_size(udp_batch_size);
+    loop_set_tcp_idle_timeout(tcp_idle_timeout);
+    if (workers > 0 && reuseport) {
+        retval = loop_set_reuseport(TRUE);
+        if (retval) {
+            krb5_klog_syslog(LOG_WARNING, _("unable to give worker processes "
+                                            "their own listener sockets: %s"),
+                             error_message(retval));
+            reuseport = FALSE;
+        }
+    }
     if ((retval = loop_setup_network(ctx, &shandle, kdc_progname,
                                      tcp_listen_backlog))) {
     net_init_error:
@@ -1039,7 +1404,23 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+    /* The process ID changes when we detach, so record the metrics socket
+     * owner only now. */
+    kdc_set_metrics_owner();
     if (workers > 0) {
+#ifndef NOCACHE
+        /* Let the workers recognize each other's retransmitted requests. */
+        retval = kdc_share_lookaside(kcontext);
+        if (retval) {
+            krb5_klog_syslog(LOG_WARNING, _("unable to share lookaside cache "
+                                            "with worker processes: %s"),
+                             error_message(retval));
+        }
+#endif
+        /* With reuseport, the supervisor binds the listener sockets only to
+         * check that it can; each worker binds its own after the fork. */
+        if (reuseport)
+            loop_close_network();
         finish_realms();
         retval = create_workers(ctx, workers);
         if (retval) {
@@ -1048,6 +1429,37 @@ int main(int argc, char **argv)
         }
         /* We get here only in a worker child process; re-initialize realms. */
         initialize_realms(kcontext, argc, argv, NULL);
+        if (reuseport) {
+            retval = loop_setup_network(ctx, &shandle, kdc_progname,
+                                        tcp_listen_backlog);
+            if (retval) {
+                kdc_err(kcontext, retval, _("while initializing network"));
+                finish_realms();
+                return 1;
+            }
+        }
+    }
+
+    /* Now that we won't fork again, hand log output to a writer thread if
+     * the logging configuration asks for one. */
+    retval = krb5_klog_start_async(kcontext);
+    if (retval) {
+        krb5_klog_syslog(LOG_WARNING, _("unable to start log writer thread: "
+                                        "%s"), error_message(retval));
+    }
+
+    retval = kdc_start_metrics(ctx);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while listening for metrics requests"));
+        finish_realms();
+        return 1;
+    }
+
+    retval = kdc_start_unknown_server_log(ctx);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while starting log timer"));
+        finish_realms();
+        return 1;
     }
 
     /* Initialize audit system and audit KDC startup. */
@@ -1057,13 +1469,46 @@ int main(int argc, char **argv)
         finish_realms();
         return 1;
     }
+
+    /* Start the threads only once the audit modules they use are loaded. */
+    if (threads > 0) {
+        retval = kdc_start_threads(ctx, threads);
+        if (retval) {
+            kdc_err(kcontext, retval, _("while creating request threads"));
+            unload_audit_modules(kcontext);
+            finish_realms();
+            return 1;
+        }
+    }
+
+    if (preauth_threads > 0) {
+        retval = kdc_start_preauth_threads(ctx, preauth_threads);
+        if (retval) {
+            kdc_err(kcontext, retval, _("while creating preauth threads"));
+            unload_audit_modules(kcontext);
+            finish_realms();
+            return 1;
+        }
+    }
+
     krb5_klog_syslog(LOG_INFO, _("commencing operation"));
     if (nofork)
         fprintf(stderr, _("%s: starting...\n"), kdc_progname);
     kau_kdc_start(kcontext, TRUE);
 
     verto_run(ctx);
+    kdc_stop_threads();
+    kdc_free_metrics();
     loop_free(ctx);
+    kdc_free_dispatch_pool();
+    for (i = 0; i < shandle.kdc_numrealms; i++) {
+        kdc_log_princ_cache_stats(shandle.kdc_realmlist[i]);
+        kdc_log_key_cache_stats(shandle.kdc_realmlist[i]);
+    }
+#ifndef NOCACHE
+    kdc_log_lookaside_stats();
+#endif
+    kdc_flush_unknown_server_log();
     kau_kdc_stop(kcontext, TRUE);
     krb5_klog_syslog(LOG_INFO, _("shutting down"));
     unload_preauth_plugins(kcontext);
@@ -1076,6 +1521,8 @@ int main(int argc, char **argv)
 #ifndef NOCACHE
     kdc_free_lookaside(kcontext);
 #endif
+    kdc_free_admission();
+    free(metrics_socket);
     krb5_free_context(kcontext);
     return errout;
 }
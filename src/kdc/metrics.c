@@ -0,0 +1,549 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/metrics.c - Request counters and latency histograms for the KDC */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * If kdc_metrics_socket is set in [kdcdefaults], the KDC counts requests by
+ * message type, transport, result code, and preauth type, and records latency
+ * histograms for whole requests and for the stages of processing them.  The
+ * counters live in an anonymous shared mapping created before any worker
+ * processes are forked, and are updated with atomic operations, so that they
+ * reflect all worker processes and request threads.  Each connection to the
+ * Unix socket receives a snapshot in the Prometheus text format, after which
+ * the KDC closes the connection.
+ *
+ * Histogram buckets are log-linear in the style of HdrHistogram: each power
+ * of two is divided into HIST_SUB equal buckets, so a bucket's width is at
+ * most 1/HIST_SUB of its lower bound.
+ */
+
+#include "k5-int.h"
+#include "k5-buf.h"
+#include "kdc_util.h"
+#include "adm_proto.h"
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+/* Values above 2^31 - 1 microseconds (about 36 minutes) are clamped. */
+#define HIST_MAX_BITS 31
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* The number of distinct preauth types tracked; others are not counted. */
+#define MAX_PREAUTH_TYPES 16
+
+/* Result code slots: protocol error codes, then one for other errors. */
+#define RESULT_OTHER (KRB_ERR_MAX + 1)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct preauth_metrics {
+    int32_t pa_type;
+    uint64_t succeeded;
+    uint64_t failed;
+    struct histogram latency;
+};
+
+struct metrics_page {
+    uint64_t requests[KDC_METRICS_NTYPES][2];
+    uint64_t lookaside_hits;
+    uint64_t shed;
+    uint64_t results[KDC_METRICS_NTYPES][RESULT_OTHER + 1];
+    struct histogram latency[KDC_METRICS_NTYPES];
+    struct histogram stages[KDC_METRICS_NTYPES][KDC_METRICS_NSTAGES];
+    struct preauth_metrics preauth[MAX_PREAUTH_TYPES];
+};
+
+/* A connection to which a snapshot is being written. */
+struct scrape {
+    struct k5buf buf;
+    size_t pos;
+};
+
+static const char *const type_names[KDC_METRICS_NTYPES] = {
+    "as", "tgs", "other"
+};
+
+static const char *const stage_names[KDC_METRICS_NSTAGES] = {
+    "decode", "db", "preauth", "crypto", "encode", "send"
+};
+
+static struct metrics_page *metrics;
+static int listen_fd = -1;
+static char *socket_path;
+static pid_t owner_pid = -1;
+static verto_ev *listen_ev;
+
+#define ATOMIC_ADD(p, n) ((void)__sync_fetch_and_add((p), (n)))
+#define ATOMIC_GET(p) __sync_fetch_and_add((p), 0)
+
+/* Return the bucket index for a value in microseconds. */
+static unsigned int
+hist_bucket(uint64_t v)
+{
+    unsigned int e;
+
+    if (v < HIST_SUB)
+        return v;
+    if (v >= ((uint64_t)1 << HIST_MAX_BITS))
+        v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+    for (e = HIST_SUB_BITS; (v >> (e + 1)) != 0; e++);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+        (unsigned int)((v >> (e - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* Return the largest value in microseconds which falls into bucket i. */
+static uint64_t
+hist_bucket_max(unsigned int i)
+{
+    unsigned int shift;
+
+    if (i < HIST_SUB)
+        return i;
+    shift = i / HIST_SUB - 1;
+    return (((uint64_t)HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+static void
+hist_record(struct histogram *h, uint64_t usec)
+{
+    ATOMIC_ADD(&h->count, 1);
+    ATOMIC_ADD(&h->sum, usec);
+    ATOMIC_ADD(&h->buckets[hist_bucket(usec)], 1);
+}
+
+static inline uint64_t
+elapsed(uint64_t start)
+{
+    uint64_t now = kdc_metrics_now();
+
+    return (now > start) ? now - start : 0;
+}
+
+/* Return a microsecond timestamp for measuring intervals. */
+uint64_t
+kdc_monotonic_time(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+#endif
+    krb5_int32 sec, usec;
+
+#ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    if (krb5_crypto_us_timeofday(&sec, &usec) != 0)
+        return 0;
+    return (uint64_t)(uint32_t)sec * 1000000 + usec;
+}
+
+/* Return a timestamp for kdc_metrics_stage() and similar, or 0 if metrics are
+ * not enabled. */
+uint64_t
+kdc_metrics_now(void)
+{
+    return (metrics == NULL) ? 0 : kdc_monotonic_time();
+}
+
+/* Record the time since start for a stage of processing a request. */
+void
+kdc_metrics_stage(enum kdc_metrics_type type, enum kdc_metrics_stage stage,
+                  uint64_t start)
+{
+    if (metrics == NULL)
+        return;
+    hist_record(&metrics->stages[type][stage], elapsed(start));
+}
+
+/* Record a request which arrived over the given transport at start and was
+ * answered now. */
+void
+kdc_metrics_request(enum kdc_metrics_type type, int is_tcp, uint64_t start)
+{
+    if (metrics == NULL)
+        return;
+    ATOMIC_ADD(&metrics->requests[type][is_tcp ? 1 : 0], 1);
+    hist_record(&metrics->latency[type], elapsed(start));
+}
+
+/* Record a request answered from the lookaside cache. */
+void
+kdc_metrics_lookaside_hit(void)
+{
+    if (metrics == NULL)
+        return;
+    ATOMIC_ADD(&metrics->lookaside_hits, 1);
+}
+
+/* Record a request refused by admission control. */
+void
+kdc_metrics_shed(void)
+{
+    if (metrics == NULL)
+        return;
+    ATOMIC_ADD(&metrics->shed, 1);
+}
+
+/* Record the result of processing a request, as a krb5 error code. */
+void
+kdc_metrics_result(enum kdc_metrics_type type, krb5_error_code code)
+{
+    long slot;
+
+    if (metrics == NULL || code == KRB5KDC_ERR_DISCARD)
+        return;
+    slot = (code == 0) ? 0 : (long)code - ERROR_TABLE_BASE_krb5;
+    if (slot < 0 || slot > KRB_ERR_MAX)
+        slot = RESULT_OTHER;
+    ATOMIC_ADD(&metrics->results[type][slot], 1);
+}
+
+/* Record the result of verifying a padata element of pa_type, which began at
+ * start. */
+void
+kdc_metrics_preauth(krb5_preauthtype pa_type, krb5_error_code code,
+                    uint64_t start)
+{
+    struct preauth_metrics *pm;
+    int i;
+    int32_t cur;
+
+    if (metrics == NULL || pa_type <= 0)
+        return;
+
+    /* Find or claim the slot for this type. */
+    for (i = 0; i < MAX_PREAUTH_TYPES; i++) {
+        pm = &metrics->preauth[i];
+        cur = __sync_val_compare_and_swap(&pm->pa_type, 0, pa_type);
+        if (cur == 0 || cur == pa_type)
+            break;
+    }
+    if (i == MAX_PREAUTH_TYPES)
+        return;
+
+    ATOMIC_ADD(code ? &pm->failed : &pm->succeeded, 1);
+    hist_record(&pm->latency, elapsed(start));
+}
+
+/* Format h as Prometheus histogram samples named name with labels. */
+static void
+add_hist(struct k5buf *buf, const char *name, const char *labels,
+         struct histogram *h)
+{
+    unsigned int i;
+    uint64_t n, cum = 0, count = ATOMIC_GET(&h->count);
+
+    if (count == 0)
+        return;
+    /* Only buckets which change the cumulative count need be listed. */
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        n = ATOMIC_GET(&h->buckets[i]);
+        if (n == 0)
+            continue;
+        cum += n;
+        k5_buf_add_fmt(buf, "%s_bucket{%s,le=\"%llu\"} %llu\n", name, labels,
+                       (unsigned long long)hist_bucket_max(i),
+                       (unsigned long long)cum);
+    }
+    k5_buf_add_fmt(buf, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+                   (unsigned long long)count);
+    k5_buf_add_fmt(buf, "%s_sum{%s} %llu\n", name, labels,
+                   (unsigned long long)ATOMIC_GET(&h->sum));
+    k5_buf_add_fmt(buf, "%s_count{%s} %llu\n", name, labels,
+                   (unsigned long long)count);
+}
+
+/* Format a snapshot of the metrics into buf. */
+static void
+format_metrics(struct k5buf *buf)
+{
+    char labels[64];
+    uint64_t n;
+    int t, s, i;
+    struct preauth_metrics *pm;
+
+    k5_buf_add(buf, "# TYPE kdc_requests_total counter\n");
+    for (t = 0; t < KDC_METRICS_NTYPES; t++) {
+        for (i = 0; i < 2; i++) {
+            k5_buf_add_fmt(buf, "kdc_requests_total{type=\"%s\","
+                           "transport=\"%s\"} %llu\n", type_names[t],
+                           i ? "tcp" : "udp", (unsigned long long)
+                           ATOMIC_GET(&metrics->requests[t][i]));
+        }
+    }
+
+    k5_buf_add(buf, "# TYPE kdc_lookaside_hits_total counter\n");
+    k5_buf_add_fmt(buf, "kdc_lookaside_hits_total %llu\n",
+                   (unsigned long long)
+                   ATOMIC_GET(&metrics->lookaside_hits));
+
+    k5_buf_add(buf, "# TYPE kdc_shed_requests_total counter\n");
+    k5_buf_add_fmt(buf, "kdc_shed_requests_total %llu\n",
+                   (unsigned long long)ATOMIC_GET(&metrics->shed));
+
+    k5_buf_add(buf, "# TYPE kdc_results_total counter\n");
+    for (t = 0; t < KDC_METRICS_NTYPES; t++) {
+        for (i = 0; i <= RESULT_OTHER; i++) {
+            n = ATOMIC_GET(&metrics->results[t][i]);
+            if (n == 0)
+                continue;
+            if (i == RESULT_OTHER) {
+                k5_buf_add_fmt(buf, "kdc_results_total{type=\"%s\","
+                               "code=\"other\"} %llu\n", type_names[t],
+                               (unsigned long long)n);
+            } else {
+                k5_buf_add_fmt(buf, "kdc_results_total{type=\"%s\","
+                               "code=\"%d\"} %llu\n", type_names[t], i,
+                               (unsigned long long)n);
+            }
+        }
+    }
+
+    k5_buf_add(buf, "# TYPE kdc_preauth_total counter\n");
+    for (i = 0; i < MAX_PREAUTH_TYPES; i++) {
+        pm = &metrics->preauth[i];
+        if (pm->pa_type == 0)
+            break;
+        k5_buf_add_fmt(buf, "kdc_preauth_total{pa_type=\"%d\","
+                       "result=\"ok\"} %llu\n", (int)pm->pa_type,
+                       (unsigned long long)ATOMIC_GET(&pm->succeeded));
+        k5_buf_add_fmt(buf, "kdc_preauth_total{pa_type=\"%d\","
+                       "result=\"failed\"} %llu\n", (int)pm->pa_type,
+                       (unsigned long long)ATOMIC_GET(&pm->failed));
+    }
+
+    k5_buf_add(buf, "# TYPE kdc_request_duration_microseconds histogram\n");
+    for (t = 0; t < KDC_METRICS_NTYPES; t++) {
+        snprintf(labels, sizeof(labels), "type=\"%s\"", type_names[t]);
+        add_hist(buf, "kdc_request_duration_microseconds", labels,
+                 &metrics->latency[t]);
+    }
+
+    k5_buf_add(buf, "# TYPE kdc_stage_duration_microseconds histogram\n");
+    for (t = 0; t < KDC_METRICS_NTYPES; t++) {
+        for (s = 0; s < KDC_METRICS_NSTAGES; s++) {
+            snprintf(labels, sizeof(labels), "type=\"%s\",stage=\"%s\"",
+                     type_names[t], stage_names[s]);
+            add_hist(buf, "kdc_stage_duration_microseconds", labels,
+                     &metrics->stages[t][s]);
+        }
+    }
+
+    k5_buf_add(buf, "# TYPE kdc_preauth_duration_microseconds histogram\n");
+    for (i = 0; i < MAX_PREAUTH_TYPES; i++) {
+        pm = &metrics->preauth[i];
+        if (pm->pa_type == 0)
+            break;
+        snprintf(labels, sizeof(labels), "pa_type=\"%d\"", (int)pm->pa_type);
+        add_hist(buf, "kdc_preauth_duration_microseconds", labels,
+                 &pm->latency);
+    }
+}
+
+static void
+free_scrape(verto_ctx *ctx, verto_ev *ev)
+{
+    struct scrape *sc = verto_get_private(ev);
+
+    close(verto_get_fd(ev));
+    k5_buf_free(&sc->buf);
+    free(sc);
+}
+
+/* Write as much of the snapshot as the socket will take. */
+static void
+write_scrape(verto_ctx *ctx, verto_ev *ev)
+{
+    struct scrape *sc = verto_get_private(ev);
+    ssize_t len;
+
+    len = write(verto_get_fd(ev), (char *)sc->buf.data + sc->pos,
+                sc->buf.len - sc->pos);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len > 0)
+        sc->pos += len;
+    if (len <= 0 || sc->pos == sc->buf.len)
+        verto_del(ev);
+}
+
+static void
+accept_scrape(verto_ctx *ctx, verto_ev *ev)
+{
+    struct scrape *sc;
+    verto_ev *wev;
+    int fd;
+
+    fd = accept(verto_get_fd(ev), NULL, NULL);
+    if (fd < 0)
+        return;
+    set_cloexec_fd(fd);
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+        goto error;
+
+    sc = malloc(sizeof(*sc));
+    if (sc == NULL)
+        goto error;
+    k5_buf_init_dynamic(&sc->buf);
+    sc->pos = 0;
+    format_metrics(&sc->buf);
+    if (k5_buf_status(&sc->buf) != 0) {
+        free(sc);
+        goto error;
+    }
+
+    wev = verto_add_io(ctx, VERTO_EV_FLAG_PERSIST | VERTO_EV_FLAG_IO_WRITE,
+                       write_scrape, fd);
+    if (wev == NULL) {
+        k5_buf_free(&sc->buf);
+        free(sc);
+        goto error;
+    }
+    verto_set_private(wev, sc, free_scrape);
+    return;
+
+error:
+    close(fd);
+}
+
+/*
+ * Enable metrics collection and create a Unix socket at path for reading
+ * them.  Only the KDC's user may connect to the socket.  This must be called
+ * before any worker processes are created.
+ */
+krb5_error_code
+kdc_init_metrics(const char *path)
+{
+    struct sockaddr_un addr;
+    krb5_error_code ret;
+    mode_t old_mask;
+    int st;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlcpy(addr.sun_path, path, sizeof(addr.sun_path)) >=
+        sizeof(addr.sun_path))
+        return ENAMETOOLONG;
+
+    metrics = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        metrics = NULL;
+        return errno;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        goto error;
+    set_cloexec_fd(listen_fd);
+    (void)unlink(path);
+    old_mask = umask(077);
+    st = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    (void)umask(old_mask);
+    if (st != 0)
+        goto error;
+    if (listen(listen_fd, 5) != 0 ||
+        fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0) {
+        (void)unlink(path);
+        goto error;
+    }
+
+    socket_path = strdup(path);
+    if (socket_path == NULL) {
+        (void)unlink(path);
+        errno = ENOMEM;
+        goto error;
+    }
+    return 0;
+
+error:
+    ret = errno;
+    if (listen_fd >= 0)
+        close(listen_fd);
+    listen_fd = -1;
+    munmap(metrics, sizeof(*metrics));
+    metrics = NULL;
+    return ret;
+}
+
+/* Record the current process as the one which removes the metrics socket at
+ * exit.  Call this after detaching from the terminal and before creating any
+ * worker processes. */
+void
+kdc_set_metrics_owner(void)
+{
+    owner_pid = getpid();
+}
+
+/* Begin answering connections to the metrics socket in ctx.  In worker
+ * processes, any worker may answer a given connection. */
+krb5_error_code
+kdc_start_metrics(verto_ctx *ctx)
+{
+    if (listen_fd < 0)
+        return 0;
+    listen_ev = verto_add_io(ctx, VERTO_EV_FLAG_PERSIST |
+                             VERTO_EV_FLAG_IO_READ, accept_scrape, listen_fd);
+    return (listen_ev == NULL) ? ENOMEM : 0;
+}
+
+void
+kdc_free_metrics(void)
+{
+    if (listen_ev != NULL)
+        verto_del(listen_ev);
+    listen_ev = NULL;
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        /* Only the process which created the socket removes it. */
+        if (getpid() == owner_pid)
+            (void)unlink(socket_path);
+    }
+    free(socket_path);
+    socket_path = NULL;
+    if (metrics != NULL)
+        munmap(metrics, sizeof(*metrics));
+    metrics = NULL;
+}
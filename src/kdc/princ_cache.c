@@ -0,0 +1,972 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/princ_cache.c - Cache of server principal entries and unknown names */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Nearly every TGS request looks up the local krbtgt entry and a service
+ * entry, and most requests involve a small set of hot principals.  When
+ * principal_cache_size is set for a realm, server and krbtgt lookups go
+ * through a bounded LRU cache of decoded entries, keyed on the requested
+ * principal name and lookup flags.  Callers always receive a deep copy, so
+ * they may modify and free it with krb5_db_free_principal() as usual.
+ *
+ * Client lookups are not cached, since the lockout and last-success state of
+ * client entries changes as requests are processed.
+ *
+ * When principal_negative_cache_size is set, the cache also remembers up to
+ * that many client, server, and krbtgt names for which the database returned
+ * KRB5_KDB_NOENTRY, in a separate LRU list, so that repeated requests for
+ * unknown names do not reach the database.  When principal_bloom_filter is
+ * set, the cache additionally consults a Bloom filter of the names of all
+ * database entries, and rejects names not in the filter.
+ *
+ * Entries are discarded when they reach principal_cache_ttl.  In addition,
+ * at most once per second the whole cache is flushed if the database age
+ * reported by krb5_db_get_age() has changed, or if the serial number in the
+ * header of the iprop update log has changed.  Together these catch kadmin
+ * changes, propagation via kprop or iprop, and kdb5_util operations.  When
+ * the update log is available, age changes alone leave the entries for
+ * unknown names in place, since they come from writes which are not logged,
+ * such as the KDC's own lockout and last-success updates.
+ *
+ * The Bloom filter is shared by a realm and its copies in request threads,
+ * and is built by iterating over the database in a background thread with
+ * its own database handle, so that neither the event loop nor request
+ * threads wait for it.  The filter is labelled with the state of the
+ * database observed before the iteration started, and is only consulted
+ * while a cache observes the same state, and for at most principal_cache_ttl
+ * after the build.  If the iprop update log is available, the state is its
+ * serial number and timestamp, which change with every kadmin or propagated
+ * change but not with the lockout and last-success updates the KDC makes
+ * itself.  Otherwise the state is the database age, which the DB2 module does
+ * not advance for those updates either.
+ * The filter is rebuilt at most once per principal_cache_ttl.
+ *
+ * Each realm structure otherwise owns its own cache; since request threads
+ * use their own copies of the realm list, only the shared filter is locked.
+ */
+
+#include "k5-int.h"
+#include "k5-queue.h"
+#include "kdc_util.h"
+#include "adm_proto.h"
+#include <kadm5/admin.h>
+#include <kdb_log.h>
+#include <syslog.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Number of bits set in the Bloom filter for each name, and the number of
+ * filter bits per database entry.  These give a false positive rate of about
+ * one percent. */
+#define BLOOM_HASHES 7
+#define BLOOM_BITS_PER_ENTRY 10
+
+struct pcache_entry {
+    K5_TAILQ_ENTRY(pcache_entry) lru_links;
+    K5_LIST_ENTRY(pcache_entry) hash_links;
+    uint32_t hash;
+    unsigned int flags;
+    krb5_principal princ;
+    krb5_db_entry *entry;       /* NULL for an unknown name */
+    time_t expires;
+};
+
+K5_TAILQ_HEAD(pcache_lru, pcache_entry);
+K5_LIST_HEAD(pcache_bucket, pcache_entry);
+
+/* The state of the database which determines the set of entry names; see the
+ * comment at the top of the file. */
+struct names_stamp {
+    krb5_boolean use_ulog;
+    time_t db_age;
+    kdb_sno_t ulog_sno;
+    kdbe_time_t ulog_time;
+};
+
+/* A Bloom filter of database entry names, shared by the caches of a realm and
+ * its copies.  All fields are protected by lock. */
+struct kdc_bloom {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_t builder;
+#endif
+    krb5_boolean have_builder;  /* builder thread has not been joined */
+    krb5_boolean building;
+    krb5_boolean cancel;        /* last reference released; stop building */
+    unsigned int refcount;
+    char *realm;
+    char **db_args;
+    krb5_deltat ttl;
+    struct names_stamp want;    /* state observed before building */
+
+    unsigned char *bits;        /* NULL until first built */
+    uint32_t mask;              /* number of filter bits minus one */
+    struct names_stamp stamp;
+    time_t expires;
+    time_t next_build;
+};
+
+#ifdef HAVE_PTHREAD
+#define LOCK_BLOOM(b) pthread_mutex_lock(&(b)->lock)
+#define UNLOCK_BLOOM(b) pthread_mutex_unlock(&(b)->lock)
+#else
+#define LOCK_BLOOM(b)
+#define UNLOCK_BLOOM(b)
+#endif
+
+struct kdc_princ_cache {
+    size_t max_entries;
+    size_t num_entries;
+    size_t max_neg_entries;
+    size_t num_neg_entries;
+    krb5_deltat ttl;
+    krb5_data realm;
+
+    /* Least recently used entries are at the tail.  Entries for unknown names
+     * are kept on neg_lru, but share the hash buckets. */
+    struct pcache_lru lru;
+    struct pcache_lru neg_lru;
+    struct pcache_bucket *buckets;
+    size_t nbuckets;            /* always a power of two */
+
+    struct kdc_bloom *bloom;    /* NULL if not using a Bloom filter */
+
+    /* Database change detection. */
+    time_t next_check;
+    krb5_boolean have_age;
+    time_t db_age;
+    int ulog_fd;
+    kdb_sno_t ulog_sno;
+    kdbe_time_t ulog_time;
+    struct names_stamp names;   /* state as of the last check */
+    krb5_boolean have_names;
+
+    unsigned long hits, misses, flushes, neg_hits, bloom_rejects;
+};
+
+/* FNV-1a over the realm and components of princ, followed by val.  Also used
+ * by the key cache. */
+uint32_t
+kdc_hash_princ(krb5_const_principal princ, unsigned int val)
+{
+    uint32_t h = 2166136261U;
+    const unsigned char *p;
+    unsigned int i, c;
+
+    for (p = (unsigned char *)princ->realm.data;
+         p < (unsigned char *)princ->realm.data + princ->realm.length; p++)
+        h = (h ^ *p) * 16777619U;
+    for (c = 0; c < (unsigned int)princ->length; c++) {
+        h = (h ^ 0xff) * 16777619U;
+        p = (unsigned char *)princ->data[c].data;
+        for (i = 0; i < princ->data[c].length; i++)
+            h = (h ^ p[i]) * 16777619U;
+    }
+    return (h ^ val) * 16777619U;
+}
+
+static void
+free_pcache_entry(krb5_context context, struct pcache_entry *ent)
+{
+    krb5_free_principal(context, ent->princ);
+    krb5_db_free_principal(context, ent->entry);
+    free(ent);
+}
+
+static void
+remove_pcache_entry(krb5_context context, struct kdc_princ_cache *cache,
+                    struct pcache_entry *ent)
+{
+    if (ent->entry == NULL) {
+        K5_TAILQ_REMOVE(&cache->neg_lru, ent, lru_links);
+        cache->num_neg_entries--;
+    } else {
+        K5_TAILQ_REMOVE(&cache->lru, ent, lru_links);
+        cache->num_entries--;
+    }
+    K5_LIST_REMOVE(ent, hash_links);
+    free_pcache_entry(context, ent);
+}
+
+/* Discard the entries for known names, and for unknown names if negative is
+ * true. */
+static void
+flush_cache(krb5_context context, struct kdc_princ_cache *cache,
+            krb5_boolean negative)
+{
+    struct pcache_entry *ent;
+
+    while ((ent = K5_TAILQ_FIRST(&cache->lru)) != NULL)
+        remove_pcache_entry(context, cache, ent);
+    while (negative && (ent = K5_TAILQ_FIRST(&cache->neg_lru)) != NULL)
+        remove_pcache_entry(context, cache, ent);
+    cache->flushes++;
+}
+
+/* Read the header of the iprop update log, if we are watching one. */
+static krb5_boolean
+read_ulog_header(struct kdc_princ_cache *cache, kdb_hlog_t *hdr)
+{
+    if (cache->ulog_fd == -1)
+        return FALSE;
+    if (pread(cache->ulog_fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+        return FALSE;
+    return hdr->kdb_hmagic == KDB_ULOG_HDR_MAGIC;
+}
+
+/*
+ * Flush the cache if the database may have changed since the last check, and
+ * record the state of the database for comparison with the Bloom filter.  If
+ * the update log is available, only its changes flush the entries for unknown
+ * names, since a name can only be added by a logged change.
+ */
+static void
+check_db_changes(krb5_context context, struct kdc_princ_cache *cache,
+                 time_t now)
+{
+    krb5_boolean age_changed = FALSE, ulog_changed = FALSE;
+    krb5_boolean have_age = FALSE, have_ulog, negative;
+    kdb_hlog_t hdr;
+    time_t age;
+
+    if (now < cache->next_check)
+        return;
+    cache->next_check = now + 1;
+
+    if (krb5_db_get_age(context, NULL, &age) == 0) {
+        if (!cache->have_age || age != cache->db_age)
+            age_changed = TRUE;
+        have_age = cache->have_age = TRUE;
+        cache->db_age = age;
+    }
+
+    have_ulog = read_ulog_header(cache, &hdr);
+    if (have_ulog) {
+        if (hdr.kdb_last_sno != cache->ulog_sno ||
+            hdr.kdb_last_time.seconds != cache->ulog_time.seconds ||
+            hdr.kdb_last_time.useconds != cache->ulog_time.useconds)
+            ulog_changed = TRUE;
+        cache->ulog_sno = hdr.kdb_last_sno;
+        cache->ulog_time = hdr.kdb_last_time;
+    }
+
+    negative = have_ulog ? ulog_changed : age_changed;
+    if ((age_changed || ulog_changed) &&
+        cache->num_entries + (negative ? cache->num_neg_entries : 0) > 0)
+        flush_cache(context, cache, negative);
+
+    memset(&cache->names, 0, sizeof(cache->names));
+    cache->names.use_ulog = have_ulog;
+    if (have_ulog) {
+        cache->names.ulog_sno = cache->ulog_sno;
+        cache->names.ulog_time = cache->ulog_time;
+    } else {
+        cache->names.db_age = cache->db_age;
+    }
+    cache->have_names = have_ulog || have_age;
+}
+
+static krb5_boolean
+stamp_eq(const struct names_stamp *a, const struct names_stamp *b)
+{
+    if (a->use_ulog != b->use_ulog)
+        return FALSE;
+    if (!a->use_ulog)
+        return a->db_age == b->db_age;
+    return a->ulog_sno == b->ulog_sno &&
+        a->ulog_time.seconds == b->ulog_time.seconds &&
+        a->ulog_time.useconds == b->ulog_time.useconds;
+}
+
+/* 64-bit FNV-1a over the realm and components of princ, for the Bloom
+ * filter. */
+static uint64_t
+bloom_hash(krb5_const_principal princ)
+{
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *p;
+    unsigned int i, c;
+
+    for (p = (unsigned char *)princ->realm.data;
+         p < (unsigned char *)princ->realm.data + princ->realm.length; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    for (c = 0; c < (unsigned int)princ->length; c++) {
+        h = (h ^ 0xff) * 1099511628211ULL;
+        p = (unsigned char *)princ->data[c].data;
+        for (i = 0; i < princ->data[c].length; i++)
+            h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Set or test the filter bits for the name hash h, using double hashing.
+ * Return true if all of the bits were already set. */
+static krb5_boolean
+bloom_bits(unsigned char *bloom, uint32_t mask, uint64_t h, krb5_boolean set)
+{
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, bit;
+    krb5_boolean present = TRUE;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        bit = (h1 + i * h2) & mask;
+        if (!(bloom[bit / 8] & (1 << (bit % 8))))
+            present = FALSE;
+        if (set)
+            bloom[bit / 8] |= 1 << (bit % 8);
+    }
+    return present;
+}
+
+struct bloom_names {
+    struct kdc_bloom *bloom;
+    uint64_t *hashes;
+    size_t count;
+    size_t alloc;
+};
+
+/* krb5_db_iterate() callback to collect the name hash of each entry. */
+static int
+collect_name(krb5_pointer ptr, krb5_db_entry *ent)
+{
+    struct bloom_names *names = ptr;
+    uint64_t *newptr;
+    size_t newalloc;
+    krb5_boolean cancel;
+
+    if (names->count % 1024 == 0) {
+        LOCK_BLOOM(names->bloom);
+        cancel = names->bloom->cancel;
+        UNLOCK_BLOOM(names->bloom);
+        if (cancel)
+            return ECANCELED;
+    }
+    if (names->count == names->alloc) {
+        newalloc = (names->alloc == 0) ? 1024 : names->alloc * 2;
+        newptr = realloc(names->hashes, newalloc * sizeof(*newptr));
+        if (newptr == NULL)
+            return ENOMEM;
+        names->hashes = newptr;
+        names->alloc = newalloc;
+    }
+    names->hashes[names->count++] = bloom_hash(ent->princ);
+    return 0;
+}
+
+/* Build a filter from the names of all entries in the database open in
+ * context, and publish it under the state bloom->want.  On failure, leave the
+ * previous filter in place; callers will not use it once the state changes. */
+static void
+build_bloom(krb5_context context, struct kdc_bloom *bloom)
+{
+    krb5_error_code ret;
+    struct bloom_names names = { NULL, NULL, 0, 0 };
+    unsigned char *bits = NULL;
+    uint64_t nbits;
+    size_t i;
+    time_t start = time(NULL);
+
+    /* Other threads of this process may write to the database while we
+     * iterate, taking the module's mutex and then its lock; we must not hold
+     * the lock while waiting for the mutex between entries. */
+    names.bloom = bloom;
+    ret = krb5_db_iterate(context, NULL, collect_name, &names,
+                          KRB5_DB_ITER_UNLOCKED);
+    if (ret)
+        goto cleanup;
+
+    for (nbits = 1024; nbits < names.count * BLOOM_BITS_PER_ENTRY &&
+             nbits < (1ULL << 32); nbits <<= 1);
+    bits = k5calloc(nbits / 8, 1, &ret);
+    if (bits == NULL)
+        goto cleanup;
+    for (i = 0; i < names.count; i++)
+        bloom_bits(bits, nbits - 1, names.hashes[i], TRUE);
+
+cleanup:
+    if (ret && ret != ECANCELED) {
+        krb5_klog_syslog(LOG_ERR, _("cannot build principal Bloom filter for "
+                                    "realm %s: %s"), bloom->realm,
+                         krb5_get_error_message(context, ret));
+    }
+    LOCK_BLOOM(bloom);
+    if (bits != NULL) {
+        free(bloom->bits);
+        bloom->bits = bits;
+        bloom->mask = nbits - 1;
+        bloom->stamp = bloom->want;
+        bloom->expires = start + bloom->ttl;
+    }
+    bloom->building = FALSE;
+    UNLOCK_BLOOM(bloom);
+    free(names.hashes);
+}
+
+#ifdef HAVE_PTHREAD
+/* Builder thread start routine.  Open the realm's database with a context of
+ * our own, since the caller's context belongs to its thread. */
+static void *
+bloom_builder(void *ptr)
+{
+    struct kdc_bloom *bloom = ptr;
+    krb5_error_code ret;
+    krb5_context context = NULL;
+
+    ret = krb5int_init_context_kdc(&context);
+    if (!ret)
+        ret = krb5_set_default_realm(context, bloom->realm);
+    if (!ret) {
+        ret = krb5_db_open(context, bloom->db_args,
+                           KRB5_KDB_OPEN_RO | KRB5_KDB_SRV_TYPE_KDC);
+    }
+    if (ret) {
+        krb5_klog_syslog(LOG_ERR, _("cannot build principal Bloom filter for "
+                                    "realm %s: %s"), bloom->realm,
+                         krb5_get_error_message(context, ret));
+        LOCK_BLOOM(bloom);
+        bloom->building = FALSE;
+        UNLOCK_BLOOM(bloom);
+    } else {
+        build_bloom(context, bloom);
+        krb5_db_fini(context);
+    }
+    krb5_free_context(context);
+    return NULL;
+}
+#endif
+
+/* Start building the filter for the database state observed by cache.  bloom
+ * must be locked and not already building. */
+static void
+start_build(krb5_context context, struct kdc_princ_cache *cache, time_t now)
+{
+    struct kdc_bloom *bloom = cache->bloom;
+
+    bloom->building = TRUE;
+    bloom->want = cache->names;
+    bloom->next_build = now + bloom->ttl;
+#ifdef HAVE_PTHREAD
+    /* The previous builder has finished; it makes no further use of bloom
+     * after clearing bloom->building. */
+    if (bloom->have_builder)
+        (void)pthread_join(bloom->builder, NULL);
+    bloom->have_builder = FALSE;
+    if (pthread_create(&bloom->builder, NULL, bloom_builder, bloom) != 0) {
+        krb5_klog_syslog(LOG_ERR, _("cannot start principal Bloom filter "
+                                    "builder for realm %s"), bloom->realm);
+        bloom->building = FALSE;
+        return;
+    }
+    bloom->have_builder = TRUE;
+#else
+    build_bloom(context, bloom);
+#endif
+}
+
+/* Return true if princ is definitely not the name of a database entry,
+ * according to the Bloom filter.  Enterprise and foreign names are never
+ * rejected, since the database module may resolve them to other names. */
+static krb5_boolean
+bloom_rejects(krb5_context context, struct kdc_princ_cache *cache,
+              krb5_const_principal princ, time_t now)
+{
+    struct kdc_bloom *bloom = cache->bloom;
+    krb5_boolean rejects = FALSE, usable;
+
+    if (bloom == NULL || princ->type == KRB5_NT_ENTERPRISE_PRINCIPAL ||
+        !data_eq(princ->realm, cache->realm) || !cache->have_names)
+        return FALSE;
+
+    LOCK_BLOOM(bloom);
+    usable = bloom->bits != NULL && stamp_eq(&bloom->stamp, &cache->names) &&
+        now < bloom->expires;
+    if (usable) {
+        rejects = !bloom_bits(bloom->bits, bloom->mask, bloom_hash(princ),
+                              FALSE);
+    } else if (!bloom->building && now >= bloom->next_build) {
+        start_build(context, cache, now);
+    }
+    UNLOCK_BLOOM(bloom);
+    return rejects;
+}
+
+/* Return a deep copy of src in *entry_out.  Return KRB5_KDB_DBTYPE_NOSUP if
+ * the entry carries module-private data which cannot be copied. */
+static krb5_error_code
+copy_db_entry(krb5_context context, const krb5_db_entry *src,
+              krb5_db_entry **entry_out)
+{
+    krb5_error_code ret;
+    krb5_db_entry *ent;
+    krb5_tl_data *tl, **tlp;
+    krb5_key_data *kd;
+    int i, j;
+
+    *entry_out = NULL;
+
+    /* Modules may hang unmarshalled private data off e_data with a zero
+     * length; we have no way to copy it. */
+    if (src->e_data != NULL && src->e_length == 0)
+        return KRB5_KDB_DBTYPE_NOSUP;
+
+    ent = k5alloc(sizeof(*ent), &ret);
+    if (ent == NULL)
+        return ret;
+    *ent = *src;
+    ent->e_data = NULL;
+    ent->princ = NULL;
+    ent->tl_data = NULL;
+    ent->key_data = NULL;
+    ent->n_key_data = 0;
+
+    if (src->e_data != NULL) {
+        ent->e_data = k5memdup(src->e_data, src->e_length, &ret);
+        if (ent->e_data == NULL)
+            goto cleanup;
+    }
+
+    ret = krb5_copy_principal(context, src->princ, &ent->princ);
+    if (ret)
+        goto cleanup;
+
+    tlp = &ent->tl_data;
+    for (tl = src->tl_data; tl != NULL; tl = tl->tl_data_next) {
+        *tlp = k5alloc(sizeof(**tlp), &ret);
+        if (*tlp == NULL)
+            goto cleanup;
+        (*tlp)->tl_data_type = tl->tl_data_type;
+        (*tlp)->tl_data_length = tl->tl_data_length;
+        if (tl->tl_data_length > 0) {
+            (*tlp)->tl_data_contents = k5memdup(tl->tl_data_contents,
+                                                tl->tl_data_length, &ret);
+            if ((*tlp)->tl_data_contents == NULL)
+                goto cleanup;
+        }
+        tlp = &(*tlp)->tl_data_next;
+    }
+
+    if (src->n_key_data > 0) {
+        ent->key_data = k5calloc(src->n_key_data, sizeof(*ent->key_data),
+                                 &ret);
+        if (ent->key_data == NULL)
+            goto cleanup;
+        for (i = 0; i < src->n_key_data; i++) {
+            kd = &ent->key_data[i];
+            *kd = src->key_data[i];
+            for (j = 0; j < 2; j++)
+                kd->key_data_contents[j] = NULL;
+            ent->n_key_data++;
+            for (j = 0; j < src->key_data[i].key_data_ver && j < 2; j++) {
+                if (kd->key_data_length[j] == 0)
+                    continue;
+                kd->key_data_contents[j] =
+                    k5memdup(src->key_data[i].key_data_contents[j],
+                             kd->key_data_length[j], &ret);
+                if (kd->key_data_contents[j] == NULL)
+                    goto cleanup;
+            }
+        }
+    }
+
+    *entry_out = ent;
+    ent = NULL;
+
+cleanup:
+    krb5_db_free_principal(context, ent);
+    return ret;
+}
+
+/* Release a reference to bloom, stopping and waiting for its builder thread
+ * when releasing the last one. */
+static void
+release_bloom(struct kdc_bloom *bloom)
+{
+    krb5_boolean last;
+
+    if (bloom == NULL)
+        return;
+    LOCK_BLOOM(bloom);
+    last = (--bloom->refcount == 0);
+    if (last)
+        bloom->cancel = TRUE;
+    UNLOCK_BLOOM(bloom);
+    if (!last)
+        return;
+
+#ifdef HAVE_PTHREAD
+    if (bloom->have_builder)
+        (void)pthread_join(bloom->builder, NULL);
+    pthread_mutex_destroy(&bloom->lock);
+#endif
+    kdc_free_db_args(bloom->db_args);
+    free(bloom->realm);
+    free(bloom->bits);
+    free(bloom);
+}
+
+static krb5_error_code
+create_bloom(const char *realm, char **db_args, krb5_deltat ttl,
+             struct kdc_bloom **bloom_out)
+{
+    krb5_error_code ret;
+    struct kdc_bloom *bloom;
+
+    *bloom_out = NULL;
+    bloom = k5alloc(sizeof(*bloom), &ret);
+    if (bloom == NULL)
+        return ret;
+#ifdef HAVE_PTHREAD
+    ret = pthread_mutex_init(&bloom->lock, NULL);
+    if (ret) {
+        free(bloom);
+        return ret;
+    }
+#endif
+    bloom->refcount = 1;
+    bloom->ttl = ttl;
+    bloom->realm = k5memdup0(realm, strlen(realm), &ret);
+    if (bloom->realm == NULL)
+        goto cleanup;
+    ret = kdc_copy_db_args(db_args, &bloom->db_args);
+    if (ret)
+        goto cleanup;
+    *bloom_out = bloom;
+    bloom = NULL;
+
+cleanup:
+    release_bloom(bloom);
+    return ret;
+}
+
+/*
+ * Create a principal cache for realm, whose database is opened with db_args.
+ * If share is not NULL, it is the cache of the realm structure being copied,
+ * and the new cache uses its Bloom filter.
+ */
+krb5_error_code
+kdc_create_princ_cache(krb5_context context, const char *realm,
+                       char **db_args, size_t max_entries,
+                       size_t max_neg_entries, krb5_boolean use_bloom,
+                       krb5_deltat ttl, struct kdc_princ_cache *share,
+                       struct kdc_princ_cache **cache_out)
+{
+    krb5_error_code ret;
+    struct kdc_princ_cache *cache;
+    kadm5_config_params params_in, params;
+    size_t i;
+
+    *cache_out = NULL;
+
+    cache = k5alloc(sizeof(*cache), &ret);
+    if (cache == NULL)
+        return ret;
+    cache->max_entries = max_entries;
+    cache->max_neg_entries = max_neg_entries;
+    cache->ttl = ttl;
+    cache->ulog_fd = -1;
+    K5_TAILQ_INIT(&cache->lru);
+    K5_TAILQ_INIT(&cache->neg_lru);
+
+    ret = alloc_data(&cache->realm, strlen(realm));
+    if (ret)
+        goto cleanup;
+    memcpy(cache->realm.data, realm, cache->realm.length);
+
+    cache->nbuckets = 16;
+    while (cache->nbuckets < max_entries + max_neg_entries)
+        cache->nbuckets <<= 1;
+    cache->buckets = k5calloc(cache->nbuckets, sizeof(*cache->buckets), &ret);
+    if (cache->buckets == NULL)
+        goto cleanup;
+    for (i = 0; i < cache->nbuckets; i++)
+        K5_LIST_INIT(&cache->buckets[i]);
+
+    if (use_bloom && share != NULL && share->bloom != NULL) {
+        cache->bloom = share->bloom;
+        LOCK_BLOOM(cache->bloom);
+        cache->bloom->refcount++;
+        UNLOCK_BLOOM(cache->bloom);
+    } else if (use_bloom) {
+        ret = create_bloom(realm, db_args, ttl, &cache->bloom);
+        if (ret)
+            goto cleanup;
+    }
+
+    /* If iprop is enabled for the realm, watch its update log header. */
+    memset(&params_in, 0, sizeof(params_in));
+    params_in.mask = KADM5_CONFIG_REALM;
+    params_in.realm = (char *)realm;
+    if (kadm5_get_config_params(context, 1, &params_in, &params) == 0) {
+        if (params.iprop_enabled && params.iprop_logfile != NULL) {
+            cache->ulog_fd = open(params.iprop_logfile, O_RDONLY);
+            if (cache->ulog_fd != -1)
+                set_cloexec_fd(cache->ulog_fd);
+        }
+        kadm5_free_config_params(context, &params);
+    }
+
+    /* Establish the baseline for change detection. */
+    check_db_changes(context, cache, time(NULL));
+
+    *cache_out = cache;
+    cache = NULL;
+
+cleanup:
+    kdc_free_princ_cache(context, cache);
+    return ret;
+}
+
+void
+kdc_free_princ_cache(krb5_context context, struct kdc_princ_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    flush_cache(context, cache, TRUE);
+    if (cache->ulog_fd != -1)
+        close(cache->ulog_fd);
+    release_bloom(cache->bloom);
+    free(cache->buckets);
+    free(cache->realm.data);
+    free(cache);
+}
+
+void
+kdc_log_princ_cache_stats(kdc_realm_t *realm)
+{
+    struct kdc_princ_cache *cache = realm->realm_princ_cache;
+
+    if (cache == NULL)
+        return;
+    krb5_klog_syslog(LOG_INFO, _("principal cache for realm %s: %lu hits, "
+                                 "%lu misses, %lu flushes, %lu negative hits, "
+                                 "%lu Bloom filter rejects"),
+                     realm->realm_name, cache->hits, cache->misses,
+                     cache->flushes, cache->neg_hits, cache->bloom_rejects);
+}
+
+/* Look up princ and flags in the cache, discarding the entry if it has
+ * expired.  Set *hash_out to the hash of princ and flags. */
+static struct pcache_entry *
+find_entry(krb5_context context, struct kdc_princ_cache *cache,
+           krb5_const_principal princ, unsigned int flags, time_t now,
+           uint32_t *hash_out)
+{
+    struct pcache_bucket *bucket;
+    struct pcache_entry *ent;
+    uint32_t hash;
+
+    hash = *hash_out = kdc_hash_princ(princ, flags);
+    bucket = &cache->buckets[hash & (cache->nbuckets - 1)];
+    K5_LIST_FOREACH(ent, bucket, hash_links) {
+        if (ent->hash == hash && ent->flags == flags &&
+            krb5_principal_compare(context, ent->princ, princ))
+            break;
+    }
+
+    if (ent != NULL && now >= ent->expires) {
+        remove_pcache_entry(context, cache, ent);
+        ent = NULL;
+    }
+    return ent;
+}
+
+/* Add ent to the cache, evicting the least recently used entry of the same
+ * kind if the cache is full.  ent->entry, ent->hash, and ent->flags must
+ * already be set. */
+static void
+insert_entry(krb5_context context, struct kdc_princ_cache *cache,
+             struct pcache_entry *ent, time_t now)
+{
+    struct pcache_lru *lru = (ent->entry == NULL) ? &cache->neg_lru :
+        &cache->lru;
+    size_t *count = (ent->entry == NULL) ? &cache->num_neg_entries :
+        &cache->num_entries;
+    size_t max = (ent->entry == NULL) ? cache->max_neg_entries :
+        cache->max_entries;
+
+    if (*count >= max)
+        remove_pcache_entry(context, cache, K5_TAILQ_LAST(lru, pcache_lru));
+    ent->expires = now + cache->ttl;
+    K5_LIST_INSERT_HEAD(&cache->buckets[ent->hash & (cache->nbuckets - 1)],
+                        ent, hash_links);
+    K5_TAILQ_INSERT_HEAD(lru, ent, lru_links);
+    (*count)++;
+}
+
+/* Remember that princ was not found in the database.  Failure to do so is not
+ * an error. */
+static void
+add_negative_entry(krb5_context context, struct kdc_princ_cache *cache,
+                   krb5_const_principal princ, unsigned int flags,
+                   uint32_t hash, time_t now)
+{
+    struct pcache_entry *ent;
+
+    if (cache->max_neg_entries == 0)
+        return;
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        return;
+    if (krb5_copy_principal(context, princ, &ent->princ) != 0) {
+        free(ent);
+        return;
+    }
+    ent->hash = hash;
+    ent->flags = flags;
+    insert_entry(context, cache, ent, now);
+}
+
+/*
+ * Return true if the realm's principal cache knows princ (looked up with
+ * flags) to be absent from the database, either from an earlier lookup or
+ * from the Bloom filter.  This does not consult the database.
+ */
+krb5_boolean
+kdc_principal_unknown(kdc_realm_t *kdc_active_realm,
+                      krb5_const_principal princ, unsigned int flags)
+{
+    struct kdc_princ_cache *cache = kdc_active_realm->realm_princ_cache;
+    struct pcache_entry *ent;
+    uint32_t hash;
+    time_t now;
+
+    if (cache == NULL)
+        return FALSE;
+
+    now = time(NULL);
+    check_db_changes(kdc_context, cache, now);
+
+    ent = find_entry(kdc_context, cache, princ, flags, now, &hash);
+    if (ent != NULL && ent->entry == NULL) {
+        cache->neg_hits++;
+        K5_TAILQ_REMOVE(&cache->neg_lru, ent, lru_links);
+        K5_TAILQ_INSERT_HEAD(&cache->neg_lru, ent, lru_links);
+        return TRUE;
+    }
+    if (ent == NULL && bloom_rejects(kdc_context, cache, princ, now)) {
+        cache->bloom_rejects++;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Record that a database lookup of princ with flags returned
+ * KRB5_KDB_NOENTRY. */
+void
+kdc_note_unknown_principal(kdc_realm_t *kdc_active_realm,
+                           krb5_const_principal princ, unsigned int flags)
+{
+    struct kdc_princ_cache *cache = kdc_active_realm->realm_princ_cache;
+    struct pcache_entry *ent;
+    uint32_t hash;
+    time_t now;
+
+    if (cache == NULL)
+        return;
+    now = time(NULL);
+    ent = find_entry(kdc_context, cache, princ, flags, now, &hash);
+    if (ent != NULL && ent->entry == NULL)
+        return;
+    if (ent != NULL)
+        remove_pcache_entry(kdc_context, cache, ent);
+    add_negative_entry(kdc_context, cache, princ, flags, hash, now);
+}
+
+/* Look up a server or krbtgt principal entry, using the realm's principal
+ * cache if it has one. */
+krb5_error_code
+kdc_get_principal(kdc_realm_t *kdc_active_realm, krb5_const_principal princ,
+                  unsigned int flags, krb5_db_entry **entry_out)
+{
+    krb5_error_code ret;
+    struct kdc_princ_cache *cache = kdc_active_realm->realm_princ_cache;
+    struct pcache_entry *ent;
+    krb5_db_entry *dbent;
+    uint32_t hash;
+    time_t now;
+
+    *entry_out = NULL;
+    if (cache == NULL)
+        return krb5_db_get_principal(kdc_context, princ, flags, entry_out);
+
+    now = time(NULL);
+    check_db_changes(kdc_context, cache, now);
+
+    ent = find_entry(kdc_context, cache, princ, flags, now, &hash);
+    if (ent != NULL && ent->entry == NULL) {
+        cache->neg_hits++;
+        K5_TAILQ_REMOVE(&cache->neg_lru, ent, lru_links);
+        K5_TAILQ_INSERT_HEAD(&cache->neg_lru, ent, lru_links);
+        return KRB5_KDB_NOENTRY;
+    }
+    if (ent != NULL) {
+        ret = copy_db_entry(kdc_context, ent->entry, entry_out);
+        if (ret)
+            return ret;
+        cache->hits++;
+        K5_TAILQ_REMOVE(&cache->lru, ent, lru_links);
+        K5_TAILQ_INSERT_HEAD(&cache->lru, ent, lru_links);
+        return 0;
+    }
+    if (bloom_rejects(kdc_context, cache, princ, now)) {
+        cache->bloom_rejects++;
+        return KRB5_KDB_NOENTRY;
+    }
+
+    cache->misses++;
+    ret = krb5_db_get_principal(kdc_context, princ, flags, &dbent);
+    if (ret == KRB5_KDB_NOENTRY)
+        add_negative_entry(kdc_context, cache, princ, flags, hash, now);
+    if (ret)
+        return ret;
+    if (cache->max_entries == 0)
+        goto done;
+
+    /* Cache a copy of the entry if we can.  Failure to do so is not an error
+     * for the lookup. */
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        goto done;
+    if (krb5_copy_principal(kdc_context, princ, &ent->princ) != 0 ||
+        copy_db_entry(kdc_context, dbent, &ent->entry) != 0) {
+        free_pcache_entry(kdc_context, ent);
+        goto done;
+    }
+    ent->hash = hash;
+    ent->flags = flags;
+    insert_entry(kdc_context, cache, ent, now);
+
+done:
+    *entry_out = dbent;
+    return 0;
+}
@@ -33,6 +33,9 @@
 #ifndef REALM_DATA_H
 #define REALM_DATA_H
 
+struct kdc_princ_cache;
+struct kdc_key_cache;
+
 typedef struct __kdc_realm_data {
     /*
      * General Kerberos per-realm data.
@@ -51,6 +54,7 @@ typedef struct __kdc_realm_data {
      */
     char *              realm_stash;    /* Stash file name for realm        */
     char *              realm_mpname;   /* Master principal name for realm  */
+    char **             realm_db_args;  /* Database arguments for realm     */
     krb5_principal      realm_mprinc;   /* Master principal for realm       */
     /*
      * Note realm_mkey is mkey read from stash or keyboard and may not be the
@@ -74,6 +78,13 @@ typedef struct __kdc_realm_data {
     krb5_boolean        realm_reject_bad_transit; /* Accept unverifiable transited_realm ? */
     krb5_boolean        realm_restrict_anon;  /* Anon to local TGT only */
     krb5_boolean        realm_assume_des_crc_sess;  /* Assume princs support des-cbc-crc for session keys */
+    int                 realm_princ_cache_size; /* Max cached server entries */
+    krb5_deltat         realm_princ_cache_ttl;  /* Lifetime of cached entries */
+    int                 realm_princ_neg_cache_size; /* Max cached unknown names */
+    krb5_boolean        realm_princ_bloom_filter; /* Filter unknown names */
+    struct kdc_princ_cache *realm_princ_cache; /* Server entry cache or NULL */
+    int                 realm_key_cache_size; /* Max cached server keys */
+    struct kdc_key_cache *realm_key_cache; /* Server key cache or NULL */
 } kdc_realm_t;
 
 struct server_handle {
@@ -84,6 +95,10 @@ struct server_handle {
 
 kdc_realm_t *find_realm_data(struct server_handle *, char *, krb5_ui_4);
 kdc_realm_t *setup_server_realm(struct server_handle *, krb5_principal);
+krb5_error_code kdc_copy_server_handle(struct server_handle *);
+void kdc_free_server_handle(struct server_handle *);
+krb5_error_code kdc_copy_db_args(char **, char ***);
+void kdc_free_db_args(char **);
 
 /*
  * These macros used to refer to a global pointer to the active realm state
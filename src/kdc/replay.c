@@ -28,15 +28,28 @@
 #include "k5-queue.h"
 #include "kdc_util.h"
 #include "extern.h"
+#include "adm_proto.h"
+#include <syslog.h>
 
 #ifndef NOCACHE
 
+#if defined(ENABLE_THREADS) && defined(HAVE_PTHREAD) && \
+    defined(_POSIX_THREAD_PROCESS_SHARED) && _POSIX_VERSION >= 200809L
+#define SHARED_LOOKASIDE
+#include <pthread.h>
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 struct entry {
     K5_LIST_ENTRY(entry) bucket_links;
     K5_TAILQ_ENTRY(entry) expire_links;
+    krb5_ui_4 bucket;
     int num_hits;
     krb5_timestamp timein;
-    krb5_data req_packet;
+    krb5_data req_packet;       /* The request, or its digest */
     krb5_data reply_packet;
 };
 
@@ -50,14 +63,29 @@ struct entry {
 K5_LIST_HEAD(entry_list, entry);
 K5_TAILQ_HEAD(entry_queue, entry);
 
-static struct entry_list hash_table[LOOKASIDE_HASH_SIZE];
-static struct entry_queue expiration_queue;
+/*
+ * The hash table is divided into shards by bucket number, each with its own
+ * lock, expiration queue, and share of the size limit, so that threads
+ * handling requests which hash to different shards do not contend.  The
+ * entries of a bucket are protected by the lock of its shard.
+ */
+struct lookaside_shard {
+    k5_mutex_t lock;
+    struct entry_queue expiration_queue;
+    size_t total_size;
+    size_t max_size;
+    int num_entries;
+    int hits;
+    int calls;
+    int max_hits_per_entry;
+};
 
-static int hits = 0;
-static int calls = 0;
-static int max_hits_per_entry = 0;
-static int num_entries = 0;
-static size_t total_size = 0;
+static struct entry_list *hash_table;
+static unsigned int hash_size = LOOKASIDE_HASH_SIZE;
+static struct lookaside_shard *shards;
+static unsigned int num_shards;
+static size_t max_size = LOOKASIDE_MAX_SIZE;
+static krb5_boolean use_digest;
 static krb5_ui_4 seed;
 
 #define STALE_TIME      (2*60)            /* two minutes */
@@ -73,7 +101,7 @@ rotl32(krb5_ui_4 x, int r)
 /*
  * Return a non-cryptographic hash of data, seeded by seed (the global
  * variable), using the MurmurHash3 algorithm by Austin Appleby.  Return the
- * result modulo LOOKASIDE_HASH_SIZE.
+ * result modulo the number of hash buckets.
  */
 static int
 murmurhash3(const krb5_data *data)
@@ -99,7 +127,34 @@ murmurhash3(const krb5_data *data)
     h = (h ^ (h >> 16)) * 0x85ebca6b;
     h = (h ^ (h >> 13)) * 0xc2b2ae35;
     h ^= h >> 16;
-    return h % LOOKASIDE_HASH_SIZE;
+    return h % hash_size;
+}
+
+/*
+ * Set *key to the cache key for req, which is req itself or, if the cache is
+ * configured to use digests, a SHA-256 digest of req placed in buf.
+ */
+static krb5_error_code
+make_key(const krb5_data *req, uint8_t buf[K5_SHA256_HASHLEN], krb5_data *key)
+{
+    krb5_error_code ret;
+
+    if (!use_digest) {
+        *key = *req;
+        return 0;
+    }
+    ret = k5_sha256(req, buf);
+    if (ret)
+        return ret;
+    *key = make_data(buf, K5_SHA256_HASHLEN);
+    return 0;
+}
+
+/* Return the shard holding the hash bucket for key. */
+static inline struct lookaside_shard *
+key_shard(const krb5_data *key)
+{
+    return &shards[murmurhash3(key) % num_shards];
 }
 
 /* Return the rough memory footprint of an entry containing req and rep. */
@@ -110,7 +165,7 @@ entry_size(const krb5_data *req, const krb5_data *rep)
         ((rep == NULL) ? 0 : rep->length);
 }
 
-/* Insert an entry into the cache. */
+/* Insert an entry into the cache.  The lock of its shard must be held. */
 static struct entry *
 insert_entry(krb5_context context, krb5_data *req, krb5_data *rep,
              krb5_timestamp time)
@@ -118,11 +173,13 @@ insert_entry(krb5_context context, krb5_data *req, krb5_data *rep,
     krb5_error_code ret;
     struct entry *entry;
     krb5_ui_4 req_hash = murmurhash3(req);
+    struct lookaside_shard *shard = &shards[req_hash % num_shards];
     size_t esize = entry_size(req, rep);
 
     entry = calloc(1, sizeof(*entry));
     if (entry == NULL)
         return NULL;
+    entry->bucket = req_hash;
     entry->timein = time;
 
     ret = krb5int_copy_data_contents(context, req, &entry->req_packet);
@@ -140,29 +197,33 @@ insert_entry(krb5_context context, krb5_data *req, krb5_data *rep,
         }
     }
 
-    K5_TAILQ_INSERT_TAIL(&expiration_queue, entry, expire_links);
+    K5_TAILQ_INSERT_TAIL(&shard->expiration_queue, entry, expire_links);
     K5_LIST_INSERT_HEAD(&hash_table[req_hash], entry, bucket_links);
-    num_entries++;
-    total_size += esize;
+    shard->num_entries++;
+    shard->total_size += esize;
 
     return entry;
 }
 
 
-/* Remove entry from its hash bucket and the expiration queue, and free it. */
+/* Remove entry from its hash bucket and the expiration queue, and free it.
+ * The lock of its shard must be held. */
 static void
 discard_entry(krb5_context context, struct entry *entry)
 {
-    total_size -= entry_size(&entry->req_packet, &entry->reply_packet);
-    num_entries--;
+    struct lookaside_shard *shard = &shards[entry->bucket % num_shards];
+
+    shard->total_size -= entry_size(&entry->req_packet, &entry->reply_packet);
+    shard->num_entries--;
     K5_LIST_REMOVE(entry, bucket_links);
-    K5_TAILQ_REMOVE(&expiration_queue, entry, expire_links);
+    K5_TAILQ_REMOVE(&shard->expiration_queue, entry, expire_links);
     krb5_free_data_contents(context, &entry->req_packet);
     krb5_free_data_contents(context, &entry->reply_packet);
     free(entry);
 }
 
-/* Return the entry for req_packet, or NULL if we don't have one. */
+/* Return the entry for req_packet, or NULL if we don't have one.  The lock of
+ * the shard for req_packet must be held. */
 static struct entry *
 find_entry(krb5_data *req_packet)
 {
@@ -176,28 +237,466 @@ find_entry(krb5_data *req_packet)
     return NULL;
 }
 
-/* Initialize the lookaside cache structures and randomize the hash seed. */
+#ifdef SHARED_LOOKASIDE
+
+/*
+ * When the KDC runs worker processes, the lookaside cache is kept in an
+ * anonymous shared mapping created by the supervisor before it forks, so that
+ * a retransmitted request is recognized by whichever worker receives it.  The
+ * mapping is inherited at the same address in every worker, so pointers into
+ * it are valid in all of them.
+ *
+ * Entries are carved out of a ring buffer in insertion order.  The oldest entry
+ * is therefore always at the head of the ring, and making room for a new entry
+ * discards entries from the head, just as the per-process cache discards from
+ * the front of its expiration queue.  Removed entries are unlinked from their
+ * hash bucket immediately but keep their ring space until the head passes
+ * them.  The ring lock protects the ring and must be acquired before any
+ * bucket lock; lookups take only the lock of the bucket they search.  The
+ * bucket array and the ring follow the header in the mapping, sized as
+ * configured for the per-process cache.
+ *
+ * The locks are robust, so that a worker which dies holding one does not hang
+ * the others.  Whatever the lock protected may have been left half-updated, so
+ * the next process to acquire it empties the bucket, or for the ring lock the
+ * whole cache.  The lookup statistics are kept per bucket so that they cover
+ * all of the workers.
+ */
+
+struct shared_entry {
+    struct shared_entry *bucket_next;
+    size_t size;                /* Ring space used, including this header */
+    krb5_ui_4 bucket;
+    krb5_boolean linked;
+    int num_hits;
+    krb5_timestamp timein;
+    unsigned int req_len;
+    unsigned int reply_len;
+    /* The request bytes and then the reply bytes follow. */
+};
+
+struct shared_bucket {
+    pthread_mutex_t lock;
+    struct shared_entry *first;
+    int hits;
+    int calls;
+    int max_hits_per_entry;
+};
+
+struct shared_lookaside {
+    size_t map_size;
+    pid_t creator;              /* The supervisor process */
+    pthread_mutex_t ring_lock;
+    unsigned char *ring;
+    size_t ring_size;
+    size_t head;                /* Offset of the oldest entry */
+    size_t tail;                /* Offset of the next allocation */
+    size_t limit;               /* End of the data at the top of the ring */
+    krb5_boolean wrapped;       /* True if live data wraps around to 0 */
+    int num_entries;            /* Entries in the ring, linked or not */
+    struct shared_bucket *buckets;
+};
+
+#define SHARED_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static struct shared_lookaside *shared_cache;
+
+static inline unsigned char *
+shared_req_bytes(struct shared_entry *e)
+{
+    return (unsigned char *)e + sizeof(*e);
+}
+
+static inline unsigned char *
+shared_reply_bytes(struct shared_entry *e)
+{
+    return shared_req_bytes(e) + e->req_len;
+}
+
+static inline struct shared_entry *
+shared_head(struct shared_lookaside *c)
+{
+    return (struct shared_entry *)(c->ring + c->head);
+}
+
+/* Lock m, returning true if its previous owner died while holding it. */
+static krb5_boolean
+shared_lock(pthread_mutex_t *m)
+{
+    if (pthread_mutex_lock(m) != EOWNERDEAD)
+        return FALSE;
+    pthread_mutex_consistent(m);
+    return TRUE;
+}
+
+/* Lock b, emptying it if a worker died while changing it.  The entries remain
+ * in the ring until the head passes them. */
+static void
+shared_lock_bucket(struct shared_bucket *b)
+{
+    if (shared_lock(&b->lock))
+        b->first = NULL;
+}
+
+/* Lock the ring of c, emptying the cache if a worker died while changing it.
+ */
+static void
+shared_lock_ring(struct shared_lookaside *c)
+{
+    unsigned int i;
+
+    if (!shared_lock(&c->ring_lock))
+        return;
+    krb5_klog_syslog(LOG_WARNING, _("worker process died while updating the "
+                                    "lookaside cache; resetting it"));
+    for (i = 0; i < hash_size; i++) {
+        shared_lock_bucket(&c->buckets[i]);
+        c->buckets[i].first = NULL;
+        pthread_mutex_unlock(&c->buckets[i].lock);
+    }
+    c->head = c->tail = 0;
+    c->limit = c->ring_size;
+    c->wrapped = FALSE;
+    c->num_entries = 0;
+}
+
+/* Unlink e from its hash bucket if it is still linked. */
+static void
+shared_unlink(struct shared_lookaside *c, struct shared_entry *e)
+{
+    struct shared_bucket *b = &c->buckets[e->bucket];
+    struct shared_entry **pp;
+
+    shared_lock_bucket(b);
+    if (e->linked) {
+        for (pp = &b->first; *pp != NULL; pp = &(*pp)->bucket_next) {
+            if (*pp == e) {
+                *pp = e->bucket_next;
+                break;
+            }
+        }
+        e->linked = FALSE;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Discard the oldest entry in the ring.  The ring lock must be held. */
+static void
+shared_discard_head(struct shared_lookaside *c)
+{
+    struct shared_entry *e = shared_head(c);
+
+    shared_unlink(c, e);
+    c->head += e->size;
+    c->num_entries--;
+    if (c->num_entries == 0) {
+        c->head = c->tail = 0;
+        c->limit = c->ring_size;
+        c->wrapped = FALSE;
+    } else if (c->wrapped && c->head == c->limit) {
+        c->head = 0;
+        c->limit = c->ring_size;
+        c->wrapped = FALSE;
+    }
+}
+
+/*
+ * Reserve size bytes (a multiple of the alignment, no larger than the ring) at
+ * the tail of the ring, discarding the oldest entries as needed.  The ring lock
+ * must be held.
+ */
+static struct shared_entry *
+shared_alloc(struct shared_lookaside *c, size_t size)
+{
+    size_t off;
+
+    for (;;) {
+        if (!c->wrapped) {
+            /* Free space is [tail, ring_size) and [0, head). */
+            if (c->ring_size - c->tail >= size) {
+                off = c->tail;
+                break;
+            }
+            if (c->num_entries > 0 && c->head >= size) {
+                c->limit = c->tail;
+                c->wrapped = TRUE;
+                off = 0;
+                break;
+            }
+        } else if (c->head - c->tail >= size) {
+            /* Free space is [tail, head). */
+            off = c->tail;
+            break;
+        }
+        shared_discard_head(c);
+    }
+
+    c->tail = off + size;
+    c->num_entries++;
+    return (struct shared_entry *)(c->ring + off);
+}
+
+static void
+shared_insert(krb5_data *req, krb5_data *rep, krb5_timestamp timenow)
+{
+    struct shared_lookaside *c = shared_cache;
+    struct shared_entry *e;
+    struct shared_bucket *b;
+    unsigned int rep_len = (rep == NULL) ? 0 : rep->length;
+    size_t size = SHARED_ALIGN(sizeof(*e) + req->length + rep_len);
+
+    if (size > c->ring_size)
+        return;
+
+    shared_lock_ring(c);
+
+    /* Purge stale entries. */
+    while (c->num_entries > 0 && STALE(shared_head(c), timenow))
+        shared_discard_head(c);
+
+    e = shared_alloc(c, size);
+    e->size = size;
+    e->bucket = murmurhash3(req);
+    e->num_hits = 0;
+    e->timein = timenow;
+    e->req_len = req->length;
+    e->reply_len = rep_len;
+    if (req->length > 0)
+        memcpy(shared_req_bytes(e), req->data, req->length);
+    if (rep_len > 0)
+        memcpy(shared_reply_bytes(e), rep->data, rep_len);
+
+    /* Link the entry while holding the ring lock, so that it cannot be
+     * discarded before it is fully initialized. */
+    b = &c->buckets[e->bucket];
+    shared_lock_bucket(b);
+    e->bucket_next = b->first;
+    b->first = e;
+    e->linked = TRUE;
+    pthread_mutex_unlock(&b->lock);
+
+    pthread_mutex_unlock(&c->ring_lock);
+}
+
+/* Return the linked entry matching req in b, whose lock must be held. */
+static struct shared_entry *
+shared_find(struct shared_bucket *b, krb5_data *req)
+{
+    struct shared_entry *e;
+
+    for (e = b->first; e != NULL; e = e->bucket_next) {
+        if (e->req_len == req->length &&
+            memcmp(shared_req_bytes(e), req->data, req->length) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static krb5_boolean
+shared_check(krb5_context context, krb5_data *req, krb5_data **reply_out)
+{
+    struct shared_bucket *b = &shared_cache->buckets[murmurhash3(req)];
+    struct shared_entry *e;
+    krb5_data d;
+    krb5_boolean found = FALSE;
+
+    shared_lock_bucket(b);
+    b->calls++;
+    e = shared_find(b, req);
+    if (e != NULL) {
+        e->num_hits++;
+        b->hits++;
+        b->max_hits_per_entry = max(b->max_hits_per_entry, e->num_hits);
+        found = TRUE;
+        /* Leave *reply_out as NULL for an in-progress entry. */
+        if (e->reply_len > 0) {
+            d = make_data(shared_reply_bytes(e), e->reply_len);
+            found = (krb5_copy_data(context, &d, reply_out) == 0);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return found;
+}
+
+static void
+shared_remove(krb5_data *req)
+{
+    struct shared_bucket *b = &shared_cache->buckets[murmurhash3(req)];
+    struct shared_entry *e, **pp;
+
+    shared_lock_bucket(b);
+    for (pp = &b->first; *pp != NULL; pp = &(*pp)->bucket_next) {
+        e = *pp;
+        if (e->req_len == req->length &&
+            memcmp(shared_req_bytes(e), req->data, req->length) == 0) {
+            *pp = e->bucket_next;
+            e->linked = FALSE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*
+ * Move the lookaside cache into a shared mapping, so that it is shared with
+ * any processes subsequently forked from this one.  Must be called after
+ * kdc_init_lookaside() and before any entries are inserted.
+ */
 krb5_error_code
-kdc_init_lookaside(krb5_context context)
+kdc_share_lookaside(krb5_context context)
 {
-    krb5_data d = make_data(&seed, sizeof(seed));
-    int i;
+    struct shared_lookaside *c;
+    pthread_mutexattr_t attr;
+    size_t hdr_size = SHARED_ALIGN(sizeof(*c));
+    size_t buckets_size = SHARED_ALIGN(hash_size * sizeof(*c->buckets));
+    size_t map_size = hdr_size + buckets_size + max_size;
+    void *map;
+    unsigned int i;
+    int ret;
+
+    if (shared_cache != NULL)
+        return 0;
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return errno;
+    c = map;
+
+    ret = pthread_mutexattr_init(&attr);
+    if (ret) {
+        munmap(map, map_size);
+        return ret;
+    }
+    ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (ret)
+        goto cleanup;
+    ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (ret)
+        goto cleanup;
+    ret = pthread_mutex_init(&c->ring_lock, &attr);
+    if (ret)
+        goto cleanup;
+    c->buckets = (struct shared_bucket *)((unsigned char *)map + hdr_size);
+    for (i = 0; i < hash_size; i++) {
+        ret = pthread_mutex_init(&c->buckets[i].lock, &attr);
+        if (ret)
+            goto cleanup;
+        c->buckets[i].first = NULL;
+        c->buckets[i].hits = c->buckets[i].calls = 0;
+        c->buckets[i].max_hits_per_entry = 0;
+    }
 
-    for (i = 0; i < LOOKASIDE_HASH_SIZE; i++)
+    c->map_size = map_size;
+    c->creator = getpid();
+    c->ring = (unsigned char *)map + hdr_size + buckets_size;
+    c->ring_size = max_size & ~(size_t)7;
+    c->head = c->tail = 0;
+    c->limit = c->ring_size;
+    c->wrapped = FALSE;
+    c->num_entries = 0;
+    shared_cache = c;
+
+cleanup:
+    pthread_mutexattr_destroy(&attr);
+    if (ret)
+        munmap(map, map_size);
+    return ret;
+}
+
+#else /* !SHARED_LOOKASIDE */
+
+krb5_error_code
+kdc_share_lookaside(krb5_context context)
+{
+    return ENOTSUP;
+}
+
+#endif /* !SHARED_LOOKASIDE */
+
+/*
+ * Initialize the lookaside cache structures and randomize the hash seed.  The
+ * cache holds up to size bytes of entries in nbuckets hash buckets, divided
+ * into nshards independently locked shards.  If digest is true, entries are
+ * keyed on a SHA-256 digest of the request instead of a copy of it.  Zero
+ * values select the defaults.
+ */
+krb5_error_code
+kdc_init_lookaside(krb5_context context, size_t size, unsigned int nbuckets,
+                   unsigned int nshards, krb5_boolean digest)
+{
+    krb5_error_code ret;
+    krb5_data d = make_data(&seed, sizeof(seed));
+    unsigned int i;
+
+    hash_size = (nbuckets > 0) ? nbuckets : LOOKASIDE_HASH_SIZE;
+    max_size = (size > 0) ? size : LOOKASIDE_MAX_SIZE;
+    num_shards = (nshards > 0) ? nshards : 1;
+    if (num_shards > hash_size)
+        num_shards = hash_size;
+    use_digest = digest;
+
+    hash_table = k5calloc(hash_size, sizeof(*hash_table), &ret);
+    if (hash_table == NULL)
+        return ret;
+    for (i = 0; i < hash_size; i++)
         K5_LIST_INIT(&hash_table[i]);
-    K5_TAILQ_INIT(&expiration_queue);
-    return krb5_c_random_make_octets(context, &d);
+
+    shards = k5calloc(num_shards, sizeof(*shards), &ret);
+    if (shards == NULL)
+        goto error;
+    for (i = 0; i < num_shards; i++) {
+        ret = k5_mutex_init(&shards[i].lock);
+        if (ret) {
+            while (i > 0)
+                k5_mutex_destroy(&shards[--i].lock);
+            goto error;
+        }
+        K5_TAILQ_INIT(&shards[i].expiration_queue);
+        shards[i].max_size = max_size / num_shards;
+    }
+
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret) {
+        for (i = 0; i < num_shards; i++)
+            k5_mutex_destroy(&shards[i].lock);
+        goto error;
+    }
+    return 0;
+
+error:
+    free(shards);
+    shards = NULL;
+    free(hash_table);
+    hash_table = NULL;
+    return ret;
 }
 
 /* Remove the lookaside cache entry for a packet. */
 void
 kdc_remove_lookaside(krb5_context kcontext, krb5_data *req_packet)
 {
+    struct lookaside_shard *shard;
     struct entry *e;
+    uint8_t digest[K5_SHA256_HASHLEN];
+    krb5_data key;
+
+    if (make_key(req_packet, digest, &key) != 0)
+        return;
+
+#ifdef SHARED_LOOKASIDE
+    if (shared_cache != NULL) {
+        shared_remove(&key);
+        return;
+    }
+#endif
 
-    e = find_entry(req_packet);
+    shard = key_shard(&key);
+    k5_mutex_lock(&shard->lock);
+    e = find_entry(&key);
     if (e != NULL)
         discard_entry(kcontext, e);
+    k5_mutex_unlock(&shard->lock);
 }
 
 /*
@@ -212,24 +711,39 @@ krb5_boolean
 kdc_check_lookaside(krb5_context kcontext, krb5_data *req_packet,
                     krb5_data **reply_packet_out)
 {
+    struct lookaside_shard *shard;
     struct entry *e;
+    uint8_t digest[K5_SHA256_HASHLEN];
+    krb5_data key;
+    krb5_boolean found = FALSE;
 
     *reply_packet_out = NULL;
-    calls++;
-
-    e = find_entry(req_packet);
-    if (e == NULL)
+    if (make_key(req_packet, digest, &key) != 0)
         return FALSE;
 
-    e->num_hits++;
-    hits++;
-
-    /* Leave *reply_packet_out as NULL for an in-progress entry. */
-    if (e->reply_packet.length == 0)
-        return TRUE;
+#ifdef SHARED_LOOKASIDE
+    if (shared_cache != NULL)
+        return shared_check(kcontext, &key, reply_packet_out);
+#endif
 
-    return (krb5_copy_data(kcontext, &e->reply_packet,
-                           reply_packet_out) == 0);
+    shard = key_shard(&key);
+    k5_mutex_lock(&shard->lock);
+    shard->calls++;
+    e = find_entry(&key);
+    if (e != NULL) {
+        e->num_hits++;
+        shard->hits++;
+        shard->max_hits_per_entry = max(shard->max_hits_per_entry,
+                                        e->num_hits);
+        found = TRUE;
+        /* Leave *reply_packet_out as NULL for an in-progress entry. */
+        if (e->reply_packet.length > 0) {
+            found = (krb5_copy_data(kcontext, &e->reply_packet,
+                                    reply_packet_out) == 0);
+        }
+    }
+    k5_mutex_unlock(&shard->lock);
+    return found;
 }
 
 /*
@@ -243,23 +757,87 @@ void
 kdc_insert_lookaside(krb5_context kcontext, krb5_data *req_packet,
                      krb5_data *reply_packet)
 {
+    struct lookaside_shard *shard;
     struct entry *e, *next;
     krb5_timestamp timenow;
-    size_t esize = entry_size(req_packet, reply_packet);
+    uint8_t digest[K5_SHA256_HASHLEN];
+    krb5_data key;
+    size_t esize;
 
     if (krb5_timeofday(kcontext, &timenow))
         return;
+    if (make_key(req_packet, digest, &key) != 0)
+        return;
+
+#ifdef SHARED_LOOKASIDE
+    if (shared_cache != NULL) {
+        shared_insert(&key, reply_packet, timenow);
+        return;
+    }
+#endif
+
+    esize = entry_size(&key, reply_packet);
+    shard = key_shard(&key);
+    k5_mutex_lock(&shard->lock);
 
     /* Purge stale entries and limit the total size of the entries. */
-    K5_TAILQ_FOREACH_SAFE(e, &expiration_queue, expire_links, next) {
-        if (!STALE(e, timenow) && total_size + esize <= LOOKASIDE_MAX_SIZE)
+    K5_TAILQ_FOREACH_SAFE(e, &shard->expiration_queue, expire_links, next) {
+        if (!STALE(e, timenow) &&
+            shard->total_size + esize <= shard->max_size)
             break;
-        max_hits_per_entry = max(max_hits_per_entry, e->num_hits);
         discard_entry(kcontext, e);
     }
 
-    insert_entry(kcontext, req_packet, reply_packet, timenow);
-    return;
+    insert_entry(kcontext, &key, reply_packet, timenow);
+    k5_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Log how many lookups the lookaside cache has answered, and the most times
+ * it answered any one request.  A shared cache's
+ * statistics cover all of the worker processes, so only the supervisor logs
+ * them.
+ */
+void
+kdc_log_lookaside_stats(void)
+{
+    int hits = 0, calls = 0, max_hits = 0;
+    unsigned int i;
+
+#ifdef SHARED_LOOKASIDE
+    struct shared_bucket *b;
+
+    if (shared_cache != NULL) {
+        if (getpid() != shared_cache->creator)
+            return;
+        for (i = 0; i < hash_size; i++) {
+            b = &shared_cache->buckets[i];
+            shared_lock_bucket(b);
+            hits += b->hits;
+            calls += b->calls;
+            max_hits = max(max_hits, b->max_hits_per_entry);
+            pthread_mutex_unlock(&b->lock);
+        }
+        goto log;
+    }
+#endif
+
+    if (shards == NULL)
+        return;
+    for (i = 0; i < num_shards; i++) {
+        k5_mutex_lock(&shards[i].lock);
+        hits += shards[i].hits;
+        calls += shards[i].calls;
+        max_hits = max(max_hits, shards[i].max_hits_per_entry);
+        k5_mutex_unlock(&shards[i].lock);
+    }
+
+#ifdef SHARED_LOOKASIDE
+log:
+#endif
+    krb5_klog_syslog(LOG_INFO, _("lookaside cache: %d hits in %d lookups, "
+                                 "at most %d for one request"),
+                     hits, calls, max_hits);
 }
 
 /* Free all entries in the lookaside cache. */
@@ -267,10 +845,28 @@ void
 kdc_free_lookaside(krb5_context kcontext)
 {
     struct entry *e, *next;
+    unsigned int i;
 
-    K5_TAILQ_FOREACH_SAFE(e, &expiration_queue, expire_links, next) {
-        discard_entry(kcontext, e);
+#ifdef SHARED_LOOKASIDE
+    if (shared_cache != NULL) {
+        munmap(shared_cache, shared_cache->map_size);
+        shared_cache = NULL;
+    }
+#endif
+
+    if (shards == NULL)
+        return;
+    for (i = 0; i < num_shards; i++) {
+        K5_TAILQ_FOREACH_SAFE(e, &shards[i].expiration_queue, expire_links,
+                              next) {
+            discard_entry(kcontext, e);
+        }
+        k5_mutex_destroy(&shards[i].lock);
     }
+    free(shards);
+    shards = NULL;
+    free(hash_table);
+    hash_table = NULL;
 }
 
 #endif /* NOCACHE */
@@ -0,0 +1,43 @@
+#!/usr/bin/python
+from k5test import *
+
+# Parse a kdcbench report into a dictionary.
+def bench(realm, args, service=None):
+    cmd = [kdcbench, '-k', keytab] + args
+    cmd += ['127.0.0.1', str(realm.portbase), realm.user_princ]
+    if service is not None:
+        cmd.append(service)
+    report = {}
+    for line in realm.run(cmd).splitlines():
+        key, value = line.split(': ', 1)
+        report[key] = value
+    return report
+
+def kdc_log(realm):
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        return f.read()
+
+kdcbench = os.path.join(buildtop, 'tests', 'kdcbench')
+conf = {'kdcdefaults': {'kdc_overload_latency': '10000'}}
+realm = K5Realm(kdc_conf=conf, create_host=True)
+keytab = os.path.join(realm.testdir, 'user.keytab')
+realm.run([kadminl, 'ktadd', '-k', keytab, '-norandkey', realm.user_princ])
+
+# A light load is processed normally.
+report = bench(realm, ['-n', '20'])
+if report['succeeded'] != '20':
+    fail('Requests refused without overload')
+
+# Saturate the KDC with AS requests over UDP.  Once the KDC notices
+# that its main loop is always busy, it should drop unauthenticated AS
+# requests until the backlog clears.
+report = bench(realm, ['-n', '5000', '-c', '64', '-w', '200'])
+if 'timeouts' not in report:
+    fail('No AS requests were refused under overload')
+if 'KDC is overloaded' not in kdc_log(realm):
+    fail('Overload not logged')
+
+# TGS requests are still processed.
+realm.run([kvno, realm.host_princ])
+
+success('KDC admission control')
@@ -0,0 +1,69 @@
+#!/usr/bin/python
+import re
+from k5test import *
+
+# Get a fresh ticket for the host principal and verify it with a
+# keytab holding only the principal's current key.
+def check_new_key(realm, keytab):
+    if os.path.exists(keytab):
+        os.remove(keytab)
+    realm.run([kadminl, 'ktadd', '-k', keytab, '-norandkey',
+               realm.host_princ])
+    realm.run([kadminl, 'ktremove', '-k', keytab, realm.host_princ, 'old'])
+    realm.kinit(realm.user_princ, password('user'))
+    output = realm.run([kvno, '-k', keytab, realm.host_princ])
+    if 'keytab entry valid' not in output:
+        fail('KDC used a stale cached key after a key change')
+
+conf = {'realms': {'$realm': {'key_cache_size': '2'}}}
+
+for args in ([], ['-t', '2']):
+    realm = K5Realm(kdc_conf=conf, start_kdc=False)
+    realm.start_kdc(args)
+
+    # Repeated requests should reuse the cached krbtgt and service keys.
+    for i in range(5):
+        realm.kinit(realm.user_princ, password('user'))
+        realm.run([kvno, realm.host_princ])
+
+    # A changed service key must replace the cached one.  Check the
+    # issued ticket against a keytab holding only the new key.
+    keytab = os.path.join(realm.testdir, 'newkey.keytab')
+    realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+    check_new_key(realm, keytab)
+    realm.run([kvno, realm.host_princ])
+
+    # So must a key change which keeps the kvno.  Reload an older dump
+    # and change the key again, so that the database holds a different
+    # key with the kvno of the cached one.
+    dumpfile = os.path.join(realm.testdir, 'dump')
+    realm.run([kdb5_util, 'dump', dumpfile])
+    realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+    check_new_key(realm, keytab)
+    realm.run([kdb5_util, 'load', dumpfile])
+    realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+    check_new_key(realm, keytab)
+
+    # After a krbtgt key change, TGTs issued under either key must work.
+    realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.krbtgt_princ])
+    realm.run([kvno, realm.host_princ])
+    realm.kinit(realm.user_princ, password('user'))
+    realm.run([kvno, realm.host_princ])
+
+    # Lookups of more keys than the cache holds should still work.
+    for i in range(4):
+        realm.addprinc('svc%d/%s' % (i, hostname))
+    for i in range(4):
+        realm.run([kvno, 'svc%d/%s' % (i, hostname)])
+
+    realm.stop_kdc()
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        log = f.read()
+    hits = 0
+    for m in re.finditer(r'key cache for realm \S+: (\d+) hits', log):
+        hits += int(m.group(1))
+    if hits == 0:
+        fail('No key cache hits')
+    realm.stop()
+
+success('KDC server key cache')
@@ -0,0 +1,63 @@
+#!/usr/bin/python
+import fcntl
+import socket
+import threading
+from k5test import *
+
+# With a log queue, messages from request threads and the main thread
+# should all be written, and written out before the KDC exits.
+conf = {'logging': {'queue_size': '64'}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False, create_host=False)
+services = ['svc/host%d' % i for i in range(10)]
+for svc in services:
+    realm.addprinc(svc)
+realm.start_kdc(['-t', '2'])
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno] + services)
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    lines = f.read().splitlines()
+if len([l for l in lines if 'AS_REQ' in l]) != 1:
+    fail('AS_REQ log message missing')
+if len([l for l in lines if 'TGS_REQ' in l]) != 10:
+    fail('TGS_REQ log messages missing')
+if 'shutting down' not in lines[-1]:
+    fail('Queued log messages written after shutdown message')
+
+# Log to a FIFO which is not read until later, so that the writer
+# thread stalls once the pipe buffer fills.  Requests should still be answered, with
+# the overflowing log messages discarded and counted.
+realm.stop()
+fifo = os.path.join(realm.testdir, 'kdc.fifo')
+conf = {'logging': {'kdc': 'FILE:' + fifo, 'queue_size': '16'}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False)
+os.mkfifo(fifo)
+# Open the read end first so that the KDC's open does not block.
+fd = os.open(fifo, os.O_RDONLY | os.O_NONBLOCK)
+realm.start_kdc()
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(10)
+for i in range(2000):
+    s.sendto(as_req('unknown%d' % i, realm.realm), (hostname, realm.portbase))
+    s.recv(4096)
+s.close()
+
+# Drain the FIFO until the KDC exits and closes it.
+output = []
+def drain():
+    fcntl.fcntl(fd, fcntl.F_SETFL, 0)
+    while True:
+        data = os.read(fd, 65536)
+        if not data:
+            break
+        output.append(data)
+    os.close(fd)
+reader = threading.Thread(target=drain)
+reader.start()
+realm.stop_kdc()
+reader.join()
+log = ''.join(output)
+if 'log messages discarded because the log queue was full' not in log:
+    fail('Discarded log messages not reported')
+
+success('KDC log queue')
@@ -0,0 +1,113 @@
+#!/usr/bin/python
+import re
+import signal
+import socket
+import stat
+import time
+from k5test import *
+
+# Connect to the KDC metrics socket and return a dictionary mapping
+# sample names with labels to values.
+def scrape(path):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.settimeout(10)
+    s.connect(path)
+    data = ''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    samples = {}
+    for line in data.splitlines():
+        if line.startswith('#'):
+            continue
+        name, value = line.rsplit(' ', 1)
+        samples[name] = int(value)
+    return samples
+
+def check(samples, name, expected):
+    value = samples.get(name, 0)
+    if value != expected:
+        fail('%s is %d, expected %d' % (name, value, expected))
+
+path = os.path.join(os.getcwd(), 'testdir', 'kdc.metrics')
+conf = {'kdcdefaults': {'kdc_metrics_socket': path}}
+realm = K5Realm(kdc_conf=conf, get_creds=False)
+realm.run([kadminl, 'modprinc', '+requires_preauth', realm.user_princ])
+
+# Only the KDC's user may connect to the socket.
+if os.stat(path).st_mode & (stat.S_IRWXG | stat.S_IRWXO):
+    fail('Metrics socket is accessible to other users')
+
+# One AS exchange with encrypted timestamp preauth: the first request
+# is answered with PREAUTH_REQUIRED (25) and the second succeeds.
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, realm.host_princ])
+samples = scrape(path)
+check(samples, 'kdc_requests_total{type="as",transport="udp"}', 2)
+check(samples, 'kdc_results_total{type="as",code="25"}', 1)
+check(samples, 'kdc_results_total{type="as",code="0"}', 1)
+check(samples, 'kdc_preauth_total{pa_type="2",result="ok"}', 1)
+check(samples, 'kdc_results_total{type="tgs",code="0"}', 1)
+check(samples, 'kdc_request_duration_microseconds_count{type="as"}', 2)
+for stage in ('decode', 'db', 'preauth', 'crypto', 'encode', 'send'):
+    name = ('kdc_stage_duration_microseconds_count{type="as",stage="%s"}' %
+            stage)
+    if samples.get(name, 0) < 1:
+        fail('No samples for AS %s stage' % stage)
+
+# Histogram buckets must be cumulative and end with the total count.
+buckets = [(k, v) for k, v in samples.items()
+           if k.startswith('kdc_request_duration_microseconds_bucket'
+                           '{type="as",')]
+bounds = sorted((float(re.search(r'le="([^"]*)"', k).group(1)), v)
+                for k, v in buckets)
+counts = [v for b, v in bounds]
+if counts != sorted(counts) or counts[-1] != 2:
+    fail('Request duration buckets are not cumulative')
+
+# The send stage covers each response from being handed to the main
+# loop until it has been written, over UDP and over TCP.
+check(samples, 'kdc_stage_duration_microseconds_count{type="as",stage="send"}',
+      2)
+tcp_conf = {'libdefaults': {'udp_preference_limit': '1'}}
+tcp_env = realm.special_env('tcp', False, krb5_conf=tcp_conf)
+realm.kinit(realm.user_princ, password('user'), env=tcp_env)
+samples = scrape(path)
+check(samples, 'kdc_requests_total{type="as",transport="tcp"}', 2)
+check(samples, 'kdc_stage_duration_microseconds_count{type="as",stage="send"}',
+      4)
+
+# Worker processes should share one set of counters, and any worker
+# may answer the metrics socket.
+realm.stop_kdc()
+realm.start_kdc(['-w', '2'])
+for i in range(3):
+    realm.kinit(realm.user_princ, password('user'))
+samples = scrape(path)
+check(samples, 'kdc_results_total{type="as",code="0"}', 3)
+realm.stop_kdc()
+if os.path.exists(path):
+    fail('Metrics socket not removed at shutdown')
+
+# A KDC which detaches from the terminal should also remove the socket
+# when it exits.
+pidfile = os.path.join(realm.testdir, 'kdc.pid')
+realm.run([krb5kdc, '-P', pidfile])
+for i in range(50):
+    if os.path.exists(pidfile) and os.path.exists(path):
+        break
+    time.sleep(0.1)
+with open(pidfile) as f:
+    pid = int(f.read())
+os.kill(pid, signal.SIGTERM)
+for i in range(50):
+    if not os.path.exists(path):
+        break
+    time.sleep(0.1)
+else:
+    fail('Metrics socket not removed by detached KDC')
+
+success('KDC metrics')
@@ -0,0 +1,198 @@
+#!/usr/bin/python
+import re
+import time
+from k5test import *
+
+conf = {'realms': {'$realm': {'principal_cache_size': '2'}}}
+
+for args in ([], ['-t', '2']):
+    realm = K5Realm(kdc_conf=conf, start_kdc=False)
+    realm.start_kdc(args)
+
+    # Repeated service ticket requests should be answered from the cache.
+    for i in range(5):
+        realm.kinit(realm.user_princ, password('user'))
+        realm.run([kvno, realm.host_princ])
+
+    # Changes to a cached entry must become visible once the KDC notices
+    # that the database has changed.
+    realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+    time.sleep(2)
+    realm.kinit(realm.user_princ, password('user'))
+    output = realm.run([kvno, realm.host_princ])
+    if 'kvno = 2' not in output:
+        fail('KDC used a stale cached entry after a key change')
+
+    # Lookups of more principals than the cache holds should still work.
+    for i in range(4):
+        realm.addprinc('svc%d/%s' % (i, hostname))
+    for i in range(4):
+        realm.run([kvno, 'svc%d/%s' % (i, hostname)])
+
+    realm.stop_kdc()
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        log = f.read()
+    hits = flushes = 0
+    for m in re.finditer(r'principal cache for realm \S+: (\d+) hits, '
+                         r'\d+ misses, (\d+) flushes', log):
+        hits += int(m.group(1))
+        flushes += int(m.group(2))
+    if hits == 0:
+        fail('No principal cache hits')
+    if flushes == 0:
+        fail('Principal cache not flushed after database change')
+    realm.stop()
+
+# The lockout and last-success updates the KDC makes to client entries
+# should not cause the cache to be flushed.
+conf = {'realms': {'$realm': {'principal_cache_size': '2'}}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False)
+realm.run([kadminl, 'addpol', '-maxfailure', '5', 'lockout'])
+realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+           'user'])
+realm.start_kdc()
+for i in range(4):
+    realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+    out = realm.run([kadminl, 'getprinc', 'user'])
+    if 'Failed password attempts: 1' not in out:
+        fail('Lockout failure not recorded')
+    realm.kinit(realm.user_princ, password('user'))
+    realm.run([kvno, realm.host_princ])
+    time.sleep(1.1)
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    log = f.read()
+m = re.search(r'(\d+) hits, \d+ misses, (\d+) flushes', log)
+if not m or int(m.group(1)) < 3:
+    fail('No principal cache hits during lockout updates')
+if int(m.group(2)) != 0:
+    fail('Principal cache flushed by lockout updates')
+realm.stop()
+
+# Check caching of unknown names, with and without the Bloom filter.
+for extra in ({'principal_negative_cache_size': '4'},
+              {'principal_bloom_filter': 'true'}):
+    conf = {'realms': {'$realm': extra}}
+    realm = K5Realm(kdc_conf=conf)
+    realm.run([kvno, realm.host_princ])
+    for i in range(15):
+        out = realm.kinit('nouser', 'pw', expected_code=1)
+        if 'not found in Kerberos database' not in out:
+            fail('Expected error message not seen for unknown client')
+        out = realm.run([kvno, 'nosvc'], expected_code=1)
+        if 'not found in Kerberos database' not in out:
+            fail('Expected error message not seen for unknown server')
+
+    # Names added to the database must be found once the KDC notices the
+    # change.
+    realm.addprinc('nouser', 'pw')
+    realm.addprinc('nosvc')
+    time.sleep(2)
+    realm.kinit('nouser', 'pw')
+    realm.run([kvno, 'nosvc'])
+
+    realm.stop_kdc()
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        log = f.read()
+    m = re.search(r'(\d+) negative hits, (\d+) Bloom filter rejects', log)
+    if not m or int(m.group(1)) + int(m.group(2)) < 28:
+        fail('Unknown names not answered from the principal cache')
+    realm.stop()
+
+# With iprop enabled, unknown names should stay in the negative cache while
+# the KDC records lockout failures and successful authentications, even with
+# a database module whose age those updates change.  A logged change must
+# still flush them.
+conf = {'dbmodules': {'db': {'db_library': 'mvcc'}},
+        'realms': {'$realm': {'principal_negative_cache_size': '4',
+                              'iprop_enable': 'true',
+                              'iprop_logfile': '$testdir/db.ulog'}}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False)
+realm.run([kadminl, 'addpol', '-maxfailure', '5', 'lockout'])
+realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+           'user'])
+realm.start_kdc()
+for i in range(5):
+    realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+    realm.kinit(realm.user_princ, password('user'))
+    out = realm.run([kvno, 'nosvc'], expected_code=1)
+    if 'not found in Kerberos database' not in out:
+        fail('Expected error message not seen for unknown server')
+    time.sleep(1.1)
+realm.addprinc('nosvc')
+time.sleep(2)
+realm.run([kvno, 'nosvc'])
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    log = f.read()
+m = re.search(r'(\d+) flushes, (\d+) negative hits', log)
+if not m or int(m.group(1)) == 0:
+    fail('Lockout updates did not change the database age')
+if int(m.group(2)) < 4:
+    fail('Negative cache flushed by lockout updates')
+realm.stop()
+
+# With iprop enabled, the Bloom filter should keep rejecting unknown names
+# while the KDC records lockout failures and successful authentications, since
+# those updates do not change the update log.
+conf = {'realms': {'$realm': {'principal_bloom_filter': 'true',
+                              'iprop_enable': 'true',
+                              'iprop_logfile': '$testdir/db.ulog'}}}
+for args in ([], ['-t', '2']):
+    realm = K5Realm(kdc_conf=conf, start_kdc=False)
+    realm.run([kadminl, 'addpol', '-maxfailure', '5', 'lockout'])
+    realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+               'user'])
+    realm.start_kdc(args)
+    realm.kinit(realm.user_princ, password('user'))
+    for i in range(10):
+        realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+        out = realm.run([kadminl, 'getprinc', 'user'])
+        if 'Failed password attempts: 1' not in out:
+            fail('Lockout failure not recorded')
+        realm.kinit(realm.user_princ, password('user'))
+        out = realm.run([kvno, 'nosvc'], expected_code=1)
+        if 'not found in Kerberos database' not in out:
+            fail('Expected error message not seen for unknown server')
+        time.sleep(0.2)
+
+    realm.stop_kdc()
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        log = f.read()
+    rejects = sum(int(n) for n in re.findall(r'(\d+) Bloom filter rejects',
+                                             log))
+    if rejects < 10:
+        fail('Bloom filter not used during lockout updates')
+    realm.stop()
+
+# Rebuild the Bloom filter of a large database every second while the KDC
+# records lockout failures and successful authentications.  The builder must
+# not hold the database lock while the KDC waits to write.
+conf = {'realms': {'$realm': {'principal_bloom_filter': 'true',
+                              'principal_cache_ttl': '1'}}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False)
+realm.run([kadminl, 'addpol', '-maxfailure', '1000', 'lockout'])
+realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+           'user'])
+dumpfile = os.path.join(realm.testdir, 'bulkdump')
+realm.run([kdb5_util, 'dump', dumpfile])
+with open(dumpfile) as f:
+    lines = f.readlines()
+fields = [l for l in lines if '\t%s\t' % realm.host_princ in l][0].split('\t')
+with open(dumpfile, 'w') as f:
+    f.write(lines[0])
+    for i in range(40000):
+        fields[6] = 'bulk%d@%s' % (i, realm.realm)
+        fields[2] = str(len(fields[6]))
+        f.write('\t'.join(fields))
+realm.run([kdb5_util, 'load', '-update', dumpfile])
+realm.start_kdc()
+for i in range(20):
+    realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+    realm.kinit(realm.user_princ, password('user'))
+    realm.run([kvno, 'nosvc'], expected_code=1)
+    time.sleep(0.2)
+realm.run([kvno, 'bulk39999'])
+realm.stop()
+
+success('KDC principal cache')
@@ -57,6 +57,13 @@ __wrap_krb5_timeofday(krb5_context context, krb5_timestamp *timeret)
 
 #include "replay.c"
 
+/* The KDC's logging is not linked into this program. */
+int
+krb5_klog_syslog(int level, const char *format, ...)
+{
+    return 0;
+}
+
 #undef krb5_timeofday
 
 #define SEED 0x6F03A219
@@ -110,17 +117,13 @@ setup_lookaside(void **state)
     krb5_error_code ret;
     krb5_context context = *state;
 
-    ret = kdc_init_lookaside(context);
+    /* Use the default sizes with a single shard, so that all entries are
+     * in shards[0]. */
+    ret = kdc_init_lookaside(context, 0, 0, 1, FALSE);
     if (ret)
         return ret;
 
-    /* Ensure some vars are all set to initial values */
     seed = SEED;
-    hits = 0;
-    calls = 0;
-    max_hits_per_entry = 0;
-    num_entries = 0;
-    total_size = 0;
 
     return 0;
 }
@@ -291,7 +294,7 @@ test_insert_entry(void **state)
     e = insert_entry(context, &req, &rep, 15);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[req_hash]), e);
-    assert_ptr_equal(K5_TAILQ_FIRST(&expiration_queue), e);
+    assert_ptr_equal(K5_TAILQ_FIRST(&shards[0].expiration_queue), e);
     assert_true(data_eq(e->req_packet, req));
     assert_true(data_eq(e->reply_packet, rep));
     assert_int_equal(e->timein, 15);
@@ -308,7 +311,7 @@ test_insert_entry_no_response(void **state)
     e = insert_entry(context, &req, NULL, 10);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[req_hash]), e);
-    assert_ptr_equal(K5_TAILQ_FIRST(&expiration_queue), e);
+    assert_ptr_equal(K5_TAILQ_FIRST(&shards[0].expiration_queue), e);
     assert_true(data_eq(e->req_packet, req));
     assert_int_equal(e->reply_packet.length, 0);
     assert_int_equal(e->timein, 10);
@@ -328,7 +331,7 @@ test_insert_entry_multiple(void **state)
     e1 = insert_entry(context, &req1, &rep1, 20);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[req_hash1]), e1);
-    assert_ptr_equal(K5_TAILQ_FIRST(&expiration_queue), e1);
+    assert_ptr_equal(K5_TAILQ_FIRST(&shards[0].expiration_queue), e1);
     assert_true(data_eq(e1->req_packet, req1));
     assert_true(data_eq(e1->reply_packet, rep1));
     assert_int_equal(e1->timein, 20);
@@ -336,7 +339,7 @@ test_insert_entry_multiple(void **state)
     e2 = insert_entry(context, &req2, NULL, 30);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[req_hash2]), e2);
-    assert_ptr_equal(K5_TAILQ_LAST(&expiration_queue,entry_queue), e2);
+    assert_ptr_equal(K5_TAILQ_LAST(&shards[0].expiration_queue,entry_queue), e2);
     assert_true(data_eq(e2->req_packet, req2));
     assert_int_equal(e2->reply_packet.length, 0);
     assert_int_equal(e2->timein, 30);
@@ -354,7 +357,7 @@ test_insert_entry_hash_collision(void **state)
     e1 = insert_entry(context, &req1, &rep1, 40);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[hc_hash]), e1);
-    assert_ptr_equal(K5_TAILQ_FIRST(&expiration_queue), e1);
+    assert_ptr_equal(K5_TAILQ_FIRST(&shards[0].expiration_queue), e1);
     assert_true(data_eq(e1->req_packet, req1));
     assert_true(data_eq(e1->reply_packet, rep1));
     assert_int_equal(e1->timein, 40);
@@ -362,7 +365,7 @@ test_insert_entry_hash_collision(void **state)
     e2 = insert_entry(context, &req2, NULL, 50);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[hc_hash]), e2);
-    assert_ptr_equal(K5_TAILQ_LAST(&expiration_queue,entry_queue), e2);
+    assert_ptr_equal(K5_TAILQ_LAST(&shards[0].expiration_queue,entry_queue), e2);
     assert_true(data_eq(e2->req_packet, req2));
     assert_int_equal(e2->reply_packet.length, 0);
     assert_int_equal(e2->timein, 50);
@@ -385,8 +388,8 @@ test_discard_entry(void **state)
     discard_entry(context, e);
 
     assert_null(K5_LIST_FIRST(&hash_table[req_hash]));
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 static void
@@ -401,8 +404,8 @@ test_discard_entry_no_response(void **state)
     discard_entry(context, e);
 
     assert_null(K5_LIST_FIRST(&hash_table[req_hash]));
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 static void
@@ -424,14 +427,14 @@ test_discard_entry_hash_collision(void **state)
         assert_ptr_not_equal(e_tmp, e1);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[hc_hash]), e2);
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, entry_size(&req2, &rep2));
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, entry_size(&req2, &rep2));
 
     discard_entry(context, e2);
 
     assert_null(K5_LIST_FIRST(&hash_table[hc_hash]));
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 /*
@@ -507,8 +510,8 @@ test_kdc_remove_lookaside(void **state)
     kdc_remove_lookaside(context, &req);
 
     assert_null(K5_LIST_FIRST(&hash_table[req_hash]));
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 static void
@@ -517,11 +520,11 @@ test_kdc_remove_lookaside_empty_cache(void **state)
     krb5_context context = *state;
     krb5_data req = string2data("I'm a test request");
 
-    assert_int_equal(num_entries, 0);
+    assert_int_equal(shards[0].num_entries, 0);
     kdc_remove_lookaside(context, &req);
 
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 static void
@@ -538,8 +541,8 @@ test_kdc_remove_lookaside_unknown(void **state)
     kdc_remove_lookaside(context, &req2);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[req_hash1]), e);
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, entry_size(&req1, &rep1));
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, entry_size(&req1, &rep1));
 }
 
 static void
@@ -560,14 +563,14 @@ test_kdc_remove_lookaside_multiple(void **state)
 
     assert_null(K5_LIST_FIRST(&hash_table[req_hash2]));
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[req_hash1]), e1);
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, entry_size(&req1, &rep1));
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, entry_size(&req1, &rep1));
 
     kdc_remove_lookaside(context, &req1);
 
     assert_null(K5_LIST_FIRST(&hash_table[req_hash1]));
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 static void
@@ -588,14 +591,14 @@ test_kdc_remove_lookaside_hash_collision(void **state)
         assert_ptr_not_equal(e_tmp, e1);
 
     assert_ptr_equal(K5_LIST_FIRST(&hash_table[hc_hash]), e2);
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, entry_size(&req2, NULL));
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, entry_size(&req2, NULL));
 
     kdc_remove_lookaside(context, &req2);
 
     assert_null(K5_LIST_FIRST(&hash_table[hc_hash]));
-    assert_int_equal(num_entries, 0);
-    assert_int_equal(total_size, 0);
+    assert_int_equal(shards[0].num_entries, 0);
+    assert_int_equal(shards[0].total_size, 0);
 }
 
 /*
@@ -618,7 +621,7 @@ test_kdc_check_lookaside_hit(void **state)
 
     assert_true(result);
     assert_true(data_eq(rep, *result_data));
-    assert_int_equal(hits, 1);
+    assert_int_equal(shards[0].hits, 1);
     assert_int_equal(e->num_hits, 1);
 }
 
@@ -634,7 +637,7 @@ test_kdc_check_lookaside_no_hit(void **state)
 
     assert_false(result);
     assert_null(result_data);
-    assert_int_equal(hits, 0);
+    assert_int_equal(shards[0].hits, 0);
 }
 
 static void
@@ -651,7 +654,7 @@ test_kdc_check_lookaside_empty(void **state)
 
     assert_false(result);
     assert_null(result_data);
-    assert_int_equal(hits, 0);
+    assert_int_equal(shards[0].hits, 0);
 }
 
 static void
@@ -671,7 +674,7 @@ test_kdc_check_lookaside_no_response(void **state)
 
     assert_true(result);
     assert_null(result_data);
-    assert_int_equal(hits, 1);
+    assert_int_equal(shards[0].hits, 1);
     assert_int_equal(e->num_hits, 1);
 }
 
@@ -693,7 +696,7 @@ test_kdc_check_lookaside_hit_multiple(void **state)
 
     assert_true(result);
     assert_true(data_eq(rep1, *result_data));
-    assert_int_equal(hits, 1);
+    assert_int_equal(shards[0].hits, 1);
     assert_int_equal(e1->num_hits, 1);
     assert_int_equal(e2->num_hits, 0);
 
@@ -703,7 +706,7 @@ test_kdc_check_lookaside_hit_multiple(void **state)
 
     assert_true(result);
     assert_null(result_data);
-    assert_int_equal(hits, 2);
+    assert_int_equal(shards[0].hits, 2);
     assert_int_equal(e1->num_hits, 1);
     assert_int_equal(e2->num_hits, 1);
 }
@@ -726,7 +729,7 @@ test_kdc_check_lookaside_hit_hash_collision(void **state)
 
     assert_true(result);
     assert_true(data_eq(rep1, *result_data));
-    assert_int_equal(hits, 1);
+    assert_int_equal(shards[0].hits, 1);
     assert_int_equal(e1->num_hits, 1);
     assert_int_equal(e2->num_hits, 0);
 
@@ -736,7 +739,7 @@ test_kdc_check_lookaside_hit_hash_collision(void **state)
 
     assert_true(result);
     assert_null(result_data);
-    assert_int_equal(hits, 2);
+    assert_int_equal(shards[0].hits, 2);
     assert_int_equal(e1->num_hits, 1);
     assert_int_equal(e2->num_hits, 1);
 }
@@ -761,11 +764,11 @@ test_kdc_insert_lookaside_single(void **state)
     assert_non_null(hash_ent);
     assert_true(data_eq(hash_ent->req_packet, req));
     assert_true(data_eq(hash_ent->reply_packet, rep));
-    exp_ent = K5_TAILQ_FIRST(&expiration_queue);
+    exp_ent = K5_TAILQ_FIRST(&shards[0].expiration_queue);
     assert_true(data_eq(exp_ent->req_packet, req));
     assert_true(data_eq(exp_ent->reply_packet, rep));
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, entry_size(&req, &rep));
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, entry_size(&req, &rep));
 }
 
 static void
@@ -783,11 +786,11 @@ test_kdc_insert_lookaside_no_reply(void **state)
     assert_non_null(hash_ent);
     assert_true(data_eq(hash_ent->req_packet, req));
     assert_int_equal(hash_ent->reply_packet.length, 0);
-    exp_ent = K5_TAILQ_FIRST(&expiration_queue);
+    exp_ent = K5_TAILQ_FIRST(&shards[0].expiration_queue);
     assert_true(data_eq(exp_ent->req_packet, req));
     assert_int_equal(exp_ent->reply_packet.length, 0);
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, entry_size(&req, NULL));
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, entry_size(&req, NULL));
 }
 
 static void
@@ -810,11 +813,11 @@ test_kdc_insert_lookaside_multiple(void **state)
     assert_non_null(hash1_ent);
     assert_true(data_eq(hash1_ent->req_packet, req1));
     assert_true(data_eq(hash1_ent->reply_packet, rep1));
-    exp_first = K5_TAILQ_FIRST(&expiration_queue);
+    exp_first = K5_TAILQ_FIRST(&shards[0].expiration_queue);
     assert_true(data_eq(exp_first->req_packet, req1));
     assert_true(data_eq(exp_first->reply_packet, rep1));
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, e1_size);
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, e1_size);
 
     time_return(0, 0);
     kdc_insert_lookaside(context, &req2, NULL);
@@ -823,11 +826,11 @@ test_kdc_insert_lookaside_multiple(void **state)
     assert_non_null(hash2_ent);
     assert_true(data_eq(hash2_ent->req_packet, req2));
     assert_int_equal(hash2_ent->reply_packet.length, 0);
-    exp_last = K5_TAILQ_LAST(&expiration_queue, entry_queue);
+    exp_last = K5_TAILQ_LAST(&shards[0].expiration_queue, entry_queue);
     assert_true(data_eq(exp_last->req_packet, req2));
     assert_int_equal(exp_last->reply_packet.length, 0);
-    assert_int_equal(num_entries, 2);
-    assert_int_equal(total_size, e1_size + e2_size);
+    assert_int_equal(shards[0].num_entries, 2);
+    assert_int_equal(shards[0].total_size, e1_size + e2_size);
 }
 
 static void
@@ -848,11 +851,11 @@ test_kdc_insert_lookaside_hash_collision(void **state)
     assert_non_null(hash_ent);
     assert_true(data_eq(hash_ent->req_packet, req1));
     assert_true(data_eq(hash_ent->reply_packet, rep1));
-    exp_first = K5_TAILQ_FIRST(&expiration_queue);
+    exp_first = K5_TAILQ_FIRST(&shards[0].expiration_queue);
     assert_true(data_eq(exp_first->req_packet, req1));
     assert_true(data_eq(exp_first->reply_packet, rep1));
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, e1_size);
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, e1_size);
 
     time_return(0, 0);
     kdc_insert_lookaside(context, &req2, NULL);
@@ -861,11 +864,11 @@ test_kdc_insert_lookaside_hash_collision(void **state)
     assert_non_null(hash_ent);
     assert_true(data_eq(hash_ent->req_packet, req2));
     assert_int_equal(hash_ent->reply_packet.length, 0);
-    exp_last = K5_TAILQ_LAST(&expiration_queue, entry_queue);
+    exp_last = K5_TAILQ_LAST(&shards[0].expiration_queue, entry_queue);
     assert_true(data_eq(exp_last->req_packet, req2));
     assert_int_equal(exp_last->reply_packet.length, 0);
-    assert_int_equal(num_entries, 2);
-    assert_int_equal(total_size, e1_size + e2_size);
+    assert_int_equal(shards[0].num_entries, 2);
+    assert_int_equal(shards[0].total_size, e1_size + e2_size);
 }
 
 static void
@@ -889,11 +892,11 @@ test_kdc_insert_lookaside_cache_expire(void **state)
     assert_non_null(hash1_ent);
     assert_true(data_eq(hash1_ent->req_packet, req1));
     assert_true(data_eq(hash1_ent->reply_packet, rep1));
-    exp_ent = K5_TAILQ_FIRST(&expiration_queue);
+    exp_ent = K5_TAILQ_FIRST(&shards[0].expiration_queue);
     assert_true(data_eq(exp_ent->req_packet, req1));
     assert_true(data_eq(exp_ent->reply_packet, rep1));
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, e1_size);
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, e1_size);
 
     /* Increase hits on entry */
     e = find_entry(&req1);
@@ -904,17 +907,62 @@ test_kdc_insert_lookaside_cache_expire(void **state)
     kdc_insert_lookaside(context, &req2, NULL);
 
     assert_null(K5_LIST_FIRST(&hash_table[req_hash1]));
-    assert_int_equal(max_hits_per_entry, 5);
+    assert_int_equal(shards[0].max_hits_per_entry, 5);
 
     hash2_ent = K5_LIST_FIRST(&hash_table[req_hash2]);
     assert_non_null(hash2_ent);
     assert_true(data_eq(hash2_ent->req_packet, req2));
     assert_int_equal(hash2_ent-> reply_packet.length, 0);
-    exp_ent = K5_TAILQ_FIRST(&expiration_queue);
+    exp_ent = K5_TAILQ_FIRST(&shards[0].expiration_queue);
     assert_true(data_eq(exp_ent->req_packet, req2));
     assert_int_equal(exp_ent->reply_packet.length, 0);
-    assert_int_equal(num_entries, 1);
-    assert_int_equal(total_size, e2_size);
+    assert_int_equal(shards[0].num_entries, 1);
+    assert_int_equal(shards[0].total_size, e2_size);
+}
+
+static void
+test_kdc_insert_lookaside_sharded_digest(void **state)
+{
+    krb5_context context = *state;
+    krb5_data req1 = string2data("I'm a test request");
+    krb5_data req2 = string2data("I'm a different test request");
+    krb5_data rep = string2data("I'm a test response");
+    krb5_data *result_data;
+    struct lookaside_shard *shard;
+    struct entry *e;
+    unsigned int i;
+    int count = 0;
+
+    /* Reinitialize with digest keys spread across four shards. */
+    kdc_free_lookaside(context);
+    assert_int_equal(kdc_init_lookaside(context, 0, 0, 4, TRUE), 0);
+    seed = SEED;
+
+    time_return(0, 0);
+    kdc_insert_lookaside(context, &req1, &rep);
+    time_return(0, 0);
+    kdc_insert_lookaside(context, &req2, NULL);
+
+    for (i = 0; i < num_shards; i++) {
+        shard = &shards[i];
+        count += shard->num_entries;
+        K5_TAILQ_FOREACH(e, &shard->expiration_queue, expire_links) {
+            assert_int_equal(e->req_packet.length, K5_SHA256_HASHLEN);
+            assert_ptr_equal(&shards[e->bucket % num_shards], shard);
+        }
+    }
+    assert_int_equal(count, 2);
+
+    assert_true(kdc_check_lookaside(context, &req1, &result_data));
+    assert_non_null(result_data);
+    assert_true(data_eq(rep, *result_data));
+    krb5_free_data(context, result_data);
+
+    assert_true(kdc_check_lookaside(context, &req2, &result_data));
+    assert_null(result_data);
+
+    kdc_remove_lookaside(context, &req2);
+    assert_false(kdc_check_lookaside(context, &req2, &result_data));
 }
 
 int main()
@@ -969,7 +1017,8 @@ int main()
         replay_unit_test(test_kdc_insert_lookaside_no_reply),
         replay_unit_test(test_kdc_insert_lookaside_multiple),
         replay_unit_test(test_kdc_insert_lookaside_hash_collision),
-        replay_unit_test(test_kdc_insert_lookaside_cache_expire)
+        replay_unit_test(test_kdc_insert_lookaside_cache_expire),
+        replay_unit_test(test_kdc_insert_lookaside_sharded_digest)
     };
 
     ret = cmocka_run_group_tests_name("replay_lookaside", replay_tests,
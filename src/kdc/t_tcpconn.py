@@ -0,0 +1,57 @@
+#!/usr/bin/python
+import socket
+import time
+from k5test import *
+
+def connect(realm):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.connect(('127.0.0.1', realm.portbase))
+    return s
+
+# Return true if the KDC has closed the connection s.
+def closed(s):
+    s.settimeout(0.5)
+    try:
+        return s.recv(1) == ''
+    except socket.timeout:
+        return False
+    except socket.error:
+        return True
+
+def kdc_log(realm):
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        return f.read()
+
+conf = {'kdcdefaults': {'kdc_tcp_idle_timeout': '3s'},
+        'libdefaults': {'udp_preference_limit': '1'}}
+realm = K5Realm(krb5_conf=conf, kdc_conf=conf, create_host=False)
+
+# The KDC allows 45 TCP connections.  Open more than that; the KDC
+# should drop the least recently active ones to make room.  Sending a
+# partial request on the first connection makes the second the oldest.
+socks = [connect(realm) for i in range(10)]
+time.sleep(0.5)
+socks[0].send('\0')
+time.sleep(0.5)
+socks += [connect(realm) for i in range(40)]
+realm.kinit(realm.user_princ, password('user'))
+if 'too many connections' not in kdc_log(realm):
+    fail('KDC did not reach its connection limit')
+if closed(socks[0]):
+    fail('Recently active connection was dropped')
+if not closed(socks[1]):
+    fail('Least recently active connection was not dropped')
+
+# The remaining connections should be closed once they are idle.
+time.sleep(4)
+if not closed(socks[-1]):
+    fail('Idle connection was not dropped')
+if 'dropping idle tcp fd' not in kdc_log(realm):
+    fail('Idle connection drop not logged')
+for s in socks:
+    s.close()
+
+# The KDC still answers over TCP.
+realm.kinit(realm.user_princ, password('user'))
+
+success('TCP connection limits')
@@ -1,8 +1,143 @@
 #!/usr/bin/python
+import re
+import signal
+import socket
+import time
 from k5test import *
 
 realm = K5Realm(start_kdc=False, create_host=False)
 realm.start_kdc(['-w', '3'])
 realm.kinit(realm.user_princ, password('user'))
 realm.klist(realm.user_princ)
-success('KDC worker processes')
+
+# Send the same request several times.  Whichever worker receives each
+# retransmission should answer it from the shared lookaside cache.
+req = as_req('nonexistent', realm.realm)
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(10)
+replies = []
+for i in range(6):
+    s.sendto(req, (hostname, realm.portbase))
+    replies.append(s.recv(4096))
+s.close()
+if len(set(replies)) != 1:
+    fail('Retransmitted requests received different replies')
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    log = f.read()
+if log.count('repeated (retransmitted?) request') != 5:
+    fail('Retransmitted requests not answered from lookaside cache')
+
+# Process TGS requests using request threads, with and without
+# worker processes.
+services = ['svc/host%d' % i for i in range(10)]
+for svc in services:
+    realm.addprinc(svc)
+for args in (['-t', '4'], ['-w', '2', '-t', '3']):
+    realm.stop_kdc()
+    realm.start_kdc(args)
+    realm.kinit(realm.user_princ, password('user'))
+    realm.run([kvno] + services)
+    out = realm.run([kvno, 'nonexistent/host'], expected_code=1)
+    if 'not found in Kerberos database' not in out:
+        fail('Expected error not seen from request thread')
+
+# After a SIGHUP, a request thread should replace its realm copies,
+# logging the statistics of the old copy's principal cache, before it
+# handles another request.
+realm.stop()
+conf = {'realms': {'$realm': {'principal_cache_size': '2'}}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False, create_host=False)
+pidfile = os.path.join(realm.testdir, 'kdc.pid')
+realm.addprinc('svc/hup1')
+realm.addprinc('svc/hup2')
+realm.start_kdc(['-t', '1', '-P', pidfile])
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, 'svc/hup1'])
+os.kill(int(open(pidfile).read()), signal.SIGHUP)
+time.sleep(1)
+realm.run([kvno, 'svc/hup2'])
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    log = f.read()
+if log.count('principal cache for realm') != 3:
+    fail('Request thread did not refresh its realms after SIGHUP')
+
+# Give each worker process its own listener sockets, and batch UDP
+# I/O.  The supervisor and each of the three workers should set up
+# the network.
+realm.stop()
+conf = {'kdcdefaults': {'kdc_reuseport': 'true', 'kdc_udp_batch_size': '16'}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False, create_host=False)
+realm.start_kdc(['-w', '3'])
+for i in range(5):
+    realm.kinit(realm.user_princ, password('user'))
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    log = f.read()
+if log.count('setting up network...') != 4:
+    fail('Worker processes did not set up their own sockets')
+
+# Queue bursts of distinct requests while the KDC is stopped, so that
+# they are received and answered in batches when it resumes.
+realm.stop_kdc()
+pidfile = os.path.join(realm.testdir, 'kdc.pid')
+realm.start_kdc(['-P', pidfile])
+pid = int(open(pidfile).read())
+names = ['unknown%d' % i for i in range(40)]
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(10)
+for burst in range(2):
+    os.kill(pid, signal.SIGSTOP)
+    for name in names:
+        s.sendto(as_req(name, realm.realm), (hostname, realm.portbase))
+    os.kill(pid, signal.SIGCONT)
+    replies = [s.recv(4096) for name in names]
+    for name in names:
+        if len([r for r in replies if der(0x1B, name) in r]) != 1:
+            fail('Missing or duplicate reply to batched request')
+s.close()
+
+# The UDP request states should have been reused across the bursts,
+# rather than allocated for each request.
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    log = f.read()
+if 'batched UDP I/O is not supported' in log:
+    fail('Batched UDP I/O not used')
+pool_stats = [l for l in log.splitlines() if 'UDP request pool:' in l]
+m = re.search(r'(\d+) heap allocations, (\d+) reuses', pool_stats[-1])
+if int(m.group(1)) >= len(names) or int(m.group(2)) < len(names):
+    fail('UDP request states not reused')
+
+# Retransmissions should still be answered from the lookaside cache
+# when it is sharded and keyed by request digests, both in a single
+# process and when shared among worker processes.
+realm.stop()
+conf = {'kdcdefaults': {'kdc_lookaside_buckets': '64',
+                        'kdc_lookaside_shards': '4',
+                        'kdc_lookaside_size': '65536',
+                        'kdc_lookaside_digest': 'true'}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False, create_host=False)
+for args in ([], ['-w', '3']):
+    realm.start_kdc(args)
+    realm.kinit(realm.user_princ, password('user'))
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(10)
+    replies = []
+    for name in ('alpha', 'beta', 'alpha', 'beta', 'alpha'):
+        s.sendto(as_req(name, realm.realm), (hostname, realm.portbase))
+        replies.append(s.recv(4096))
+    s.close()
+    realm.stop_kdc()
+    if replies[0] != replies[2] or replies[1] != replies[3]:
+        fail('Retransmitted requests received different replies')
+    with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+        log = f.read()
+    if log.count('repeated (retransmitted?) request') != 3:
+        fail('Retransmitted requests not answered from lookaside cache')
+    if log.count('lookaside cache: 3 hits') != 1:
+        fail('Lookaside cache hits not counted across worker processes')
+    if 'at most 2 for one request' not in log:
+        fail('Lookaside cache hits per entry not counted')
+    os.remove(os.path.join(realm.testdir, 'kdc.log'))
+
+success('KDC worker processes and request threads')
@@ -0,0 +1,544 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/threads.c - Request processing threads for the KDC */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * When krb5kdc is started with -t, TGS requests are processed by a pool of
+ * threads rather than on the main loop thread.  The main loop thread still
+ * performs all network I/O and lookaside cache operations; dispatch() queues
+ * each TGS request as a job, a request thread runs process_tgs_req() on it,
+ * and the finished job is handed back to the main loop through a pipe so that
+ * the response is sent from the main loop thread.
+ *
+ * krb5 contexts may not be used by more than one thread at a time, so each
+ * request thread uses its own copy of the realm list (see
+ * kdc_copy_server_handle()), with its own contexts and database handles.  AS
+ * requests are still processed on the main loop thread, since preauth modules
+ * may complete them asynchronously using the main loop.
+ *
+ * If kdc_preauth_threads is set, a separate pool of threads runs work offloaded
+ * by kdcpreauth modules through the offload callback, such as PKINIT signature
+ * verification and key agreement, so that the main loop can continue with
+ * other requests.  Each preauth thread has its own krb5 context; finished work
+ * is handed back to the main loop through the same pipe.
+ */
+
+#include "k5-int.h"
+#include "k5-queue.h"
+#include "kdc_util.h"
+#include "adm_proto.h"
+#include <syslog.h>
+
+#ifdef HAVE_PTHREAD
+
+#include <pthread.h>
+
+struct job {
+    K5_TAILQ_ENTRY(job) links;
+    krb5_data *pkt;
+    const krb5_fulladdr *from;
+    loop_respond_fn respond;
+    void *arg;
+    krb5_error_code code;
+    krb5_data *response;
+};
+
+K5_TAILQ_HEAD(job_queue, job);
+
+struct preauth_job {
+    K5_TAILQ_ENTRY(preauth_job) links;
+    krb5_context context;
+    krb5_kdcpreauth_work_fn work;
+    krb5_kdcpreauth_work_done_fn done;
+    void *arg;
+    krb5_error_code code;
+    char *errmsg;
+};
+
+K5_TAILQ_HEAD(preauth_job_queue, preauth_job);
+
+struct request_thread {
+    pthread_t tid;
+    krb5_boolean started;
+    struct server_handle handle;
+    unsigned int hangups;       /* value of hangup_count for handle */
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct job_queue pending_jobs = K5_TAILQ_HEAD_INITIALIZER(pending_jobs);
+static struct job_queue done_jobs = K5_TAILQ_HEAD_INITIALIZER(done_jobs);
+static krb5_boolean stopping;
+static unsigned int hangup_count;
+
+static struct request_thread *request_threads;
+static int num_request_threads;
+
+static pthread_cond_t preauth_cond = PTHREAD_COND_INITIALIZER;
+static struct preauth_job_queue pending_preauth =
+    K5_TAILQ_HEAD_INITIALIZER(pending_preauth);
+static struct preauth_job_queue done_preauth =
+    K5_TAILQ_HEAD_INITIALIZER(done_preauth);
+static struct preauth_thread {
+    pthread_t tid;
+    krb5_boolean started;
+    krb5_context context;
+} *preauth_threads;
+static int num_preauth_threads;
+static int wakeup_fds[2] = { -1, -1 };
+static verto_ev *wakeup_ev;
+
+/* Replace the realm copies of t with new ones after a SIGHUP, so that it uses
+ * the reloaded configuration.  Keep the old copies on failure. */
+static void
+refresh_handle(struct request_thread *t)
+{
+    krb5_error_code ret;
+    struct server_handle handle;
+
+    ret = kdc_copy_server_handle(&handle);
+    if (ret) {
+        krb5_klog_syslog(LOG_ERR, _("cannot refresh realms of request "
+                                    "thread: %s"), error_message(ret));
+        return;
+    }
+    kdc_free_server_handle(&t->handle);
+    t->handle = handle;
+}
+
+static void *
+request_thread_main(void *arg)
+{
+    struct request_thread *t = arg;
+    struct job *job;
+    krb5_boolean notify, refresh;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!stopping && K5_TAILQ_EMPTY(&pending_jobs))
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (stopping)
+            break;
+        job = K5_TAILQ_FIRST(&pending_jobs);
+        K5_TAILQ_REMOVE(&pending_jobs, job, links);
+        refresh = (t->hangups != hangup_count);
+        t->hangups = hangup_count;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (refresh)
+            refresh_handle(t);
+
+        job->code = process_tgs_req(&t->handle, job->pkt, job->from,
+                                    &job->response);
+
+        pthread_mutex_lock(&queue_lock);
+        /* Only wake up the main loop if it hasn't already been woken. */
+        notify = K5_TAILQ_EMPTY(&done_jobs) && K5_TAILQ_EMPTY(&done_preauth);
+        K5_TAILQ_INSERT_TAIL(&done_jobs, job, links);
+        if (notify)
+            (void)write(wakeup_fds[1], "", 1);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/* Make the thread context dst match the requesting context src in its default
+ * realm and clock. */
+static void
+sync_context(krb5_context dst, krb5_context src)
+{
+    char *realm;
+    krb5_timestamp sec;
+    krb5_int32 usec;
+
+    if (krb5_get_default_realm(src, &realm) == 0) {
+        (void)krb5_set_default_realm(dst, realm);
+        krb5_free_default_realm(src, realm);
+    }
+    if (krb5_get_time_offsets(src, &sec, &usec) == 0)
+        (void)krb5_set_time_offsets(dst, sec, usec);
+}
+
+static void *
+preauth_thread_main(void *arg)
+{
+    struct preauth_thread *t = arg;
+    struct preauth_job *job;
+    const char *msg;
+    krb5_boolean notify;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!stopping && K5_TAILQ_EMPTY(&pending_preauth))
+            pthread_cond_wait(&preauth_cond, &queue_lock);
+        if (stopping)
+            break;
+        job = K5_TAILQ_FIRST(&pending_preauth);
+        K5_TAILQ_REMOVE(&pending_preauth, job, links);
+        pthread_mutex_unlock(&queue_lock);
+
+        sync_context(t->context, job->context);
+        krb5_clear_error_message(t->context);
+        job->code = (*job->work)(t->context, job->arg);
+        if (job->code) {
+            msg = krb5_get_error_message(t->context, job->code);
+            job->errmsg = strdup(msg);
+            krb5_free_error_message(t->context, msg);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        notify = K5_TAILQ_EMPTY(&done_jobs) && K5_TAILQ_EMPTY(&done_preauth);
+        K5_TAILQ_INSERT_TAIL(&done_preauth, job, links);
+        if (notify)
+            (void)write(wakeup_fds[1], "", 1);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/* Call the done function of a finished preauth job and free it. */
+static void
+finish_preauth_job(struct preauth_job *job)
+{
+    if (job->errmsg != NULL) {
+        krb5_set_error_message(job->context, job->code, "%s", job->errmsg);
+        free(job->errmsg);
+    }
+    (*job->done)(job->arg, job->code);
+    free(job);
+}
+
+/* Send the responses for all finished jobs, and complete finished preauth
+ * work.  Called from the main loop. */
+static void
+finish_jobs(void)
+{
+    struct job_queue finished;
+    struct preauth_job_queue finished_preauth;
+    struct job *job;
+    struct preauth_job *pjob;
+
+    K5_TAILQ_INIT(&finished);
+    K5_TAILQ_INIT(&finished_preauth);
+    pthread_mutex_lock(&queue_lock);
+    K5_TAILQ_CONCAT(&finished, &done_jobs, links);
+    K5_TAILQ_CONCAT(&finished_preauth, &done_preauth, links);
+    pthread_mutex_unlock(&queue_lock);
+
+    while ((job = K5_TAILQ_FIRST(&finished)) != NULL) {
+        K5_TAILQ_REMOVE(&finished, job, links);
+        (*job->respond)(job->arg, job->code, job->response);
+        free(job);
+    }
+    while ((pjob = K5_TAILQ_FIRST(&finished_preauth)) != NULL) {
+        K5_TAILQ_REMOVE(&finished_preauth, pjob, links);
+        finish_preauth_job(pjob);
+    }
+}
+
+static void
+on_wakeup(verto_ctx *ctx, verto_ev *ev)
+{
+    char buf[64];
+
+    while (read(verto_get_fd(ev), buf, sizeof(buf)) > 0);
+    finish_jobs();
+}
+
+/*
+ * Queue the TGS request pkt to be processed by a request thread.  Return false
+ * if there are no request threads (or on allocation failure), in which case
+ * the caller should process the request itself.  Otherwise, respond will be
+ * called from the main loop when processing is finished.
+ */
+krb5_boolean
+kdc_queue_tgs_req(krb5_data *pkt, const krb5_fulladdr *from,
+                  loop_respond_fn respond, void *arg)
+{
+    struct job *job;
+
+    if (num_request_threads == 0)
+        return FALSE;
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        return FALSE;
+    job->pkt = pkt;
+    job->from = from;
+    job->respond = respond;
+    job->arg = arg;
+
+    pthread_mutex_lock(&queue_lock);
+    K5_TAILQ_INSERT_TAIL(&pending_jobs, job, links);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return TRUE;
+}
+
+/*
+ * Queue work to be run on a preauth thread, with done to be called from the
+ * main loop when it is finished.  Return false if there are no preauth threads
+ * (or on allocation failure), in which case the caller should run the work
+ * itself.
+ */
+krb5_boolean
+kdc_queue_preauth_work(krb5_context context, krb5_kdcpreauth_work_fn work,
+                       krb5_kdcpreauth_work_done_fn done, void *arg)
+{
+    struct preauth_job *job;
+
+    if (num_preauth_threads == 0)
+        return FALSE;
+    job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        return FALSE;
+    job->context = context;
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+
+    pthread_mutex_lock(&queue_lock);
+    K5_TAILQ_INSERT_TAIL(&pending_preauth, job, links);
+    pthread_cond_signal(&preauth_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return TRUE;
+}
+
+/* Create the pipe through which threads wake up the main loop, if it does not
+ * already exist. */
+static krb5_error_code
+start_wakeup(verto_ctx *ctx)
+{
+    if (wakeup_ev != NULL)
+        return 0;
+    if (pipe(wakeup_fds) != 0)
+        return errno;
+    set_cloexec_fd(wakeup_fds[0]);
+    set_cloexec_fd(wakeup_fds[1]);
+    if (fcntl(wakeup_fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(wakeup_fds[1], F_SETFL, O_NONBLOCK) != 0)
+        return errno;
+    wakeup_ev = verto_add_io(ctx, VERTO_EV_FLAG_PERSIST |
+                             VERTO_EV_FLAG_IO_READ, on_wakeup, wakeup_fds[0]);
+    if (wakeup_ev == NULL)
+        return ENOMEM;
+    return 0;
+}
+
+/* Create num request threads and arrange for their results to be delivered
+ * through ctx. */
+krb5_error_code
+kdc_start_threads(verto_ctx *ctx, int num)
+{
+    krb5_error_code ret;
+    struct request_thread *t;
+    int i;
+
+    ret = start_wakeup(ctx);
+    if (ret)
+        goto error;
+
+    request_threads = calloc(num, sizeof(*request_threads));
+    if (request_threads == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+    num_request_threads = num;
+    stopping = FALSE;
+    for (i = 0; i < num; i++) {
+        t = &request_threads[i];
+        t->hangups = hangup_count;
+        ret = kdc_copy_server_handle(&t->handle);
+        if (ret)
+            goto error;
+        ret = pthread_create(&t->tid, NULL, request_thread_main, t);
+        if (ret)
+            goto error;
+        t->started = TRUE;
+    }
+
+    krb5_klog_syslog(LOG_INFO, _("created %d request threads"), num);
+    return 0;
+
+error:
+    kdc_stop_threads();
+    return ret;
+}
+
+/* Make the request threads replace their realm copies before processing their
+ * next requests.  Called from the main loop after the realms have been
+ * refreshed for a SIGHUP. */
+void
+kdc_threads_hangup(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    hangup_count++;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/* Create num preauth threads and arrange for their results to be delivered
+ * through ctx. */
+krb5_error_code
+kdc_start_preauth_threads(verto_ctx *ctx, int num)
+{
+    krb5_error_code ret;
+    struct preauth_thread *t;
+    int i;
+
+    ret = start_wakeup(ctx);
+    if (ret)
+        goto error;
+
+    preauth_threads = calloc(num, sizeof(*preauth_threads));
+    if (preauth_threads == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+    num_preauth_threads = num;
+    stopping = FALSE;
+    for (i = 0; i < num; i++) {
+        t = &preauth_threads[i];
+        ret = krb5int_init_context_kdc(&t->context);
+        if (ret)
+            goto error;
+        ret = pthread_create(&t->tid, NULL, preauth_thread_main, t);
+        if (ret)
+            goto error;
+        t->started = TRUE;
+    }
+
+    krb5_klog_syslog(LOG_INFO, _("created %d preauth threads"), num);
+    return 0;
+
+error:
+    kdc_stop_threads();
+    return ret;
+}
+
+/* Stop the request threads and deliver any outstanding responses.  Called
+ * from the main loop thread after the loop has exited. */
+void
+kdc_stop_threads(void)
+{
+    struct job *job;
+    struct preauth_job *pjob;
+    int i;
+
+    if (request_threads == NULL && preauth_threads == NULL &&
+        wakeup_fds[0] == -1)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = TRUE;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_cond_broadcast(&preauth_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (i = 0; i < num_request_threads; i++) {
+        if (request_threads[i].started)
+            pthread_join(request_threads[i].tid, NULL);
+        kdc_free_server_handle(&request_threads[i].handle);
+    }
+    free(request_threads);
+    request_threads = NULL;
+    num_request_threads = 0;
+
+    for (i = 0; i < num_preauth_threads; i++) {
+        if (preauth_threads[i].started)
+            pthread_join(preauth_threads[i].tid, NULL);
+        if (preauth_threads[i].context != NULL)
+            krb5_free_context(preauth_threads[i].context);
+    }
+    free(preauth_threads);
+    preauth_threads = NULL;
+    num_preauth_threads = 0;
+
+    /* Deliver responses for finished jobs, and discard unstarted ones. */
+    finish_jobs();
+    while ((job = K5_TAILQ_FIRST(&pending_jobs)) != NULL) {
+        K5_TAILQ_REMOVE(&pending_jobs, job, links);
+        (*job->respond)(job->arg, KRB5KDC_ERR_DISCARD, NULL);
+        free(job);
+    }
+    while ((pjob = K5_TAILQ_FIRST(&pending_preauth)) != NULL) {
+        K5_TAILQ_REMOVE(&pending_preauth, pjob, links);
+        pjob->code = KRB5KDC_ERR_DISCARD;
+        finish_preauth_job(pjob);
+    }
+
+    if (wakeup_ev != NULL)
+        verto_del(wakeup_ev);
+    wakeup_ev = NULL;
+    if (wakeup_fds[0] != -1) {
+        close(wakeup_fds[0]);
+        close(wakeup_fds[1]);
+    }
+    wakeup_fds[0] = wakeup_fds[1] = -1;
+}
+
+#else /* !HAVE_PTHREAD */
+
+krb5_boolean
+kdc_queue_tgs_req(krb5_data *pkt, const krb5_fulladdr *from,
+                  loop_respond_fn respond, void *arg)
+{
+    return FALSE;
+}
+
+krb5_error_code
+kdc_start_threads(verto_ctx *ctx, int num)
+{
+    return ENOTSUP;
+}
+
+void
+kdc_threads_hangup(void)
+{
+}
+
+krb5_boolean
+kdc_queue_preauth_work(krb5_context context, krb5_kdcpreauth_work_fn work,
+                       krb5_kdcpreauth_work_done_fn done, void *arg)
+{
+    return FALSE;
+}
+
+krb5_error_code
+kdc_start_preauth_threads(verto_ctx *ctx, int num)
+{
+    return ENOTSUP;
+}
+
+void
+kdc_stop_threads(void)
+{
+}
+
+#endif /* !HAVE_PTHREAD */
@@ -25,6 +25,7 @@
  */
 
 #include "k5-int.h"
+#include "k5-queue.h"
 #include "adm_proto.h"
 #include <sys/ioctl.h>
 #include <syslog.h>
@@ -69,6 +70,9 @@
 
 static int tcp_or_rpc_data_counter;
 static int max_tcp_or_rpc_data_connections = 45;
+static int tcp_idle_timeout;
+static krb5_boolean reuseport;
+static int udp_batch_size = 1;
 
 static int
 setreuseaddr(int sock, int value)
@@ -76,6 +80,14 @@ setreuseaddr(int sock, int value)
     return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
 }
 
+#ifdef SO_REUSEPORT
+static int
+setreuseport(int sock, int value)
+{
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+}
+#endif
+
 #if defined(IPV6_V6ONLY)
 static int
 setv6only(int sock, int value)
@@ -121,6 +133,36 @@ static const char *const bind_type_names[] = {
     [RPC] = "RPC",
 };
 
+/* A notification requested with loop_notify_sent() for a response. */
+struct sent_notify {
+    loop_sent_fn fn;
+    void *data;
+};
+
+/* The notification for the next response handed to a respond function. */
+static struct sent_notify next_sent;
+
+/* Move the pending notification, if any, to n. */
+static void
+take_sent_notify(struct sent_notify *n)
+{
+    *n = next_sent;
+    next_sent.fn = NULL;
+    next_sent.data = NULL;
+}
+
+/* Deliver the notification in n, if there is one, and clear it. */
+static void
+notify_sent(struct sent_notify *n, krb5_boolean ok)
+{
+    loop_sent_fn fn = n->fn;
+
+    if (fn == NULL)
+        return;
+    n->fn = NULL;
+    (*fn)(n->data, ok);
+}
+
 /* Per-connection info.  */
 struct connection {
     void *handle;
@@ -146,9 +188,18 @@ struct connection {
     sg_buf sgbuf[2];
     sg_buf *sgp;
     int sgnum;
+    struct sent_notify sent;
 
-    /* Crude denial-of-service avoidance support (TCP or RPC) */
-    time_t start_time;
+    /*
+     * Crude denial-of-service avoidance support (TCP or RPC).  Data
+     * connections waiting for input or output are kept on a list in order of
+     * last activity, so that the least recently active connection can be
+     * found in constant time when there are too many or they are idle.
+     */
+    verto_ev *ev;
+    time_t active_time;
+    K5_TAILQ_ENTRY(connection) lru_links;
+    krb5_boolean on_lru;
 
     /* RPC-specific fields */
     SVCXPRT *transp;
@@ -206,6 +257,96 @@ struct bind_address {
 static SET(verto_ev *) events;
 static SET(struct bind_address) bind_addresses;
 
+/* TCP data connections are not kept in events, only in the LRU list.  RPC data
+ * connections are kept in both. */
+K5_TAILQ_HEAD(connection_list, connection);
+static struct connection_list lru_conns =
+    K5_TAILQ_HEAD_INITIALIZER(lru_conns);
+static verto_ev *idle_timer;
+
+/* Idle pool objects are linked through their first bytes. */
+struct pool_link {
+    struct pool_link *next;
+};
+
+void *
+loop_pool_get(struct loop_pool *pool)
+{
+    struct pool_link *obj;
+
+    assert(pool->objsize >= sizeof(struct pool_link));
+    obj = pool->free_list;
+    if (obj != NULL) {
+        pool->free_list = obj->next;
+        pool->idle--;
+        pool->reuses++;
+    } else {
+        obj = malloc(pool->objsize);
+        if (obj == NULL)
+            return NULL;
+        pool->heap_allocs++;
+    }
+    if (++pool->in_use > pool->high_water)
+        pool->high_water = pool->in_use;
+    return obj;
+}
+
+void
+loop_pool_put(struct loop_pool *pool, void *obj)
+{
+    struct pool_link *link = obj;
+
+    if (obj == NULL)
+        return;
+    pool->in_use--;
+    if (pool->idle >= pool->max_idle) {
+        free(obj);
+        return;
+    }
+    link->next = pool->free_list;
+    pool->free_list = link;
+    pool->idle++;
+}
+
+krb5_error_code
+loop_pool_prealloc(struct loop_pool *pool, unsigned int n)
+{
+    struct pool_link *obj;
+
+    assert(pool->objsize >= sizeof(struct pool_link));
+    while (pool->idle < n) {
+        obj = malloc(pool->objsize);
+        if (obj == NULL)
+            return ENOMEM;
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+        pool->idle++;
+        pool->heap_allocs++;
+    }
+    return 0;
+}
+
+void
+loop_pool_drain(struct loop_pool *pool)
+{
+    struct pool_link *obj;
+
+    while ((obj = pool->free_list) != NULL) {
+        pool->free_list = obj->next;
+        free(obj);
+    }
+    pool->idle = 0;
+}
+
+void
+loop_pool_log_stats(struct loop_pool *pool, const char *name)
+{
+    krb5_klog_syslog(LOG_INFO, _("%s pool: %u in use, high-water mark %u, "
+                                 "%lu heap allocations, %lu reuses"), name,
+                     pool->in_use, pool->high_water, pool->heap_allocs,
+                     pool->reuses);
+}
+
 verto_ctx *
 loop_init(verto_ev_type types)
 {
@@ -453,6 +594,7 @@ free_connection(struct connection *conn)
 {
     if (!conn)
         return;
+    notify_sent(&conn->sent, FALSE);
     if (conn->response)
         krb5_free_data(get_context(conn->handle), conn->response);
     if (conn->buffer)
@@ -476,6 +618,89 @@ remove_event_from_set(verto_ev *ev)
         }
 }
 
+/* Remove conn from the LRU list if it is on it. */
+static void
+lru_remove(struct connection *conn)
+{
+    if (!conn->on_lru)
+        return;
+    K5_TAILQ_REMOVE(&lru_conns, conn, lru_links);
+    conn->on_lru = FALSE;
+    conn->ev = NULL;
+}
+
+/* Close conn, which must be on the LRU list, either to make room for a new
+ * connection or because it has been idle for too long. */
+static void
+drop_connection(struct connection *conn, krb5_boolean idle)
+{
+    const char *type = (conn->type == CONN_RPC) ? "rpc" : "tcp";
+    int fd = verto_get_fd(conn->ev);
+
+    if (idle) {
+        krb5_klog_syslog(LOG_INFO, _("dropping idle %s fd %d from %s"), type,
+                         fd, conn->addrbuf);
+    } else {
+        krb5_klog_syslog(LOG_INFO, _("dropping %s fd %d from %s"), type, fd,
+                         conn->addrbuf);
+    }
+    if (conn->type == CONN_RPC)
+        conn->rpc_force_close = 1;
+    verto_del(conn->ev);
+}
+
+static void schedule_idle_timer(verto_ctx *ctx);
+
+/* Close the connections which have been idle for tcp_idle_timeout seconds.
+ * They are at the head of the LRU list. */
+static void
+expire_idle_connections(verto_ctx *ctx, verto_ev *ev)
+{
+    struct connection *conn;
+    time_t now = time(NULL);
+
+    idle_timer = NULL;
+    while ((conn = K5_TAILQ_FIRST(&lru_conns)) != NULL &&
+           now - conn->active_time >= tcp_idle_timeout)
+        drop_connection(conn, TRUE);
+    schedule_idle_timer(ctx);
+}
+
+/*
+ * If idle timeouts are enabled and no timer is pending, set a timer for when
+ * the least recently active connection will become idle.  Since every
+ * connection has the same timeout, one timer suffices; if the connection is
+ * used again before the timer fires, the timer is rescheduled for the new
+ * head of the list.
+ */
+static void
+schedule_idle_timer(verto_ctx *ctx)
+{
+    struct connection *oldest = K5_TAILQ_FIRST(&lru_conns);
+    time_t wait;
+
+    if (tcp_idle_timeout <= 0 || idle_timer != NULL || oldest == NULL)
+        return;
+    wait = oldest->active_time + tcp_idle_timeout - time(NULL);
+    if (wait < 0)
+        wait = 0;
+    idle_timer = verto_add_timeout(ctx, VERTO_EV_FLAG_NONE,
+                                   expire_idle_connections, wait * 1000);
+}
+
+/* Record activity on conn, whose current event is ev, moving it to the tail of
+ * the LRU list. */
+static void
+lru_touch(verto_ctx *ctx, struct connection *conn, verto_ev *ev)
+{
+    lru_remove(conn);
+    conn->ev = ev;
+    conn->active_time = time(NULL);
+    K5_TAILQ_INSERT_TAIL(&lru_conns, conn, lru_links);
+    conn->on_lru = TRUE;
+    schedule_idle_timer(ctx);
+}
+
 static void
 free_socket(verto_ctx *ctx, verto_ev *ev)
 {
@@ -483,11 +708,14 @@ free_socket(verto_ctx *ctx, verto_ev *ev)
     fd_set fds;
     int fd;
 
-    remove_event_from_set(ev);
-
     fd = verto_get_fd(ev);
     conn = verto_get_private(ev);
 
+    if (conn != NULL && (conn->type == CONN_TCP || conn->type == CONN_RPC))
+        lru_remove(conn);
+    if (conn == NULL || conn->type != CONN_TCP)
+        remove_event_from_set(ev);
+
     /* Close the file descriptor. */
     krb5_klog_syslog(LOG_INFO, _("closing down fd %d"), fd);
     if (fd >= 0 && (!conn || conn->type != CONN_RPC || conn->rpc_force_close))
@@ -575,6 +803,7 @@ add_fd(struct socksetup *data, int sock, enum conn_type conntype,
 }
 
 static void process_packet(verto_ctx *ctx, verto_ev *ev);
+static krb5_error_code preallocate_udp_states(void);
 static void accept_tcp_connection(verto_ctx *ctx, verto_ev *ev);
 static void process_tcp_connection_read(verto_ctx *ctx, verto_ev *ev);
 static void process_tcp_connection_write(verto_ctx *ctx, verto_ev *ev);
@@ -586,12 +815,13 @@ add_tcp_read_fd(struct socksetup *data, int sock)
 {
     return add_fd(data, sock, CONN_TCP,
                   VERTO_EV_FLAG_IO_READ | VERTO_EV_FLAG_PERSIST,
-                  process_tcp_connection_read, 1);
+                  process_tcp_connection_read, 0);
 }
 
 /*
  * Create a socket and bind it to addr.  Ensure the socket will work with
- * select().  Set the socket cloexec, reuseaddr, and if applicable v6-only.
+ * select().  Set the socket cloexec, reuseaddr, if requested reuseport, and if
+ * applicable v6-only.
  * Does not call listen().  Returns -1 on failure after logging an error.
  */
 static int
@@ -622,6 +852,16 @@ create_server_socket(struct socksetup *data, struct sockaddr *addr, int type)
                 _("Cannot enable SO_REUSEADDR on fd %d"), sock);
     }
 
+#ifdef SO_REUSEPORT
+    if (reuseport && setreuseport(sock, 1) < 0) {
+        data->retval = errno;
+        com_err(data->prog, errno,
+                _("Cannot enable SO_REUSEPORT on fd %d"), sock);
+        close(sock);
+        return -1;
+    }
+#endif
+
     if (addr->sa_family == AF_INET6) {
 #ifdef IPV6_V6ONLY
         if (setv6only(sock, 1))
@@ -909,17 +1149,14 @@ loop_setup_network(verto_ctx *ctx, void *handle, const char *prog,
                    int tcp_listen_backlog)
 {
     struct socksetup setup_data;
-    verto_ev *ev;
-    int i, ret;
+    int ret;
 
     /* Check to make sure that at least one address was added to the loop. */
     if (bind_addresses.n == 0)
         return EINVAL;
 
     /* Close any open connections. */
-    FOREACH_ELT(events, i, ev)
-        verto_del(ev);
-    events.n = 0;
+    loop_close_network();
 
     setup_data.ctx = ctx;
     setup_data.handle = handle;
@@ -940,7 +1177,60 @@ loop_setup_network(verto_ctx *ctx, void *handle, const char *prog,
         exit (1);
     }
 
+    /* Preallocate UDP request state so that steady-state UDP request handling
+     * does not need the heap. */
+    ret = preallocate_udp_states();
+    if (ret)
+        return ret;
+
+    return 0;
+}
+
+krb5_error_code
+loop_set_reuseport(krb5_boolean value)
+{
+#ifdef SO_REUSEPORT
+    reuseport = value;
     return 0;
+#else
+    return value ? ENOTSUP : 0;
+#endif
+}
+
+void
+loop_set_udp_batch_size(int n)
+{
+    udp_batch_size = (n < 1) ? 1 : (n > UDP_MAX_BATCH) ? UDP_MAX_BATCH : n;
+}
+
+void
+loop_set_tcp_idle_timeout(int seconds)
+{
+    tcp_idle_timeout = (seconds < 0) ? 0 : seconds;
+}
+
+void
+loop_notify_sent(loop_sent_fn sent, void *data)
+{
+    next_sent.fn = sent;
+    next_sent.data = data;
+}
+
+void
+loop_close_network(void)
+{
+    struct connection *conn;
+    verto_ev *ev;
+    int i;
+
+    FOREACH_ELT(events, i, ev)
+        verto_del(ev);
+    events.n = 0;
+    while ((conn = K5_TAILQ_FIRST(&lru_conns)) != NULL)
+        verto_del(conn->ev);
+    if (idle_timer != NULL)
+        verto_del(idle_timer);
+    idle_timer = NULL;
 }
 
 void
@@ -986,20 +1276,45 @@ struct udp_dispatch_state {
     struct sockaddr_storage daddr;
     aux_addressing_info auxaddr;
     krb5_data request;
+    krb5_data *response;
+    struct sent_notify sent;
     char pktbuf[MAX_DGRAM_SIZE];
 };
 
+/* Replies produced while a batch of received packets is being dispatched, to
+ * be sent together by flush_udp_replies(). */
+static struct {
+    krb5_boolean active;
+    int fd;
+    int n;
+    struct udp_dispatch_state *states[UDP_MAX_BATCH];
+} udp_replies;
+
+/* Enough UDP dispatch states for a few batches of requests, preallocated when
+ * the network is set up, are kept for reuse. */
+#define UDP_POOL_PREALLOC 16
+#define UDP_POOL_MAX_IDLE 256
+static struct loop_pool udp_pool =
+    LOOP_POOL_INITIALIZER(struct udp_dispatch_state, UDP_POOL_MAX_IDLE);
+
+static krb5_error_code
+preallocate_udp_states(void)
+{
+    return loop_pool_prealloc(&udp_pool, UDP_POOL_PREALLOC + udp_batch_size);
+}
+
 static void
-process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
+free_udp_dispatch_state(struct udp_dispatch_state *state)
 {
-    struct udp_dispatch_state *state = arg;
-    int cc;
+    krb5_free_data(get_context(state->handle), state->response);
+    loop_pool_put(&udp_pool, state);
+}
 
-    if (code)
-        com_err(state->prog ? state->prog : NULL, code,
-                _("while dispatching (udp)"));
-    if (code || response == NULL)
-        goto out;
+/* Send response to the requester of state, returning true on success. */
+static krb5_boolean
+send_udp_reply(struct udp_dispatch_state *state, krb5_data *response)
+{
+    int cc;
 
     cc = send_to_from(state->port_fd, response->data,
                       (socklen_t) response->length, 0,
@@ -1028,60 +1343,114 @@ process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
 
         com_err(state->prog, e, _("while sending reply to %s/%s from %s"),
                 saddrbuf, sportbuf, daddrbuf);
-        goto out;
+        return FALSE;
     }
     if ((size_t)cc != response->length) {
         com_err(state->prog, 0, _("short reply write %d vs %d\n"),
                 response->length, cc);
+        return FALSE;
     }
-
-out:
-    krb5_free_data(get_context(state->handle), response);
-    free(state);
+    return TRUE;
 }
 
+/* Send the replies collected while dispatching a batch of packets. */
 static void
-process_packet(verto_ctx *ctx, verto_ev *ev)
+flush_udp_replies(void)
 {
-    int cc;
-    struct connection *conn;
+    struct udp_msg msgs[UDP_MAX_BATCH];
     struct udp_dispatch_state *state;
+    krb5_boolean ok;
+    int i, sent;
+
+    for (i = 0; i < udp_replies.n; i++) {
+        state = udp_replies.states[i];
+        msgs[i].buf = state->response->data;
+        msgs[i].len = state->response->length;
+        msgs[i].remote = ss2sa(&state->saddr);
+        msgs[i].remote_len = state->saddr_len;
+        msgs[i].local = ss2sa(&state->daddr);
+        msgs[i].local_len = state->daddr_len;
+        msgs[i].auxaddr = &state->auxaddr;
+    }
+    sent = (udp_replies.n > 0) ?
+        send_to_from_batch(udp_replies.fd, msgs, udp_replies.n) : 0;
+
+    /* Send any replies which didn't go out with the batch individually, so
+     * that errors are reported for them. */
+    for (i = 0; i < udp_replies.n; i++) {
+        state = udp_replies.states[i];
+        ok = (i < sent) ? TRUE : send_udp_reply(state, state->response);
+        notify_sent(&state->sent, ok);
+        free_udp_dispatch_state(state);
+    }
+    udp_replies.n = 0;
+}
 
-    conn = verto_get_private(ev);
+static void
+process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
+{
+    struct udp_dispatch_state *state = arg;
+    krb5_boolean ok = FALSE;
 
-    state = malloc(sizeof(*state));
-    if (!state) {
-        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
+    take_sent_notify(&state->sent);
+    if (code)
+        com_err(state->prog ? state->prog : NULL, code,
+                _("while dispatching (udp)"));
+    if (code || response == NULL)
+        goto out;
+
+    /* If this reply was produced while dispatching a batch of packets from
+     * the same socket, send it along with the others. */
+    if (udp_replies.active && udp_replies.fd == state->port_fd &&
+        udp_replies.n < UDP_MAX_BATCH) {
+        state->response = response;
+        udp_replies.states[udp_replies.n++] = state;
         return;
     }
 
+    ok = send_udp_reply(state, response);
+
+out:
+    notify_sent(&state->sent, ok);
+    krb5_free_data(get_context(state->handle), response);
+    loop_pool_put(&udp_pool, state);
+}
+
+static void
+init_udp_dispatch_state(struct udp_dispatch_state *state,
+                        struct connection *conn, int fd)
+{
     state->handle = conn->handle;
     state->prog = conn->prog;
-    state->port_fd = verto_get_fd(ev);
-    assert(state->port_fd >= 0);
-
+    state->port_fd = fd;
     state->saddr_len = sizeof(state->saddr);
     state->daddr_len = sizeof(state->daddr);
     memset(&state->auxaddr, 0, sizeof(state->auxaddr));
-    cc = recv_from_to(state->port_fd, state->pktbuf, sizeof(state->pktbuf), 0,
-                      (struct sockaddr *)&state->saddr, &state->saddr_len,
-                      (struct sockaddr *)&state->daddr, &state->daddr_len,
-                      &state->auxaddr);
-    if (cc == -1) {
-        if (errno != EINTR && errno != EAGAIN
-            /*
-             * This is how Linux indicates that a previous transmission was
-             * refused, e.g., if the client timed out before getting the
-             * response packet.
-             */
-            && errno != ECONNREFUSED
-        )
-            com_err(conn->prog, errno, _("while receiving from network"));
-        free(state);
-        return;
-    }
+    state->response = NULL;
+}
+
+/* Log an error from receiving a UDP packet unless it is expected. */
+static void
+log_udp_recv_error(struct connection *conn, int e)
+{
+    if (e != EINTR && e != EAGAIN
+        /*
+         * This is how Linux indicates that a previous transmission was
+         * refused, e.g., if the client timed out before getting the
+         * response packet.
+         */
+        && e != ECONNREFUSED
+    )
+        com_err(conn->prog, e, _("while receiving from network"));
+}
+
+/* Dispatch a received packet of length cc, taking ownership of state. */
+static void
+dispatch_packet(verto_ctx *ctx, struct connection *conn,
+                struct udp_dispatch_state *state, int cc)
+{
     if (!cc) { /* zero-length packet? */
-        free(state);
+        loop_pool_put(&udp_pool, state);
         return;
     }
 
@@ -1118,44 +1487,112 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
              &state->request, 0, ctx, process_packet_response, state);
 }
 
-static int
-kill_lru_tcp_or_rpc_connection(void *handle, verto_ev *newev)
+/*
+ * Receive up to udp_batch_size packets from the socket for ev with one system
+ * call, dispatch them, and send the replies produced synchronously with one
+ * system call.  Return false if batched I/O is not supported.
+ */
+static krb5_boolean
+process_packet_batch(verto_ctx *ctx, verto_ev *ev)
 {
-    struct connection *c = NULL, *oldest_c = NULL;
-    verto_ev *ev, *oldest_ev = NULL;
-    int i, fd = -1;
+    struct connection *conn = verto_get_private(ev);
+    struct udp_dispatch_state *states[UDP_MAX_BATCH], *state;
+    struct udp_msg msgs[UDP_MAX_BATCH];
+    int fd = verto_get_fd(ev), i, n, count = 0;
+
+    /* Gather buffers for the packets. */
+    while (count < udp_batch_size) {
+        state = loop_pool_get(&udp_pool);
+        if (state == NULL)
+            break;
+        init_udp_dispatch_state(state, conn, fd);
+        msgs[count].buf = state->pktbuf;
+        msgs[count].len = sizeof(state->pktbuf);
+        msgs[count].remote = ss2sa(&state->saddr);
+        msgs[count].remote_len = state->saddr_len;
+        msgs[count].local = ss2sa(&state->daddr);
+        msgs[count].local_len = state->daddr_len;
+        msgs[count].auxaddr = &state->auxaddr;
+        states[count++] = state;
+    }
+    if (count == 0) {
+        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
+        return TRUE;
+    }
 
-    krb5_klog_syslog(LOG_INFO, _("too many connections"));
+    n = recv_from_to_batch(fd, msgs, count);
+    if (n < 0 && errno != ENOSYS) {
+        log_udp_recv_error(conn, errno);
+        n = 0;
+    }
 
-    FOREACH_ELT (events, i, ev) {
-        if (ev == newev)
-            continue;
+    /* Release the buffers we didn't use. */
+    for (i = (n < 0) ? 0 : n; i < count; i++)
+        loop_pool_put(&udp_pool, states[i]);
+    if (n < 0)
+        return FALSE;
+
+    udp_replies.active = TRUE;
+    udp_replies.fd = fd;
+    for (i = 0; i < n; i++) {
+        states[i]->saddr_len = msgs[i].remote_len;
+        states[i]->daddr_len = msgs[i].local_len;
+        dispatch_packet(ctx, conn, states[i], msgs[i].len);
+    }
+    udp_replies.active = FALSE;
+    flush_udp_replies();
+    return TRUE;
+}
 
-        c = verto_get_private(ev);
-        if (!c)
-            continue;
-        if (c->type != CONN_TCP && c->type != CONN_RPC)
-            continue;
-#if 0
-        krb5_klog_syslog(LOG_INFO, "fd %d started at %ld",
-                         verto_get_fd(oldest_ev),
-                         c->start_time);
-#endif
-        if (oldest_c == NULL
-            || oldest_c->start_time > c->start_time) {
-            oldest_ev = ev;
-            oldest_c = c;
-        }
+static void
+process_packet(verto_ctx *ctx, verto_ev *ev)
+{
+    int cc;
+    struct connection *conn;
+    struct udp_dispatch_state *state;
+
+    conn = verto_get_private(ev);
+
+    if (udp_batch_size > 1) {
+        if (process_packet_batch(ctx, ev))
+            return;
+        krb5_klog_syslog(LOG_INFO, _("batched UDP I/O is not supported; "
+                                     "receiving one packet at a time"));
+        udp_batch_size = 1;
     }
-    if (oldest_c != NULL) {
-        krb5_klog_syslog(LOG_INFO, _("dropping %s fd %d from %s"),
-                         c->type == CONN_RPC ? "rpc" : "tcp",
-                         verto_get_fd(oldest_ev), oldest_c->addrbuf);
-        if (oldest_c->type == CONN_RPC)
-            oldest_c->rpc_force_close = 1;
-        verto_del(oldest_ev);
+
+    state = loop_pool_get(&udp_pool);
+    if (!state) {
+        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
+        return;
     }
-    return fd;
+
+    init_udp_dispatch_state(state, conn, verto_get_fd(ev));
+    assert(state->port_fd >= 0);
+
+    cc = recv_from_to(state->port_fd, state->pktbuf, sizeof(state->pktbuf), 0,
+                      (struct sockaddr *)&state->saddr, &state->saddr_len,
+                      (struct sockaddr *)&state->daddr, &state->daddr_len,
+                      &state->auxaddr);
+    if (cc == -1) {
+        log_udp_recv_error(conn, errno);
+        loop_pool_put(&udp_pool, state);
+        return;
+    }
+    dispatch_packet(ctx, conn, state, cc);
+}
+
+/* Drop the least recently active data connection other than newconn.
+ * Connections whose requests are being processed are not on the LRU list and
+ * are not considered. */
+static void
+kill_lru_tcp_or_rpc_connection(struct connection *newconn)
+{
+    struct connection *oldest = K5_TAILQ_FIRST(&lru_conns);
+
+    krb5_klog_syslog(LOG_INFO, _("too many connections"));
+    if (oldest != NULL && oldest != newconn)
+        drop_connection(oldest, FALSE);
 }
 
 static void
@@ -1219,10 +1656,10 @@ accept_tcp_connection(verto_ctx *ctx, verto_ev *ev)
     newconn->addrlen = addrlen;
     newconn->bufsiz = 1024 * 1024;
     newconn->buffer = malloc(newconn->bufsiz);
-    newconn->start_time = time(0);
+    lru_touch(ctx, newconn, newev);
 
     if (++tcp_or_rpc_data_counter > max_tcp_or_rpc_data_connections)
-        kill_lru_tcp_or_rpc_connection(conn->handle, newev);
+        kill_lru_tcp_or_rpc_connection(newconn);
 
     if (newconn->buffer == 0) {
         com_err(conn->prog, errno,
@@ -1246,6 +1683,9 @@ struct tcp_dispatch_state {
     int sock;
 };
 
+static struct loop_pool tcp_pool =
+    LOOP_POOL_INITIALIZER(struct tcp_dispatch_state, 64);
+
 static void
 process_tcp_response(void *arg, krb5_error_code code, krb5_data *response)
 {
@@ -1254,6 +1694,7 @@ process_tcp_response(void *arg, krb5_error_code code, krb5_data *response)
 
     assert(state);
     state->conn->response = response;
+    take_sent_notify(&state->conn->sent);
 
     if (code)
         com_err(state->conn->prog, code, _("while dispatching (tcp)"));
@@ -1267,9 +1708,10 @@ process_tcp_response(void *arg, krb5_error_code code, krb5_data *response)
     state->conn->sgnum = 2;
 
     ev = make_event(state->ctx, VERTO_EV_FLAG_IO_WRITE | VERTO_EV_FLAG_PERSIST,
-                    process_tcp_connection_write, state->sock, state->conn, 1);
+                    process_tcp_connection_write, state->sock, state->conn, 0);
     if (ev) {
-        free(state);
+        lru_touch(state->ctx, state->conn, ev);
+        loop_pool_put(&tcp_pool, state);
         return;
     }
 
@@ -1277,7 +1719,7 @@ kill_tcp_connection:
     tcp_or_rpc_data_counter--;
     free_connection(state->conn);
     close(state->sock);
-    free(state);
+    loop_pool_put(&tcp_pool, state);
 }
 
 /* Creates the tcp_dispatch_state and deletes the verto event. */
@@ -1286,7 +1728,7 @@ prepare_for_dispatch(verto_ctx *ctx, verto_ev *ev)
 {
     struct tcp_dispatch_state *state;
 
-    state = malloc(sizeof(*state));
+    state = loop_pool_get(&tcp_pool);
     if (!state) {
         krb5_klog_syslog(LOG_ERR, _("error allocating tcp dispatch private!"));
         return NULL;
@@ -1295,7 +1737,7 @@ prepare_for_dispatch(verto_ctx *ctx, verto_ev *ev)
     state->sock = verto_get_fd(ev);
     state->ctx = ctx;
     verto_set_private(ev, NULL, NULL); /* Don't close the fd or free conn! */
-    remove_event_from_set(ev); /* Remove it from the set. */
+    lru_remove(state->conn);
     verto_del(ev);
     return state;
 }
@@ -1329,6 +1771,7 @@ process_tcp_connection_read(verto_ctx *ctx, verto_ev *ev)
         if (nread == 0) /* eof */
             goto kill_tcp_connection;
         conn->offset += nread;
+        lru_touch(ctx, conn, ev);
         if (conn->offset == 4) {
             unsigned char *p = (unsigned char *)conn->buffer;
             conn->msglen = load_32_be(p);
@@ -1370,8 +1813,10 @@ process_tcp_connection_read(verto_ctx *ctx, verto_ev *ev)
         if (nread == 0) /* eof */
             goto kill_tcp_connection;
         conn->offset += nread;
-        if (conn->offset < conn->msglen + 4)
+        if (conn->offset < conn->msglen + 4) {
+            lru_touch(ctx, conn, ev);
             return;
+        }
 
         /* Have a complete message, and exactly one message. */
         state = prepare_for_dispatch(ctx, ev);
@@ -1426,13 +1871,17 @@ process_tcp_connection_write(verto_ctx *ctx, verto_ev *ev)
         /* If we still have more data to send, just return so that
          * the main loop can call this function again when the socket
          * is ready for more writing. */
-        if (conn->sgnum > 0)
+        if (conn->sgnum > 0) {
+            lru_touch(ctx, conn, ev);
             return;
+        }
     }
 
     /* Finished sending.  We should go back to reading, though if we
      * sent a FIELD_TOOLONG error in reply to a length with the high
      * bit set, RFC 4120 says we have to close the TCP stream. */
+    if (conn->sgnum == 0)
+        notify_sent(&conn->sent, TRUE);
     verto_del(ev);
 }
 
@@ -1443,6 +1892,12 @@ loop_free(verto_ctx *ctx)
     struct bind_address val;
 
     verto_free(ctx);
+    idle_timer = NULL;
+
+    loop_pool_log_stats(&udp_pool, "UDP request");
+    loop_pool_log_stats(&tcp_pool, "TCP request");
+    loop_pool_drain(&udp_pool);
+    loop_pool_drain(&tcp_pool);
 
     /* Free each addresses added to the loop. */
     FOREACH_ELT(bind_addresses, i, val)
@@ -1533,10 +1988,10 @@ accept_rpc_connection(verto_ctx *ctx, verto_ev *ev)
 
         newconn->addr_s = addr_s;
         newconn->addrlen = addrlen;
-        newconn->start_time = time(0);
+        lru_touch(ctx, newconn, newev);
 
         if (++tcp_or_rpc_data_counter > max_tcp_or_rpc_data_connections)
-            kill_lru_tcp_or_rpc_connection(newconn->handle, newev);
+            kill_lru_tcp_or_rpc_connection(newconn);
 
         newconn->faddr.address = &newconn->kaddr;
         init_addr(&newconn->faddr, ss2sa(&newconn->addr_s));
@@ -1554,6 +2009,8 @@ process_rpc_connection(verto_ctx *ctx, verto_ev *ev)
 
     if (!FD_ISSET(verto_get_fd(ev), &svc_fdset))
         verto_del(ev);
+    else
+        lru_touch(ctx, verto_get_private(ev), ev);
 }
 
 #endif /* INET */
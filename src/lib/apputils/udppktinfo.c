@@ -258,6 +258,34 @@ check_cmsg_pktinfo(struct cmsghdr *cmsgptr, struct sockaddr *to,
            check_cmsg_v6_pktinfo(cmsgptr, to, tolen, auxaddr);
 }
 
+/*
+ * Set *to and *tolen from the pktinfo control message in a received msg, or
+ * set *tolen to 0 if no destination address information is present.
+ */
+static void
+get_msg_to(struct msghdr *msg, struct sockaddr *to, socklen_t *tolen,
+           aux_addressing_info *auxaddr)
+{
+    struct cmsghdr *cmsgptr;
+
+    /*
+     * On Darwin (and presumably all *BSD with KAME stacks), CMSG_FIRSTHDR
+     * doesn't check for a non-zero controllen.  RFC 3542 recommends making
+     * this check, even though the (new) spec for CMSG_FIRSTHDR says it's
+     * supposed to do the check.
+     */
+    if (msg->msg_controllen) {
+        cmsgptr = CMSG_FIRSTHDR(msg);
+        while (cmsgptr) {
+            if (check_cmsg_pktinfo(cmsgptr, to, tolen, auxaddr))
+                return;
+            cmsgptr = CMSG_NXTHDR(msg, cmsgptr);
+        }
+    }
+    /* No info about destination addr was available.  */
+    *tolen = 0;
+}
+
 /*
  * Receive a message from a socket.
  *
@@ -286,7 +314,6 @@ recv_from_to(int sock, void *buf, size_t len, int flags,
     int r;
     struct iovec iov;
     char cmsg[CMSG_SPACE(sizeof(union pktinfo))];
-    struct cmsghdr *cmsgptr;
     struct msghdr msg;
 
     /* Don't use pktinfo if the socket isn't bound to a wildcard address. */
@@ -315,23 +342,7 @@ recv_from_to(int sock, void *buf, size_t len, int flags,
     if (r < 0)
         return r;
     *fromlen = msg.msg_namelen;
-
-    /*
-     * On Darwin (and presumably all *BSD with KAME stacks), CMSG_FIRSTHDR
-     * doesn't check for a non-zero controllen.  RFC 3542 recommends making
-     * this check, even though the (new) spec for CMSG_FIRSTHDR says it's
-     * supposed to do the check.
-     */
-    if (msg.msg_controllen) {
-        cmsgptr = CMSG_FIRSTHDR(&msg);
-        while (cmsgptr) {
-            if (check_cmsg_pktinfo(cmsgptr, to, tolen, auxaddr))
-                return r;
-            cmsgptr = CMSG_NXTHDR(&msg, cmsgptr);
-        }
-    }
-    /* No info about destination addr was available.  */
-    *tolen = 0;
+    get_msg_to(&msg, to, tolen, auxaddr);
     return r;
 }
 
@@ -434,6 +445,43 @@ set_msg_from(int family, struct msghdr *msg, struct cmsghdr *cmsgptr,
     return EINVAL;
 }
 
+/*
+ * Initialize msg to send the contents of iov to the address to, using cbuf
+ * (which must be CMSG_SPACE(sizeof(union pktinfo)) bytes) to request the
+ * source address from if possible.  Return true if the source address was
+ * set.
+ */
+static krb5_boolean
+init_send_msg(struct msghdr *msg, struct iovec *iov, char *cbuf,
+              const struct sockaddr *to, socklen_t tolen,
+              struct sockaddr *from, socklen_t fromlen,
+              aux_addressing_info *auxaddr)
+{
+    struct cmsghdr *cmsgptr;
+
+    memset(cbuf, 0, CMSG_SPACE(sizeof(union pktinfo)));
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = (void *)to;
+    msg->msg_namelen = tolen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 1;
+    if (from == NULL || fromlen == 0 || from->sa_family != to->sa_family)
+        return FALSE;
+
+    msg->msg_control = cbuf;
+    /* CMSG_FIRSTHDR needs a non-zero controllen, or it'll return NULL on
+     * Linux. */
+    msg->msg_controllen = CMSG_SPACE(sizeof(union pktinfo));
+    cmsgptr = CMSG_FIRSTHDR(msg);
+    msg->msg_controllen = 0;
+
+    if (set_msg_from(from->sa_family, msg, cmsgptr, from, fromlen, auxaddr)) {
+        msg->msg_control = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
 /*
  * Send a message to an address.
  *
@@ -458,7 +506,6 @@ send_to_from(int sock, void *buf, size_t len, int flags,
     int r;
     struct iovec iov;
     struct msghdr msg;
-    struct cmsghdr *cmsgptr;
     char cbuf[CMSG_SPACE(sizeof(union pktinfo))];
 
     /* Don't use pktinfo if the socket isn't bound to a wildcard address. */
@@ -474,20 +521,7 @@ send_to_from(int sock, void *buf, size_t len, int flags,
     /* Truncation?  */
     if (iov.iov_len != len)
         return EINVAL;
-    memset(cbuf, 0, sizeof(cbuf));
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = (void *)to;
-    msg.msg_namelen = tolen;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cbuf;
-    /* CMSG_FIRSTHDR needs a non-zero controllen, or it'll return NULL on
-     * Linux. */
-    msg.msg_controllen = sizeof(cbuf);
-    cmsgptr = CMSG_FIRSTHDR(&msg);
-    msg.msg_controllen = 0;
-
-    if (set_msg_from(from->sa_family, &msg, cmsgptr, from, fromlen, auxaddr))
+    if (!init_send_msg(&msg, &iov, cbuf, to, tolen, from, fromlen, auxaddr))
         goto use_sendto;
     return sendmsg(sock, &msg, flags);
 
@@ -495,6 +529,131 @@ use_sendto:
     return sendto(sock, buf, len, flags, to, tolen);
 }
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+
+/* Control message buffer, aligned for struct cmsghdr. */
+union pktinfo_cbuf {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(union pktinfo))];
+};
+
+/*
+ * Receive up to n messages from a non-blocking socket with a single system
+ * call.  For each message received, set buf, len, remote, and remote_len as
+ * recv_from_to() would set buf, its return value, from, and fromlen, and set
+ * local, local_len, and auxaddr as recv_from_to() would set to, tolen, and
+ * auxaddr.  The caller must initialize len, remote_len, and local_len to the
+ * buffer sizes.
+ *
+ * Returns the number of messages received, or -1 with errno set on error.
+ */
+int
+recv_from_to_batch(int sock, struct udp_msg *msgs, int n)
+{
+    struct mmsghdr mmsg[UDP_MAX_BATCH];
+    struct iovec iov[UDP_MAX_BATCH];
+    union pktinfo_cbuf cbufs[UDP_MAX_BATCH];
+    struct msghdr *msg;
+    int i, r, wildcard;
+
+    if (n > UDP_MAX_BATCH)
+        n = UDP_MAX_BATCH;
+
+    /* Don't use pktinfo if the socket isn't bound to a wildcard address. */
+    wildcard = is_socket_bound_to_wildcard(sock);
+    if (wildcard < 0)
+        return -1;
+
+    memset(mmsg, 0, n * sizeof(*mmsg));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = msgs[i].buf;
+        iov[i].iov_len = msgs[i].len;
+        msg = &mmsg[i].msg_hdr;
+        msg->msg_name = msgs[i].remote;
+        msg->msg_namelen = msgs[i].remote_len;
+        msg->msg_iov = &iov[i];
+        msg->msg_iovlen = 1;
+        if (wildcard) {
+            msg->msg_control = cbufs[i].buf;
+            msg->msg_controllen = sizeof(cbufs[i].buf);
+        }
+    }
+
+    r = recvmmsg(sock, mmsg, n, 0, NULL);
+    if (r < 0)
+        return r;
+
+    for (i = 0; i < r; i++) {
+        msg = &mmsg[i].msg_hdr;
+        msgs[i].len = mmsg[i].msg_len;
+        msgs[i].remote_len = msg->msg_namelen;
+        if (wildcard) {
+            /* Clobber with something recognizeable in case we can't extract
+             * the address but try to use it anyways. */
+            memset(msgs[i].local, 0x40, msgs[i].local_len);
+            get_msg_to(msg, msgs[i].local, &msgs[i].local_len,
+                       msgs[i].auxaddr);
+        } else {
+            msgs[i].local_len = 0;
+        }
+    }
+    return r;
+}
+
+/*
+ * Send n messages with a single system call.  For each message, send len bytes
+ * from buf to remote, from the address local if possible, as send_to_from()
+ * would.
+ *
+ * Returns the number of messages sent, which may be fewer than n, or -1 with
+ * errno set if the first message could not be sent.
+ */
+int
+send_to_from_batch(int sock, struct udp_msg *msgs, int n)
+{
+    struct mmsghdr mmsg[UDP_MAX_BATCH];
+    struct iovec iov[UDP_MAX_BATCH];
+    union pktinfo_cbuf cbufs[UDP_MAX_BATCH];
+    int i, wildcard;
+
+    if (n > UDP_MAX_BATCH)
+        n = UDP_MAX_BATCH;
+
+    /* Don't use pktinfo if the socket isn't bound to a wildcard address. */
+    wildcard = is_socket_bound_to_wildcard(sock);
+    if (wildcard < 0)
+        return -1;
+
+    memset(mmsg, 0, n * sizeof(*mmsg));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = msgs[i].buf;
+        iov[i].iov_len = msgs[i].len;
+        (void)init_send_msg(&mmsg[i].msg_hdr, &iov[i], cbufs[i].buf,
+                            msgs[i].remote, msgs[i].remote_len,
+                            wildcard ? msgs[i].local : NULL,
+                            msgs[i].local_len, msgs[i].auxaddr);
+    }
+    return sendmmsg(sock, mmsg, n, 0);
+}
+
+#else /* HAVE_RECVMMSG && HAVE_SENDMMSG */
+
+int
+recv_from_to_batch(int sock, struct udp_msg *msgs, int n)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+send_to_from_batch(int sock, struct udp_msg *msgs, int n)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
+
 #else /* HAVE_PKTINFO_SUPPORT && CMSG_SPACE */
 
 krb5_error_code
@@ -522,4 +681,18 @@ send_to_from(int sock, void *buf, size_t len, int flags,
     return sendto(sock, buf, len, flags, to, tolen);
 }
 
+int
+recv_from_to_batch(int sock, struct udp_msg *msgs, int n)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+send_to_from_batch(int sock, struct udp_msg *msgs, int n)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 #endif /* HAVE_PKTINFO_SUPPORT && CMSG_SPACE */
@@ -55,4 +55,30 @@ send_to_from(int sock, void *buf, size_t len, int flags,
              const struct sockaddr *to, socklen_t tolen, struct sockaddr *from,
              socklen_t fromlen, aux_addressing_info *auxaddr);
 
+/* The most messages recv_from_to_batch() or send_to_from_batch() will handle
+ * in one call. */
+#define UDP_MAX_BATCH 64
+
+/* A message for recv_from_to_batch() or send_to_from_batch(). */
+struct udp_msg {
+    void *buf;
+    size_t len;
+    struct sockaddr *remote;    /* peer address */
+    socklen_t remote_len;
+    struct sockaddr *local;     /* local address, if known */
+    socklen_t local_len;
+    aux_addressing_info *auxaddr;
+};
+
+/*
+ * Receive or send up to UDP_MAX_BATCH messages with one system call.  These
+ * return -1 with errno set to ENOSYS if the platform does not support batched
+ * datagram I/O, in which case recv_from_to() and send_to_from() must be used.
+ */
+int
+recv_from_to_batch(int sock, struct udp_msg *msgs, int n);
+
+int
+send_to_from_batch(int sock, struct udp_msg *msgs, int n);
+
 #endif /* UDPPKTINFO_H */
@@ -38,6 +38,11 @@
 #include <syslog.h>
 #include <stdarg.h>
 
+#if defined(HAVE_PTHREAD) && defined(__GNUC__)
+#include <pthread.h>
+#define ASYNC_LOG
+#endif
+
 #define KRB5_KLOG_MAX_ERRMSG_SIZE       2048
 #ifndef MAXHOSTNAMELEN
 #define MAXHOSTNAMELEN  256
@@ -64,6 +69,8 @@
 #define log_notice_string       _("Notice")
 #define log_info_string         _("info")
 #define log_debug_string        _("debug")
+#define log_dropped_string      _("%lu log messages discarded because the " \
+                                  "log queue was full")
 
 /*
  * Output logging.
@@ -138,6 +145,7 @@ struct log_control {
     char                *log_hostname;
     krb5_boolean        log_opened;
     krb5_boolean        log_debug;
+    int                 log_queue_size;
 };
 
 static struct log_control log_control = {
@@ -149,6 +157,14 @@ static struct log_control log_control = {
 };
 static struct log_entry def_log_entry;
 
+/* Protects log output and log_control file handles, since the KDC may log
+ * from request threads. */
+static k5_mutex_t log_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+
+#ifdef ASYNC_LOG
+static void stop_writer(void);
+#endif
+
 /*
  * These macros define any special processing that needs to happen for
  * devices.  For unix, of course, this is hardly anything.
@@ -253,6 +269,7 @@ klog_com_err_proc(const char *whoami, long int code, const char *format, va_list
      * Now that we have the message formatted, perform the output to each
      * logging specification.
      */
+    k5_mutex_lock(&log_lock);
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
         /* Omit messages marked as LOG_DEBUG for non-syslog outputs unless we
          * are configured to include them. */
@@ -309,6 +326,7 @@ klog_com_err_proc(const char *whoami, long int code, const char *format, va_list
             break;
         }
     }
+    k5_mutex_unlock(&log_lock);
 }
 
 /*
@@ -341,7 +359,7 @@ krb5_klog_init(krb5_context kcontext, char *ename, char *whoami, krb5_boolean do
     int         i, ngood, fd, append;
     char        *cp, *cp2;
     char        savec = '\0';
-    int         error, debug;
+    int         error, debug, queue_size;
     int         do_openlog, log_facility;
     FILE        *f = NULL;
 
@@ -349,6 +367,10 @@ krb5_klog_init(krb5_context kcontext, char *ename, char *whoami, krb5_boolean do
     do_openlog = 0;
     log_facility = 0;
 
+    error = k5_mutex_finish_init(&log_lock);
+    if (error)
+        return error;
+
     err_context = kcontext;
 
     /* Look up [logging]->debug in the profile to see if we should include
@@ -357,6 +379,12 @@ krb5_klog_init(krb5_context kcontext, char *ename, char *whoami, krb5_boolean do
                              KRB5_CONF_DEBUG, NULL, 0, &debug))
         log_control.log_debug = debug;
 
+    /* Look up [logging]->queue_size to see how many messages may be queued
+     * for a writer thread, if the caller starts one.  Default to zero. */
+    if (!profile_get_integer(kcontext->profile, KRB5_CONF_LOGGING,
+                             KRB5_CONF_QUEUE_SIZE, NULL, 0, &queue_size))
+        log_control.log_queue_size = queue_size;
+
     /*
      * Look up [logging]-><ename> in the profile.  If that doesn't
      * succeed, then look for [logging]->default.
@@ -670,6 +698,9 @@ krb5_klog_close(krb5_context kcontext)
 {
     int lindex;
     (void) reset_com_err_hook();
+#ifdef ASYNC_LOG
+    stop_writer();
+#endif
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
         switch (log_control.log_entries[lindex].log_type) {
         case K_LOG_FILE:
@@ -752,27 +783,30 @@ severity2string(int severity)
 }
 
 /*
- * krb5_klog_syslog()   - Simulate the calling sequence of syslog(3), while
- *                        also performing the logging redirection as specified
- *                        by krb5_klog_init().
+ * Format a syslog-esque message into outbuf, and set *syslogp to the position
+ * of the message text after the header.  Return -1 if the date cannot be
+ * formatted.
  */
 static int
-klog_vsyslog(int priority, const char *format, va_list arglist)
+klog_format(char *outbuf, size_t len, int priority, char **syslogp,
+            const char *format, va_list arglist)
 #if !defined(__cplusplus) && (__GNUC__ > 2)
-    __attribute__((__format__(__printf__, 2, 0)))
+    __attribute__((__format__(__printf__, 5, 0)))
 #endif
     ;
 
 static int
-klog_vsyslog(int priority, const char *format, va_list arglist)
+klog_format(char *outbuf, size_t len, int priority, char **syslogp,
+            const char *format, va_list arglist)
 {
-    char        outbuf[KRB5_KLOG_MAX_ERRMSG_SIZE];
-    int         lindex;
-    char        *syslogp;
     char        *cp;
     time_t      now;
 #ifdef  HAVE_STRFTIME
     size_t      soff;
+    struct tm   *tm;
+#ifdef  HAVE_LOCALTIME_R
+    struct tm   tmbuf;
+#endif  /* HAVE_LOCALTIME_R */
 #endif  /* HAVE_STRFTIME */
 
     /*
@@ -790,7 +824,12 @@ klog_vsyslog(int priority, const char *format, va_list arglist)
     /*
      * Format the date: mon dd hh:mm:ss
      */
-    soff = strftime(outbuf, sizeof(outbuf), "%b %d %H:%M:%S", localtime(&now));
+#ifdef  HAVE_LOCALTIME_R
+    tm = localtime_r(&now, &tmbuf);
+#else   /* HAVE_LOCALTIME_R */
+    tm = localtime(&now);
+#endif  /* HAVE_LOCALTIME_R */
+    soff = (tm != NULL) ? strftime(outbuf, len, "%b %d %H:%M:%S", tm) : 0;
     if (soff > 0)
         cp += soff;
     else
@@ -806,18 +845,29 @@ klog_vsyslog(int priority, const char *format, va_list arglist)
     cp += 15;
 #endif  /* HAVE_STRFTIME */
 #ifdef VERBOSE_LOGS
-    snprintf(cp, sizeof(outbuf) - (cp-outbuf), " %s %s[%ld](%s): ",
+    snprintf(cp, len - (cp-outbuf), " %s %s[%ld](%s): ",
              log_control.log_hostname ? log_control.log_hostname : "",
              log_control.log_whoami ? log_control.log_whoami : "",
              (long) getpid(),
              severity2string(priority));
 #else
-    snprintf(cp, sizeof(outbuf) - (cp-outbuf), " ");
+    snprintf(cp, len - (cp-outbuf), " ");
 #endif
-    syslogp = &outbuf[strlen(outbuf)];
+    *syslogp = &outbuf[strlen(outbuf)];
 
     /* Now format the actual message */
-    vsnprintf(syslogp, sizeof(outbuf) - (syslogp - outbuf), format, arglist);
+    vsnprintf(*syslogp, len - (*syslogp - outbuf), format, arglist);
+    return(0);
+}
+
+/*
+ * Write a message formatted by klog_format() to each logging specification.
+ * The caller must hold log_lock.
+ */
+static void
+klog_write(int priority, const char *outbuf, const char *syslogp)
+{
+    int         lindex;
 
     /*
      * If the user did not use krb5_klog_init() instead of dropping
@@ -879,6 +929,287 @@ klog_vsyslog(int priority, const char *format, va_list arglist)
             break;
         }
     }
+}
+
+/* Format a message and write it immediately, regardless of whether a writer
+ * thread is running. */
+static void
+klog_write_now(int priority, const char *format, ...)
+#if !defined(__cplusplus) && (__GNUC__ > 2)
+    __attribute__((__format__(__printf__, 2, 3)))
+#endif
+    ;
+
+static void
+klog_write_now(int priority, const char *format, ...)
+{
+    char        outbuf[KRB5_KLOG_MAX_ERRMSG_SIZE];
+    char        *syslogp;
+    va_list     pvar;
+    int         ret;
+
+    va_start(pvar, format);
+    ret = klog_format(outbuf, sizeof(outbuf), priority, &syslogp, format,
+                      pvar);
+    va_end(pvar);
+    if (ret)
+        return;
+    k5_mutex_lock(&log_lock);
+    klog_write(priority, outbuf, syslogp);
+    k5_mutex_unlock(&log_lock);
+}
+
+#ifdef ASYNC_LOG
+
+/*
+ * When a writer thread is started with krb5_klog_start_async(), formatted
+ * messages are placed in a fixed-size ring of slots and written out by the
+ * writer thread, so that callers never wait for log output.  Producers claim
+ * slots with a compare-and-swap on the head counter and publish them by
+ * advancing the slot sequence number; no lock is taken unless the writer is
+ * asleep and must be woken.  If the ring is full, the message is discarded
+ * and counted, and the writer reports the count once it catches up.
+ *
+ * A slot whose sequence number equals a position p is free for the producer
+ * claiming p; a sequence number of p + 1 means the message for p is ready.
+ * After writing the message, the writer sets the sequence number to the
+ * position at which the slot will next be claimed.
+ */
+struct log_slot {
+    unsigned long seq;
+    int priority;
+    size_t msgoff;
+    char buf[KRB5_KLOG_MAX_ERRMSG_SIZE];
+};
+
+struct log_queue {
+    struct log_slot *slots;
+    unsigned long mask;
+    unsigned long head;         /* next position for producers to claim */
+    unsigned long tail;         /* next position for the writer to write */
+    unsigned long dropped;      /* messages discarded because of overflow */
+    krb5_boolean running;
+    krb5_boolean stopping;
+    int sleeping;
+    pthread_t writer;
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+};
+
+static struct log_queue log_queue;
+
+static inline unsigned long
+atomic_get(unsigned long *p)
+{
+    return __sync_fetch_and_add(p, 0);
+}
+
+static inline void
+atomic_set(unsigned long *p, unsigned long val)
+{
+    __sync_synchronize();
+    *(volatile unsigned long *)p = val;
+    __sync_synchronize();
+}
+
+/* Place a formatted message in the queue, or count it as dropped if the queue
+ * is full. */
+static void
+queue_message(int priority, const char *outbuf, const char *syslogp)
+{
+    struct log_slot *slot;
+    unsigned long pos, seq;
+
+    pos = atomic_get(&log_queue.head);
+    for (;;) {
+        slot = &log_queue.slots[pos & log_queue.mask];
+        seq = atomic_get(&slot->seq);
+        if (seq == pos) {
+            if (__sync_bool_compare_and_swap(&log_queue.head, pos, pos + 1))
+                break;
+        } else if ((long)(seq - pos) < 0) {
+            /* The writer has not yet freed this slot. */
+            (void)__sync_fetch_and_add(&log_queue.dropped, 1);
+            return;
+        }
+        pos = atomic_get(&log_queue.head);
+    }
+
+    slot->priority = priority;
+    slot->msgoff = syslogp - outbuf;
+    strlcpy(slot->buf, outbuf, sizeof(slot->buf));
+    atomic_set(&slot->seq, pos + 1);
+
+    /* The full barrier in atomic_set() orders the publication above against
+     * this check, so the writer cannot miss the message while going to
+     * sleep. */
+    if (*(volatile int *)&log_queue.sleeping) {
+        pthread_mutex_lock(&log_queue.wait_lock);
+        pthread_cond_signal(&log_queue.wait_cond);
+        pthread_mutex_unlock(&log_queue.wait_lock);
+    }
+}
+
+/* Return the next slot for the writer if its message is ready. */
+static struct log_slot *
+ready_slot(void)
+{
+    struct log_slot *slot;
+
+    slot = &log_queue.slots[log_queue.tail & log_queue.mask];
+    return (atomic_get(&slot->seq) == log_queue.tail + 1) ? slot : NULL;
+}
+
+static void *
+log_writer_main(void *arg)
+{
+    struct log_slot *slot;
+    unsigned long n, dropped, reported = 0;
+
+    for (;;) {
+        /* Write the ready messages, up to one ring's worth at a time so
+         * that overflows are reported during a sustained burst. */
+        k5_mutex_lock(&log_lock);
+        for (n = 0; n <= log_queue.mask && (slot = ready_slot()) != NULL;
+             n++) {
+            klog_write(slot->priority, slot->buf, slot->buf + slot->msgoff);
+            atomic_set(&slot->seq, log_queue.tail + log_queue.mask + 1);
+            log_queue.tail++;
+        }
+        k5_mutex_unlock(&log_lock);
+
+        dropped = atomic_get(&log_queue.dropped);
+        if (dropped != reported) {
+            klog_write_now(LOG_WARNING, log_dropped_string,
+                           dropped - reported);
+            reported = dropped;
+        }
+        if (n > 0)
+            continue;
+
+        pthread_mutex_lock(&log_queue.wait_lock);
+        log_queue.sleeping = 1;
+        __sync_synchronize();
+        if (ready_slot() == NULL && !log_queue.stopping)
+            pthread_cond_wait(&log_queue.wait_cond, &log_queue.wait_lock);
+        log_queue.sleeping = 0;
+        if (ready_slot() == NULL && log_queue.stopping) {
+            pthread_mutex_unlock(&log_queue.wait_lock);
+            break;
+        }
+        pthread_mutex_unlock(&log_queue.wait_lock);
+    }
+    return NULL;
+}
+
+/* Stop the writer thread after it writes any queued messages. */
+static void
+stop_writer(void)
+{
+    if (!log_queue.running)
+        return;
+    log_queue.running = FALSE;
+    pthread_mutex_lock(&log_queue.wait_lock);
+    log_queue.stopping = TRUE;
+    pthread_cond_signal(&log_queue.wait_cond);
+    pthread_mutex_unlock(&log_queue.wait_lock);
+    pthread_join(log_queue.writer, NULL);
+    pthread_cond_destroy(&log_queue.wait_cond);
+    pthread_mutex_destroy(&log_queue.wait_lock);
+    free(log_queue.slots);
+    log_queue.slots = NULL;
+}
+
+#endif /* ASYNC_LOG */
+
+/*
+ * krb5_klog_start_async() - Start a thread to write log messages, if
+ *                           [logging]->queue_size is set.  Since threads do
+ *                           not survive fork(), this should be called after
+ *                           the process has daemonized.
+ */
+krb5_error_code
+krb5_klog_start_async(krb5_context kcontext)
+{
+#ifdef ASYNC_LOG
+    unsigned long i, nslots;
+    int ret;
+
+    if (log_control.log_queue_size <= 0 || log_queue.running)
+        return 0;
+
+    /* Use a power of two so that positions map to slots with a mask. */
+    for (nslots = 1; nslots < (unsigned long)log_control.log_queue_size;
+         nslots <<= 1);
+    log_queue.slots = calloc(nslots, sizeof(*log_queue.slots));
+    if (log_queue.slots == NULL)
+        return ENOMEM;
+    for (i = 0; i < nslots; i++)
+        log_queue.slots[i].seq = i;
+    log_queue.mask = nslots - 1;
+    log_queue.head = log_queue.tail = log_queue.dropped = 0;
+    log_queue.stopping = FALSE;
+    log_queue.sleeping = 0;
+
+    ret = pthread_mutex_init(&log_queue.wait_lock, NULL);
+    if (ret)
+        goto error;
+    ret = pthread_cond_init(&log_queue.wait_cond, NULL);
+    if (ret) {
+        pthread_mutex_destroy(&log_queue.wait_lock);
+        goto error;
+    }
+    ret = pthread_create(&log_queue.writer, NULL, log_writer_main, NULL);
+    if (ret) {
+        pthread_cond_destroy(&log_queue.wait_cond);
+        pthread_mutex_destroy(&log_queue.wait_lock);
+        goto error;
+    }
+    log_queue.running = TRUE;
+    return 0;
+
+error:
+    free(log_queue.slots);
+    log_queue.slots = NULL;
+    return ret;
+#else
+    /* Without threads, messages are always written synchronously. */
+    return 0;
+#endif
+}
+
+/*
+ * krb5_klog_syslog()   - Simulate the calling sequence of syslog(3), while
+ *                        also performing the logging redirection as specified
+ *                        by krb5_klog_init().
+ */
+static int
+klog_vsyslog(int priority, const char *format, va_list arglist)
+#if !defined(__cplusplus) && (__GNUC__ > 2)
+    __attribute__((__format__(__printf__, 2, 0)))
+#endif
+    ;
+
+static int
+klog_vsyslog(int priority, const char *format, va_list arglist)
+{
+    char        outbuf[KRB5_KLOG_MAX_ERRMSG_SIZE];
+    char        *syslogp;
+
+    if (klog_format(outbuf, sizeof(outbuf), priority, &syslogp, format,
+                    arglist))
+        return(-1);
+
+#ifdef ASYNC_LOG
+    if (log_queue.running) {
+        queue_message(priority, outbuf, syslogp);
+        return(0);
+    }
+#endif
+
+    k5_mutex_lock(&log_lock);
+    klog_write(priority, outbuf, syslogp);
+    k5_mutex_unlock(&log_lock);
     return(0);
 }
 
@@ -911,6 +1242,7 @@ krb5_klog_reopen(krb5_context kcontext)
      * Only logs which are actually files need to be closed
      * and reopened in response to a SIGHUP
      */
+    k5_mutex_lock(&log_lock);
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
         if (log_control.log_entries[lindex].log_type == K_LOG_FILE) {
             fclose(log_control.log_entries[lindex].lfu_filep);
@@ -929,4 +1261,5 @@ krb5_klog_reopen(krb5_context kcontext)
             }
         }
     }
+    k5_mutex_unlock(&log_lock);
 }
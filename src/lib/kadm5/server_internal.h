@@ -100,6 +100,46 @@ krb5_error_code     kdb_iter_entry(kadm5_server_handle_t handle,
                                    void (*iter_fct)(void *, krb5_principal),
                                    void *data);
 
+/* Default principal lockout for KDB modules (svr_lockout.c) */
+typedef krb5_error_code
+(*kdb_lockout_get_policy_fn)(krb5_context context, char *name,
+                             osa_policy_ent_t *policy);
+
+/* Changes made to an entry by kdb_lockout_update(). */
+#define KDB_LOCKOUT_LAST_SUCCESS        0x1 /* last_success was set */
+#define KDB_LOCKOUT_FAILURES            0x2 /* a failure was counted */
+#define KDB_LOCKOUT_RESET               0x4 /* the failure count was cleared */
+#define KDB_LOCKOUT_RESTART             0x8 /* earlier failures expired */
+
+/* Get the lockout parameters of entry's policy using get_policy, or zeros if
+ * entry has no policy. */
+krb5_error_code     kdb_lockout_policy(krb5_context context,
+                                       krb5_db_entry *entry,
+                                       kdb_lockout_get_policy_fn get_policy,
+                                       krb5_kvno *pw_max_fail,
+                                       krb5_deltat *pw_failcnt_interval,
+                                       krb5_deltat *pw_lockout_duration);
+
+/* Return true if entry is locked out at time stamp. */
+krb5_boolean        kdb_lockout_locked(krb5_context context,
+                                       krb5_timestamp stamp,
+                                       krb5_kvno max_fail,
+                                       krb5_deltat lockout_duration,
+                                       krb5_db_entry *entry);
+
+/* Return true if an AS request with the result status affects lockout. */
+krb5_boolean        kdb_lockout_audited(krb5_error_code status);
+
+/* Update the lockout fields of entry for an AS request with the result status
+ * at time stamp, and return the KDB_LOCKOUT_* flags for the changes made. */
+int                 kdb_lockout_update(krb5_context context,
+                                       krb5_db_entry *entry,
+                                       krb5_timestamp stamp,
+                                       krb5_error_code status,
+                                       krb5_deltat failcnt_interval,
+                                       krb5_boolean disable_lockout,
+                                       krb5_boolean disable_last_success);
+
 kadm5_ret_t         init_pwqual(kadm5_server_handle_t handle);
 void                destroy_pwqual(kadm5_server_handle_t handle);
 
@@ -0,0 +1,170 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/kadm5/srv/svr_lockout.c - Default principal lockout for KDB modules */
+/*
+ * Copyright (C) 2009 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+/*
+ * Helper routines for database modules which store the lockout fields of
+ * principal entries themselves and wish to use the default principal lockout
+ * functionality.  The module supplies the policy lookup and writes back the
+ * entries these routines update.
+ */
+
+#include "k5-int.h"
+#include "server_internal.h"
+
+krb5_error_code
+kdb_lockout_policy(krb5_context context, krb5_db_entry *entry,
+                   kdb_lockout_get_policy_fn get_policy,
+                   krb5_kvno *pw_max_fail, krb5_deltat *pw_failcnt_interval,
+                   krb5_deltat *pw_lockout_duration)
+{
+    krb5_tl_data tl_data;
+    krb5_error_code code;
+    osa_princ_ent_rec adb;
+    XDR xdrs;
+
+    *pw_max_fail = 0;
+    *pw_failcnt_interval = 0;
+    *pw_lockout_duration = 0;
+
+    tl_data.tl_data_type = KRB5_TL_KADM_DATA;
+
+    code = krb5_dbe_lookup_tl_data(context, entry, &tl_data);
+    if (code != 0 || tl_data.tl_data_length == 0)
+        return code;
+
+    memset(&adb, 0, sizeof(adb));
+    xdrmem_create(&xdrs, (char *)tl_data.tl_data_contents,
+                  tl_data.tl_data_length, XDR_DECODE);
+    if (!xdr_osa_princ_ent_rec(&xdrs, &adb)) {
+        xdr_destroy(&xdrs);
+        return KADM5_XDR_FAILURE;
+    }
+
+    if (adb.policy != NULL) {
+        osa_policy_ent_t policy = NULL;
+
+        code = get_policy(context, adb.policy, &policy);
+        if (code == 0) {
+            *pw_max_fail = policy->pw_max_fail;
+            *pw_failcnt_interval = policy->pw_failcnt_interval;
+            *pw_lockout_duration = policy->pw_lockout_duration;
+            krb5_db_free_policy(context, policy);
+        }
+    }
+
+    xdr_destroy(&xdrs);
+
+    xdrmem_create(&xdrs, NULL, 0, XDR_FREE);
+    xdr_osa_princ_ent_rec(&xdrs, &adb);
+    xdr_destroy(&xdrs);
+
+    return 0;
+}
+
+/* draft-behera-ldap-password-policy-10.txt 7.1 */
+krb5_boolean
+kdb_lockout_locked(krb5_context context, krb5_timestamp stamp,
+                   krb5_kvno max_fail, krb5_deltat lockout_duration,
+                   krb5_db_entry *entry)
+{
+    krb5_timestamp unlock_time;
+
+    /* If the entry was unlocked since the last failure, it's not locked. */
+    if (krb5_dbe_lookup_last_admin_unlock(context, entry, &unlock_time) == 0 &&
+        entry->last_failed <= unlock_time)
+        return FALSE;
+
+    if (max_fail == 0 || entry->fail_auth_count < max_fail)
+        return FALSE;
+
+    if (lockout_duration == 0)
+        return TRUE; /* principal permanently locked */
+
+    return (stamp < entry->last_failed + lockout_duration);
+}
+
+krb5_boolean
+kdb_lockout_audited(krb5_error_code status)
+{
+    switch (status) {
+    case 0:
+    case KRB5KDC_ERR_PREAUTH_FAILED:
+    case KRB5KRB_AP_ERR_BAD_INTEGRITY:
+        return TRUE;
+#if 0
+    case KRB5KDC_ERR_CLIENT_REVOKED:
+        return TRUE;
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+int
+kdb_lockout_update(krb5_context context, krb5_db_entry *entry,
+                   krb5_timestamp stamp, krb5_error_code status,
+                   krb5_deltat failcnt_interval, krb5_boolean disable_lockout,
+                   krb5_boolean disable_last_success)
+{
+    krb5_timestamp unlock_time;
+    int mask = 0;
+
+    /* Only mark the authentication as successful if the entry
+     * required preauthentication, otherwise we have no idea. */
+    if (status == 0 && (entry->attributes & KRB5_KDB_REQUIRES_PRE_AUTH)) {
+        if (!disable_lockout && entry->fail_auth_count != 0) {
+            entry->fail_auth_count = 0;
+            mask |= KDB_LOCKOUT_RESET;
+        }
+        if (!disable_last_success) {
+            entry->last_success = stamp;
+            mask |= KDB_LOCKOUT_LAST_SUCCESS;
+        }
+    } else if (!disable_lockout &&
+               (status == KRB5KDC_ERR_PREAUTH_FAILED ||
+                status == KRB5KRB_AP_ERR_BAD_INTEGRITY)) {
+        if (krb5_dbe_lookup_last_admin_unlock(context, entry,
+                                              &unlock_time) == 0 &&
+            entry->last_failed <= unlock_time) {
+            /* Reset fail_auth_count after administrative unlock. */
+            entry->fail_auth_count = 0;
+            mask |= KDB_LOCKOUT_RESTART;
+        }
+
+        if (failcnt_interval != 0 &&
+            stamp > entry->last_failed + failcnt_interval) {
+            /* Reset fail_auth_count after failcnt_interval. */
+            entry->fail_auth_count = 0;
+            mask |= KDB_LOCKOUT_RESTART;
+        }
+
+        entry->last_failed = stamp;
+        entry->fail_auth_count++;
+        mask |= KDB_LOCKOUT_FAILURES;
+    }
+
+    return mask;
+}
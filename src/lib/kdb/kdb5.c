@@ -433,7 +433,13 @@ kdb_load_library(krb5_context kcontext, char *lib_name, db_library *lib)
         goto clean_n_exit;
     }
 
-    memcpy(&(*lib)->vftabl, vftabl_addrs[0], sizeof(kdb_vftabl));
+    /* Only copy the methods of the minor versions the module knows about. */
+    if (((kdb_vftabl *)vftabl_addrs[0])->min_ver >= 1) {
+        memcpy(&(*lib)->vftabl, vftabl_addrs[0], sizeof(kdb_vftabl));
+    } else {
+        memcpy(&(*lib)->vftabl, vftabl_addrs[0],
+               offsetof(kdb_vftabl, get_principal_async));
+    }
     kdb_setup_opt_functions(*lib);
 
     if ((status = (*lib)->vftabl.init_library()))
@@ -768,6 +774,54 @@ krb5_db_get_principal(krb5_context kcontext, krb5_const_principal search_for,
     return 0;
 }
 
+struct get_principal_async_state {
+    krb5_db_get_principal_cb respond;
+    void *arg;
+};
+
+static void
+get_principal_async_done(krb5_context kcontext, void *arg,
+                         krb5_error_code code, krb5_db_entry *entry)
+{
+    struct get_principal_async_state *state = arg;
+    krb5_db_get_principal_cb respond = state->respond;
+    void *respond_arg = state->arg;
+
+    free(state);
+    if (code == 0 && entry->key_data != NULL)
+        krb5_dbe_sort_key_data(entry->key_data, entry->n_key_data);
+    (*respond)(kcontext, respond_arg, code, code ? NULL : entry);
+}
+
+void
+krb5_db_get_principal_async(krb5_context kcontext, struct verto_ctx *vctx,
+                            krb5_const_principal search_for,
+                            unsigned int flags,
+                            krb5_db_get_principal_cb respond, void *arg)
+{
+    krb5_error_code status;
+    kdb_vftabl *v;
+    krb5_db_entry *entry = NULL;
+    struct get_principal_async_state *state;
+
+    status = get_vftabl(kcontext, &v);
+    if (status == 0 && v->get_principal_async != NULL) {
+        state = k5alloc(sizeof(*state), &status);
+        if (state != NULL) {
+            state->respond = respond;
+            state->arg = arg;
+            v->get_principal_async(kcontext, vctx, search_for, flags,
+                                   get_principal_async_done, state);
+            return;
+        }
+    }
+
+    /* Fall back to a synchronous lookup. */
+    if (status == 0)
+        status = krb5_db_get_principal(kcontext, search_for, flags, &entry);
+    (*respond)(kcontext, arg, status, entry);
+}
+
 static void
 free_tl_data(krb5_tl_data *list)
 {
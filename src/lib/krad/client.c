@@ -111,6 +111,49 @@ get_server(krad_client *rc, const struct addrinfo *ai, const char *secret,
     return 0;
 }
 
+/* Return a rank for a remote; remotes with lower ranks are tried first.
+ * Remotes which have answered come before remotes which haven't been used,
+ * and remotes which have recently timed out come last. */
+static int
+remote_rank(krad_remote *rr, time_t currtime)
+{
+    if (kr_remote_failing(rr, currtime))
+        return 2;
+    return (kr_remote_rtt(rr) < 0) ? 1 : 0;
+}
+
+/* Return true if remote a should be tried before remote b. */
+static krb5_boolean
+remote_before(krad_remote *a, krad_remote *b, time_t currtime)
+{
+    int arank = remote_rank(a, currtime), brank = remote_rank(b, currtime);
+
+    if (arank != brank)
+        return arank < brank;
+    return arank == 0 && kr_remote_rtt(a) < kr_remote_rtt(b);
+}
+
+/* Order the remotes of a request so that the quickest healthy remote is tried
+ * first, preserving the resolver's order otherwise. */
+static void
+sort_remotes(remote_state *remotes, ssize_t count)
+{
+    remote_state tmp;
+    time_t currtime;
+    ssize_t i, j;
+
+    currtime = time(NULL);
+    for (i = 1; i < count; i++) {
+        tmp = remotes[i];
+        for (j = i; j > 0; j--) {
+            if (!remote_before(tmp.remote, remotes[j - 1].remote, currtime))
+                break;
+            remotes[j] = remotes[j - 1];
+        }
+        remotes[j] = tmp;
+    }
+}
+
 /* Free a request. */
 static void
 request_free(request *req)
@@ -168,6 +211,7 @@ request_new(krad_client *rc, krad_code code, const krad_attrset *attrs,
             return retval;
         }
     }
+    sort_remotes(rqst->remotes, rqst->count);
 
     *req = rqst;
     return 0;
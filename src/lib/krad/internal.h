@@ -76,6 +76,10 @@ krb5_error_code
 kr_attrset_decode(krb5_context ctx, const krb5_data *in, const char *secret,
                   const unsigned char *auth, krad_attrset **set);
 
+/* Change the identifier of a request packet which has not yet been sent. */
+void
+kr_packet_set_id(krad_packet *pkt, unsigned char id);
+
 /* Create a new remote object which manages a socket and the state of
  * outstanding requests. */
 krb5_error_code
@@ -89,6 +93,8 @@ kr_remote_free(krad_remote *rr);
 /*
  * Send the packet to the remote. The cb will be called when a response is
  * received, the request times out, the request is canceled or an error occurs.
+ * Up to 256 packets, one per RADIUS identifier, may be outstanding to a
+ * remote at once; further packets wait until an identifier is free.
  *
  * The timeout parameter is the total timeout across all retries in
  * milliseconds.
@@ -109,6 +115,16 @@ kr_remote_send(krad_remote *rr, krad_code code, krad_attrset *attrs,
 void
 kr_remote_cancel(krad_remote *rr, const krad_packet *pkt);
 
+/* Return the smoothed round-trip time of requests to the remote in
+ * milliseconds, or -1 if no response has been received from it. */
+int
+kr_remote_rtt(const krad_remote *rr);
+
+/* Determine if a request to this remote object has timed out recently, with
+ * no response received from it since. */
+krb5_boolean
+kr_remote_failing(const krad_remote *rr, time_t now);
+
 /* Determine if this remote object refers to the remote resource identified
  * by the addrinfo struct and the secret. */
 krb5_boolean
@@ -448,6 +448,12 @@ krad_packet_decode_response(krb5_context ctx, const char *secret,
     return retval;
 }
 
+void
+kr_packet_set_id(krad_packet *pkt, unsigned char id)
+{
+    pkt_id_set(pkt, id);
+}
+
 const krb5_data *
 krad_packet_encode(const krad_packet *pkt)
 {
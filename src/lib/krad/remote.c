@@ -35,12 +35,20 @@
 #include <unistd.h>
 
 #include <sys/un.h>
+#include <sys/time.h>
 
 #define FLAGS_NONE  VERTO_EV_FLAG_NONE
 #define FLAGS_READ  VERTO_EV_FLAG_IO_READ
 #define FLAGS_WRITE VERTO_EV_FLAG_IO_WRITE
 #define FLAGS_BASE  VERTO_EV_FLAG_PERSIST | VERTO_EV_FLAG_IO_ERROR
 
+/* The number of distinct RADIUS packet identifiers. */
+#define ID_COUNT (UCHAR_MAX + 1)
+
+/* How long, in seconds, a remote is passed over after a request to it times
+ * out. */
+#define FAILED_HOLD 30
+
 K5_TAILQ_HEAD(request_head, request_st);
 
 typedef struct request_st request;
@@ -54,6 +62,9 @@ struct request_st {
     int timeout;
     size_t retries;
     size_t sent;
+    int64_t sent_ms;            /* When the packet was last sent. */
+    krb5_boolean resent;        /* Whether the packet has been retried. */
+    krb5_boolean queued;        /* Whether the packet is waiting for an ID. */
 };
 
 struct krad_remote_st {
@@ -64,6 +75,14 @@ struct krad_remote_st {
     char *secret;
     struct addrinfo *info;
     struct request_head list;
+    struct request_head queue;
+    request *ids[ID_COUNT];
+    size_t nids;
+    /* The ID_COUNT - nids unused IDs, in a ring starting at free_head. */
+    unsigned char free_ids[ID_COUNT];
+    size_t free_head;
+    int srtt;
+    time_t failed;
     char buffer_[KRAD_PACKET_SIZE_MAX];
     krb5_data buffer;
 };
@@ -74,19 +93,75 @@ on_io(verto_ctx *ctx, verto_ev *ev);
 static void
 on_timeout(verto_ctx *ctx, verto_ev *ev);
 
-/* Iterate over the set of outstanding packets. */
+static void
+remote_dequeue(krad_remote *rr);
+
+/* Iterate over a single outstanding packet. */
 static const krad_packet *
-iterator(request **out)
+iterator_one(request **out)
 {
     request *tmp = *out;
 
     if (tmp == NULL)
         return NULL;
 
-    *out = K5_TAILQ_NEXT(tmp, list);
+    *out = NULL;
     return tmp->request;
 }
 
+/* Return the current time in milliseconds. */
+static int64_t
+get_time_ms(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) != 0)
+        return 0;
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Return the identifier of a packet. */
+static inline unsigned char
+packet_id(const krad_packet *pkt)
+{
+    return krad_packet_encode(pkt)->data[1];
+}
+
+/* Fill the ring of unused packet IDs with a random permutation, so that the
+ * IDs a remote uses are not predictable. */
+static krb5_error_code
+init_free_ids(krad_remote *rr)
+{
+    krb5_error_code retval;
+    unsigned char rnd[ID_COUNT], t;
+    krb5_data rdata = make_data(rnd, sizeof(rnd));
+    int i, j;
+
+    retval = krb5_c_random_make_octets(rr->kctx, &rdata);
+    if (retval != 0)
+        return retval;
+
+    for (i = 0; i < ID_COUNT; i++)
+        rr->free_ids[i] = i;
+    for (i = ID_COUNT - 1; i > 0; i--) {
+        j = rnd[i] % (i + 1);
+        t = rr->free_ids[i];
+        rr->free_ids[i] = rr->free_ids[j];
+        rr->free_ids[j] = t;
+    }
+    rr->free_head = 0;
+    return 0;
+}
+
+/* Return a packet ID to the end of the ring of unused IDs. */
+static void
+remote_release_id(krad_remote *rr, unsigned char id)
+{
+    rr->ids[id] = NULL;
+    rr->free_ids[(rr->free_head + ID_COUNT - rr->nids) % ID_COUNT] = id;
+    rr->nids--;
+}
+
 /* Create a new request. */
 static krb5_error_code
 request_new(krad_remote *rr, krad_packet *rqst, int timeout, size_t retries,
@@ -109,13 +184,40 @@ request_new(krad_remote *rr, krad_packet *rqst, int timeout, size_t retries,
     return 0;
 }
 
+/* Add a request holding a packet ID to the outstanding list. */
+static void
+request_insert(krad_remote *rr, request *req)
+{
+    rr->ids[packet_id(req->request)] = req;
+    rr->nids++;
+    K5_TAILQ_INSERT_TAIL(&rr->list, req, list);
+}
+
+/* Remove a request from the outstanding list or the queue, releasing its
+ * packet ID if it holds one. */
+static void
+request_remove(request *req)
+{
+    krad_remote *rr = req->rr;
+
+    if (req->queued) {
+        K5_TAILQ_REMOVE(&rr->queue, req, list);
+        return;
+    }
+
+    remote_release_id(rr, packet_id(req->request));
+    K5_TAILQ_REMOVE(&rr->list, req, list);
+}
+
 /* Finish a request, calling the callback and freeing it. */
 static inline void
 request_finish(request *req, krb5_error_code retval,
                const krad_packet *response)
 {
+    krad_remote *rr = req->rr;
+
     if (retval != ETIMEDOUT)
-        K5_TAILQ_REMOVE(&req->rr->list, req, list);
+        request_remove(req);
 
     req->cb(retval, req->request, response, req->data);
 
@@ -123,6 +225,7 @@ request_finish(request *req, krb5_error_code retval,
         krad_packet_free(req->request);
         verto_del(req->timer);
         free(req);
+        remote_dequeue(rr);
     }
 }
 
@@ -215,6 +318,41 @@ remote_del_flags(krad_remote *remote, verto_ev_flag flags)
     verto_set_flags(remote->io, FLAGS_BASE | flags);
 }
 
+/* Take the least recently used of the unused packet IDs.  The caller must
+ * ensure that one exists, and must add a request with the ID using
+ * request_insert(). */
+static unsigned char
+remote_free_id(krad_remote *rr)
+{
+    unsigned char id = rr->free_ids[rr->free_head];
+
+    rr->free_head = (rr->free_head + 1) % ID_COUNT;
+    return id;
+}
+
+/* Give packet IDs to queued requests while there are unused IDs, and schedule
+ * the requests to be sent. */
+static void
+remote_dequeue(krad_remote *rr)
+{
+    krb5_error_code retval;
+    request *r;
+
+    while (!K5_TAILQ_EMPTY(&rr->queue) && rr->nids < ID_COUNT) {
+        r = K5_TAILQ_FIRST(&rr->queue);
+        K5_TAILQ_REMOVE(&rr->queue, r, list);
+        r->queued = FALSE;
+        kr_packet_set_id(r->request, remote_free_id(rr));
+        request_insert(rr, r);
+
+        retval = remote_add_flags(rr, FLAGS_WRITE);
+        if (retval != 0) {
+            request_finish(r, retval, NULL);
+            return;
+        }
+    }
+}
+
 /* Close the connection and start the timers of all outstanding requests. */
 static void
 remote_shutdown(krad_remote *rr)
@@ -246,15 +384,21 @@ on_timeout(verto_ctx *ctx, verto_ev *ev)
     /* If we have more retries to perform, resend the packet. */
     if (req->retries-- > 0) {
         req->sent = 0;
+        req->resent = TRUE;
         retval = remote_add_flags(req->rr, FLAGS_WRITE);
         if (retval == 0)
             return;
     }
 
+    /* Pass over this remote for a while in favor of others. */
+    if (retval == ETIMEDOUT)
+        req->rr->failed = time(NULL);
+
     request_finish(req, retval, NULL);
 }
 
-/* Write data to the socket. */
+/* Write data to the socket, sending as many unsent packets as the socket will
+ * take. */
 static void
 on_io_write(krad_remote *rr)
 {
@@ -283,21 +427,22 @@ on_io_write(krad_remote *rr)
             return;
         }
 
-        /* If the packet was completely sent, set a timeout. */
+        /* If the packet was only partially sent, finish it next time. */
         r->sent += written;
-        if (r->sent == tmp->length) {
-            if (request_start_timer(r, rr->vctx) != 0) {
-                request_finish(r, ENOMEM, NULL);
-                return;
-            }
+        if (r->sent != tmp->length)
+            return;
 
-            if (remote_add_flags(rr, FLAGS_READ) != 0) {
-                remote_shutdown(rr);
-                return;
-            }
+        /* The packet was completely sent, so set a timeout. */
+        r->sent_ms = get_time_ms();
+        if (request_start_timer(r, rr->vctx) != 0) {
+            request_finish(r, ENOMEM, NULL);
+            return;
         }
 
-        return;
+        if (remote_add_flags(rr, FLAGS_READ) != 0) {
+            remote_shutdown(rr);
+            return;
+        }
     }
 
     remote_del_flags(rr, FLAGS_WRITE);
@@ -313,7 +458,7 @@ on_io_read(krad_remote *rr)
     krb5_error_code retval;
     ssize_t pktlen;
     request *tmp, *r;
-    int i;
+    int i, rtt;
 
     pktlen = sizeof(rr->buffer_) - rr->buffer.length;
     if (rr->info->ai_socktype == SOCK_STREAM) {
@@ -346,24 +491,28 @@ on_io_read(krad_remote *rr)
     if (rr->info->ai_socktype == SOCK_STREAM && pktlen > 0)
         return;
 
-    /* Decode the packet. */
-    tmp = K5_TAILQ_FIRST(&rr->list);
+    /* Decode the packet, checking it against the outstanding request with the
+     * same identifier. */
+    r = (rr->buffer.length > 1) ?
+        rr->ids[(unsigned char)rr->buffer.data[1]] : NULL;
+    tmp = r;
     retval = krad_packet_decode_response(rr->kctx, rr->secret, &rr->buffer,
-                                         (krad_packet_iter_cb)iterator, &tmp,
-                                         &req, &rsp);
+                                         (krad_packet_iter_cb)iterator_one,
+                                         &tmp, &req, &rsp);
     rr->buffer.length = 0;
     if (retval != 0)
         return;
 
-    /* Match the response with an outstanding request. */
-    if (req != NULL) {
-        K5_TAILQ_FOREACH(r, &rr->list, list) {
-            if (r->request == req &&
-                r->sent == krad_packet_encode(req)->length) {
-                request_finish(r, 0, rsp);
-                break;
-            }
+    /* Match the response with the outstanding request. */
+    if (req != NULL && r->sent == krad_packet_encode(req)->length) {
+        /* Only sample the round-trip time of packets sent once, since we
+         * can't tell which transmission a retried packet's response is for. */
+        if (!r->resent) {
+            rtt = (int)(get_time_ms() - r->sent_ms);
+            rr->srtt = (rr->srtt < 0) ? rtt : (7 * rr->srtt + rtt) / 8;
         }
+        rr->failed = 0;
+        request_finish(r, 0, rsp);
     }
 
     krad_packet_free(rsp);
@@ -397,8 +546,15 @@ kr_remote_new(krb5_context kctx, verto_ctx *vctx, const struct addrinfo *info,
     tmp->vctx = vctx;
     tmp->buffer = make_data(tmp->buffer_, 0);
     K5_TAILQ_INIT(&tmp->list);
+    K5_TAILQ_INIT(&tmp->queue);
     tmp->fd = -1;
+    tmp->srtt = -1;
 
+    retval = init_free_ids(tmp);
+    if (retval != 0)
+        goto error;
+
+    retval = ENOMEM;
     tmp->secret = strdup(secret);
     if (tmp->secret == NULL)
         goto error;
@@ -427,6 +583,10 @@ kr_remote_free(krad_remote *rr)
     if (rr == NULL)
         return;
 
+    /* Cancel queued requests first, so that finishing outstanding requests
+     * doesn't send them. */
+    while (!K5_TAILQ_EMPTY(&rr->queue))
+        request_finish(K5_TAILQ_FIRST(&rr->queue), ECANCELED, NULL);
     while (!K5_TAILQ_EMPTY(&rr->list))
         request_finish(K5_TAILQ_FIRST(&rr->list), ECANCELED, NULL);
 
@@ -450,9 +610,10 @@ kr_remote_send(krad_remote *rr, krad_code code, krad_attrset *attrs,
     if (rr->info->ai_socktype == SOCK_STREAM)
         retries = 0;
 
-    r = K5_TAILQ_FIRST(&rr->list);
+    /* The packet is given its ID by remote_free_id() below, or when it is
+     * dequeued if every packet ID is in use. */
     retval = krad_packet_new_request(rr->kctx, rr->secret, code, attrs,
-                                     (krad_packet_iter_cb)iterator, &r, &tmp);
+                                     NULL, NULL, &tmp);
     if (retval != 0)
         goto error;
 
@@ -468,11 +629,19 @@ kr_remote_send(krad_remote *rr, krad_code code, krad_attrset *attrs,
     if (retval != 0)
         goto error;
 
-    retval = remote_add_flags(rr, FLAGS_WRITE);
-    if (retval != 0)
-        goto error;
+    if (rr->nids < ID_COUNT) {
+        retval = remote_add_flags(rr, FLAGS_WRITE);
+        if (retval != 0) {
+            free(r);
+            goto error;
+        }
+        kr_packet_set_id(tmp, remote_free_id(rr));
+        request_insert(rr, r);
+    } else {
+        r->queued = TRUE;
+        K5_TAILQ_INSERT_TAIL(&rr->queue, r, list);
+    }
 
-    K5_TAILQ_INSERT_TAIL(&rr->list, r, list);
     if (pkt != NULL)
         *pkt = tmp;
     return 0;
@@ -493,6 +662,25 @@ kr_remote_cancel(krad_remote *rr, const krad_packet *pkt)
             return;
         }
     }
+
+    K5_TAILQ_FOREACH(r, &rr->queue, list) {
+        if (r->request == pkt) {
+            request_finish(r, ECANCELED, NULL);
+            return;
+        }
+    }
+}
+
+int
+kr_remote_rtt(const krad_remote *rr)
+{
+    return rr->srtt;
+}
+
+krb5_boolean
+kr_remote_failing(const krad_remote *rr, time_t now)
+{
+    return rr->failed != 0 && now - rr->failed < FAILED_HOLD;
 }
 
 krb5_boolean
@@ -31,12 +31,21 @@
 
 #define EVENT_COUNT 6
 
+/* More requests than there are RADIUS packet identifiers. */
+#define PIPELINE_COUNT 300
+
 static struct
 {
     int count;
     struct event events[EVENT_COUNT];
 } record;
 
+static struct
+{
+    int count;
+    int accepts;
+} pipeline;
+
 static krad_attrset *set;
 static krad_remote *rr;
 static verto_ctx *vctx;
@@ -56,6 +65,17 @@ callback(krb5_error_code retval, const krad_packet *request,
     verto_break(vctx);
 }
 
+static void
+pipeline_callback(krb5_error_code retval, const krad_packet *request,
+                  const krad_packet *response, void *data)
+{
+    if (retval == 0 &&
+        krad_packet_get_code(response) == krad_code_name2num("Access-Accept"))
+        pipeline.accepts++;
+    if (++pipeline.count == PIPELINE_COUNT)
+        verto_break(vctx);
+}
+
 static void
 remote_new(krb5_context kctx, krad_remote **remote)
 {
@@ -107,6 +127,7 @@ main(int argc, const char **argv)
 {
     krb5_context kctx = NULL;
     krb5_data tmp;
+    int i;
 
     if (!daemon_start(argc, argv)) {
         fprintf(stderr, "Unable to start pyrad daemon, skipping test...\n");
@@ -132,6 +153,19 @@ main(int argc, const char **argv)
     noerror(do_auth("reject", NULL));
     verto_run(vctx);
 
+    /* Send more packets at once than there are packet identifiers. */
+    tmp = string2data("accept");
+    noerror(krad_attrset_add(set, krad_attr_name2num("User-Password"), &tmp));
+    for (i = 0; i < PIPELINE_COUNT; i++) {
+        noerror(kr_remote_send(rr, krad_code_name2num("Access-Request"), set,
+                               pipeline_callback, NULL, 1000, 3, NULL));
+    }
+    krad_attrset_del(set, krad_attr_name2num("User-Password"), 0);
+    verto_run(vctx);
+    insist(pipeline.accepts == PIPELINE_COUNT);
+    insist(kr_remote_rtt(rr) >= 0);
+    insist(!kr_remote_failing(rr, time(NULL)));
+
     /* Send canceled packet. */
     insist(verto_add_timeout(vctx, VERTO_EV_FLAG_NONE, test_timeout, 0) !=
            NULL);
@@ -141,6 +175,7 @@ main(int argc, const char **argv)
     daemon_stop();
     noerror(do_auth("accept", NULL));
     verto_run(vctx);
+    insist(kr_remote_failing(rr, time(NULL)));
 
     /* Test outstanding packet freeing. */
     noerror(do_auth("accept", NULL));
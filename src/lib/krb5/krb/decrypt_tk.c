@@ -26,17 +26,11 @@
 
 #include "k5-int.h"
 
-/*
-  Decrypts dec_ticket->enc_part
-  using *srv_key, and places result in dec_ticket->enc_part2.
-  The storage of dec_ticket->enc_part2 will be allocated before return.
-
-  returns errors from encryption routines, system errors
-
-*/
-
-krb5_error_code KRB5_CALLCONV
-krb5_decrypt_tkt_part(krb5_context context, const krb5_keyblock *srv_key, register krb5_ticket *ticket)
+/* Decrypt ticket->enc_part with srv_key, or with the keyblock kb if srv_key
+ * is NULL, and decode the result into ticket->enc_part2. */
+static krb5_error_code
+decrypt_tkt_part(krb5_context context, krb5_key srv_key,
+                 const krb5_keyblock *kb, krb5_ticket *ticket)
 {
     krb5_enc_tkt_part *dec_tkt_part;
     krb5_data scratch;
@@ -53,9 +47,14 @@ krb5_decrypt_tkt_part(krb5_context context, const krb5_keyblock *srv_key, regist
         return(ENOMEM);
 
     /* call the encryption routine */
-    if ((retval = krb5_c_decrypt(context, srv_key,
-                                 KRB5_KEYUSAGE_KDC_REP_TICKET, 0,
-                                 &ticket->enc_part, &scratch))) {
+    if (srv_key != NULL) {
+        retval = krb5_k_decrypt(context, srv_key, KRB5_KEYUSAGE_KDC_REP_TICKET,
+                                0, &ticket->enc_part, &scratch);
+    } else {
+        retval = krb5_c_decrypt(context, kb, KRB5_KEYUSAGE_KDC_REP_TICKET, 0,
+                                &ticket->enc_part, &scratch);
+    }
+    if (retval) {
         free(scratch.data);
         return retval;
     }
@@ -68,3 +67,28 @@ krb5_decrypt_tkt_part(krb5_context context, const krb5_keyblock *srv_key, regist
     zapfree(scratch.data, scratch.length);
     return retval;
 }
+
+/*
+  Decrypts dec_ticket->enc_part
+  using *srv_key, and places result in dec_ticket->enc_part2.
+  The storage of dec_ticket->enc_part2 will be allocated before return.
+
+  returns errors from encryption routines, system errors
+
+*/
+
+krb5_error_code KRB5_CALLCONV
+krb5_decrypt_tkt_part(krb5_context context, const krb5_keyblock *srv_key,
+                      register krb5_ticket *ticket)
+{
+    return decrypt_tkt_part(context, NULL, srv_key, ticket);
+}
+
+/* Like krb5_decrypt_tkt_part(), but use a krb5_key so that the caller can
+ * reuse its derived keys across tickets. */
+krb5_error_code
+k5_decrypt_tkt_part_key(krb5_context context, krb5_key srv_key,
+                        krb5_ticket *ticket)
+{
+    return decrypt_tkt_part(context, srv_key, NULL, ticket);
+}
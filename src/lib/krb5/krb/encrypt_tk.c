@@ -62,3 +62,40 @@ krb5_encrypt_tkt_part(krb5_context context, const krb5_keyblock *srv_key, regist
 
     return(retval);
 }
+
+/* Like krb5_encrypt_tkt_part(), but use a krb5_key so that the caller can
+ * reuse its derived keys across tickets. */
+krb5_error_code
+k5_encrypt_tkt_part_key(krb5_context context, krb5_key srv_key,
+                        krb5_ticket *dec_ticket)
+{
+    krb5_data *scratch;
+    krb5_enc_data *cipher = &dec_ticket->enc_part;
+    krb5_error_code retval;
+    size_t enclen;
+
+    retval = encode_krb5_enc_tkt_part(dec_ticket->enc_part2, &scratch);
+    if (retval)
+        return retval;
+
+    retval = krb5_c_encrypt_length(context, krb5_k_key_enctype(context,
+                                                               srv_key),
+                                   scratch->length, &enclen);
+    if (retval)
+        goto cleanup;
+    cipher->ciphertext.length = enclen;
+    cipher->ciphertext.data = k5alloc(enclen, &retval);
+    if (cipher->ciphertext.data == NULL)
+        goto cleanup;
+    retval = krb5_k_encrypt(context, srv_key, KRB5_KEYUSAGE_KDC_REP_TICKET, 0,
+                            scratch, cipher);
+    if (retval) {
+        free(cipher->ciphertext.data);
+        cipher->ciphertext.data = NULL;
+    }
+
+cleanup:
+    zapfree(scratch->data, scratch->length);
+    free(scratch);
+    return retval;
+}
@@ -477,7 +477,7 @@ rd_req_decoded_opt(krb5_context context, krb5_auth_context *auth_context,
     int                   rfc4537_etypes_len = 0;
     krb5_enctype         *permitted_etypes = NULL;
     int                   permitted_etypes_len = 0;
-    krb5_keyblock         decrypt_key;
+    krb5_keyblock         decrypt_key, *kb;
 
     decrypt_key.enctype = ENCTYPE_NULL;
     decrypt_key.contents = NULL;
@@ -488,13 +488,17 @@ rd_req_decoded_opt(krb5_context context, krb5_auth_context *auth_context,
 
     /* decrypt the ticket */
     if ((*auth_context)->key) { /* User to User authentication */
-        if ((retval = krb5_decrypt_tkt_part(context,
-                                            &(*auth_context)->key->keyblock,
-                                            req->ticket)))
+        if ((retval = k5_decrypt_tkt_part_key(context, (*auth_context)->key,
+                                              req->ticket)))
             goto cleanup;
+        /* The key may be shared with the caller, so copy its contents. */
         if (check_valid_flag) {
-            decrypt_key = (*auth_context)->key->keyblock;
-            (*auth_context)->key->keyblock.contents = NULL;
+            retval = krb5_k_key_keyblock(context, (*auth_context)->key,
+                                         &kb);
+            if (retval)
+                goto cleanup;
+            decrypt_key = *kb;
+            free(kb);
         }
         krb5_k_free_key(context, (*auth_context)->key);
         (*auth_context)->key = NULL;
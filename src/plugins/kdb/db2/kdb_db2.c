@@ -160,6 +160,7 @@ ctx_clear(krb5_db2_context *dbc)
      */
     free(dbc->db_lf_name);
     free(dbc->db_name);
+    free(dbc->db_fname);
     /*
      * Clear the structure and reset the defaults.
      */
@@ -203,7 +204,7 @@ configure_context(krb5_context context, char *conf_section, char **db_args)
 {
     krb5_error_code status;
     krb5_db2_context *dbc;
-    char **t_ptr, *opt = NULL, *val = NULL, *pval = NULL;
+    char **t_ptr, *opt = NULL, *val = NULL, *pval = NULL, *sval = NULL;
     profile_t profile = KRB5_DB_GET_PROFILE(context);
     int bval;
 
@@ -276,10 +277,31 @@ configure_context(krb5_context context, char *conf_section, char **db_args)
         goto cleanup;
     dbc->disable_lockout = bval;
 
+    status = profile_get_boolean(profile, KDB_MODULE_SECTION, conf_section,
+                                 KRB5_CONF_KEEP_OPEN, FALSE, &bval);
+    if (status != 0)
+        goto cleanup;
+    dbc->keep_open = bval;
+
+    status = profile_get_string(profile, KDB_MODULE_SECTION, conf_section,
+                                KRB5_CONF_LOCKOUT_FLUSH_INTERVAL, NULL,
+                                &sval);
+    if (status != 0)
+        goto cleanup;
+    if (sval != NULL &&
+        (krb5_string_to_deltat(sval, &dbc->lockout_flush_interval) != 0 ||
+         dbc->lockout_flush_interval < 0)) {
+        status = EINVAL;
+        k5_setmsg(context, status, _("Invalid %s value \"%s\""),
+                  KRB5_CONF_LOCKOUT_FLUSH_INTERVAL, sval);
+        goto cleanup;
+    }
+
 cleanup:
     free(opt);
     free(val);
     profile_release_string(pval);
+    profile_release_string(sval);
     return status;
 }
 
@@ -393,6 +415,52 @@ open_db(krb5_context context, krb5_db2_context *dbc, int flags, int mode,
     return (db == NULL) ? errno : 0;
 }
 
+/*
+ * Record the identity of the database file dbc->db was just opened on, and the
+ * database age at the time, so that the handle can be retained across locks
+ * and validated with db_handle_current().
+ */
+static void
+note_db_identity(krb5_db2_context *dbc)
+{
+    struct stat st;
+    int fd;
+
+    dbc->db_ident_valid = FALSE;
+    if (dbc->db_fname == NULL &&
+        ctx_dbsuffix(dbc, SUFFIX_DB, &dbc->db_fname) != 0)
+        return;
+    if (fstat(dbc->db_lf_file, &st) != 0)
+        return;
+    dbc->db_age = st.st_mtime;
+    fd = dbc->db->fd(dbc->db);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return;
+    dbc->db_dev = st.st_dev;
+    dbc->db_ino = st.st_ino;
+    dbc->db_ident_valid = TRUE;
+}
+
+/*
+ * Return true if the retained handle dbc->db can be used under a new shared
+ * lock.  Every write updates the lockfile timestamp (see ctx_update_age()), so
+ * an unchanged timestamp means the contents are the same; a different inode
+ * means the file was replaced, as by kdb5_util load.
+ */
+static krb5_boolean
+db_handle_current(krb5_db2_context *dbc)
+{
+    struct stat st;
+
+    if (!dbc->db_ident_valid)
+        return FALSE;
+    if (fstat(dbc->db_lf_file, &st) != 0 || st.st_mtime != dbc->db_age)
+        return FALSE;
+    if (stat(dbc->db_fname, &st) != 0)
+        return FALSE;
+    return st.st_dev == dbc->db_dev && st.st_ino == dbc->db_ino;
+}
+
 static krb5_error_code
 ctx_unlock(krb5_context context, krb5_db2_context *dbc)
 {
@@ -406,8 +474,12 @@ ctx_unlock(krb5_context context, krb5_db2_context *dbc)
 
     db = dbc->db;
     if (--(dbc->db_locks_held) == 0) {
-        db->close(db);
-        dbc->db = NULL;
+        /* If keep_open is set, retain a read-only handle for the next shared
+         * lock. */
+        if (!dbc->keep_open || dbc->db_lock_mode != KRB5_LOCKMODE_SHARED) {
+            db->close(db);
+            dbc->db = NULL;
+        }
         dbc->db_lock_mode = 0;
 
         retval2 = krb5_lock_file(context, dbc->db_lf_file,
@@ -447,19 +519,27 @@ ctx_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
         else if (retval)
             return retval;
 
-        /* Open the DB (or re-open it for read/write). */
-        if (dbc->db != NULL)
+        /* Open the DB (or re-open it for read/write), unless we retained a
+         * read-only handle which is still current. */
+        if (dbc->db != NULL &&
+            (kmode != KRB5_LOCKMODE_SHARED || !db_handle_current(dbc))) {
             dbc->db->close(dbc->db);
-        retval = open_db(context, dbc,
-                         kmode == KRB5_LOCKMODE_SHARED ? O_RDONLY : O_RDWR,
-                         0600, &dbc->db);
-        if (retval) {
-            dbc->db_locks_held = 0;
-            dbc->db_lock_mode = 0;
-            (void) osa_adb_release_lock(dbc->policy_db);
-            (void) krb5_lock_file(context, dbc->db_lf_file,
-                                  KRB5_LOCKMODE_UNLOCK);
-            return retval;
+            dbc->db = NULL;
+        }
+        if (dbc->db == NULL) {
+            retval = open_db(context, dbc,
+                             kmode == KRB5_LOCKMODE_SHARED ? O_RDONLY : O_RDWR,
+                             0600, &dbc->db);
+            if (retval) {
+                dbc->db_locks_held = 0;
+                dbc->db_lock_mode = 0;
+                (void) osa_adb_release_lock(dbc->policy_db);
+                (void) krb5_lock_file(context, dbc->db_lf_file,
+                                      KRB5_LOCKMODE_UNLOCK);
+                return retval;
+            }
+            if (dbc->keep_open)
+                note_db_identity(dbc);
         }
 
         dbc->db_lock_mode = kmode;
@@ -522,6 +602,9 @@ cleanup:
 static void
 ctx_fini(krb5_db2_context *dbc)
 {
+    /* Close a read-only handle retained by keep_open. */
+    if (dbc->db != NULL && dbc->db_locks_held == 0)
+        dbc->db->close(dbc->db);
     if (dbc->db_lf_file != -1)
         (void) close(dbc->db_lf_file);
     if (dbc->policy_db)
@@ -533,8 +616,17 @@ ctx_fini(krb5_db2_context *dbc)
 krb5_error_code
 krb5_db2_fini(krb5_context context)
 {
-    if (context->dal_handle->db_context != NULL) {
-        ctx_fini(context->dal_handle->db_context);
+    krb5_db2_context *dbc = context->dal_handle->db_context;
+
+    if (dbc != NULL) {
+        /* Write out any lockout updates we have been holding back. */
+        if (dbc->lockout_pending != NULL) {
+            if (dbc->db_inited)
+                (void)krb5_db2_lockout_flush(context);
+            krb5_db2_lockout_free_pending(context, dbc->lockout_pending);
+            dbc->lockout_pending = NULL;
+        }
+        ctx_fini(dbc);
         context->dal_handle->db_context = NULL;
     }
     return 0;
@@ -557,9 +649,11 @@ check_openable(krb5_context context)
 }
 
 /*
- * Return the last modification time of the database.
- *
- * Think about using fstat.
+ * Return the time of the last change to the database, not counting the
+ * lockout and last-success updates made by the KDC, which would otherwise
+ * invalidate the KDC's principal cache on every authentication.  This is the
+ * access time of the lockfile, which only ctx_update_age() sets; its
+ * modification time advances with every write.
  */
 
 krb5_error_code
@@ -575,13 +669,16 @@ krb5_db2_get_age(krb5_context context, char *db_name, time_t *age)
     if (fstat(dbc->db_lf_file, &st) < 0)
         *age = -1;
     else
-        *age = st.st_mtime;
+        *age = st.st_atime;
     return 0;
 }
 
-/* Try to update the timestamp on dbc's lockfile. */
+/*
+ * Try to advance the modification time of dbc's lockfile, and also its access
+ * time (the age reported by krb5_db2_get_age()) unless lockout is true.
+ */
 static void
-ctx_update_age(krb5_db2_context *dbc)
+ctx_update_age(krb5_db2_context *dbc, krb5_boolean lockout)
 {
     struct stat st;
     time_t now;
@@ -590,12 +687,9 @@ ctx_update_age(krb5_db2_context *dbc)
     now = time((time_t *) NULL);
     if (fstat(dbc->db_lf_file, &st) != 0)
         return;
-    if (st.st_mtime >= now) {
-        utbuf.actime = st.st_mtime + 1;
-        utbuf.modtime = st.st_mtime + 1;
-        (void) utime(dbc->db_lf_name, &utbuf);
-    } else
-        (void) utime(dbc->db_lf_name, (struct utimbuf *) NULL);
+    utbuf.modtime = (st.st_mtime >= now) ? st.st_mtime + 1 : now;
+    utbuf.actime = lockout ? st.st_atime : utbuf.modtime;
+    (void) utime(dbc->db_lf_name, &utbuf);
 }
 
 krb5_error_code
@@ -802,9 +896,10 @@ cleanup:
     return retval;
 }
 
-krb5_error_code
-krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
-                       char **db_args)
+/* Store entry, as a lockout or last-success update if lockout is true. */
+static krb5_error_code
+put_principal(krb5_context context, krb5_db_entry *entry, char **db_args,
+              krb5_boolean lockout)
 {
     int     dbret;
     DB     *db;
@@ -849,11 +944,24 @@ krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
     krb5_free_data_contents(context, &contdata);
 
 cleanup:
-    ctx_update_age(dbc);
+    ctx_update_age(dbc, lockout);
     (void) krb5_db2_unlock(context); /* unlock database */
     return (retval);
 }
 
+krb5_error_code
+krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
+                       char **db_args)
+{
+    return put_principal(context, entry, db_args, FALSE);
+}
+
+krb5_error_code
+krb5_db2_put_lockout(krb5_context context, krb5_db_entry *entry)
+{
+    return put_principal(context, entry, NULL, TRUE);
+}
+
 krb5_error_code
 krb5_db2_delete_principal(krb5_context context, krb5_const_principal searchfor)
 {
@@ -922,7 +1030,7 @@ cleankey:
     krb5_free_data_contents(context, &keydata);
 
 cleanup:
-    ctx_update_age(dbc);
+    ctx_update_age(dbc, FALSE);
     (void) krb5_db2_unlock(context); /* unlock write lock */
     return retval;
 }
@@ -940,6 +1048,7 @@ typedef struct iter_curs {
     krb5_db2_context *dbc;
     int lockmode;
     krb5_boolean islocked;
+    krb5_boolean unlocked;      /* release the DB lock around callbacks */
 } iter_curs;
 
 /* Lock DB handle of curs, updating curs->islocked. */
@@ -968,6 +1077,7 @@ static krb5_error_code
 curs_init(iter_curs *curs, krb5_context ctx, krb5_db2_context *dbc,
           krb5_flags iterflags)
 {
+    krb5_error_code retval;
     int isrecurse = iterflags & KRB5_DB_ITER_RECURSE;
     unsigned int prevflag = R_PREV;
     unsigned int nextflag = R_NEXT;
@@ -977,6 +1087,8 @@ curs_init(iter_curs *curs, krb5_context ctx, krb5_db2_context *dbc,
     curs->islocked = FALSE;
     curs->ctx = ctx;
     curs->dbc = dbc;
+    curs->unlocked = dbc->unlockiter ||
+        (iterflags & KRB5_DB_ITER_UNLOCKED) != 0;
 
     if (iterflags & KRB5_DB_ITER_WRITE)
         curs->lockmode = KRB5_LOCKMODE_EXCLUSIVE;
@@ -1005,7 +1117,21 @@ curs_init(iter_curs *curs, krb5_context ctx, krb5_db2_context *dbc,
         curs->startflag = R_FIRST;
         curs->stepflag = nextflag;
     }
-    return curs_lock(curs);
+    retval = curs_lock(curs);
+    if (retval)
+        return retval;
+
+    /* We only know the database type once it has been opened. */
+    if (dbc->hashfirst && curs->unlocked) {
+        if (iterflags & KRB5_DB_ITER_UNLOCKED) {
+            curs_unlock(curs);
+            k5_setmsg(ctx, EINVAL, _("Unlocked iteration is not supported "
+                                     "for hash databases"));
+            return EINVAL;
+        }
+        curs->unlocked = FALSE;
+    }
+    return 0;
 }
 
 /* Get initial entry. */
@@ -1021,7 +1147,7 @@ curs_start(iter_curs *curs)
 static krb5_error_code
 curs_save(iter_curs *curs)
 {
-    if (!curs->dbc->unlockiter)
+    if (!curs->unlocked)
         return 0;
 
     curs->keycopy.data = malloc(curs->key.size);
@@ -1050,7 +1176,7 @@ curs_step(iter_curs *curs)
     int dbret;
     krb5_db2_context *dbc = curs->dbc;
 
-    if (dbc->unlockiter) {
+    if (curs->unlocked) {
         /* Reacquire libdb cursor using saved copy of key. */
         curs->key = curs->keycopy;
         dbret = dbc->db->seq(dbc->db, &curs->key, &curs->data, R_CURSOR);
@@ -1066,7 +1192,6 @@ curs_step(iter_curs *curs)
 static krb5_error_code
 curs_run_cb(iter_curs *curs, ctx_iterate_cb func, krb5_pointer func_arg)
 {
-    krb5_db2_context *dbc = curs->dbc;
     krb5_error_code retval, lockerr;
     krb5_db_entry *entry;
     krb5_context ctx = curs->ctx;
@@ -1081,14 +1206,14 @@ curs_run_cb(iter_curs *curs, ctx_iterate_cb func, krb5_pointer func_arg)
     if (retval)
         return retval;
 
-    if (dbc->unlockiter)
+    if (curs->unlocked)
         curs_unlock(curs);
 
     k5_mutex_unlock(krb5_db2_mutex);
     retval = (*func)(func_arg, entry);
     krb5_db_free_principal(ctx, entry);
     k5_mutex_lock(krb5_db2_mutex);
-    if (dbc->unlockiter) {
+    if (curs->unlocked) {
         lockerr = curs_lock(curs);
         if (lockerr)
             return lockerr;
@@ -1448,7 +1573,7 @@ ctx_promote(krb5_context context, krb5_db2_context *dbc_temp,
         goto cleanup;
     }
 
-    ctx_update_age(dbc_real);
+    ctx_update_age(dbc_real, FALSE);
 
     /* Release and remove the temporary DB lockfiles. */
     (void) unlink(tlock);
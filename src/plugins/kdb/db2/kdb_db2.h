@@ -33,6 +33,8 @@
 
 #include "policy_db.h"
 
+struct lockout_pending;
+
 typedef struct _krb5_db2_context {
     krb5_boolean        db_inited;      /* Context initialized          */
     char *              db_name;        /* Name of database             */
@@ -48,6 +50,14 @@ typedef struct _krb5_db2_context {
     krb5_boolean        disable_last_success;
     krb5_boolean        disable_lockout;
     krb5_boolean        unlockiter;
+    krb5_boolean        keep_open;      /* Retain read-only handle      */
+    char *              db_fname;       /* Name of principal DB file    */
+    krb5_boolean        db_ident_valid; /* Fields below are set         */
+    dev_t               db_dev;         /* Device of open DB file       */
+    ino_t               db_ino;         /* Inode of open DB file        */
+    time_t              db_age;         /* Lock file mtime at open      */
+    krb5_deltat         lockout_flush_interval; /* Write-behind delay   */
+    struct lockout_pending *lockout_pending; /* Unwritten updates       */
 } krb5_db2_context;
 
 krb5_error_code krb5_db2_init(krb5_context);
@@ -57,6 +67,7 @@ krb5_error_code krb5_db2_get_principal(krb5_context, krb5_const_principal,
                                        unsigned int, krb5_db_entry **);
 krb5_error_code krb5_db2_put_principal(krb5_context, krb5_db_entry *,
                                        char **db_args);
+krb5_error_code krb5_db2_put_lockout(krb5_context, krb5_db_entry *);
 krb5_error_code krb5_db2_iterate(krb5_context, char *,
                                  krb5_error_code (*)(krb5_pointer,
                                                      krb5_db_entry *),
@@ -126,6 +137,13 @@ krb5_db2_lockout_audit(krb5_context context,
                        krb5_timestamp stamp,
                        krb5_error_code status);
 
+krb5_error_code
+krb5_db2_lockout_flush(krb5_context context);
+
+void
+krb5_db2_lockout_free_pending(krb5_context context,
+                              struct lockout_pending *pending);
+
 krb5_error_code
 krb5_db2_check_policy_as(krb5_context kcontext, krb5_kdc_req *request,
                          krb5_db_entry *client, krb5_db_entry *server,
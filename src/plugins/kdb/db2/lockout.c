@@ -25,6 +25,7 @@
  */
 
 #include "k5-int.h"
+#include "k5-queue.h"
 #include "kdb.h"
 #include <stdio.h>
 #include <errno.h>
@@ -33,83 +34,269 @@
 #include "kdb_db2.h"
 
 /*
- * Helper routines for databases that wish to use the default
- * principal lockout functionality.
+ * If lockout_flush_interval is set, lockout and last_success changes made
+ * while auditing AS requests are not written to the database immediately.
+ * They are recorded in a table of pending updates, which is overlaid onto
+ * client entries when they are checked and audited, so lockout decisions
+ * still see every failure made through this database handle.  Failures are
+ * recorded as a count of new failures, and are added to the stored count
+ * when written, so that failures recorded by several KDC worker processes add
+ * up.  Whether the stored count has expired (through failcnt_interval or an
+ * administrative unlock) is decided against the stored entry at that time;
+ * only a successful authentication discards the stored count outright.
+ *
+ * The table is written out under a single exclusive lock by the first audit
+ * after the interval has passed since the last flush, immediately when a
+ * principal reaches its lockout threshold (so that other processes see the
+ * lockout), and when the database is closed.  Updates which have not been
+ * flushed are lost if the KDC exits abnormally.
  */
 
-static krb5_error_code
-lookup_lockout_policy(krb5_context context,
-                      krb5_db_entry *entry,
-                      krb5_kvno *pw_max_fail,
-                      krb5_deltat *pw_failcnt_interval,
-                      krb5_deltat *pw_lockout_duration)
-{
-    krb5_tl_data tl_data;
-    krb5_error_code code;
-    osa_princ_ent_rec adb;
-    XDR xdrs;
+#define PENDING_NBUCKETS        256
 
-    *pw_max_fail = 0;
-    *pw_failcnt_interval = 0;
-    *pw_lockout_duration = 0;
+struct pending_update {
+    K5_LIST_ENTRY(pending_update) links;
+    krb5_principal princ;
+    uint32_t hash;
+    int mask;
+    krb5_timestamp last_success;
+    krb5_timestamp first_failed;
+    krb5_timestamp last_failed;
+    krb5_kvno new_failures;
+};
 
-    tl_data.tl_data_type = KRB5_TL_KADM_DATA;
+K5_LIST_HEAD(pending_bucket, pending_update);
 
-    code = krb5_dbe_lookup_tl_data(context, entry, &tl_data);
-    if (code != 0 || tl_data.tl_data_length == 0)
-        return code;
+struct lockout_pending {
+    struct pending_bucket buckets[PENDING_NBUCKETS];
+    krb5_timestamp next_flush;
+};
 
-    memset(&adb, 0, sizeof(adb));
-    xdrmem_create(&xdrs, (char *)tl_data.tl_data_contents,
-                  tl_data.tl_data_length, XDR_DECODE);
-    if (!xdr_osa_princ_ent_rec(&xdrs, &adb)) {
-        xdr_destroy(&xdrs);
-        return KADM5_XDR_FAILURE;
+static uint32_t
+hash_princ(krb5_const_principal princ)
+{
+    uint32_t h = 2166136261U;
+    int i;
+    unsigned int j;
+    const krb5_data *d;
+
+    for (i = -1; i < princ->length; i++) {
+        d = (i < 0) ? &princ->realm : &princ->data[i];
+        for (j = 0; j < d->length; j++)
+            h = (h ^ (unsigned char)d->data[j]) * 16777619U;
+        h = (h ^ 0xff) * 16777619U;
     }
+    return h;
+}
 
-    if (adb.policy != NULL) {
-        osa_policy_ent_t policy = NULL;
+static struct pending_update *
+find_pending(krb5_context context, struct lockout_pending *pending,
+             krb5_const_principal princ, uint32_t hash)
+{
+    struct pending_update *upd;
 
-        code = krb5_db2_get_policy(context, adb.policy, &policy);
-        if (code == 0) {
-            *pw_max_fail = policy->pw_max_fail;
-            *pw_failcnt_interval = policy->pw_failcnt_interval;
-            *pw_lockout_duration = policy->pw_lockout_duration;
-            krb5_db_free_policy(context, policy);
-        }
+    K5_LIST_FOREACH(upd, &pending->buckets[hash % PENDING_NBUCKETS], links) {
+        if (upd->hash == hash &&
+            krb5_principal_compare(context, upd->princ, princ))
+            return upd;
     }
+    return NULL;
+}
+
+static void
+free_pending_update(krb5_context context, struct pending_update *upd)
+{
+    K5_LIST_REMOVE(upd, links);
+    krb5_free_principal(context, upd->princ);
+    free(upd);
+}
+
+void
+krb5_db2_lockout_free_pending(krb5_context context,
+                              struct lockout_pending *pending)
+{
+    struct pending_update *upd;
+    int i;
+
+    if (pending == NULL)
+        return;
+    for (i = 0; i < PENDING_NBUCKETS; i++) {
+        while ((upd = K5_LIST_FIRST(&pending->buckets[i])) != NULL)
+            free_pending_update(context, upd);
+    }
+    free(pending);
+}
 
-    xdr_destroy(&xdrs);
+/*
+ * Merge the lockout fields of upd into entry.  failcnt_interval is the
+ * failure count interval of entry's policy; the stored failure count is
+ * discarded if it expired before the first pending failure.
+ */
+static void
+apply_update(krb5_context context, struct pending_update *upd,
+             krb5_deltat failcnt_interval, krb5_db_entry *entry)
+{
+    krb5_timestamp unlock_time;
+
+    if ((upd->mask & KDB_LOCKOUT_LAST_SUCCESS) &&
+        upd->last_success > entry->last_success)
+        entry->last_success = upd->last_success;
+    if (upd->mask & KDB_LOCKOUT_RESET)
+        entry->fail_auth_count = 0;
+    if (!(upd->mask & KDB_LOCKOUT_FAILURES))
+        return;
+
+    if (krb5_dbe_lookup_last_admin_unlock(context, entry,
+                                          &unlock_time) == 0 &&
+        entry->last_failed <= unlock_time)
+        entry->fail_auth_count = 0;
+    if (failcnt_interval != 0 &&
+        upd->first_failed > entry->last_failed + failcnt_interval)
+        entry->fail_auth_count = 0;
+    entry->fail_auth_count += upd->new_failures;
+    if (upd->last_failed > entry->last_failed)
+        entry->last_failed = upd->last_failed;
+}
+
+/* Apply any unwritten updates for entry's principal to entry.  This must be
+ * done only once for an entry read from the database. */
+static void
+overlay_pending(krb5_context context, krb5_db2_context *db_ctx,
+                krb5_deltat failcnt_interval, krb5_db_entry *entry)
+{
+    struct pending_update *upd;
+
+    if (db_ctx->lockout_pending == NULL)
+        return;
+    upd = find_pending(context, db_ctx->lockout_pending, entry->princ,
+                       hash_princ(entry->princ));
+    if (upd != NULL)
+        apply_update(context, upd, failcnt_interval, entry);
+}
+
+/*
+ * Record pending updates for entry as indicated by mask.  KDB_LOCKOUT_RESET
+ * records a successful authentication which cleared the failure count.
+ * KDB_LOCKOUT_FAILURES records one new failure at entry->last_failed; with
+ * KDB_LOCKOUT_RESTART, earlier pending failures had expired and are discarded.
+ */
+static krb5_error_code
+record_pending(krb5_context context, krb5_db2_context *db_ctx,
+               krb5_db_entry *entry, krb5_timestamp stamp, int mask)
+{
+    krb5_error_code ret;
+    struct lockout_pending *pending = db_ctx->lockout_pending;
+    struct pending_update *upd;
+    uint32_t hash;
+    int i;
+
+    if (pending == NULL) {
+        pending = k5alloc(sizeof(*pending), &ret);
+        if (pending == NULL)
+            return ret;
+        for (i = 0; i < PENDING_NBUCKETS; i++)
+            K5_LIST_INIT(&pending->buckets[i]);
+        pending->next_flush = stamp + db_ctx->lockout_flush_interval;
+        db_ctx->lockout_pending = pending;
+    }
 
-    xdrmem_create(&xdrs, NULL, 0, XDR_FREE);
-    xdr_osa_princ_ent_rec(&xdrs, &adb);
-    xdr_destroy(&xdrs);
+    hash = hash_princ(entry->princ);
+    upd = find_pending(context, pending, entry->princ, hash);
+    if (upd == NULL) {
+        upd = k5alloc(sizeof(*upd), &ret);
+        if (upd == NULL)
+            return ret;
+        ret = krb5_copy_principal(context, entry->princ, &upd->princ);
+        if (ret) {
+            free(upd);
+            return ret;
+        }
+        upd->hash = hash;
+        K5_LIST_INSERT_HEAD(&pending->buckets[hash % PENDING_NBUCKETS], upd,
+                            links);
+    }
 
+    if (mask & KDB_LOCKOUT_LAST_SUCCESS)
+        upd->last_success = entry->last_success;
+    if (mask & (KDB_LOCKOUT_RESET | KDB_LOCKOUT_RESTART)) {
+        /* Earlier pending failures no longer count. */
+        upd->new_failures = 0;
+        upd->mask &= ~KDB_LOCKOUT_FAILURES;
+    }
+    if (mask & KDB_LOCKOUT_FAILURES) {
+        if (upd->new_failures == 0)
+            upd->first_failed = entry->last_failed;
+        upd->last_failed = entry->last_failed;
+        upd->new_failures++;
+    }
+    upd->mask |= mask & ~KDB_LOCKOUT_RESTART;
     return 0;
 }
 
-/* draft-behera-ldap-password-policy-10.txt 7.1 */
-static krb5_boolean
-locked_check_p(krb5_context context,
-               krb5_timestamp stamp,
-               krb5_kvno max_fail,
-               krb5_timestamp lockout_duration,
-               krb5_db_entry *entry)
+/* Merge upd into the current database entry for its principal. */
+static krb5_error_code
+flush_update(krb5_context context, struct pending_update *upd)
 {
+    krb5_error_code ret;
+    krb5_db_entry *entry;
     krb5_timestamp unlock_time;
+    krb5_kvno max_fail;
+    krb5_deltat failcnt_interval, lockout_duration;
 
-    /* If the entry was unlocked since the last failure, it's not locked. */
-    if (krb5_dbe_lookup_last_admin_unlock(context, entry, &unlock_time) == 0 &&
-        entry->last_failed <= unlock_time)
-        return FALSE;
+    ret = krb5_db2_get_principal(context, upd->princ, 0, &entry);
+    if (ret == KRB5_KDB_NOENTRY)
+        return 0;
+    if (ret)
+        return ret;
+
+    /* Drop failures which an administrator has unlocked since we saw them. */
+    if ((upd->mask & KDB_LOCKOUT_FAILURES) &&
+        krb5_dbe_lookup_last_admin_unlock(context, entry,
+                                          &unlock_time) == 0 &&
+        upd->last_failed <= unlock_time)
+        upd->mask &= ~KDB_LOCKOUT_FAILURES;
+
+    if (kdb_lockout_policy(context, entry, krb5_db2_get_policy, &max_fail,
+                           &failcnt_interval, &lockout_duration) != 0)
+        failcnt_interval = 0;
+    apply_update(context, upd, failcnt_interval, entry);
+
+    ret = krb5_db2_put_lockout(context, entry);
+    krb5_db_free_principal(context, entry);
+    return ret;
+}
 
-    if (max_fail == 0 || entry->fail_auth_count < max_fail)
-        return FALSE;
+/* Write all pending lockout updates to the database. */
+krb5_error_code
+krb5_db2_lockout_flush(krb5_context context)
+{
+    krb5_error_code ret, ret2;
+    krb5_db2_context *db_ctx = context->dal_handle->db_context;
+    struct lockout_pending *pending = db_ctx->lockout_pending;
+    struct pending_update *upd;
+    krb5_timestamp now;
+    int i;
+
+    if (pending == NULL)
+        return 0;
 
-    if (lockout_duration == 0)
-        return TRUE; /* principal permanently locked */
+    ret = krb5_db2_lock(context, KRB5_DB_LOCKMODE_EXCLUSIVE);
+    if (ret)
+        return ret;
+    for (i = 0; i < PENDING_NBUCKETS; i++) {
+        while ((upd = K5_LIST_FIRST(&pending->buckets[i])) != NULL) {
+            /* An update which can't be written is discarded. */
+            ret2 = flush_update(context, upd);
+            if (ret2 && !ret)
+                ret = ret2;
+            free_pending_update(context, upd);
+        }
+    }
+    (void)krb5_db2_unlock(context);
 
-    return (stamp < entry->last_failed + lockout_duration);
+    if (krb5_timeofday(context, &now) == 0)
+        pending->next_flush = now + db_ctx->lockout_flush_interval;
+    return ret;
 }
 
 krb5_error_code
@@ -122,20 +309,32 @@ krb5_db2_lockout_check_policy(krb5_context context,
     krb5_deltat failcnt_interval = 0;
     krb5_deltat lockout_duration = 0;
     krb5_db2_context *db_ctx = context->dal_handle->db_context;
+    krb5_timestamp last_success, last_failed;
+    krb5_kvno fail_auth_count;
+    krb5_boolean locked;
 
     if (db_ctx->disable_lockout)
         return 0;
 
-    code = lookup_lockout_policy(context, entry, &max_fail,
-                                 &failcnt_interval,
-                                 &lockout_duration);
+    code = kdb_lockout_policy(context, entry, krb5_db2_get_policy,
+                              &max_fail, &failcnt_interval,
+                              &lockout_duration);
     if (code != 0)
         return code;
 
-    if (locked_check_p(context, stamp, max_fail, lockout_duration, entry))
-        return KRB5KDC_ERR_CLIENT_REVOKED;
-
-    return 0;
+    /* The entry will be audited later, so overlay pending updates onto it
+     * only for the duration of the check. */
+    last_success = entry->last_success;
+    last_failed = entry->last_failed;
+    fail_auth_count = entry->fail_auth_count;
+    overlay_pending(context, db_ctx, failcnt_interval, entry);
+    locked = kdb_lockout_locked(context, stamp, max_fail, lockout_duration,
+                                entry);
+    entry->last_success = last_success;
+    entry->last_failed = last_failed;
+    entry->fail_auth_count = fail_auth_count;
+
+    return locked ? KRB5KDC_ERR_CLIENT_REVOKED : 0;
 }
 
 krb5_error_code
@@ -149,75 +348,45 @@ krb5_db2_lockout_audit(krb5_context context,
     krb5_deltat failcnt_interval = 0;
     krb5_deltat lockout_duration = 0;
     krb5_db2_context *db_ctx = context->dal_handle->db_context;
-    krb5_boolean need_update = FALSE;
-    krb5_timestamp unlock_time;
-
-    switch (status) {
-    case 0:
-    case KRB5KDC_ERR_PREAUTH_FAILED:
-    case KRB5KRB_AP_ERR_BAD_INTEGRITY:
-        break;
-#if 0
-    case KRB5KDC_ERR_CLIENT_REVOKED:
-        break;
-#endif
-    default:
-        return 0;
-    }
+    int update_mask;
 
-    if (entry == NULL)
+    if (!kdb_lockout_audited(status) || entry == NULL)
         return 0;
 
     if (!db_ctx->disable_lockout) {
-        code = lookup_lockout_policy(context, entry, &max_fail,
-                                     &failcnt_interval, &lockout_duration);
+        code = kdb_lockout_policy(context, entry, krb5_db2_get_policy,
+                                  &max_fail, &failcnt_interval,
+                                  &lockout_duration);
         if (code != 0)
             return code;
     }
 
+    overlay_pending(context, db_ctx, failcnt_interval, entry);
+
     /*
      * Don't continue to modify the DB for an already locked account.
      * (In most cases, status will be KRB5KDC_ERR_CLIENT_REVOKED, and
      * this check is unneeded, but in rare cases, we can fail with an
      * integrity error or preauth failure before a policy check.)
      */
-    if (locked_check_p(context, stamp, max_fail, lockout_duration, entry))
+    if (kdb_lockout_locked(context, stamp, max_fail, lockout_duration, entry))
         return 0;
 
-    /* Only mark the authentication as successful if the entry
-     * required preauthentication, otherwise we have no idea. */
-    if (status == 0 && (entry->attributes & KRB5_KDB_REQUIRES_PRE_AUTH)) {
-        if (!db_ctx->disable_lockout && entry->fail_auth_count != 0) {
-            entry->fail_auth_count = 0;
-            need_update = TRUE;
-        }
-        if (!db_ctx->disable_last_success) {
-            entry->last_success = stamp;
-            need_update = TRUE;
-        }
-    } else if (!db_ctx->disable_lockout &&
-               (status == KRB5KDC_ERR_PREAUTH_FAILED ||
-                status == KRB5KRB_AP_ERR_BAD_INTEGRITY)) {
-        if (krb5_dbe_lookup_last_admin_unlock(context, entry,
-                                              &unlock_time) == 0 &&
-            entry->last_failed <= unlock_time) {
-            /* Reset fail_auth_count after administrative unlock. */
-            entry->fail_auth_count = 0;
-        }
-
-        if (failcnt_interval != 0 &&
-            stamp > entry->last_failed + failcnt_interval) {
-            /* Reset fail_auth_count after failcnt_interval. */
-            entry->fail_auth_count = 0;
-        }
-
-        entry->last_failed = stamp;
-        entry->fail_auth_count++;
-        need_update = TRUE;
-    }
-
-    if (need_update) {
-        code = krb5_db2_put_principal(context, entry, NULL);
+    update_mask = kdb_lockout_update(context, entry, stamp, status,
+                                     failcnt_interval, db_ctx->disable_lockout,
+                                     db_ctx->disable_last_success);
+    if (update_mask != 0 && db_ctx->lockout_flush_interval > 0) {
+        code = record_pending(context, db_ctx, entry, stamp, update_mask);
+        if (code != 0)
+            return code;
+        /* Write out the table once the interval has passed, or as soon as
+         * this principal becomes locked so that other KDC processes sharing
+         * the database see the lockout. */
+        if (stamp >= db_ctx->lockout_pending->next_flush ||
+            (max_fail != 0 && entry->fail_auth_count >= max_fail))
+            return krb5_db2_lockout_flush(context);
+    } else if (update_mask != 0) {
+        code = krb5_db2_put_lockout(context, entry);
         if (code != 0)
             return code;
     }
@@ -192,6 +192,8 @@ struct _krb5_ldap_server_info {
 
 typedef enum {SERVICE_DN_TYPE_SERVER, SERVICE_DN_TYPE_CLIENT} krb5_ldap_servicetype;
 
+struct ldap_lookup;
+
 typedef struct _krb5_ldap_context {
     krb5_ldap_servicetype         service_type;
     krb5_ldap_server_info         **server_info_list;
@@ -213,6 +215,10 @@ typedef struct _krb5_ldap_context {
     krb5_boolean                  disable_lockout;
     int                           ldap_debug;
     krb5_context                  kcontext;   /* to set the error code and message */
+    unsigned int                  async_lookups; /* length of active_lookups */
+    struct ldap_lookup            *active_lookups; /* lookups holding a handle */
+    struct ldap_lookup            *lookup_queue; /* lookups awaiting a handle */
+    struct ldap_lookup            *lookup_queue_tail;
 } krb5_ldap_context;
 
 
@@ -262,6 +268,9 @@ krb5_ldap_open( krb5_context , char *,
 krb5_error_code
 krb5_ldap_close( krb5_context );
 
+void
+krb5_ldap_cancel_lookups(krb5_ldap_context *);
+
 krb5_error_code
 krb5_ldap_free_ldap_context(krb5_ldap_context *);
 
@@ -359,6 +359,7 @@ krb5_ldap_close(krb5_context context)
     ldap_context = (krb5_ldap_context *) dal_handle->db_context;
     dal_handle->db_context = NULL;
 
+    krb5_ldap_cancel_lookups(ldap_context);
     krb5_ldap_free_ldap_context(ldap_context);
 
     return 0;
@@ -202,6 +202,22 @@ krb5_ldap_request_handle_from_pool(krb5_ldap_context *ldap_context,
     return st;
 }
 
+/*
+ * Return a handle from the pool without opening a new connection, or NULL if
+ * no handle is idle.
+ */
+
+krb5_ldap_server_handle *
+krb5_ldap_idle_handle_from_pool(krb5_ldap_context *ldap_context)
+{
+    krb5_ldap_server_handle    *ldap_server_handle;
+
+    HNDL_LOCK(ldap_context);
+    ldap_server_handle = krb5_get_ldap_handle(ldap_context);
+    HNDL_UNLOCK(ldap_context);
+    return ldap_server_handle;
+}
+
 /*
  * wrapper function wrapper called to get the next ldap server handle, when the current
  * ldap server handle returns LDAP_SERVER_DOWN.
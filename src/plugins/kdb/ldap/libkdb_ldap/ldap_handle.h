@@ -37,6 +37,9 @@ krb5_ldap_request_handle_from_pool(krb5_ldap_context *, krb5_ldap_server_handle
 krb5_error_code
 krb5_ldap_request_next_handle_from_pool(krb5_ldap_context *, krb5_ldap_server_handle **);
 
+krb5_ldap_server_handle *
+krb5_ldap_idle_handle_from_pool(krb5_ldap_context *);
+
 void
 krb5_ldap_put_handle_to_pool(krb5_ldap_context *, krb5_ldap_server_handle *);
 
@@ -102,6 +102,11 @@ krb5_error_code
 krb5_ldap_get_principal(krb5_context , krb5_const_principal ,
                         unsigned int, krb5_db_entry **);
 
+void
+krb5_ldap_get_principal_async(krb5_context, struct verto_ctx *,
+                              krb5_const_principal, unsigned int,
+                              krb5_db_get_principal_cb, void *);
+
 krb5_error_code
 krb5_ldap_delete_principal(krb5_context, krb5_const_principal);
 
@@ -70,6 +70,7 @@
 #include "ldap_err.h"
 #include <kadm5/admin.h>
 #include <time.h>
+#include <verto.h>
 
 extern char* principal_attributes[];
 extern char* max_pwd_life_attr[];
@@ -98,6 +99,125 @@ berval2tl_data(struct berval *in, krb5_tl_data **out)
     return 0;
 }
 
+/* Set *user_out to the unparsed name of searchfor and *filter_out to an LDAP
+ * filter matching it. */
+static krb5_error_code
+make_princ_filter(krb5_context context, krb5_const_principal searchfor,
+                  char **user_out, char **filter_out)
+{
+    krb5_error_code st;
+    char *user = NULL, *filtuser = NULL, *filter = NULL;
+    size_t len;
+
+    *user_out = *filter_out = NULL;
+
+    if ((st = krb5_unparse_name(context, searchfor, &user)) != 0)
+        goto cleanup;
+
+    if ((st = krb5_ldap_unparse_principal_name(user)) != 0)
+        goto cleanup;
+
+    filtuser = ldap_filter_correct(user);
+    if (filtuser == NULL) {
+        st = ENOMEM;
+        goto cleanup;
+    }
+
+    len = strlen(FILTER) + strlen(filtuser) + 2 + 1;  /* 2 for closing brackets */
+    if ((filter = malloc(len)) == NULL) {
+        st = ENOMEM;
+        goto cleanup;
+    }
+    snprintf(filter, len, FILTER"%s))", filtuser);
+
+    *user_out = user;
+    *filter_out = filter;
+    user = NULL;
+
+cleanup:
+    free(user);
+    free(filtuser);
+    return st;
+}
+
+/*
+ * Look through the search result for the entry of the principal named user.
+ * If it is found, set *entry_out to a new DB entry for it; otherwise leave
+ * *entry_out NULL.
+ */
+static krb5_error_code
+find_princ_entry(krb5_context context, krb5_ldap_context *ldap_context,
+                 LDAP *ld, LDAPMessage *result, const char *user,
+                 krb5_const_principal searchfor, unsigned int flags,
+                 krb5_db_entry **entry_out)
+{
+    krb5_error_code st = 0;
+    LDAPMessage *ent;
+    char **values, *cname = NULL;
+    krb5_principal cprinc = NULL;
+    krb5_boolean found = FALSE;
+    krb5_db_entry *entry = NULL;
+    int i;
+
+    *entry_out = NULL;
+
+    for (ent = ldap_first_entry(ld, result); ent != NULL && !found;
+         ent = ldap_next_entry(ld, ent)) {
+
+        /* get the associated directory user information */
+        if ((values = ldap_get_values(ld, ent, "krbprincipalname")) != NULL) {
+            /* a wild-card in a principal name can return a list of kerberos
+             * principals.  Make sure that the correct principal is returned.
+             * NOTE: a principalname k* in ldap server will return all the
+             * principals starting with a k */
+            for (i = 0; values[i] != NULL; ++i) {
+                if (strcmp(values[i], user) == 0) {
+                    found = TRUE;
+                    break;
+                }
+            }
+            ldap_value_free(values);
+        }
+        if (!found) /* no matching principal found */
+            continue;
+
+        if ((values = ldap_get_values(ld, ent, "krbcanonicalname")) != NULL) {
+            if (values[0] && strcmp(values[0], user) != 0) {
+                /* We matched an alias, not the canonical name. */
+                if (flags & KRB5_KDB_FLAG_ALIAS_OK) {
+                    st = krb5_ldap_parse_principal_name(values[0], &cname);
+                    if (st == 0)
+                        st = krb5_parse_name(context, cname, &cprinc);
+                } else { /* No canonicalization, so don't return aliases. */
+                    found = FALSE;
+                }
+            }
+            ldap_value_free(values);
+            if (st != 0)
+                goto cleanup;
+            if (!found)
+                continue;
+        }
+
+        entry = k5alloc(sizeof(*entry), &st);
+        if (entry == NULL)
+            goto cleanup;
+        if ((st = populate_krb5_db_entry(context, ldap_context, ld, ent,
+                                         cprinc ? cprinc : searchfor,
+                                         entry)) != 0)
+            goto cleanup;
+    }
+
+    *entry_out = entry;
+    entry = NULL;
+
+cleanup:
+    krb5_db_free_principal(context, entry);
+    free(cname);
+    krb5_free_principal(context, cprinc);
+    return st;
+}
+
 /*
  * look up a principal in the directory.
  */
@@ -106,17 +226,15 @@ krb5_error_code
 krb5_ldap_get_principal(krb5_context context, krb5_const_principal searchfor,
                         unsigned int flags, krb5_db_entry **entry_ptr)
 {
-    char                        *user=NULL, *filter=NULL, *filtuser=NULL;
-    unsigned int                tree=0, ntrees=1, princlen=0;
+    char                        *user=NULL, *filter=NULL;
+    unsigned int                tree=0, ntrees=1;
     krb5_error_code             tempst=0, st=0;
-    char                        **values=NULL, **subtree=NULL, *cname=NULL;
+    char                        **subtree=NULL;
     LDAP                        *ld=NULL;
-    LDAPMessage                 *result=NULL, *ent=NULL;
+    LDAPMessage                 *result=NULL;
     krb5_ldap_context           *ldap_context=NULL;
     kdb5_dal_handle             *dal_handle=NULL;
     krb5_ldap_server_handle     *ldap_server_handle=NULL;
-    krb5_principal              cprinc=NULL;
-    krb5_boolean                found=FALSE;
     krb5_db_entry               *entry = NULL;
 
     *entry_ptr = NULL;
@@ -138,85 +256,25 @@ krb5_ldap_get_principal(krb5_context context, krb5_const_principal searchfor,
         goto cleanup;
     }
 
-    if ((st=krb5_unparse_name(context, searchfor, &user)) != 0)
-        goto cleanup;
-
-    if ((st=krb5_ldap_unparse_principal_name(user)) != 0)
+    if ((st = make_princ_filter(context, searchfor, &user, &filter)) != 0)
         goto cleanup;
 
-    filtuser = ldap_filter_correct(user);
-    if (filtuser == NULL) {
-        st = ENOMEM;
-        goto cleanup;
-    }
-
-    princlen = strlen(FILTER) + strlen(filtuser) + 2 + 1;  /* 2 for closing brackets */
-    if ((filter = malloc(princlen)) == NULL) {
-        st = ENOMEM;
-        goto cleanup;
-    }
-    snprintf(filter, princlen, FILTER"%s))", filtuser);
-
     if ((st = krb5_get_subtree_info(ldap_context, &subtree, &ntrees)) != 0)
         goto cleanup;
 
     GET_HANDLE();
-    for (tree=0; tree < ntrees && !found; ++tree) {
+    for (tree=0; tree < ntrees && entry == NULL; ++tree) {
 
         LDAP_SEARCH(subtree[tree], ldap_context->lrparams->search_scope, filter, principal_attributes);
-        for (ent=ldap_first_entry(ld, result); ent != NULL && !found; ent=ldap_next_entry(ld, ent)) {
-
-            /* get the associated directory user information */
-            if ((values=ldap_get_values(ld, ent, "krbprincipalname")) != NULL) {
-                int i;
-
-                /* a wild-card in a principal name can return a list of kerberos principals.
-                 * Make sure that the correct principal is returned.
-                 * NOTE: a principalname k* in ldap server will return all the principals starting with a k
-                 */
-                for (i=0; values[i] != NULL; ++i) {
-                    if (strcmp(values[i], user) == 0) {
-                        found = TRUE;
-                        break;
-                    }
-                }
-                ldap_value_free(values);
-
-                if (!found) /* no matching principal found */
-                    continue;
-            }
-
-            if ((values=ldap_get_values(ld, ent, "krbcanonicalname")) != NULL) {
-                if (values[0] && strcmp(values[0], user) != 0) {
-                    /* We matched an alias, not the canonical name. */
-                    if (flags & KRB5_KDB_FLAG_ALIAS_OK) {
-                        st = krb5_ldap_parse_principal_name(values[0], &cname);
-                        if (st != 0)
-                            goto cleanup;
-                        st = krb5_parse_name(context, cname, &cprinc);
-                        if (st != 0)
-                            goto cleanup;
-                    } else /* No canonicalization, so don't return aliases. */
-                        found = FALSE;
-                }
-                ldap_value_free(values);
-                if (!found)
-                    continue;
-            }
-
-            entry = k5alloc(sizeof(*entry), &st);
-            if (entry == NULL)
-                goto cleanup;
-            if ((st = populate_krb5_db_entry(context, ldap_context, ld, ent,
-                                             cprinc ? cprinc : searchfor,
-                                             entry)) != 0)
-                goto cleanup;
-        }
+        st = find_princ_entry(context, ldap_context, ld, result, user,
+                              searchfor, flags, &entry);
+        if (st != 0)
+            goto cleanup;
         ldap_msgfree(result);
         result = NULL;
     } /* for (tree=0 ... */
 
-    if (found) {
+    if (entry != NULL) {
         *entry_ptr = entry;
         entry = NULL;
     } else
@@ -242,16 +300,351 @@ cleanup:
     if (user)
         free(user);
 
-    if (filtuser)
-        free(filtuser);
+    return st;
+}
 
-    if (cname)
-        free(cname);
+/*
+ * An asynchronous principal lookup.  Each lookup takes an idle server handle
+ * from the pool without opening a new connection.  At most
+ * ldap_conns_per_server - 1 lookups are outstanding at once, leaving a handle
+ * for synchronous lookups; further lookups wait in a queue on the LDAP context
+ * and are started as handles are returned.  If no handle is idle and no
+ * lookup is outstanding, the lookup is performed synchronously, which opens a
+ * connection or rebinds as needed.  The searches of each subtree are
+ * sent with ldap_search_ext(), and the results are collected when the
+ * connection becomes readable.  Lookups holding a handle are kept on a list,
+ * so that they and the queued lookups can be failed if the database is closed
+ * first.
+ */
+struct ldap_lookup {
+    struct ldap_lookup *next;
+    krb5_context context;
+    krb5_ldap_context *ldap_context;
+    krb5_ldap_server_handle *handle;
+    verto_ctx *vctx;
+    verto_ev *ev;
+    krb5_principal searchfor;
+    unsigned int flags;
+    char *user;
+    char *filter;
+    char **subtree;
+    unsigned int ntrees;
+    unsigned int tree;
+    int msgid;
+    krb5_db_get_principal_cb respond;
+    void *arg;
+};
+
+/* Return lookup's server handle to the pool, if it has one. */
+static void
+release_handle(struct ldap_lookup *lookup)
+{
+    krb5_ldap_context *ldap_context = lookup->ldap_context;
+    struct ldap_lookup **lp;
+
+    if (lookup->handle == NULL)
+        return;
+    for (lp = &ldap_context->active_lookups; *lp != NULL; lp = &(*lp)->next) {
+        if (*lp == lookup) {
+            *lp = lookup->next;
+            break;
+        }
+    }
+    lookup->next = NULL;
+    krb5_ldap_put_handle_to_pool(ldap_context, lookup->handle);
+    lookup->handle = NULL;
+    ldap_context->async_lookups--;
+}
 
-    if (cprinc)
-        krb5_free_principal(context, cprinc);
+static void
+free_lookup(struct ldap_lookup *lookup)
+{
+    unsigned int i;
 
-    return st;
+    if (lookup->ev != NULL)
+        verto_del(lookup->ev);
+    release_handle(lookup);
+    krb5_free_principal(lookup->context, lookup->searchfor);
+    free(lookup->user);
+    free(lookup->filter);
+    if (lookup->subtree != NULL) {
+        for (i = 0; i < lookup->ntrees; i++)
+            free(lookup->subtree[i]);
+        free(lookup->subtree);
+    }
+    free(lookup);
+}
+
+static void
+finish_lookup(struct ldap_lookup *lookup, krb5_error_code st,
+              krb5_db_entry *entry)
+{
+    krb5_context context = lookup->context;
+    krb5_db_get_principal_cb respond = lookup->respond;
+    void *arg = lookup->arg;
+
+    free_lookup(lookup);
+    (*respond)(context, arg, st, entry);
+}
+
+/* Return the handle of a lookup to the pool and perform it synchronously,
+ * which will connect, rebind, or move to another server as needed. */
+static void
+retry_lookup(struct ldap_lookup *lookup)
+{
+    krb5_error_code st;
+    krb5_db_entry *entry = NULL;
+
+    release_handle(lookup);
+    st = krb5_ldap_get_principal(lookup->context, lookup->searchfor,
+                                 lookup->flags, &entry);
+    finish_lookup(lookup, st, entry);
+}
+
+/* Send the search of the current subtree. */
+static int
+send_search(struct ldap_lookup *lookup)
+{
+    return ldap_search_ext(lookup->handle->ldap_handle,
+                           lookup->subtree[lookup->tree],
+                           lookup->ldap_context->lrparams->search_scope,
+                           lookup->filter, principal_attributes, 0, NULL,
+                           NULL, &timelimit, LDAP_NO_LIMIT, &lookup->msgid);
+}
+
+static void
+lookup_result(struct ldap_lookup *lookup)
+{
+    krb5_context context = lookup->context;
+    LDAP *ld = lookup->handle->ldap_handle;
+    LDAPMessage *result = NULL;
+    struct timeval zero = { 0, 0 };
+    krb5_db_entry *entry = NULL;
+    krb5_error_code st;
+    int rc;
+
+    rc = ldap_result(ld, lookup->msgid, LDAP_MSG_ALL, &zero, &result);
+    if (rc == 0)
+        return;                 /* The result is not complete yet. */
+    if (rc == -1)
+        (void)ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &rc);
+    else
+        rc = ldap_result2error(ld, result, 0);
+
+    if (translate_ldap_error(rc, OP_SEARCH) == KRB5_KDB_ACCESS_ERROR) {
+        ldap_msgfree(result);
+        retry_lookup(lookup);
+        return;
+    }
+    if (rc != LDAP_SUCCESS) {
+        ldap_msgfree(result);
+        finish_lookup(lookup, set_ldap_error(context, rc, OP_SEARCH), NULL);
+        return;
+    }
+
+    st = find_princ_entry(context, lookup->ldap_context, ld, result,
+                          lookup->user, lookup->searchfor, lookup->flags,
+                          &entry);
+    ldap_msgfree(result);
+    if (st != 0 || entry != NULL) {
+        finish_lookup(lookup, st, entry);
+        return;
+    }
+
+    /* Search the next subtree, if there is one. */
+    if (++lookup->tree >= lookup->ntrees) {
+        finish_lookup(lookup, KRB5_KDB_NOENTRY, NULL);
+        return;
+    }
+    rc = send_search(lookup);
+    if (rc != LDAP_SUCCESS)
+        finish_lookup(lookup, set_ldap_error(context, rc, OP_SEARCH), NULL);
+}
+
+static void start_queued_lookups(krb5_ldap_context *ldap_context);
+
+static void
+lookup_readable(verto_ctx *vctx, verto_ev *ev)
+{
+    struct ldap_lookup *lookup = verto_get_private(ev);
+    krb5_ldap_context *ldap_context = lookup->ldap_context;
+
+    lookup_result(lookup);
+    /* Use any handle the lookup returned to the pool. */
+    start_queued_lookups(ldap_context);
+}
+
+/* Take an idle server handle from the pool for lookup, if one is available,
+ * without opening a new connection. */
+static krb5_boolean
+take_handle(struct ldap_lookup *lookup)
+{
+    krb5_ldap_context *ldap_context = lookup->ldap_context;
+
+    if (ldap_context->async_lookups >= ldap_context->max_server_conns - 1)
+        return FALSE;
+    lookup->handle = krb5_ldap_idle_handle_from_pool(ldap_context);
+    if (lookup->handle == NULL)
+        return FALSE;
+    ldap_context->async_lookups++;
+    return TRUE;
+}
+
+/* Link lookup, which has just been dequeued or created and holds a handle,
+ * into the list of active lookups. */
+static void
+add_active(struct ldap_lookup *lookup)
+{
+    krb5_ldap_context *ldap_context = lookup->ldap_context;
+
+    lookup->next = ldap_context->active_lookups;
+    ldap_context->active_lookups = lookup;
+}
+
+/* Send the first search of lookup, which holds a server handle, and wait for
+ * the connection to become readable. */
+static void
+start_lookup(struct ldap_lookup *lookup)
+{
+    int rc, fd = -1;
+
+    rc = send_search(lookup);
+    if (translate_ldap_error(rc, OP_SEARCH) == KRB5_KDB_ACCESS_ERROR) {
+        retry_lookup(lookup);
+        return;
+    } else if (rc != LDAP_SUCCESS) {
+        finish_lookup(lookup, set_ldap_error(lookup->context, rc, OP_SEARCH),
+                      NULL);
+        return;
+    }
+
+    if (ldap_get_option(lookup->handle->ldap_handle, LDAP_OPT_DESC,
+                        &fd) != LDAP_OPT_SUCCESS || fd < 0) {
+        retry_lookup(lookup);
+        return;
+    }
+    lookup->ev = verto_add_io(lookup->vctx, VERTO_EV_FLAG_PERSIST |
+                              VERTO_EV_FLAG_IO_READ, lookup_readable, fd);
+    if (lookup->ev == NULL) {
+        retry_lookup(lookup);
+        return;
+    }
+    verto_set_private(lookup->ev, lookup, NULL);
+}
+
+/* Start queued lookups for as many idle server handles as there are.  If none
+ * is idle and no lookup holds one, perform the next lookup synchronously. */
+static void
+start_queued_lookups(krb5_ldap_context *ldap_context)
+{
+    struct ldap_lookup *lookup;
+
+    while ((lookup = ldap_context->lookup_queue) != NULL) {
+        if (!take_handle(lookup) && ldap_context->async_lookups > 0)
+            return;
+        ldap_context->lookup_queue = lookup->next;
+        lookup->next = NULL;
+        if (lookup->handle != NULL) {
+            add_active(lookup);
+            start_lookup(lookup);
+        } else {
+            retry_lookup(lookup);
+        }
+    }
+}
+
+/*
+ * Fail the lookups which are outstanding or waiting for a server handle, when
+ * the database is closed.  ldap_context must already be detached from the DAL
+ * handle, so that lookups started by the callbacks fail immediately.
+ */
+void
+krb5_ldap_cancel_lookups(krb5_ldap_context *ldap_context)
+{
+    struct ldap_lookup *lookup;
+
+    while ((lookup = ldap_context->lookup_queue) != NULL) {
+        ldap_context->lookup_queue = lookup->next;
+        lookup->next = NULL;
+        finish_lookup(lookup, KRB5_KDB_DBNOTINITED, NULL);
+    }
+    ldap_context->lookup_queue_tail = NULL;
+    while ((lookup = ldap_context->active_lookups) != NULL)
+        finish_lookup(lookup, KRB5_KDB_DBNOTINITED, NULL);
+}
+
+void
+krb5_ldap_get_principal_async(krb5_context context, verto_ctx *vctx,
+                              krb5_const_principal searchfor,
+                              unsigned int flags,
+                              krb5_db_get_principal_cb respond, void *arg)
+{
+    krb5_error_code st;
+    krb5_ldap_context *ldap_context = context->dal_handle->db_context;
+    struct ldap_lookup *lookup;
+
+    krb5_clear_error_message(context);
+
+    if (ldap_context == NULL || ldap_context->server_info_list == NULL) {
+        (*respond)(context, arg, KRB5_KDB_DBNOTINITED, NULL);
+        return;
+    }
+    if (!is_principal_in_realm(ldap_context, searchfor)) {
+        st = KRB5_KDB_NOENTRY;
+        k5_setmsg(context, st, _("Principal does not belong to realm"));
+        (*respond)(context, arg, st, NULL);
+        return;
+    }
+
+    lookup = k5alloc(sizeof(*lookup), &st);
+    if (lookup == NULL) {
+        (*respond)(context, arg, st, NULL);
+        return;
+    }
+    lookup->context = context;
+    lookup->ldap_context = ldap_context;
+    lookup->vctx = vctx;
+    lookup->flags = flags;
+    lookup->respond = respond;
+    lookup->arg = arg;
+
+    st = krb5_copy_principal(context, searchfor, &lookup->searchfor);
+    if (st)
+        goto error;
+    st = make_princ_filter(context, searchfor, &lookup->user, &lookup->filter);
+    if (st)
+        goto error;
+    st = krb5_get_subtree_info(ldap_context, &lookup->subtree,
+                               &lookup->ntrees);
+    if (st)
+        goto error;
+    if (lookup->ntrees == 0) {
+        st = KRB5_KDB_NOENTRY;
+        goto error;
+    }
+
+    if (ldap_context->lookup_queue != NULL || !take_handle(lookup)) {
+        if (ldap_context->async_lookups == 0) {
+            retry_lookup(lookup);
+            return;
+        }
+        /* Wait for an outstanding lookup to return its handle. */
+        if (ldap_context->lookup_queue == NULL)
+            ldap_context->lookup_queue = lookup;
+        else
+            ldap_context->lookup_queue_tail->next = lookup;
+        ldap_context->lookup_queue_tail = lookup;
+        return;
+    }
+    add_active(lookup);
+    start_lookup(lookup);
+    /* If the search failed, start_lookup() returned the handle to the
+     * pool. */
+    start_queued_lookups(ldap_context);
+    return;
+
+error:
+    finish_lookup(lookup, st, NULL);
 }
 
 typedef enum{ ADD_PRINCIPAL, MODIFY_PRINCIPAL } OPERATION;
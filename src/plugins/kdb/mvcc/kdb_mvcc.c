@@ -0,0 +1,836 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/mvcc/kdb_mvcc.c - KDB module glue for the MVCC engine */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Each krb5 context has its own mvcc_env, so unlike the db2 module this
+ * module needs no global mutex; threads with separate contexts read
+ * concurrently, and the engine serializes writers.
+ *
+ * KDB lock modes map onto the engine as follows: a shared lock pins a read
+ * snapshot, so a dump taken under it is consistent without blocking writers;
+ * an exclusive or permanent lock opens a write transaction which commits when
+ * the lock is released.  A permanent lock therefore never leaves the database
+ * unusable; if the process dies, the transaction is simply discarded.
+ */
+
+#include "kdb_mvcc.h"
+#include <kadm5/admin.h>
+#include "kdb5.h"
+
+static krb5_boolean
+inited(krb5_context context)
+{
+    mvcc_context *dbc = context->dal_handle->db_context;
+
+    return dbc != NULL && dbc->env != NULL;
+}
+
+static void
+ctx_free(mvcc_context *dbc)
+{
+    if (dbc == NULL)
+        return;
+    mvcc_env_close(dbc->env);
+    free(dbc->path);
+    free(dbc);
+}
+
+static krb5_error_code
+get_db_opt(const char *input, char **opt, char **val)
+{
+    const char *pos = strchr(input, '=');
+
+    *opt = *val = NULL;
+    if (pos == NULL) {
+        *val = strdup(input);
+        return (*val == NULL) ? ENOMEM : 0;
+    }
+    *opt = k5memdup0(input, pos - input, NULL);
+    *val = strdup(pos + 1);
+    if (*opt == NULL || *val == NULL) {
+        free(*opt);
+        free(*val);
+        *opt = *val = NULL;
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/* Using db_args and the profile, create a module context for context. */
+static krb5_error_code
+configure_context(krb5_context context, char *conf_section, char **db_args)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc;
+    profile_t profile = KRB5_DB_GET_PROFILE(context);
+    char **t_ptr, *opt = NULL, *val = NULL, *pval = NULL, *dbname = NULL;
+    int bval;
+
+    dbc = k5alloc(sizeof(*dbc), &ret);
+    if (dbc == NULL)
+        return ret;
+
+    for (t_ptr = db_args; t_ptr && *t_ptr; t_ptr++) {
+        free(opt);
+        free(val);
+        ret = get_db_opt(*t_ptr, &opt, &val);
+        if (ret)
+            goto cleanup;
+        if (opt != NULL && strcmp(opt, "dbname") == 0) {
+            free(dbname);
+            dbname = strdup(val);
+            if (dbname == NULL) {
+                ret = ENOMEM;
+                goto cleanup;
+            }
+        } else if (opt == NULL && strcmp(val, "temporary") == 0) {
+            dbc->tempdb = TRUE;
+        } else if (opt == NULL && strcmp(val, "merge_nra") == 0) {
+            dbc->merge_nra = TRUE;
+        } else {
+            ret = EINVAL;
+            k5_setmsg(context, ret, _("Unsupported argument \"%s\" for mvcc"),
+                      (opt != NULL) ? opt : val);
+            goto cleanup;
+        }
+    }
+
+    if (dbname == NULL) {
+        /* Check for database_name in the db_module section, and for
+         * compatibility, in the realm. */
+        ret = profile_get_string(profile, KDB_MODULE_SECTION, conf_section,
+                                 KRB5_CONF_DATABASE_NAME, NULL, &pval);
+        if (ret == 0 && pval == NULL) {
+            ret = profile_get_string(profile, KDB_REALM_SECTION,
+                                     KRB5_DB_GET_REALM(context),
+                                     KRB5_CONF_DATABASE_NAME,
+                                     DEFAULT_KDB_FILE, &pval);
+        }
+        if (ret)
+            goto cleanup;
+        dbname = strdup(pval);
+        if (dbname == NULL) {
+            ret = ENOMEM;
+            goto cleanup;
+        }
+    }
+    if (asprintf(&dbc->path, "%s%s", dbname, dbc->tempdb ? "~" : "") < 0) {
+        dbc->path = NULL;
+        ret = ENOMEM;
+        goto cleanup;
+    }
+
+    ret = profile_get_boolean(profile, KDB_MODULE_SECTION, conf_section,
+                              KRB5_CONF_DISABLE_LAST_SUCCESS, FALSE, &bval);
+    if (ret)
+        goto cleanup;
+    dbc->disable_last_success = bval;
+
+    ret = profile_get_boolean(profile, KDB_MODULE_SECTION, conf_section,
+                              KRB5_CONF_DISABLE_LOCKOUT, FALSE, &bval);
+    if (ret)
+        goto cleanup;
+    dbc->disable_lockout = bval;
+
+    context->dal_handle->db_context = dbc;
+    dbc = NULL;
+
+cleanup:
+    ctx_free(dbc);
+    free(opt);
+    free(val);
+    free(dbname);
+    profile_release_string(pval);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_init_library()
+{
+    return mvcc_tree_init();
+}
+
+static krb5_error_code
+mvcc_fini_library()
+{
+    mvcc_tree_fini();
+    return 0;
+}
+
+static krb5_error_code
+mvcc_fini(krb5_context context)
+{
+    ctx_free(context->dal_handle->db_context);
+    context->dal_handle->db_context = NULL;
+    return 0;
+}
+
+static krb5_error_code
+mvcc_open(krb5_context context, char *conf_section, char **db_args, int mode)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc;
+
+    krb5_clear_error_message(context);
+    if (inited(context))
+        return 0;
+
+    ret = configure_context(context, conf_section, db_args);
+    if (ret)
+        return ret;
+    dbc = context->dal_handle->db_context;
+    ret = mvcc_env_open(dbc->path, FALSE, &dbc->env);
+    if (ret)
+        mvcc_fini(context);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_create(krb5_context context, char *conf_section, char **db_args)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc;
+
+    krb5_clear_error_message(context);
+    if (inited(context))
+        return 0;
+
+    ret = configure_context(context, conf_section, db_args);
+    if (ret)
+        return ret;
+    dbc = context->dal_handle->db_context;
+
+    /* A temporary database left over from an earlier load can be
+     * discarded. */
+    if (dbc->tempdb)
+        (void)unlink(dbc->path);
+    ret = mvcc_env_create(dbc->path);
+    if (ret)
+        goto error;
+    ret = mvcc_env_open(dbc->path, FALSE, &dbc->env);
+    if (ret)
+        goto error;
+
+    /* Load the temporary database in one transaction, committed by
+     * promotion. */
+    if (dbc->tempdb) {
+        ret = mvcc_begin(dbc->env);
+        if (ret)
+            goto error;
+        dbc->lock_modes[dbc->nlocks++] = KRB5_DB_LOCKMODE_EXCLUSIVE;
+    }
+    return 0;
+
+error:
+    mvcc_fini(context);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_destroy(krb5_context context, char *conf_section, char **db_args)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc;
+
+    if (inited(context))
+        mvcc_fini(context);
+
+    krb5_clear_error_message(context);
+    ret = configure_context(context, conf_section, db_args);
+    if (ret)
+        return ret;
+    dbc = context->dal_handle->db_context;
+    ret = mvcc_env_open(dbc->path, FALSE, &dbc->env);
+    if (ret)
+        goto cleanup;
+
+    /* Make processes with the file open notice that it is gone. */
+    ret = mvcc_env_retire(dbc->env);
+    if (ret)
+        goto cleanup;
+    if (unlink(dbc->path) != 0)
+        ret = errno;
+
+cleanup:
+    mvcc_fini(context);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_get_age(krb5_context context, char *db_name, time_t *age)
+{
+    mvcc_context *dbc = context->dal_handle->db_context;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+    return mvcc_env_age(dbc->env, age);
+}
+
+static krb5_error_code
+mvcc_lock(krb5_context context, int mode)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc = context->dal_handle->db_context;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+    if (dbc->nlocks == (int)(sizeof(dbc->lock_modes) /
+                             sizeof(*dbc->lock_modes)))
+        return KRB5_KDB_RECURSIVELOCK;
+
+    switch (mode) {
+    case KRB5_DB_LOCKMODE_SHARED:
+        ret = mvcc_pin(dbc->env);
+        break;
+    case KRB5_DB_LOCKMODE_EXCLUSIVE:
+    case KRB5_DB_LOCKMODE_PERMANENT:
+        ret = mvcc_begin(dbc->env);
+        break;
+    default:
+        return KRB5_KDB_BADLOCKMODE;
+    }
+    if (ret)
+        return ret;
+    dbc->lock_modes[dbc->nlocks++] = mode;
+    return 0;
+}
+
+static krb5_error_code
+mvcc_unlock(krb5_context context)
+{
+    mvcc_context *dbc = context->dal_handle->db_context;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+    if (dbc->nlocks == 0)
+        return KRB5_KDB_NOTLOCKED;
+    if (dbc->lock_modes[--dbc->nlocks] == KRB5_DB_LOCKMODE_SHARED) {
+        mvcc_unpin(dbc->env);
+        return 0;
+    }
+    return mvcc_commit(dbc->env);
+}
+
+/* Set *key_out to the tree key for princ. */
+static krb5_error_code
+princ_key(krb5_context context, krb5_const_principal princ, krb5_data *key)
+{
+    krb5_error_code ret;
+    char *name;
+
+    *key = empty_data();
+    ret = krb5_unparse_name(context, princ, &name);
+    if (ret)
+        return ret;
+    *key = string2data(name);
+    return 0;
+}
+
+static krb5_error_code
+mvcc_get_principal(krb5_context context, krb5_const_principal searchfor,
+                   unsigned int flags, krb5_db_entry **entry)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key, val = empty_data();
+
+    *entry = NULL;
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = princ_key(context, searchfor, &key);
+    if (ret)
+        return ret;
+    ret = mvcc_get(dbc->env, MVCC_TREE_PRINC, &key, &val);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_decode_princ(context, &val, entry);
+
+cleanup:
+    krb5_free_data_contents(context, &key);
+    krb5_free_data_contents(context, &val);
+    return ret;
+}
+
+krb5_error_code
+mvcc_put_principal(krb5_context context, krb5_db_entry *entry, char **db_args)
+{
+    krb5_error_code ret, ret2;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key = empty_data(), val = empty_data();
+
+    krb5_clear_error_message(context);
+    if (db_args != NULL) {
+        k5_setmsg(context, EINVAL, _("Unsupported argument \"%s\" for mvcc"),
+                  db_args[0]);
+        return EINVAL;
+    }
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = princ_key(context, entry->princ, &key);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_encode_princ(context, entry, &val);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_begin(dbc->env);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_put(dbc->env, MVCC_TREE_PRINC, &key, &val);
+    ret2 = mvcc_commit(dbc->env);
+    if (!ret)
+        ret = ret2;
+
+cleanup:
+    krb5_free_data_contents(context, &key);
+    zapfree(val.data, val.length);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_delete_principal(krb5_context context, krb5_const_principal searchfor)
+{
+    krb5_error_code ret, ret2;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = princ_key(context, searchfor, &key);
+    if (ret)
+        return ret;
+    ret = mvcc_begin(dbc->env);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_del(dbc->env, MVCC_TREE_PRINC, &key);
+    ret2 = mvcc_commit(dbc->env);
+    if (!ret)
+        ret = ret2;
+
+cleanup:
+    krb5_free_data_contents(context, &key);
+    return ret;
+}
+
+/*
+ * Iterate over the principals in env, which must be pinned or within a
+ * transaction.  Each step seeks past the previous key, so the callback may
+ * modify the database.
+ */
+static krb5_error_code
+iterate_princs(krb5_context context, mvcc_env *env, krb5_boolean reverse,
+               krb5_error_code (*func)(krb5_pointer, krb5_db_entry *),
+               krb5_pointer func_arg)
+{
+    krb5_error_code ret;
+    krb5_db_entry *entry;
+    krb5_data prev = empty_data(), key, val;
+    krb5_boolean first = TRUE;
+
+    for (;;) {
+        ret = mvcc_next(env, MVCC_TREE_PRINC, first ? NULL : &prev, reverse,
+                        &key, &val);
+        if (ret == KRB5_KDB_NOENTRY) {
+            ret = 0;
+            break;
+        }
+        if (ret)
+            break;
+        first = FALSE;
+        krb5_free_data_contents(context, &prev);
+        prev = key;
+        ret = mvcc_decode_princ(context, &val, &entry);
+        zapfree(val.data, val.length);
+        if (ret)
+            break;
+        ret = (*func)(func_arg, entry);
+        krb5_db_free_principal(context, entry);
+        if (ret)
+            break;
+    }
+    krb5_free_data_contents(context, &prev);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_iterate(krb5_context context, char *match_expr,
+             krb5_error_code (*func)(krb5_pointer, krb5_db_entry *),
+             krb5_pointer func_arg, krb5_flags iterflags)
+{
+    krb5_error_code ret, ret2;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_boolean write = (iterflags & KRB5_DB_ITER_WRITE) != 0;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    /* A read-only iteration sees one consistent snapshot throughout. */
+    ret = write ? mvcc_begin(dbc->env) : mvcc_pin(dbc->env);
+    if (ret)
+        return ret;
+    ret = iterate_princs(context, dbc->env, (iterflags & KRB5_DB_ITER_REV) != 0,
+                         func, func_arg);
+    if (write) {
+        ret2 = mvcc_commit(dbc->env);
+        if (!ret)
+            ret = ret2;
+    } else {
+        mvcc_unpin(dbc->env);
+    }
+    return ret;
+}
+
+static krb5_error_code
+mvcc_create_policy(krb5_context context, osa_policy_ent_t policy)
+{
+    krb5_error_code ret, ret2;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key = string2data(policy->name), val = empty_data(), old;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = mvcc_encode_policy(policy, &val);
+    if (ret)
+        return ret;
+    ret = mvcc_begin(dbc->env);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_get(dbc->env, MVCC_TREE_POLICY, &key, &old);
+    if (ret == 0) {
+        krb5_free_data_contents(context, &old);
+        ret = KADM5_DUP;
+    } else if (ret == KRB5_KDB_NOENTRY) {
+        ret = mvcc_put(dbc->env, MVCC_TREE_POLICY, &key, &val);
+    }
+    ret2 = mvcc_commit(dbc->env);
+    if (!ret)
+        ret = ret2;
+
+cleanup:
+    krb5_free_data_contents(context, &val);
+    return ret;
+}
+
+krb5_error_code
+mvcc_get_policy(krb5_context context, char *name, osa_policy_ent_t *policy)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key = string2data(name), val;
+
+    *policy = NULL;
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = mvcc_get(dbc->env, MVCC_TREE_POLICY, &key, &val);
+    if (ret)
+        return ret;
+    ret = mvcc_decode_policy(&key, &val, policy);
+    krb5_free_data_contents(context, &val);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_put_policy(krb5_context context, osa_policy_ent_t policy)
+{
+    krb5_error_code ret, ret2;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key = string2data(policy->name), val = empty_data(), old;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = mvcc_encode_policy(policy, &val);
+    if (ret)
+        return ret;
+    ret = mvcc_begin(dbc->env);
+    if (ret)
+        goto cleanup;
+    ret = mvcc_get(dbc->env, MVCC_TREE_POLICY, &key, &old);
+    if (ret == 0) {
+        krb5_free_data_contents(context, &old);
+        ret = mvcc_put(dbc->env, MVCC_TREE_POLICY, &key, &val);
+    }
+    ret2 = mvcc_commit(dbc->env);
+    if (!ret)
+        ret = ret2;
+
+cleanup:
+    krb5_free_data_contents(context, &val);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_iter_policy(krb5_context context, char *match_entry,
+                 osa_adb_iter_policy_func func, void *data)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    osa_policy_ent_t pol;
+    krb5_data prev = empty_data(), key, val;
+    krb5_boolean first = TRUE;
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = mvcc_pin(dbc->env);
+    if (ret)
+        return ret;
+    for (;;) {
+        ret = mvcc_next(dbc->env, MVCC_TREE_POLICY, first ? NULL : &prev,
+                        FALSE, &key, &val);
+        if (ret == KRB5_KDB_NOENTRY) {
+            ret = 0;
+            break;
+        }
+        if (ret)
+            break;
+        first = FALSE;
+        krb5_free_data_contents(context, &prev);
+        prev = key;
+        ret = mvcc_decode_policy(&key, &val, &pol);
+        krb5_free_data_contents(context, &val);
+        if (ret)
+            break;
+        (*func)(data, pol);
+        krb5_db_free_policy(context, pol);
+    }
+    krb5_free_data_contents(context, &prev);
+    mvcc_unpin(dbc->env);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_delete_policy(krb5_context context, char *policy)
+{
+    krb5_error_code ret, ret2;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    krb5_data key = string2data(policy);
+
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+
+    ret = mvcc_begin(dbc->env);
+    if (ret)
+        return ret;
+    ret = mvcc_del(dbc->env, MVCC_TREE_POLICY, &key);
+    ret2 = mvcc_commit(dbc->env);
+    return ret ? ret : ret2;
+}
+
+/* Copy the non-replicated attributes of entries in real_env into the
+ * matching entries in the transaction open on temp_env. */
+static krb5_error_code
+merge_nra(krb5_context context, mvcc_env *temp_env, mvcc_env *real_env)
+{
+    krb5_error_code ret;
+    krb5_db_entry *temp = NULL, *real = NULL;
+    krb5_data prev = empty_data(), key, val;
+    krb5_boolean first = TRUE;
+
+    for (;;) {
+        ret = mvcc_next(temp_env, MVCC_TREE_PRINC, first ? NULL : &prev,
+                        FALSE, &key, &val);
+        if (ret == KRB5_KDB_NOENTRY) {
+            ret = 0;
+            break;
+        }
+        if (ret)
+            break;
+        first = FALSE;
+        krb5_free_data_contents(context, &prev);
+        prev = key;
+        zapfree(val.data, val.length);
+
+        /* The principal may be newly created, in which case skip it. */
+        ret = mvcc_get(real_env, MVCC_TREE_PRINC, &key, &val);
+        if (ret == KRB5_KDB_NOENTRY)
+            continue;
+        if (ret)
+            break;
+        ret = mvcc_decode_princ(context, &val, &real);
+        zapfree(val.data, val.length);
+        if (ret)
+            break;
+        ret = mvcc_get(temp_env, MVCC_TREE_PRINC, &key, &val);
+        if (!ret) {
+            ret = mvcc_decode_princ(context, &val, &temp);
+            zapfree(val.data, val.length);
+        }
+        if (ret)
+            break;
+
+        if (temp->last_success != real->last_success ||
+            temp->last_failed != real->last_failed ||
+            temp->fail_auth_count != real->fail_auth_count) {
+            temp->last_success = real->last_success;
+            temp->last_failed = real->last_failed;
+            temp->fail_auth_count = real->fail_auth_count;
+            ret = mvcc_encode_princ(context, temp, &val);
+            if (!ret) {
+                ret = mvcc_put(temp_env, MVCC_TREE_PRINC, &key, &val);
+                zapfree(val.data, val.length);
+            }
+        }
+        krb5_db_free_principal(context, temp);
+        krb5_db_free_principal(context, real);
+        temp = real = NULL;
+        if (ret)
+            break;
+    }
+    krb5_db_free_principal(context, temp);
+    krb5_db_free_principal(context, real);
+    krb5_free_data_contents(context, &prev);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_promote_db(krb5_context context, char *conf_section, char **db_args)
+{
+    krb5_error_code ret;
+    mvcc_context *dbc = context->dal_handle->db_context;
+    mvcc_env *real_env = NULL;
+    krb5_boolean real_txn = FALSE;
+    char *real_path = NULL;
+
+    /* context must hold the transaction loading a temporary DB. */
+    if (!inited(context))
+        return KRB5_KDB_DBNOTINITED;
+    if (!dbc->tempdb)
+        return EINVAL;
+    if (dbc->nlocks != 1 || !mvcc_in_txn(dbc->env))
+        return KRB5_KDB_NOTLOCKED;
+
+    real_path = k5memdup0(dbc->path, strlen(dbc->path) - 1, &ret);
+    if (real_path == NULL)
+        return ret;
+    ret = mvcc_env_create(real_path);
+    if (ret && ret != EEXIST)
+        goto cleanup;
+    ret = mvcc_env_open(real_path, FALSE, &real_env);
+    if (ret)
+        goto cleanup;
+
+    if (dbc->merge_nra) {
+        ret = merge_nra(context, dbc->env, real_env);
+        if (ret)
+            goto cleanup;
+    }
+    dbc->nlocks--;
+    ret = mvcc_commit(dbc->env);
+    if (ret)
+        goto cleanup;
+
+    /* Hold the real DB's write lock so no update to the old file can be
+     * lost, then swap the files and mark the old one as replaced. */
+    ret = mvcc_begin(real_env);
+    if (ret)
+        goto cleanup;
+    real_txn = TRUE;
+    if (rename(dbc->path, real_path) != 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    ret = mvcc_env_retire(real_env);
+    if (ret)
+        goto cleanup;
+    real_txn = FALSE;
+    ret = mvcc_commit(real_env);
+    if (ret)
+        goto cleanup;
+
+    /* Finalize the context since the temp DB is gone. */
+    mvcc_fini(context);
+
+cleanup:
+    if (real_txn)
+        mvcc_abort(real_env);
+    mvcc_env_close(real_env);
+    free(real_path);
+    return ret;
+}
+
+static krb5_error_code
+mvcc_check_policy_as(krb5_context context, krb5_kdc_req *request,
+                     krb5_db_entry *client, krb5_db_entry *server,
+                     krb5_timestamp kdc_time, const char **status,
+                     krb5_pa_data ***e_data)
+{
+    krb5_error_code ret;
+
+    ret = mvcc_lockout_check_policy(context, client, kdc_time);
+    if (ret == KRB5KDC_ERR_CLIENT_REVOKED)
+        *status = "LOCKED_OUT";
+    return ret;
+}
+
+static void
+mvcc_audit_as_req(krb5_context context, krb5_kdc_req *request,
+                  krb5_db_entry *client, krb5_db_entry *server,
+                  krb5_timestamp authtime, krb5_error_code error_code)
+{
+    (void)mvcc_lockout_audit(context, client, authtime, error_code);
+}
+
+kdb_vftabl PLUGIN_SYMBOL_NAME(krb5_mvcc, kdb_function_table) = {
+    KRB5_KDB_DAL_MAJOR_VERSION,             /* major version number */
+    0,                                      /* minor version number 0 */
+    /* init_library */                  mvcc_init_library,
+    /* fini_library */                  mvcc_fini_library,
+    /* init_module */                   mvcc_open,
+    /* fini_module */                   mvcc_fini,
+    /* create */                        mvcc_create,
+    /* destroy */                       mvcc_destroy,
+    /* get_age */                       mvcc_get_age,
+    /* lock */                          mvcc_lock,
+    /* unlock */                        mvcc_unlock,
+    /* get_principal */                 mvcc_get_principal,
+    /* put_principal */                 mvcc_put_principal,
+    /* delete_principal */              mvcc_delete_principal,
+    /* rename_principal */              NULL,
+    /* iterate */                       mvcc_iterate,
+    /* create_policy */                 mvcc_create_policy,
+    /* get_policy */                    mvcc_get_policy,
+    /* put_policy */                    mvcc_put_policy,
+    /* iter_policy */                   mvcc_iter_policy,
+    /* delete_policy */                 mvcc_delete_policy,
+    /* blah blah blah */ 0,0,0,0,0,
+    /* promote_db */                    mvcc_promote_db,
+    0, 0, 0, 0,
+    /* check_policy_as */               mvcc_check_policy_as,
+    0,
+    /* audit_as_req */                  mvcc_audit_as_req,
+    0, 0
+};
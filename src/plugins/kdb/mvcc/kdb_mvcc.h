@@ -0,0 +1,165 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/mvcc/kdb_mvcc.h - MVCC KDB module internal declarations */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KDB_MVCC_H
+#define KDB_MVCC_H
+
+#include "k5-int.h"
+#include <kdb.h>
+
+/*
+ * The mvcc module stores principals and policies in a single file holding two
+ * copy-on-write B+trees.  Committed pages are never modified in place, so
+ * readers work from a memory-mapped snapshot without taking any lock; a
+ * writer builds the next version of the trees in new pages and publishes it
+ * by writing one of two alternating meta pages.  The engine is in
+ * mvcc_tree.c; this header describes its interface to the KDB glue.
+ */
+
+#define MVCC_TREE_PRINC         0
+#define MVCC_TREE_POLICY        1
+#define MVCC_NTREES             2
+
+/* Longest key (unparsed principal or policy name) the trees accept. */
+#define MVCC_MAX_KEY            1000
+
+typedef struct mvcc_env_st mvcc_env;
+
+/* Initialize and finalize process-wide engine state. */
+int mvcc_tree_init(void);
+void mvcc_tree_fini(void);
+
+/* Create an empty database file at path.  Return EEXIST if it exists. */
+krb5_error_code mvcc_env_create(const char *path);
+
+/* Open the database file at path.  If rdonly is true, the caller will not
+ * attempt writes. */
+krb5_error_code mvcc_env_open(const char *path, krb5_boolean rdonly,
+                              mvcc_env **env_out);
+
+/* Abort any open transaction and close env. */
+void mvcc_env_close(mvcc_env *env);
+
+/* Mark the database file as replaced or destroyed, so that other processes
+ * holding it open will reopen the path on their next operation.  If env has an
+ * open transaction, the mark is written when it commits. */
+krb5_error_code mvcc_env_retire(mvcc_env *env);
+
+/* Set *age_out to the commit time of the newest version of the database. */
+krb5_error_code mvcc_env_age(mvcc_env *env, time_t *age_out);
+
+/*
+ * Pin a read snapshot.  Reads outside of a write transaction use the pinned
+ * snapshot; pins nest, and the snapshot is released when the outermost pin is
+ * released.  mvcc_get() and mvcc_next() pin and unpin implicitly.
+ */
+krb5_error_code mvcc_pin(mvcc_env *env);
+void mvcc_unpin(mvcc_env *env);
+
+/* Look up key in tree and place a copy of its value in *val_out.  Return
+ * KRB5_KDB_NOENTRY if key is not present. */
+krb5_error_code mvcc_get(mvcc_env *env, int tree, const krb5_data *key,
+                         krb5_data *val_out);
+
+/*
+ * Find the first key in tree greater than *after (less than, if reverse is
+ * true), or the first (last) key in tree if after is NULL.  Place copies of
+ * the key and value in *key_out and *val_out.  Return KRB5_KDB_NOENTRY at the
+ * end of the tree.
+ */
+krb5_error_code mvcc_next(mvcc_env *env, int tree, const krb5_data *after,
+                          krb5_boolean reverse, krb5_data *key_out,
+                          krb5_data *val_out);
+
+/*
+ * Begin a write transaction, waiting for any writer in another process.
+ * Transactions nest; only the outermost mvcc_commit() makes the changes
+ * durable and visible to readers.  If any operation within the transaction
+ * fails in a way which might leave the trees inconsistent, the transaction
+ * is poisoned and the outermost commit will fail.
+ */
+krb5_error_code mvcc_begin(mvcc_env *env);
+krb5_error_code mvcc_commit(mvcc_env *env);
+
+/* Discard the outermost transaction and all nested levels. */
+void mvcc_abort(mvcc_env *env);
+
+/* Return true if env has an open write transaction. */
+krb5_boolean mvcc_in_txn(mvcc_env *env);
+
+/* Store val under key in tree within the current transaction. */
+krb5_error_code mvcc_put(mvcc_env *env, int tree, const krb5_data *key,
+                         const krb5_data *val);
+
+/* Remove key from tree within the current transaction.  Return
+ * KRB5_KDB_NOENTRY if key is not present. */
+krb5_error_code mvcc_del(mvcc_env *env, int tree, const krb5_data *key);
+
+/* Per-context module state. */
+typedef struct {
+    char *path;                 /* database file name */
+    krb5_boolean tempdb;
+    krb5_boolean merge_nra;
+    krb5_boolean disable_last_success;
+    krb5_boolean disable_lockout;
+    mvcc_env *env;
+    int lock_modes[16];         /* stack of KDB lock modes held */
+    int nlocks;
+} mvcc_context;
+
+/* From marshal.c */
+krb5_error_code mvcc_encode_princ(krb5_context context,
+                                  const krb5_db_entry *entry,
+                                  krb5_data *out);
+krb5_error_code mvcc_decode_princ(krb5_context context, const krb5_data *in,
+                                  krb5_db_entry **entry_out);
+krb5_error_code mvcc_encode_policy(const osa_policy_ent_rec *pol,
+                                   krb5_data *out);
+krb5_error_code mvcc_decode_policy(const krb5_data *key, const krb5_data *in,
+                                   osa_policy_ent_t *pol_out);
+
+/* From kdb_mvcc.c */
+krb5_error_code mvcc_get_policy(krb5_context context, char *name,
+                                osa_policy_ent_t *policy);
+krb5_error_code mvcc_put_principal(krb5_context context,
+                                   krb5_db_entry *entry, char **db_args);
+
+/* From lockout.c */
+krb5_error_code mvcc_lockout_check_policy(krb5_context context,
+                                          krb5_db_entry *entry,
+                                          krb5_timestamp stamp);
+krb5_error_code mvcc_lockout_audit(krb5_context context,
+                                   krb5_db_entry *entry,
+                                   krb5_timestamp stamp,
+                                   krb5_error_code status);
+
+#endif /* KDB_MVCC_H */
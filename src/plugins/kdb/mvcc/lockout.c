@@ -0,0 +1,85 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/mvcc/lockout.c */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Export of this software from the United States of America may
+ *   require a specific license from the United States Government.
+ *   It is the responsibility of any person or organization contemplating
+ *   export to obtain such a license before exporting.
+ *
+ * WITHIN THAT CONSTRAINT, permission to use, copy, modify, and
+ * distribute this software and its documentation for any purpose and
+ * without fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright notice and
+ * this permission notice appear in supporting documentation, and that
+ * the name of M.I.T. not be used in advertising or publicity pertaining
+ * to distribution of the software without specific, written prior
+ * permission.  Furthermore if you modify this software you must label
+ * your software as modified software and not distribute it in such a
+ * fashion that it might be confused with the original M.I.T. software.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is" without express
+ * or implied warranty.
+ */
+
+#include "k5-int.h"
+#include <kadm5/server_internal.h>
+#include "kdb5.h"
+#include "kdb_mvcc.h"
+
+krb5_error_code
+mvcc_lockout_check_policy(krb5_context context, krb5_db_entry *entry,
+                          krb5_timestamp stamp)
+{
+    krb5_error_code code;
+    krb5_kvno max_fail = 0;
+    krb5_deltat failcnt_interval = 0;
+    krb5_deltat lockout_duration = 0;
+    mvcc_context *db_ctx = context->dal_handle->db_context;
+
+    if (db_ctx->disable_lockout)
+        return 0;
+
+    code = kdb_lockout_policy(context, entry, mvcc_get_policy, &max_fail,
+                              &failcnt_interval, &lockout_duration);
+    if (code != 0)
+        return code;
+
+    if (kdb_lockout_locked(context, stamp, max_fail, lockout_duration, entry))
+        return KRB5KDC_ERR_CLIENT_REVOKED;
+
+    return 0;
+}
+
+krb5_error_code
+mvcc_lockout_audit(krb5_context context, krb5_db_entry *entry,
+                   krb5_timestamp stamp, krb5_error_code status)
+{
+    krb5_error_code code;
+    krb5_kvno max_fail = 0;
+    krb5_deltat failcnt_interval = 0;
+    krb5_deltat lockout_duration = 0;
+    mvcc_context *db_ctx = context->dal_handle->db_context;
+
+    if (!kdb_lockout_audited(status) || entry == NULL)
+        return 0;
+
+    if (!db_ctx->disable_lockout) {
+        code = kdb_lockout_policy(context, entry, mvcc_get_policy, &max_fail,
+                                  &failcnt_interval, &lockout_duration);
+        if (code != 0)
+            return code;
+    }
+
+    /* Don't continue to modify the DB for an already locked account. */
+    if (kdb_lockout_locked(context, stamp, max_fail, lockout_duration, entry))
+        return 0;
+
+    if (kdb_lockout_update(context, entry, stamp, status, failcnt_interval,
+                           db_ctx->disable_lockout,
+                           db_ctx->disable_last_success) == 0)
+        return 0;
+    return mvcc_put_principal(context, entry, NULL);
+}
@@ -0,0 +1,365 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/mvcc/marshal.c - principal and policy record encodings */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Principal and policy records are stored as sequences of big-endian
+ * integers and counted byte strings, each beginning with a 16-bit record
+ * version.  Principal records include the unparsed principal name, so they
+ * can be decoded without the key.
+ */
+
+#include "k5-input.h"
+#include "kdb_mvcc.h"
+
+#define PRINC_RECORD_VERSION    1
+#define POLICY_RECORD_VERSION   1
+
+static void
+put16(struct k5buf *buf, unsigned int val)
+{
+    unsigned char n[2];
+
+    store_16_be(val, n);
+    k5_buf_add_len(buf, n, 2);
+}
+
+static void
+put32(struct k5buf *buf, uint32_t val)
+{
+    unsigned char n[4];
+
+    store_32_be(val, n);
+    k5_buf_add_len(buf, n, 4);
+}
+
+static void
+put_tl_data(struct k5buf *buf, const krb5_tl_data *tl)
+{
+    for (; tl != NULL; tl = tl->tl_data_next) {
+        put16(buf, tl->tl_data_type);
+        put16(buf, tl->tl_data_length);
+        k5_buf_add_len(buf, tl->tl_data_contents, tl->tl_data_length);
+    }
+}
+
+static krb5_error_code
+get_tl_data(struct k5input *in, int count, krb5_tl_data **tl_out)
+{
+    krb5_tl_data *tl, **tlp = tl_out;
+    const unsigned char *contents;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        tl = calloc(1, sizeof(*tl));
+        if (tl == NULL)
+            return ENOMEM;
+        *tlp = tl;
+        tlp = &tl->tl_data_next;
+        tl->tl_data_type = k5_input_get_uint16_be(in);
+        tl->tl_data_length = k5_input_get_uint16_be(in);
+        contents = k5_input_get_bytes(in, tl->tl_data_length);
+        if (in->status)
+            return KRB5_KDB_TRUNCATED_RECORD;
+        if (tl->tl_data_length > 0) {
+            tl->tl_data_contents = malloc(tl->tl_data_length);
+            if (tl->tl_data_contents == NULL)
+                return ENOMEM;
+            memcpy(tl->tl_data_contents, contents, tl->tl_data_length);
+        }
+    }
+    return 0;
+}
+
+krb5_error_code
+mvcc_encode_princ(krb5_context context, const krb5_db_entry *entry,
+                  krb5_data *out)
+{
+    krb5_error_code ret;
+    struct k5buf buf;
+    const krb5_key_data *kd;
+    char *name;
+    int i, j;
+
+    *out = empty_data();
+    ret = krb5_unparse_name(context, entry->princ, &name);
+    if (ret)
+        return ret;
+
+    k5_buf_init_dynamic(&buf);
+    put16(&buf, PRINC_RECORD_VERSION);
+    put32(&buf, entry->attributes);
+    put32(&buf, entry->max_life);
+    put32(&buf, entry->max_renewable_life);
+    put32(&buf, entry->expiration);
+    put32(&buf, entry->pw_expiration);
+    put32(&buf, entry->last_success);
+    put32(&buf, entry->last_failed);
+    put32(&buf, entry->fail_auth_count);
+    put16(&buf, entry->n_tl_data);
+    put16(&buf, entry->n_key_data);
+    put32(&buf, entry->e_length);
+    k5_buf_add_len(&buf, entry->e_data, entry->e_length);
+    put16(&buf, strlen(name));
+    k5_buf_add(&buf, name);
+    put_tl_data(&buf, entry->tl_data);
+    for (i = 0; i < entry->n_key_data; i++) {
+        kd = &entry->key_data[i];
+        put16(&buf, kd->key_data_ver);
+        put16(&buf, kd->key_data_kvno);
+        for (j = 0; j < kd->key_data_ver; j++) {
+            put16(&buf, kd->key_data_type[j]);
+            put16(&buf, kd->key_data_length[j]);
+            k5_buf_add_len(&buf, kd->key_data_contents[j],
+                           kd->key_data_length[j]);
+        }
+    }
+    free(name);
+
+    ret = k5_buf_status(&buf);
+    if (ret)
+        return ret;
+    *out = make_data(buf.data, buf.len);
+    return 0;
+}
+
+krb5_error_code
+mvcc_decode_princ(krb5_context context, const krb5_data *in,
+                  krb5_db_entry **entry_out)
+{
+    krb5_error_code ret;
+    struct k5input kin;
+    krb5_db_entry *entry;
+    krb5_key_data *kd;
+    const unsigned char *bytes;
+    char *name = NULL;
+    size_t len;
+    int i, j, nkeys;
+
+    *entry_out = NULL;
+    entry = k5alloc(sizeof(*entry), &ret);
+    if (entry == NULL)
+        return ret;
+
+    k5_input_init(&kin, in->data, in->length);
+    if (k5_input_get_uint16_be(&kin) != PRINC_RECORD_VERSION) {
+        ret = kin.status ? KRB5_KDB_TRUNCATED_RECORD : KRB5_KDB_BAD_VERSION;
+        goto cleanup;
+    }
+    entry->len = KRB5_KDB_V1_BASE_LENGTH;
+    entry->attributes = k5_input_get_uint32_be(&kin);
+    entry->max_life = k5_input_get_uint32_be(&kin);
+    entry->max_renewable_life = k5_input_get_uint32_be(&kin);
+    entry->expiration = k5_input_get_uint32_be(&kin);
+    entry->pw_expiration = k5_input_get_uint32_be(&kin);
+    entry->last_success = k5_input_get_uint32_be(&kin);
+    entry->last_failed = k5_input_get_uint32_be(&kin);
+    entry->fail_auth_count = k5_input_get_uint32_be(&kin);
+    entry->n_tl_data = k5_input_get_uint16_be(&kin);
+    nkeys = k5_input_get_uint16_be(&kin);
+    len = k5_input_get_uint32_be(&kin);
+    bytes = k5_input_get_bytes(&kin, len);
+    if (kin.status || entry->n_tl_data < 0 || nkeys > INT16_MAX) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+    if (len > 0) {
+        entry->e_data = k5memdup(bytes, len, &ret);
+        if (entry->e_data == NULL)
+            goto cleanup;
+        entry->e_length = len;
+        entry->len += len;
+    }
+
+    len = k5_input_get_uint16_be(&kin);
+    bytes = k5_input_get_bytes(&kin, len);
+    if (kin.status) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+    name = k5memdup0(bytes, len, &ret);
+    if (name == NULL)
+        goto cleanup;
+    ret = krb5_parse_name(context, name, &entry->princ);
+    if (ret)
+        goto cleanup;
+
+    ret = get_tl_data(&kin, entry->n_tl_data, &entry->tl_data);
+    if (ret)
+        goto cleanup;
+
+    /* Set n_key_data only once the array exists, so the entry can be freed
+     * at any point. */
+    if (nkeys > 0) {
+        entry->key_data = k5calloc(nkeys, sizeof(*entry->key_data), &ret);
+        if (entry->key_data == NULL)
+            goto cleanup;
+        entry->n_key_data = nkeys;
+    }
+    for (i = 0; i < entry->n_key_data; i++) {
+        kd = &entry->key_data[i];
+        kd->key_data_ver = k5_input_get_uint16_be(&kin);
+        kd->key_data_kvno = k5_input_get_uint16_be(&kin);
+        if (kd->key_data_ver < 0 ||
+            kd->key_data_ver > KRB5_KDB_V1_KEY_DATA_ARRAY) {
+            ret = KRB5_KDB_BAD_VERSION;
+            goto cleanup;
+        }
+        for (j = 0; j < kd->key_data_ver; j++) {
+            kd->key_data_type[j] = k5_input_get_uint16_be(&kin);
+            kd->key_data_length[j] = k5_input_get_uint16_be(&kin);
+            bytes = k5_input_get_bytes(&kin, kd->key_data_length[j]);
+            if (kin.status) {
+                ret = KRB5_KDB_TRUNCATED_RECORD;
+                goto cleanup;
+            }
+            if (kd->key_data_length[j] > 0) {
+                kd->key_data_contents[j] =
+                    k5memdup(bytes, kd->key_data_length[j], &ret);
+                if (kd->key_data_contents[j] == NULL)
+                    goto cleanup;
+            }
+        }
+    }
+    if (kin.status) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+
+    *entry_out = entry;
+    entry = NULL;
+
+cleanup:
+    free(name);
+    krb5_db_free_principal(context, entry);
+    return ret;
+}
+
+krb5_error_code
+mvcc_encode_policy(const osa_policy_ent_rec *pol, krb5_data *out)
+{
+    krb5_error_code ret;
+    struct k5buf buf;
+    size_t len;
+
+    *out = empty_data();
+    k5_buf_init_dynamic(&buf);
+    put16(&buf, POLICY_RECORD_VERSION);
+    put32(&buf, pol->pw_min_life);
+    put32(&buf, pol->pw_max_life);
+    put32(&buf, pol->pw_min_length);
+    put32(&buf, pol->pw_min_classes);
+    put32(&buf, pol->pw_history_num);
+    put32(&buf, pol->pw_max_fail);
+    put32(&buf, pol->pw_failcnt_interval);
+    put32(&buf, pol->pw_lockout_duration);
+    put32(&buf, pol->attributes);
+    put32(&buf, pol->max_life);
+    put32(&buf, pol->max_renewable_life);
+    if (pol->allowed_keysalts == NULL) {
+        put32(&buf, 0);
+    } else {
+        len = strlen(pol->allowed_keysalts) + 1;
+        put32(&buf, len);
+        k5_buf_add_len(&buf, pol->allowed_keysalts, len);
+    }
+    put16(&buf, pol->n_tl_data);
+    put_tl_data(&buf, pol->tl_data);
+
+    ret = k5_buf_status(&buf);
+    if (ret)
+        return ret;
+    *out = make_data(buf.data, buf.len);
+    return 0;
+}
+
+krb5_error_code
+mvcc_decode_policy(const krb5_data *key, const krb5_data *in,
+                   osa_policy_ent_t *pol_out)
+{
+    krb5_error_code ret;
+    struct k5input kin;
+    osa_policy_ent_t pol;
+    const unsigned char *bytes;
+    size_t len;
+
+    *pol_out = NULL;
+    pol = k5alloc(sizeof(*pol), &ret);
+    if (pol == NULL)
+        return ret;
+    pol->name = k5memdup0(key->data, key->length, &ret);
+    if (pol->name == NULL)
+        goto cleanup;
+
+    k5_input_init(&kin, in->data, in->length);
+    if (k5_input_get_uint16_be(&kin) != POLICY_RECORD_VERSION) {
+        ret = kin.status ? KRB5_KDB_TRUNCATED_RECORD : KRB5_KDB_BAD_VERSION;
+        goto cleanup;
+    }
+    pol->version = 3;
+    pol->pw_min_life = k5_input_get_uint32_be(&kin);
+    pol->pw_max_life = k5_input_get_uint32_be(&kin);
+    pol->pw_min_length = k5_input_get_uint32_be(&kin);
+    pol->pw_min_classes = k5_input_get_uint32_be(&kin);
+    pol->pw_history_num = k5_input_get_uint32_be(&kin);
+    pol->pw_max_fail = k5_input_get_uint32_be(&kin);
+    pol->pw_failcnt_interval = k5_input_get_uint32_be(&kin);
+    pol->pw_lockout_duration = k5_input_get_uint32_be(&kin);
+    pol->attributes = k5_input_get_uint32_be(&kin);
+    pol->max_life = k5_input_get_uint32_be(&kin);
+    pol->max_renewable_life = k5_input_get_uint32_be(&kin);
+    len = k5_input_get_uint32_be(&kin);
+    bytes = k5_input_get_bytes(&kin, len);
+    if (kin.status || (len > 0 && bytes[len - 1] != '\0')) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+    if (len > 0) {
+        pol->allowed_keysalts = k5memdup(bytes, len, &ret);
+        if (pol->allowed_keysalts == NULL)
+            goto cleanup;
+    }
+    pol->n_tl_data = k5_input_get_uint16_be(&kin);
+    if (kin.status || pol->n_tl_data < 0) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+    ret = get_tl_data(&kin, pol->n_tl_data, &pol->tl_data);
+    if (ret)
+        goto cleanup;
+
+    *pol_out = pol;
+    pol = NULL;
+
+cleanup:
+    krb5_db_free_policy(NULL, pol);
+    return ret;
+}
@@ -0,0 +1,2228 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/mvcc/mvcc_tree.c - copy-on-write B+tree storage engine */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * File layout
+ * -----------
+ *
+ * The file is an array of fixed-size pages.  Pages 0 and 1 hold alternating
+ * copies of the meta record; the valid copy with the higher transaction ID
+ * describes the current version of the database.  Pages 2-5 hold the reader
+ * table, which is mapped read-write and shared by every process using the
+ * file.  All other pages are B+tree branch or leaf pages, overflow pages
+ * holding large values, or freelist pages.
+ *
+ * Committed pages are never written again until no reader can reach them.  A
+ * write transaction copies each page it changes (or modifies pages it
+ * allocated itself in place), writes the new pages, syncs them, and then
+ * writes the meta record into the older of the two meta pages and syncs
+ * again.  A crash at any point leaves a valid meta record describing either
+ * the old or the new version.
+ *
+ * Readers pin a snapshot by publishing its transaction ID in a reader table
+ * slot, then re-reading the meta record to make sure it was still current
+ * when published.  A page freed by transaction F is reused only when every
+ * published reader is at F or later, so a pinned snapshot stays intact
+ * without readers taking any lock.  If no reader slot can be claimed (for
+ * instance because the file is read-only to this process), readers fall back
+ * to holding a shared lock on the file.
+ *
+ * Writers are serialized by an exclusive lock on the database file, plus a
+ * process-wide mutex in case the platform lacks open file description locks.
+ *
+ * Multi-byte integers are stored in host byte order; use kdb5_util dump and
+ * load to move a database between architectures.
+ */
+
+#include "kdb_mvcc.h"
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#define PGSIZE                  4096
+#define META_MAGIC              0x4D564343      /* "MVCC" */
+#define FORMAT_VERSION          1
+#define META_REPLACED           0x1
+
+#define RTABLE_PAGE             2
+#define RTABLE_PAGES            4
+#define FIRST_DATA_PAGE         (RTABLE_PAGE + RTABLE_PAGES)
+
+#define PAGE_BRANCH             1
+#define PAGE_LEAF               2
+#define PAGE_OVERFLOW           3
+#define PAGE_FREELIST           4
+
+#define HDR_SIZE                16
+#define PAGE_CAP                (PGSIZE - HDR_SIZE)
+#define LEAF_FIXED              8
+#define BRANCH_FIXED            6
+#define CELL_OVERFLOW           0x1
+
+/* Largest leaf cell holding its value inline.  Any three cells of this size
+ * fit in a page, so inserting into a full page never needs more than a
+ * three-way split. */
+#define MAX_INLINE              1000
+
+#define MAX_DEPTH               32
+#define MAX_SPLIT               8
+
+/* Spill dirty pages to the file beyond this many in one transaction. */
+#define MAX_DIRTY_BUFS          4096
+
+/* Grow the file in units of this many pages. */
+#define GROW_PAGES              256
+
+struct meta {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t flags;
+    uint64_t txnid;
+    int64_t commit_time;
+    uint32_t npages;
+    uint32_t freelist;
+    uint32_t roots[MVCC_NTREES];
+    uint64_t checksum;
+};
+
+struct page_hdr {
+    uint16_t type;
+    uint16_t count;             /* cells or freelist entries */
+    uint32_t next;              /* overflow or freelist chain */
+    uint32_t used;              /* data bytes in an overflow page */
+    uint32_t pad;
+};
+
+/* One reader slot per cache line. */
+struct reader_slot {
+    uint32_t pid;
+    uint32_t pad;
+    uint64_t txnid;
+    unsigned char fill[48];
+};
+
+#define NREADERS (RTABLE_PAGES * PGSIZE / sizeof(struct reader_slot))
+
+/* A freelist entry: pgno was freed by transaction txnid. */
+struct freeent {
+    uint32_t pgno;
+    uint32_t pad;
+    uint64_t txnid;
+};
+
+#define FL_PER_PAGE (PAGE_CAP / sizeof(struct freeent))
+
+struct flist {
+    struct freeent *ents;
+    size_t n;
+    size_t alloc;
+};
+
+/* A page owned by the current transaction.  buf is NULL if the page has been
+ * spilled to the file; live is false if the page was freed again. */
+struct dirty {
+    uint32_t pgno;
+    krb5_boolean live;
+    unsigned char *buf;
+};
+
+struct txn {
+    struct meta base;           /* version the transaction started from */
+    struct meta meta;           /* working meta record */
+    struct dirty *dirty;
+    size_t dcap;
+    size_t dused;
+    size_t nbufs;
+    struct flist ready;         /* free pages we may reuse */
+    struct flist keep;          /* free pages a reader may still see */
+    struct flist freed;         /* pages freed by this transaction */
+    krb5_boolean modified;
+    krb5_error_code failed;
+};
+
+struct mvcc_env_st {
+    char *path;
+    int fd;
+    krb5_boolean rdonly;
+    unsigned char *map;
+    size_t mapsize;
+    struct reader_slot *rtable;
+    int slot;
+    pid_t slot_pid;
+    int pins;
+    krb5_boolean shared_locked;
+    struct meta snap;
+    struct txn *txn;
+    int depth;
+};
+
+/* A source of pages: a pinned snapshot, or a write transaction. */
+struct view {
+    mvcc_env *env;
+    struct txn *txn;
+    const struct meta *meta;
+};
+
+/* The library may be finalized and initialized again without being unloaded,
+ * so allocate the mutex rather than using a static initializer. */
+static k5_mutex_t *write_lock;
+
+int
+mvcc_tree_init(void)
+{
+    return krb5int_mutex_alloc(&write_lock);
+}
+
+void
+mvcc_tree_fini(void)
+{
+    krb5int_mutex_free(write_lock);
+    write_lock = NULL;
+}
+
+/*** Utilities ***/
+
+static uint64_t
+meta_checksum(const struct meta *m)
+{
+    const unsigned char *p = (const unsigned char *)m;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < offsetof(struct meta, checksum); i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int
+compare_key(const unsigned char *k1, size_t len1, const unsigned char *k2,
+            size_t len2)
+{
+    int cmp;
+
+    cmp = memcmp(k1, k2, (len1 < len2) ? len1 : len2);
+    if (cmp != 0)
+        return cmp;
+    return (len1 < len2) ? -1 : (len1 > len2) ? 1 : 0;
+}
+
+static krb5_error_code
+write_full(int fd, const void *buf, size_t len, off_t off)
+{
+    const unsigned char *p = buf;
+    ssize_t nw;
+
+    while (len > 0) {
+        nw = pwrite(fd, p, len, off);
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        p += nw;
+        off += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+static krb5_error_code
+sync_file(int fd)
+{
+#ifdef HAVE_FDATASYNC
+    return (fdatasync(fd) == 0) ? 0 : errno;
+#else
+    return (fsync(fd) == 0) ? 0 : errno;
+#endif
+}
+
+static krb5_error_code
+flist_add(struct flist *fl, uint32_t pgno, uint64_t txnid)
+{
+    struct freeent *ents;
+    size_t newalloc;
+
+    if (fl->n == fl->alloc) {
+        newalloc = (fl->alloc == 0) ? 64 : fl->alloc * 2;
+        ents = realloc(fl->ents, newalloc * sizeof(*ents));
+        if (ents == NULL)
+            return ENOMEM;
+        fl->ents = ents;
+        fl->alloc = newalloc;
+    }
+    fl->ents[fl->n].pgno = pgno;
+    fl->ents[fl->n].pad = 0;
+    fl->ents[fl->n].txnid = txnid;
+    fl->n++;
+    return 0;
+}
+
+/*** Reader table ***/
+
+static krb5_boolean
+pid_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void
+slot_set(struct reader_slot *s, uint64_t txnid)
+{
+    (void)__sync_lock_test_and_set(&s->txnid, txnid);
+    __sync_synchronize();
+}
+
+static uint64_t
+slot_get(struct reader_slot *s)
+{
+    return __sync_fetch_and_add(&s->txnid, 0);
+}
+
+/* Make sure env owns a reader slot, claiming one if necessary.  Return false
+ * if no slot is available. */
+static krb5_boolean
+ensure_slot(mvcc_env *env)
+{
+    struct reader_slot *s;
+    pid_t pid = getpid();
+    uint32_t cur;
+    size_t i;
+
+    if (env->rtable == NULL)
+        return FALSE;
+    /* After a fork, leave the parent's slot alone and claim our own. */
+    if (env->slot >= 0 && env->slot_pid == pid)
+        return TRUE;
+    env->slot = -1;
+    for (i = 0; i < NREADERS; i++) {
+        s = &env->rtable[i];
+        cur = s->pid;
+        if (cur != 0 && (cur == (uint32_t)pid || pid_alive(cur)))
+            continue;
+        if (!__sync_bool_compare_and_swap(&s->pid, cur, (uint32_t)pid))
+            continue;
+        slot_set(s, 0);
+        env->slot = i;
+        env->slot_pid = pid;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+release_slot(mvcc_env *env)
+{
+    struct reader_slot *s;
+
+    if (env->rtable == NULL || env->slot < 0 || env->slot_pid != getpid())
+        return;
+    s = &env->rtable[env->slot];
+    slot_set(s, 0);
+    (void)__sync_bool_compare_and_swap(&s->pid, (uint32_t)env->slot_pid, 0);
+    env->slot = -1;
+}
+
+/* Return the oldest transaction ID pinned by a live reader, or limit if there
+ * is no older one.  Clear the slots of readers which have exited. */
+static uint64_t
+oldest_reader(mvcc_env *env, uint64_t limit)
+{
+    struct reader_slot *s;
+    uint64_t txnid, oldest = limit;
+    uint32_t pid;
+    size_t i;
+
+    if (env->rtable == NULL)
+        return oldest;
+    for (i = 0; i < NREADERS; i++) {
+        s = &env->rtable[i];
+        pid = s->pid;
+        if (pid == 0)
+            continue;
+        if (!pid_alive(pid)) {
+            slot_set(s, 0);
+            (void)__sync_bool_compare_and_swap(&s->pid, pid, 0);
+            continue;
+        }
+        txnid = slot_get(s);
+        if (txnid != 0 && txnid < oldest)
+            oldest = txnid;
+    }
+    return oldest;
+}
+
+/*** File and mapping management ***/
+
+/* Set *out to the current meta record. */
+static krb5_error_code
+read_meta(mvcc_env *env, struct meta *out)
+{
+    struct meta m[2];
+    krb5_boolean valid[2];
+    int i;
+
+    __sync_synchronize();
+    for (i = 0; i < 2; i++) {
+        memcpy(&m[i], env->map + (size_t)i * PGSIZE, sizeof(m[i]));
+        valid[i] = m[i].magic == META_MAGIC &&
+            m[i].version == FORMAT_VERSION && m[i].page_size == PGSIZE &&
+            m[i].checksum == meta_checksum(&m[i]) &&
+            m[i].npages >= FIRST_DATA_PAGE;
+    }
+    if (!valid[0] && !valid[1]) {
+        if (m[0].magic == META_MAGIC || m[1].magic == META_MAGIC)
+            return KRB5_KDB_BAD_VERSION;
+        return KRB5_KDB_DB_CORRUPT;
+    }
+    if (valid[0] && (!valid[1] || m[0].txnid > m[1].txnid))
+        *out = m[0];
+    else
+        *out = m[1];
+    return 0;
+}
+
+/* Make sure the read mapping covers npages pages. */
+static krb5_error_code
+ensure_map(mvcc_env *env, uint32_t npages)
+{
+    struct stat st;
+    void *map;
+
+    if (env->mapsize >= (size_t)npages * PGSIZE)
+        return 0;
+    if (fstat(env->fd, &st) != 0)
+        return errno;
+    if ((size_t)st.st_size < (size_t)npages * PGSIZE)
+        return KRB5_KDB_DB_CORRUPT;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, env->fd, 0);
+    if (map == MAP_FAILED)
+        return errno;
+    if (env->map != NULL)
+        munmap(env->map, env->mapsize);
+    env->map = map;
+    env->mapsize = st.st_size;
+    return 0;
+}
+
+/* Make sure the file is large enough to hold npages pages. */
+static krb5_error_code
+grow_file(mvcc_env *env, uint32_t npages)
+{
+    struct stat st;
+    off_t size;
+
+    if (fstat(env->fd, &st) != 0)
+        return errno;
+    size = (off_t)npages * PGSIZE;
+    if (st.st_size >= size)
+        return 0;
+    size = ((off_t)npages + GROW_PAGES - 1) / GROW_PAGES * GROW_PAGES * PGSIZE;
+    if (ftruncate(env->fd, size) != 0)
+        return errno;
+    return 0;
+}
+
+static void
+close_file(mvcc_env *env)
+{
+    release_slot(env);
+    if (env->rtable != NULL)
+        munmap(env->rtable, RTABLE_PAGES * PGSIZE);
+    if (env->map != NULL)
+        munmap(env->map, env->mapsize);
+    if (env->fd != -1)
+        close(env->fd);
+    env->rtable = NULL;
+    env->map = NULL;
+    env->mapsize = 0;
+    env->fd = -1;
+    env->slot = -1;
+}
+
+static krb5_error_code
+open_file(mvcc_env *env)
+{
+    krb5_error_code ret;
+    struct meta m;
+    struct stat st;
+    void *rtable;
+
+    env->fd = open(env->path, env->rdonly ? O_RDONLY : O_RDWR);
+    if (env->fd == -1 && errno == EACCES && !env->rdonly) {
+        env->rdonly = TRUE;
+        env->fd = open(env->path, O_RDONLY);
+    }
+    if (env->fd == -1)
+        return (errno == ENOENT) ? KRB5_KDB_DBNOTINITED : errno;
+    set_cloexec_fd(env->fd);
+
+    if (fstat(env->fd, &st) != 0) {
+        ret = errno;
+        goto error;
+    }
+    if ((size_t)st.st_size < FIRST_DATA_PAGE * PGSIZE) {
+        ret = KRB5_KDB_DB_CORRUPT;
+        goto error;
+    }
+    ret = ensure_map(env, FIRST_DATA_PAGE);
+    if (ret)
+        goto error;
+    ret = read_meta(env, &m);
+    if (ret)
+        goto error;
+
+    if (!env->rdonly) {
+        rtable = mmap(NULL, RTABLE_PAGES * PGSIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, env->fd, RTABLE_PAGE * PGSIZE);
+        if (rtable != MAP_FAILED)
+            env->rtable = rtable;
+    }
+    return 0;
+
+error:
+    close_file(env);
+    return ret;
+}
+
+/* Reopen the path after the file we had open was replaced. */
+static krb5_error_code
+reopen_file(mvcc_env *env)
+{
+    close_file(env);
+    return open_file(env);
+}
+
+krb5_error_code
+mvcc_env_create(const char *path)
+{
+    krb5_error_code ret;
+    unsigned char *buf;
+    struct meta m;
+    int fd;
+
+    buf = calloc(FIRST_DATA_PAGE, PGSIZE);
+    if (buf == NULL)
+        return ENOMEM;
+    memset(&m, 0, sizeof(m));
+    m.magic = META_MAGIC;
+    m.version = FORMAT_VERSION;
+    m.page_size = PGSIZE;
+    m.txnid = 1;
+    m.commit_time = time(NULL);
+    m.npages = FIRST_DATA_PAGE;
+    m.checksum = meta_checksum(&m);
+    memcpy(buf + (m.txnid % 2) * PGSIZE, &m, sizeof(m));
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        ret = errno;
+        goto cleanup;
+    }
+    set_cloexec_fd(fd);
+    ret = write_full(fd, buf, FIRST_DATA_PAGE * PGSIZE, 0);
+    if (!ret)
+        ret = (fsync(fd) == 0) ? 0 : errno;
+    close(fd);
+    if (ret)
+        (void)unlink(path);
+
+cleanup:
+    free(buf);
+    return ret;
+}
+
+krb5_error_code
+mvcc_env_open(const char *path, krb5_boolean rdonly, mvcc_env **env_out)
+{
+    krb5_error_code ret;
+    mvcc_env *env;
+
+    *env_out = NULL;
+    env = k5alloc(sizeof(*env), &ret);
+    if (env == NULL)
+        return ret;
+    env->fd = -1;
+    env->slot = -1;
+    env->rdonly = rdonly;
+    env->path = strdup(path);
+    if (env->path == NULL) {
+        free(env);
+        return ENOMEM;
+    }
+    ret = open_file(env);
+    if (ret) {
+        free(env->path);
+        free(env);
+        return ret;
+    }
+    *env_out = env;
+    return 0;
+}
+
+void
+mvcc_env_close(mvcc_env *env)
+{
+    if (env == NULL)
+        return;
+    if (env->txn != NULL)
+        mvcc_abort(env);
+    if (env->shared_locked)
+        (void)krb5_lock_file(NULL, env->fd, KRB5_LOCKMODE_UNLOCK);
+    close_file(env);
+    free(env->path);
+    free(env);
+}
+
+krb5_error_code
+mvcc_env_age(mvcc_env *env, time_t *age_out)
+{
+    krb5_error_code ret;
+    struct meta m;
+
+    *age_out = -1;
+    if (env->txn != NULL) {
+        *age_out = env->txn->base.commit_time;
+        return 0;
+    }
+    ret = read_meta(env, &m);
+    if (ret)
+        return ret;
+    if ((m.flags & META_REPLACED) && env->pins == 0) {
+        ret = reopen_file(env);
+        if (ret)
+            return ret;
+        ret = read_meta(env, &m);
+        if (ret)
+            return ret;
+    }
+    *age_out = m.commit_time;
+    return 0;
+}
+
+/*** Page access ***/
+
+/* Return a pointer to page pgno as seen by v, or NULL if pgno is out of
+ * range.  The pointer is valid until the next call to view_page() or any
+ * function which allocates or frees pages. */
+static const unsigned char *
+view_page(struct view *v, uint32_t pgno)
+{
+    struct txn *txn = v->txn;
+    size_t i, mask;
+
+    if (txn != NULL && txn->dcap > 0) {
+        mask = txn->dcap - 1;
+        for (i = (pgno * 2654435761U) & mask; txn->dirty[i].pgno != 0;
+             i = (i + 1) & mask) {
+            if (txn->dirty[i].pgno == pgno) {
+                if (txn->dirty[i].live && txn->dirty[i].buf != NULL)
+                    return txn->dirty[i].buf;
+                break;
+            }
+        }
+    }
+    if (pgno < FIRST_DATA_PAGE || pgno >= v->meta->npages)
+        return NULL;
+    if (ensure_map(v->env, pgno + 1) != 0)
+        return NULL;
+    return v->env->map + (size_t)pgno * PGSIZE;
+}
+
+static inline const struct page_hdr *
+hdr(const unsigned char *p)
+{
+    return (const struct page_hdr *)p;
+}
+
+/* Return true if p is a well-formed page of the given type. */
+static krb5_boolean
+check_page(const unsigned char *p, int type)
+{
+    if (p == NULL || hdr(p)->type != type)
+        return FALSE;
+    if (type == PAGE_OVERFLOW)
+        return hdr(p)->used <= PAGE_CAP;
+    if (type == PAGE_FREELIST)
+        return hdr(p)->count <= FL_PER_PAGE;
+    return HDR_SIZE + 2 * (size_t)hdr(p)->count <= PGSIZE;
+}
+
+/* A decoded view of a leaf or branch cell. */
+struct cell {
+    const unsigned char *key;
+    size_t klen;
+    unsigned int flags;         /* leaf only */
+    uint32_t vlen;              /* leaf only */
+    const unsigned char *val;   /* leaf only, if not CELL_OVERFLOW */
+    uint32_t ovfl;              /* leaf only, if CELL_OVERFLOW */
+    uint32_t child;             /* branch only */
+};
+
+/* Decode cell i of page p, which has been checked with check_page(). */
+static krb5_boolean
+get_cell(const unsigned char *p, unsigned int i, struct cell *c)
+{
+    size_t off, count = hdr(p)->count, minoff = HDR_SIZE + 2 * count;
+
+    if (i >= count)
+        return FALSE;
+    off = load_16_n(p + HDR_SIZE + 2 * i);
+    memset(c, 0, sizeof(*c));
+    if (hdr(p)->type == PAGE_LEAF) {
+        if (off < minoff || off + LEAF_FIXED > PGSIZE)
+            return FALSE;
+        c->klen = load_16_n(p + off);
+        c->flags = load_16_n(p + off + 2);
+        c->vlen = load_32_n(p + off + 4);
+        off += LEAF_FIXED;
+        if (c->klen > PGSIZE - off)
+            return FALSE;
+        c->key = p + off;
+        off += c->klen;
+        if (c->flags & CELL_OVERFLOW) {
+            if (off + 4 > PGSIZE || c->vlen == 0)
+                return FALSE;
+            c->ovfl = load_32_n(p + off);
+        } else {
+            if (c->vlen > PGSIZE - off)
+                return FALSE;
+            c->val = p + off;
+        }
+    } else {
+        if (off < minoff || off + BRANCH_FIXED > PGSIZE)
+            return FALSE;
+        c->child = load_32_n(p + off);
+        c->klen = load_16_n(p + off + 4);
+        off += BRANCH_FIXED;
+        if (c->klen > PGSIZE - off)
+            return FALSE;
+        c->key = p + off;
+    }
+    return TRUE;
+}
+
+/* Set *idx_out to the index of the child of branch page p which covers key.
+ * The key of cell 0 is not used; it covers everything below cell 1. */
+static krb5_boolean
+branch_index(const unsigned char *p, const krb5_data *key, unsigned int *idx)
+{
+    unsigned int lo = 1, hi = hdr(p)->count, mid;
+    struct cell c;
+
+    if (hi == 0)
+        return FALSE;
+    /* Find the last cell whose key is <= key. */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (!get_cell(p, mid, &c))
+            return FALSE;
+        if (compare_key(c.key, c.klen, (unsigned char *)key->data,
+                        key->length) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *idx = lo - 1;
+    return TRUE;
+}
+
+/* Set *idx to the index of the first cell of leaf page p whose key is >= key,
+ * and *exact to whether it is equal. */
+static krb5_boolean
+leaf_index(const unsigned char *p, const krb5_data *key, unsigned int *idx,
+           krb5_boolean *exact)
+{
+    unsigned int lo = 0, hi = hdr(p)->count, mid;
+    struct cell c;
+    int cmp;
+
+    *exact = FALSE;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (!get_cell(p, mid, &c))
+            return FALSE;
+        cmp = compare_key(c.key, c.klen, (unsigned char *)key->data,
+                          key->length);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+            if (cmp == 0)
+                *exact = TRUE;
+        }
+    }
+    *idx = lo;
+    return TRUE;
+}
+
+/* Copy the value of leaf cell c into *val_out. */
+static krb5_error_code
+copy_value(struct view *v, const struct cell *c, krb5_data *val_out)
+{
+    krb5_error_code ret;
+    const unsigned char *p;
+    unsigned char *buf;
+    uint32_t pgno, vlen = c->vlen, remaining, used;
+
+    buf = k5alloc(vlen + 1, &ret);
+    if (buf == NULL)
+        return ret;
+    if (!(c->flags & CELL_OVERFLOW)) {
+        memcpy(buf, c->val, vlen);
+    } else {
+        remaining = vlen;
+        pgno = c->ovfl;
+        while (remaining > 0) {
+            p = view_page(v, pgno);
+            if (!check_page(p, PAGE_OVERFLOW))
+                goto corrupt;
+            used = hdr(p)->used;
+            if (used == 0 || used > remaining)
+                goto corrupt;
+            memcpy(buf + (vlen - remaining), p + HDR_SIZE, used);
+            remaining -= used;
+            pgno = hdr(p)->next;
+        }
+    }
+    *val_out = make_data(buf, vlen);
+    return 0;
+
+corrupt:
+    free(buf);
+    return KRB5_KDB_DB_CORRUPT;
+}
+
+static krb5_error_code
+copy_key(const struct cell *c, krb5_data *key_out)
+{
+    krb5_error_code ret;
+    char *buf;
+
+    buf = k5alloc(c->klen + 1, &ret);
+    if (buf == NULL)
+        return ret;
+    memcpy(buf, c->key, c->klen);
+    *key_out = make_data(buf, c->klen);
+    return 0;
+}
+
+/*** Tree searches ***/
+
+static krb5_error_code
+tree_get(struct view *v, uint32_t root, const krb5_data *key,
+         krb5_data *val_out)
+{
+    const unsigned char *p;
+    krb5_boolean exact;
+    unsigned int idx, depth;
+    uint32_t pgno = root;
+    struct cell c;
+
+    if (pgno == 0)
+        return KRB5_KDB_NOENTRY;
+    for (depth = 0; depth < MAX_DEPTH; depth++) {
+        p = view_page(v, pgno);
+        if (check_page(p, PAGE_BRANCH)) {
+            if (!branch_index(p, key, &idx) || !get_cell(p, idx, &c))
+                return KRB5_KDB_DB_CORRUPT;
+            pgno = c.child;
+        } else if (check_page(p, PAGE_LEAF)) {
+            if (!leaf_index(p, key, &idx, &exact))
+                return KRB5_KDB_DB_CORRUPT;
+            if (!exact)
+                return KRB5_KDB_NOENTRY;
+            if (!get_cell(p, idx, &c))
+                return KRB5_KDB_DB_CORRUPT;
+            return copy_value(v, &c, val_out);
+        } else {
+            return KRB5_KDB_DB_CORRUPT;
+        }
+    }
+    return KRB5_KDB_DB_CORRUPT;
+}
+
+static krb5_error_code
+tree_next(struct view *v, uint32_t root, const krb5_data *after,
+          krb5_boolean reverse, krb5_data *key_out, krb5_data *val_out)
+{
+    krb5_error_code ret;
+    struct {
+        uint32_t pgno;
+        unsigned int idx;
+    } path[MAX_DEPTH];
+    const unsigned char *p;
+    krb5_boolean seek = (after != NULL), exact;
+    unsigned int depth = 0, idx, n;
+    uint32_t pgno = root;
+    struct cell c;
+    long i;
+
+    if (pgno == 0)
+        return KRB5_KDB_NOENTRY;
+    for (;;) {
+        p = view_page(v, pgno);
+        if (check_page(p, PAGE_BRANCH)) {
+            n = hdr(p)->count;
+            if (n == 0 || depth >= MAX_DEPTH)
+                return KRB5_KDB_DB_CORRUPT;
+            if (seek) {
+                if (!branch_index(p, after, &idx))
+                    return KRB5_KDB_DB_CORRUPT;
+            } else {
+                idx = reverse ? n - 1 : 0;
+            }
+            if (!get_cell(p, idx, &c))
+                return KRB5_KDB_DB_CORRUPT;
+            path[depth].pgno = pgno;
+            path[depth].idx = idx;
+            depth++;
+            pgno = c.child;
+            continue;
+        }
+        if (!check_page(p, PAGE_LEAF))
+            return KRB5_KDB_DB_CORRUPT;
+
+        n = hdr(p)->count;
+        if (seek) {
+            if (!leaf_index(p, after, &idx, &exact))
+                return KRB5_KDB_DB_CORRUPT;
+            i = reverse ? (long)idx - 1 : (exact ? (long)idx + 1 : idx);
+        } else {
+            i = reverse ? (long)n - 1 : 0;
+        }
+        if (i >= 0 && i < n) {
+            if (!get_cell(p, i, &c))
+                return KRB5_KDB_DB_CORRUPT;
+            ret = copy_key(&c, key_out);
+            if (ret)
+                return ret;
+            ret = copy_value(v, &c, val_out);
+            if (ret) {
+                krb5_free_data_contents(NULL, key_out);
+                return ret;
+            }
+            return 0;
+        }
+
+        /* This leaf is exhausted; move to the adjacent subtree. */
+        seek = FALSE;
+        for (;;) {
+            if (depth == 0)
+                return KRB5_KDB_NOENTRY;
+            p = view_page(v, path[depth - 1].pgno);
+            if (!check_page(p, PAGE_BRANCH))
+                return KRB5_KDB_DB_CORRUPT;
+            i = (long)path[depth - 1].idx + (reverse ? -1 : 1);
+            if (i >= 0 && i < hdr(p)->count)
+                break;
+            depth--;
+        }
+        if (!get_cell(p, i, &c))
+            return KRB5_KDB_DB_CORRUPT;
+        path[depth - 1].idx = i;
+        pgno = c.child;
+    }
+}
+
+/*** Snapshots ***/
+
+krb5_error_code
+mvcc_pin(mvcc_env *env)
+{
+    krb5_error_code ret;
+    struct meta m, m2;
+    krb5_boolean have_slot;
+
+    if (env->pins > 0) {
+        env->pins++;
+        return 0;
+    }
+    if (env->txn != NULL) {
+        env->snap = env->txn->base;
+        env->pins = 1;
+        return 0;
+    }
+
+    for (;;) {
+        ret = read_meta(env, &m);
+        if (ret)
+            return ret;
+        if (m.flags & META_REPLACED) {
+            ret = reopen_file(env);
+            if (ret)
+                return ret;
+            continue;
+        }
+
+        have_slot = ensure_slot(env);
+        if (have_slot) {
+            slot_set(&env->rtable[env->slot], m.txnid);
+            ret = read_meta(env, &m2);
+            if (ret)
+                goto error;
+            if (m2.txnid != m.txnid || (m2.flags & META_REPLACED))
+                continue;
+        } else {
+            ret = krb5_lock_file(NULL, env->fd, KRB5_LOCKMODE_SHARED);
+            if (ret)
+                return ret;
+            env->shared_locked = TRUE;
+            ret = read_meta(env, &m);
+            if (ret)
+                goto error;
+            if (m.flags & META_REPLACED) {
+                (void)krb5_lock_file(NULL, env->fd, KRB5_LOCKMODE_UNLOCK);
+                env->shared_locked = FALSE;
+                ret = reopen_file(env);
+                if (ret)
+                    return ret;
+                continue;
+            }
+        }
+        break;
+    }
+
+    ret = ensure_map(env, m.npages);
+    if (ret)
+        goto error;
+    env->snap = m;
+    env->pins = 1;
+    return 0;
+
+error:
+    env->pins = 1;
+    mvcc_unpin(env);
+    return ret;
+}
+
+void
+mvcc_unpin(mvcc_env *env)
+{
+    if (env->pins == 0 || --env->pins > 0)
+        return;
+    if (env->slot >= 0 && env->slot_pid == getpid())
+        slot_set(&env->rtable[env->slot], 0);
+    if (env->shared_locked) {
+        env->shared_locked = FALSE;
+        /* A write transaction releases the lock when it finishes. */
+        if (env->txn == NULL)
+            (void)krb5_lock_file(NULL, env->fd, KRB5_LOCKMODE_UNLOCK);
+    }
+}
+
+krb5_error_code
+mvcc_get(mvcc_env *env, int tree, const krb5_data *key, krb5_data *val_out)
+{
+    krb5_error_code ret;
+    struct view v;
+
+    *val_out = empty_data();
+    if (env->txn != NULL) {
+        v.env = env;
+        v.txn = env->txn;
+        v.meta = &env->txn->meta;
+        return tree_get(&v, v.meta->roots[tree], key, val_out);
+    }
+
+    ret = mvcc_pin(env);
+    if (ret)
+        return ret;
+    v.env = env;
+    v.txn = NULL;
+    v.meta = &env->snap;
+    ret = tree_get(&v, v.meta->roots[tree], key, val_out);
+    mvcc_unpin(env);
+    return ret;
+}
+
+krb5_error_code
+mvcc_next(mvcc_env *env, int tree, const krb5_data *after,
+          krb5_boolean reverse, krb5_data *key_out, krb5_data *val_out)
+{
+    krb5_error_code ret;
+    struct view v;
+
+    *key_out = empty_data();
+    *val_out = empty_data();
+    if (env->txn != NULL) {
+        v.env = env;
+        v.txn = env->txn;
+        v.meta = &env->txn->meta;
+        return tree_next(&v, v.meta->roots[tree], after, reverse, key_out,
+                         val_out);
+    }
+
+    ret = mvcc_pin(env);
+    if (ret)
+        return ret;
+    v.env = env;
+    v.txn = NULL;
+    v.meta = &env->snap;
+    ret = tree_next(&v, v.meta->roots[tree], after, reverse, key_out,
+                    val_out);
+    mvcc_unpin(env);
+    return ret;
+}
+
+/*** Transaction page management ***/
+
+/* Return the slot for pgno in the dirty table, or the empty slot where it
+ * would be inserted.  The table must have been allocated. */
+static struct dirty *
+dirty_slot(struct txn *txn, uint32_t pgno)
+{
+    size_t i, mask = txn->dcap - 1;
+
+    for (i = (pgno * 2654435761U) & mask; txn->dirty[i].pgno != 0;
+         i = (i + 1) & mask) {
+        if (txn->dirty[i].pgno == pgno)
+            break;
+    }
+    return &txn->dirty[i];
+}
+
+static struct dirty *
+dirty_find(struct txn *txn, uint32_t pgno)
+{
+    struct dirty *d;
+
+    if (txn->dcap == 0)
+        return NULL;
+    d = dirty_slot(txn, pgno);
+    return (d->pgno == 0) ? NULL : d;
+}
+
+/* Record pgno as owned by txn with contents buf. */
+static krb5_error_code
+dirty_add(struct txn *txn, uint32_t pgno, unsigned char *buf)
+{
+    struct dirty *d, *old = txn->dirty;
+    size_t i, oldcap = txn->dcap;
+
+    d = dirty_find(txn, pgno);
+    if (d == NULL && (txn->dused + 1) * 2 > txn->dcap) {
+        txn->dcap = (oldcap == 0) ? 256 : oldcap * 2;
+        txn->dirty = calloc(txn->dcap, sizeof(*txn->dirty));
+        if (txn->dirty == NULL) {
+            txn->dirty = old;
+            txn->dcap = oldcap;
+            return ENOMEM;
+        }
+        txn->dused = 0;
+        for (i = 0; i < oldcap; i++) {
+            if (old[i].pgno == 0)
+                continue;
+            d = dirty_slot(txn, old[i].pgno);
+            *d = old[i];
+            txn->dused++;
+        }
+        free(old);
+        d = NULL;
+    }
+    if (d == NULL) {
+        d = dirty_slot(txn, pgno);
+        d->pgno = pgno;
+        txn->dused++;
+    }
+    d->live = TRUE;
+    d->buf = buf;
+    txn->nbufs++;
+    return 0;
+}
+
+/* Write every buffered page to the file and release the buffers. */
+static krb5_error_code
+spill(mvcc_env *env, struct txn *txn)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    ret = grow_file(env, txn->meta.npages);
+    if (ret)
+        return ret;
+    for (i = 0; i < txn->dcap; i++) {
+        if (txn->dirty[i].buf == NULL)
+            continue;
+        ret = write_full(env->fd, txn->dirty[i].buf, PGSIZE,
+                         (off_t)txn->dirty[i].pgno * PGSIZE);
+        if (ret)
+            return ret;
+        free(txn->dirty[i].buf);
+        txn->dirty[i].buf = NULL;
+    }
+    txn->nbufs = 0;
+    return 0;
+}
+
+/* Allocate a zeroed page owned by the transaction.  The buffer pointer is
+ * valid until the next page allocation. */
+static krb5_error_code
+alloc_page(struct view *v, uint32_t *pgno_out, unsigned char **buf_out)
+{
+    krb5_error_code ret;
+    struct txn *txn = v->txn;
+    unsigned char *buf;
+    uint32_t pgno;
+
+    if (txn->nbufs >= MAX_DIRTY_BUFS) {
+        ret = spill(v->env, txn);
+        if (ret)
+            return ret;
+    }
+    buf = k5alloc(PGSIZE, &ret);
+    if (buf == NULL)
+        return ret;
+    if (txn->ready.n > 0) {
+        pgno = txn->ready.ents[--txn->ready.n].pgno;
+    } else {
+        if (txn->meta.npages >= UINT32_MAX / PGSIZE) {
+            free(buf);
+            return ENOSPC;
+        }
+        pgno = txn->meta.npages++;
+    }
+    ret = dirty_add(txn, pgno, buf);
+    if (ret) {
+        free(buf);
+        return ret;
+    }
+    *pgno_out = pgno;
+    *buf_out = buf;
+    return 0;
+}
+
+/* Release pgno from the current version of the database. */
+static krb5_error_code
+free_page(struct view *v, uint32_t pgno)
+{
+    struct txn *txn = v->txn;
+    struct dirty *d;
+
+    d = dirty_find(txn, pgno);
+    if (d != NULL && d->live) {
+        /* No reader can see a page this transaction allocated. */
+        if (d->buf != NULL)
+            txn->nbufs--;
+        free(d->buf);
+        d->buf = NULL;
+        d->live = FALSE;
+        return flist_add(&txn->ready, pgno, 0);
+    }
+    return flist_add(&txn->freed, pgno, txn->meta.txnid);
+}
+
+/* Get a zeroed writable buffer to hold the new contents of pgno (0 for a new
+ * page), which is updated in place if the transaction owns it. */
+static krb5_error_code
+replace_page(struct view *v, uint32_t pgno, uint32_t *pgno_out,
+             unsigned char **buf_out)
+{
+    krb5_error_code ret;
+    struct txn *txn = v->txn;
+    struct dirty *d;
+
+    if (pgno != 0) {
+        d = dirty_find(txn, pgno);
+        if (d != NULL && d->live) {
+            if (d->buf == NULL) {
+                if (txn->nbufs >= MAX_DIRTY_BUFS) {
+                    ret = spill(v->env, txn);
+                    if (ret)
+                        return ret;
+                }
+                d->buf = k5alloc(PGSIZE, &ret);
+                if (d->buf == NULL)
+                    return ret;
+                txn->nbufs++;
+            } else {
+                memset(d->buf, 0, PGSIZE);
+            }
+            *pgno_out = pgno;
+            *buf_out = d->buf;
+            return 0;
+        }
+        ret = free_page(v, pgno);
+        if (ret)
+            return ret;
+    }
+    return alloc_page(v, pgno_out, buf_out);
+}
+
+static krb5_error_code
+write_overflow(struct view *v, const krb5_data *val, uint32_t *pgno_out)
+{
+    krb5_error_code ret;
+    struct page_hdr *h;
+    unsigned char *buf;
+    uint32_t pgno, next = 0;
+    size_t npages, j, off, len;
+
+    /* Write the chain back to front so each page knows its successor. */
+    npages = (val->length + PAGE_CAP - 1) / PAGE_CAP;
+    for (j = npages; j > 0; j--) {
+        off = (j - 1) * PAGE_CAP;
+        len = val->length - off;
+        if (len > PAGE_CAP)
+            len = PAGE_CAP;
+        ret = alloc_page(v, &pgno, &buf);
+        if (ret)
+            return ret;
+        h = (struct page_hdr *)buf;
+        h->type = PAGE_OVERFLOW;
+        h->next = next;
+        h->used = len;
+        memcpy(buf + HDR_SIZE, val->data + off, len);
+        next = pgno;
+    }
+    *pgno_out = next;
+    return 0;
+}
+
+static krb5_error_code
+free_overflow(struct view *v, uint32_t pgno, uint32_t vlen)
+{
+    krb5_error_code ret;
+    const unsigned char *p;
+    uint32_t next, used;
+
+    while (vlen > 0) {
+        p = view_page(v, pgno);
+        if (!check_page(p, PAGE_OVERFLOW))
+            return KRB5_KDB_DB_CORRUPT;
+        used = hdr(p)->used;
+        next = hdr(p)->next;
+        if (used == 0 || used > vlen)
+            return KRB5_KDB_DB_CORRUPT;
+        ret = free_page(v, pgno);
+        if (ret)
+            return ret;
+        vlen -= used;
+        pgno = next;
+    }
+    return 0;
+}
+
+/*** Node modification ***/
+
+/* A decoded page whose cells may be freely rearranged.  Cell data points into
+ * page copies or key copies held in mem, or into caller-supplied keys and
+ * values. */
+struct node {
+    int type;
+    struct cell *cells;
+    size_t n;
+    size_t alloc;
+    void **mem;
+    size_t nmem;
+    size_t amem;
+};
+
+/* The pages replacing a node after modification: the page numbers, lower
+ * bound keys, and encoded sizes. */
+struct repl {
+    size_t n;
+    struct {
+        uint32_t pgno;
+        unsigned char *key;
+        size_t klen;
+        size_t size;
+    } e[MAX_SPLIT];
+};
+
+static void
+node_free(struct node *node)
+{
+    size_t i;
+
+    for (i = 0; i < node->nmem; i++)
+        free(node->mem[i]);
+    free(node->mem);
+    free(node->cells);
+    memset(node, 0, sizeof(*node));
+}
+
+/* Make node responsible for freeing ptr. */
+static krb5_error_code
+node_keep(struct node *node, void *ptr)
+{
+    void **mem;
+    size_t newalloc;
+
+    if (node->nmem == node->amem) {
+        newalloc = (node->amem == 0) ? 4 : node->amem * 2;
+        mem = realloc(node->mem, newalloc * sizeof(*mem));
+        if (mem == NULL) {
+            free(ptr);
+            return ENOMEM;
+        }
+        node->mem = mem;
+        node->amem = newalloc;
+    }
+    node->mem[node->nmem++] = ptr;
+    return 0;
+}
+
+/* Insert count uninitialized cells at position i. */
+static krb5_error_code
+node_open(struct node *node, size_t i, size_t count)
+{
+    struct cell *cells;
+    size_t newalloc;
+
+    if (node->n + count > node->alloc) {
+        newalloc = node->alloc * 2 + count + 8;
+        cells = realloc(node->cells, newalloc * sizeof(*cells));
+        if (cells == NULL)
+            return ENOMEM;
+        node->cells = cells;
+        node->alloc = newalloc;
+    }
+    memmove(node->cells + i + count, node->cells + i,
+            (node->n - i) * sizeof(*node->cells));
+    memset(node->cells + i, 0, count * sizeof(*node->cells));
+    node->n += count;
+    return 0;
+}
+
+static void
+node_remove(struct node *node, size_t i)
+{
+    memmove(node->cells + i, node->cells + i + 1,
+            (node->n - i - 1) * sizeof(*node->cells));
+    node->n--;
+}
+
+static krb5_error_code
+load_node(struct view *v, uint32_t pgno, struct node *node)
+{
+    krb5_error_code ret;
+    const unsigned char *p;
+    unsigned char *copy;
+    unsigned int i, count;
+
+    memset(node, 0, sizeof(*node));
+    p = view_page(v, pgno);
+    if (check_page(p, PAGE_LEAF))
+        node->type = PAGE_LEAF;
+    else if (check_page(p, PAGE_BRANCH))
+        node->type = PAGE_BRANCH;
+    else
+        return KRB5_KDB_DB_CORRUPT;
+    copy = k5memdup(p, PGSIZE, &ret);
+    if (copy == NULL)
+        return ret;
+    ret = node_keep(node, copy);
+    if (ret)
+        return ret;
+    count = hdr(copy)->count;
+    ret = node_open(node, 0, count);
+    if (ret)
+        goto error;
+    for (i = 0; i < count; i++) {
+        if (!get_cell(copy, i, &node->cells[i])) {
+            ret = KRB5_KDB_DB_CORRUPT;
+            goto error;
+        }
+    }
+    return 0;
+
+error:
+    node_free(node);
+    return ret;
+}
+
+static size_t
+cell_size(int type, const struct cell *c)
+{
+    if (type == PAGE_BRANCH)
+        return BRANCH_FIXED + c->klen;
+    return LEAF_FIXED + c->klen + ((c->flags & CELL_OVERFLOW) ? 4 : c->vlen);
+}
+
+/* Encode count cells into the zeroed page buf. */
+static void
+encode_page(int type, const struct cell *cells, size_t count,
+            unsigned char *buf)
+{
+    struct page_hdr *h = (struct page_hdr *)buf;
+    const struct cell *c;
+    size_t i, pos = PGSIZE, klen;
+
+    h->type = type;
+    h->count = count;
+    for (i = 0; i < count; i++) {
+        c = &cells[i];
+        if (type == PAGE_BRANCH) {
+            /* The first key of a branch is implied by its parent. */
+            klen = (i == 0) ? 0 : c->klen;
+            pos -= BRANCH_FIXED + klen;
+            store_32_n(c->child, buf + pos);
+            store_16_n(klen, buf + pos + 4);
+            memcpy(buf + pos + BRANCH_FIXED, c->key, klen);
+        } else {
+            pos -= cell_size(type, c);
+            store_16_n(c->klen, buf + pos);
+            store_16_n(c->flags, buf + pos + 2);
+            store_32_n(c->vlen, buf + pos + 4);
+            memcpy(buf + pos + LEAF_FIXED, c->key, c->klen);
+            if (c->flags & CELL_OVERFLOW)
+                store_32_n(c->ovfl, buf + pos + LEAF_FIXED + c->klen);
+            else
+                memcpy(buf + pos + LEAF_FIXED + c->klen, c->val, c->vlen);
+        }
+        store_16_n(pos, buf + HDR_SIZE + 2 * i);
+    }
+}
+
+/*
+ * Write node into one or more pages, reusing pgno (if not 0) for the first.
+ * Fill in out with the resulting pages.  An empty node releases pgno and
+ * yields no pages.
+ */
+static krb5_error_code
+write_node(struct view *v, struct node *node, uint32_t pgno, struct repl *out)
+{
+    krb5_error_code ret;
+    unsigned char *buf;
+    size_t total = 0, target, nchunks, start, end, size, s, i;
+
+    memset(out, 0, sizeof(*out));
+    if (node->n == 0)
+        return (pgno != 0) ? free_page(v, pgno) : 0;
+
+    for (i = 0; i < node->n; i++)
+        total += 2 + cell_size(node->type, &node->cells[i]);
+    nchunks = (total + PAGE_CAP - 1) / PAGE_CAP;
+    target = (total + nchunks - 1) / nchunks;
+
+    for (start = 0; start < node->n; start = end) {
+        size = 0;
+        for (end = start; end < node->n; end++) {
+            s = 2 + cell_size(node->type, &node->cells[end]);
+            if (size > 0 && (size + s > PAGE_CAP || size >= target))
+                break;
+            size += s;
+        }
+        if (out->n == MAX_SPLIT)
+            return KRB5_KDB_INTERNAL_ERROR;
+
+        ret = (out->n == 0) ? replace_page(v, pgno, &out->e[out->n].pgno,
+                                           &buf) :
+            alloc_page(v, &out->e[out->n].pgno, &buf);
+        if (ret)
+            return ret;
+        encode_page(node->type, node->cells + start, end - start, buf);
+
+        out->e[out->n].size = size;
+        out->e[out->n].klen = node->cells[start].klen;
+        out->e[out->n].key = k5alloc(node->cells[start].klen + 1, &ret);
+        if (out->e[out->n].key == NULL)
+            return ret;
+        memcpy(out->e[out->n].key, node->cells[start].key,
+               node->cells[start].klen);
+        out->n++;
+    }
+    return 0;
+}
+
+/* Transfer ownership of the keys in r to node. */
+static krb5_error_code
+adopt_keys(struct node *node, struct repl *r)
+{
+    krb5_error_code ret = 0, ret2;
+    size_t i;
+
+    for (i = 0; i < r->n; i++) {
+        if (r->e[i].key == NULL)
+            continue;
+        ret2 = node_keep(node, r->e[i].key);
+        r->e[i].key = NULL;
+        if (ret2 && !ret)
+            ret = ret2;
+    }
+    return ret;
+}
+
+static void
+free_repl(struct repl *r)
+{
+    size_t i;
+
+    for (i = 0; i < r->n; i++)
+        free(r->e[i].key);
+    r->n = 0;
+}
+
+/* Replace branch cell i of node with the pages in r.  The first page keeps
+ * cell i's key. */
+static krb5_error_code
+replace_child(struct node *node, size_t i, struct repl *r)
+{
+    krb5_error_code ret;
+    size_t j;
+
+    ret = adopt_keys(node, r);
+    if (ret)
+        return ret;
+    if (r->n == 0) {
+        node_remove(node, i);
+        return 0;
+    }
+    node->cells[i].child = r->e[0].pgno;
+    ret = node_open(node, i + 1, r->n - 1);
+    if (ret)
+        return ret;
+    for (j = 1; j < r->n; j++) {
+        node->cells[i + j].key = node->mem[node->nmem - r->n + j];
+        node->cells[i + j].klen = r->e[j].klen;
+        node->cells[i + j].child = r->e[j].pgno;
+    }
+    return 0;
+}
+
+/* Merge the children at branch cells l and l + 1 of node, which may split
+ * again if they do not fit in one page. */
+static krb5_error_code
+merge_children(struct view *v, struct node *node, size_t l)
+{
+    krb5_error_code ret;
+    struct node left, right;
+    struct repl r;
+
+    memset(&r, 0, sizeof(r));
+    ret = load_node(v, node->cells[l].child, &left);
+    if (ret)
+        return ret;
+    ret = load_node(v, node->cells[l + 1].child, &right);
+    if (ret)
+        goto cleanup_left;
+    if (left.type != right.type || right.n == 0) {
+        ret = KRB5_KDB_DB_CORRUPT;
+        goto cleanup;
+    }
+
+    /* The right child's first key comes from our separator. */
+    if (right.type == PAGE_BRANCH) {
+        right.cells[0].key = node->cells[l + 1].key;
+        right.cells[0].klen = node->cells[l + 1].klen;
+    }
+    ret = node_open(&left, left.n, right.n);
+    if (ret)
+        goto cleanup;
+    memcpy(left.cells + left.n - right.n, right.cells,
+           right.n * sizeof(*right.cells));
+
+    ret = free_page(v, node->cells[l].child);
+    if (!ret)
+        ret = free_page(v, node->cells[l + 1].child);
+    if (!ret)
+        ret = write_node(v, &left, 0, &r);
+    if (ret)
+        goto cleanup;
+
+    node_remove(node, l + 1);
+    ret = replace_child(node, l, &r);
+
+cleanup:
+    free_repl(&r);
+    node_free(&right);
+cleanup_left:
+    node_free(&left);
+    return ret;
+}
+
+struct op {
+    krb5_boolean del;
+    const krb5_data *key;
+    struct cell cell;           /* new leaf cell, if not del */
+};
+
+/* Apply op to the subtree rooted at pgno, placing the pages which replace it
+ * in out. */
+static krb5_error_code
+modify(struct view *v, uint32_t pgno, int depth, struct op *op,
+       struct repl *out)
+{
+    krb5_error_code ret;
+    struct node node;
+    struct repl sub;
+    struct cell *c;
+    size_t i, l;
+    int cmp = 1;
+
+    memset(out, 0, sizeof(*out));
+    memset(&sub, 0, sizeof(sub));
+    if (depth >= MAX_DEPTH)
+        return KRB5_KDB_DB_CORRUPT;
+    ret = load_node(v, pgno, &node);
+    if (ret)
+        return ret;
+
+    if (node.type == PAGE_LEAF) {
+        for (i = 0; i < node.n; i++) {
+            c = &node.cells[i];
+            cmp = compare_key(c->key, c->klen,
+                              (unsigned char *)op->key->data,
+                              op->key->length);
+            if (cmp >= 0)
+                break;
+        }
+        if (i < node.n && cmp == 0) {
+            c = &node.cells[i];
+            if (c->flags & CELL_OVERFLOW) {
+                ret = free_overflow(v, c->ovfl, c->vlen);
+                if (ret)
+                    goto cleanup;
+            }
+            if (op->del)
+                node_remove(&node, i);
+            else
+                *c = op->cell;
+        } else if (op->del) {
+            ret = KRB5_KDB_NOENTRY;
+            goto cleanup;
+        } else {
+            ret = node_open(&node, i, 1);
+            if (ret)
+                goto cleanup;
+            node.cells[i] = op->cell;
+        }
+        ret = write_node(v, &node, pgno, out);
+        goto cleanup;
+    }
+
+    /* Find the child covering the key; the first child covers everything
+     * below the second child's key. */
+    for (i = 1; i < node.n; i++) {
+        c = &node.cells[i];
+        if (compare_key(c->key, c->klen, (unsigned char *)op->key->data,
+                        op->key->length) > 0)
+            break;
+    }
+    i--;
+    ret = modify(v, node.cells[i].child, depth + 1, op, &sub);
+    if (ret)
+        goto cleanup;
+    ret = replace_child(&node, i, &sub);
+    if (ret)
+        goto cleanup;
+
+    /* Rebalance a child which has become small. */
+    if (sub.n == 1 && sub.e[0].size < PAGE_CAP / 4 && node.n > 1) {
+        l = (i > 0) ? i - 1 : i;
+        ret = merge_children(v, &node, l);
+        if (ret)
+            goto cleanup;
+    }
+    ret = write_node(v, &node, pgno, out);
+
+cleanup:
+    if (ret)
+        free_repl(out);
+    free_repl(&sub);
+    node_free(&node);
+    return ret;
+}
+
+/* Apply op to tree within v's transaction. */
+static krb5_error_code
+tree_modify(struct view *v, int tree, struct op *op)
+{
+    krb5_error_code ret;
+    const unsigned char *p;
+    struct node node;
+    struct repl r;
+    struct cell c;
+    uint32_t root = v->txn->meta.roots[tree];
+    size_t j;
+
+    memset(&r, 0, sizeof(r));
+    memset(&node, 0, sizeof(node));
+    if (root == 0) {
+        if (op->del)
+            return KRB5_KDB_NOENTRY;
+        node.type = PAGE_LEAF;
+        ret = node_open(&node, 0, 1);
+        if (ret)
+            goto cleanup;
+        node.cells[0] = op->cell;
+        ret = write_node(v, &node, 0, &r);
+        if (ret)
+            goto cleanup;
+        root = r.e[0].pgno;
+    } else {
+        ret = modify(v, root, 0, op, &r);
+        if (ret)
+            goto cleanup;
+
+        /* Grow a new root above a split. */
+        while (r.n > 1) {
+            node_free(&node);
+            node.type = PAGE_BRANCH;
+            ret = adopt_keys(&node, &r);
+            if (ret)
+                goto cleanup;
+            ret = node_open(&node, 0, r.n);
+            if (ret)
+                goto cleanup;
+            for (j = 0; j < r.n; j++) {
+                node.cells[j].key = node.mem[j];
+                node.cells[j].klen = r.e[j].klen;
+                node.cells[j].child = r.e[j].pgno;
+            }
+            ret = write_node(v, &node, 0, &r);
+            if (ret)
+                goto cleanup;
+        }
+        root = (r.n == 0) ? 0 : r.e[0].pgno;
+
+        /* Collapse branch roots with a single child. */
+        while (root != 0) {
+            p = view_page(v, root);
+            if (!check_page(p, PAGE_BRANCH) || hdr(p)->count != 1)
+                break;
+            if (!get_cell(p, 0, &c)) {
+                ret = KRB5_KDB_DB_CORRUPT;
+                goto cleanup;
+            }
+            ret = free_page(v, root);
+            if (ret)
+                goto cleanup;
+            root = c.child;
+        }
+    }
+    v->txn->meta.roots[tree] = root;
+
+cleanup:
+    free_repl(&r);
+    node_free(&node);
+    return ret;
+}
+
+/*** Transactions ***/
+
+static void
+free_txn(struct txn *txn)
+{
+    size_t i;
+
+    if (txn == NULL)
+        return;
+    for (i = 0; i < txn->dcap; i++)
+        free(txn->dirty[i].buf);
+    free(txn->dirty);
+    free(txn->ready.ents);
+    free(txn->keep.ents);
+    free(txn->freed.ents);
+    free(txn);
+}
+
+/* Release the write lock on env, keeping a shared lock if a fallback reader
+ * pin needs it. */
+static void
+release_write_lock(mvcc_env *env)
+{
+    int mode = env->shared_locked ? KRB5_LOCKMODE_SHARED :
+        KRB5_LOCKMODE_UNLOCK;
+
+    (void)krb5_lock_file(NULL, env->fd, mode);
+    k5_mutex_unlock(write_lock);
+}
+
+/* Load the freelist of txn's base version, sorting entries into those we can
+ * reuse now and those a reader might still see. */
+static krb5_error_code
+load_freelist(struct view *v, uint64_t threshold)
+{
+    krb5_error_code ret;
+    struct txn *txn = v->txn;
+    const unsigned char *p;
+    struct freeent ent;
+    uint32_t pgno = txn->base.freelist;
+    unsigned int i, npages = 0;
+
+    while (pgno != 0) {
+        p = view_page(v, pgno);
+        if (!check_page(p, PAGE_FREELIST) || ++npages > txn->base.npages)
+            return KRB5_KDB_DB_CORRUPT;
+        for (i = 0; i < hdr(p)->count; i++) {
+            memcpy(&ent, p + HDR_SIZE + i * sizeof(ent), sizeof(ent));
+            if (ent.pgno < FIRST_DATA_PAGE || ent.pgno >= txn->base.npages)
+                return KRB5_KDB_DB_CORRUPT;
+            if (ent.txnid <= threshold)
+                ret = flist_add(&txn->ready, ent.pgno, ent.txnid);
+            else
+                ret = flist_add(&txn->keep, ent.pgno, ent.txnid);
+            if (ret)
+                return ret;
+        }
+        pgno = hdr(p)->next;
+    }
+    return 0;
+}
+
+krb5_error_code
+mvcc_begin(mvcc_env *env)
+{
+    krb5_error_code ret;
+    struct txn *txn;
+    struct meta m;
+    struct view v;
+    uint64_t threshold;
+
+    if (env->txn != NULL) {
+        env->depth++;
+        return 0;
+    }
+    if (env->rdonly)
+        return EACCES;
+
+    k5_mutex_lock(write_lock);
+    for (;;) {
+        ret = krb5_lock_file(NULL, env->fd, KRB5_LOCKMODE_EXCLUSIVE);
+        if (ret)
+            goto error;
+        ret = read_meta(env, &m);
+        if (ret)
+            goto error_locked;
+        if (!(m.flags & META_REPLACED))
+            break;
+        if (env->pins > 0) {
+            /* We can't switch files under a pinned snapshot. */
+            ret = KRB5_KDB_DB_CHANGED;
+            goto error_locked;
+        }
+        (void)krb5_lock_file(NULL, env->fd, KRB5_LOCKMODE_UNLOCK);
+        ret = reopen_file(env);
+        if (ret)
+            goto error;
+        if (env->rdonly) {
+            ret = EACCES;
+            goto error;
+        }
+    }
+    ret = ensure_map(env, m.npages);
+    if (ret)
+        goto error_locked;
+
+    txn = k5alloc(sizeof(*txn), &ret);
+    if (txn == NULL)
+        goto error_locked;
+    txn->base = m;
+    txn->meta = m;
+    txn->meta.txnid = m.txnid + 1;
+
+    /* Pages freed by a transaction at or before the oldest pinned snapshot,
+     * and at or before the current version, are unreachable. */
+    threshold = oldest_reader(env, m.txnid);
+    v.env = env;
+    v.txn = txn;
+    v.meta = &txn->meta;
+    ret = load_freelist(&v, threshold);
+    if (ret) {
+        free_txn(txn);
+        goto error_locked;
+    }
+
+    env->txn = txn;
+    env->depth = 1;
+    return 0;
+
+error_locked:
+    (void)krb5_lock_file(NULL, env->fd, env->shared_locked ?
+                         KRB5_LOCKMODE_SHARED : KRB5_LOCKMODE_UNLOCK);
+error:
+    k5_mutex_unlock(write_lock);
+    return ret;
+}
+
+krb5_boolean
+mvcc_in_txn(mvcc_env *env)
+{
+    return env->txn != NULL;
+}
+
+void
+mvcc_abort(mvcc_env *env)
+{
+    if (env->txn == NULL)
+        return;
+    free_txn(env->txn);
+    env->txn = NULL;
+    env->depth = 0;
+    release_write_lock(env);
+}
+
+/* Write the freelist for txn into newly allocated pages. */
+static krb5_error_code
+save_freelist(struct view *v)
+{
+    krb5_error_code ret;
+    struct txn *txn = v->txn;
+    struct flist *lists[3];
+    struct page_hdr *h;
+    unsigned char *buf;
+    uint32_t pgno, *pages = NULL, *newpages;
+    size_t total, need, npages = 0, k, li, ei, slot;
+
+    /* The old freelist pages are released along with everything else. */
+    pgno = txn->base.freelist;
+    while (pgno != 0) {
+        const unsigned char *p = view_page(v, pgno);
+
+        if (!check_page(p, PAGE_FREELIST))
+            return KRB5_KDB_DB_CORRUPT;
+        k = hdr(p)->next;
+        ret = free_page(v, pgno);
+        if (ret)
+            return ret;
+        pgno = k;
+    }
+
+    /* Allocating pages for the list may shrink it, so recompute the need
+     * after each allocation. */
+    for (;;) {
+        total = txn->ready.n + txn->keep.n + txn->freed.n;
+        need = (total + FL_PER_PAGE - 1) / FL_PER_PAGE;
+        if (npages >= need)
+            break;
+        newpages = realloc(pages, (npages + 1) * sizeof(*pages));
+        if (newpages == NULL) {
+            ret = ENOMEM;
+            goto cleanup;
+        }
+        pages = newpages;
+        ret = alloc_page(v, &pages[npages], &buf);
+        if (ret)
+            goto cleanup;
+        npages++;
+    }
+
+    lists[0] = &txn->ready;
+    lists[1] = &txn->keep;
+    lists[2] = &txn->freed;
+    li = ei = 0;
+    for (k = 0; k < npages; k++) {
+        ret = replace_page(v, pages[k], &pgno, &buf);
+        if (ret)
+            goto cleanup;
+        h = (struct page_hdr *)buf;
+        h->type = PAGE_FREELIST;
+        h->next = (k + 1 < npages) ? pages[k + 1] : 0;
+        for (slot = 0; slot < FL_PER_PAGE && li < 3; ) {
+            if (ei >= lists[li]->n) {
+                li++;
+                ei = 0;
+                continue;
+            }
+            memcpy(buf + HDR_SIZE + slot * sizeof(struct freeent),
+                   &lists[li]->ents[ei++], sizeof(struct freeent));
+            slot++;
+        }
+        h->count = slot;
+    }
+    txn->meta.freelist = (npages > 0) ? pages[0] : 0;
+    ret = 0;
+
+cleanup:
+    free(pages);
+    return ret;
+}
+
+static krb5_error_code
+commit_txn(mvcc_env *env, struct txn *txn)
+{
+    krb5_error_code ret;
+    unsigned char *buf;
+    struct view v;
+    time_t now;
+    size_t i;
+
+    v.env = env;
+    v.txn = txn;
+    v.meta = &txn->meta;
+    ret = save_freelist(&v);
+    if (ret)
+        return ret;
+
+    ret = grow_file(env, txn->meta.npages);
+    if (ret)
+        return ret;
+    for (i = 0; i < txn->dcap; i++) {
+        if (!txn->dirty[i].live || txn->dirty[i].buf == NULL)
+            continue;
+        ret = write_full(env->fd, txn->dirty[i].buf, PGSIZE,
+                         (off_t)txn->dirty[i].pgno * PGSIZE);
+        if (ret)
+            return ret;
+    }
+    ret = sync_file(env->fd);
+    if (ret)
+        return ret;
+
+    /* Commit times strictly increase, so they can serve as the database
+     * age. */
+    now = time(NULL);
+    txn->meta.commit_time = (now > txn->base.commit_time) ? now :
+        txn->base.commit_time + 1;
+    txn->meta.checksum = meta_checksum(&txn->meta);
+    buf = k5alloc(PGSIZE, &ret);
+    if (buf == NULL)
+        return ret;
+    memcpy(buf, &txn->meta, sizeof(txn->meta));
+    ret = write_full(env->fd, buf, PGSIZE,
+                     (off_t)(txn->meta.txnid % 2) * PGSIZE);
+    free(buf);
+    if (ret)
+        return ret;
+    return sync_file(env->fd);
+}
+
+krb5_error_code
+mvcc_commit(mvcc_env *env)
+{
+    krb5_error_code ret;
+    struct txn *txn = env->txn;
+
+    if (txn == NULL)
+        return KRB5_KDB_NOTLOCKED;
+    if (--env->depth > 0)
+        return 0;
+
+    if (txn->failed)
+        ret = txn->failed;
+    else if (txn->modified)
+        ret = commit_txn(env, txn);
+    else
+        ret = 0;
+
+    /* Move a pinned snapshot forward to the version we just wrote. */
+    if (ret == 0 && txn->modified && env->pins > 0) {
+        env->snap = txn->meta;
+        if (env->slot >= 0 && env->slot_pid == getpid())
+            slot_set(&env->rtable[env->slot], txn->meta.txnid);
+        (void)ensure_map(env, txn->meta.npages);
+    }
+
+    free_txn(txn);
+    env->txn = NULL;
+    release_write_lock(env);
+    return ret;
+}
+
+krb5_error_code
+mvcc_put(mvcc_env *env, int tree, const krb5_data *key, const krb5_data *val)
+{
+    krb5_error_code ret;
+    struct txn *txn = env->txn;
+    struct view v;
+    struct op op;
+
+    if (txn == NULL)
+        return KRB5_KDB_NOTLOCKED;
+    if (txn->failed)
+        return txn->failed;
+    if (key->length == 0 || key->length > MVCC_MAX_KEY)
+        return EINVAL;
+
+    v.env = env;
+    v.txn = txn;
+    v.meta = &txn->meta;
+    memset(&op, 0, sizeof(op));
+    op.key = key;
+    op.cell.key = (unsigned char *)key->data;
+    op.cell.klen = key->length;
+    op.cell.vlen = val->length;
+    txn->modified = TRUE;
+    if (LEAF_FIXED + key->length + val->length > MAX_INLINE) {
+        op.cell.flags = CELL_OVERFLOW;
+        ret = write_overflow(&v, val, &op.cell.ovfl);
+        if (ret)
+            goto cleanup;
+    } else {
+        op.cell.val = (unsigned char *)val->data;
+    }
+    ret = tree_modify(&v, tree, &op);
+
+cleanup:
+    if (ret)
+        txn->failed = ret;
+    return ret;
+}
+
+krb5_error_code
+mvcc_del(mvcc_env *env, int tree, const krb5_data *key)
+{
+    krb5_error_code ret;
+    struct txn *txn = env->txn;
+    struct view v;
+    struct op op;
+
+    if (txn == NULL)
+        return KRB5_KDB_NOTLOCKED;
+    if (txn->failed)
+        return txn->failed;
+    if (key->length == 0 || key->length > MVCC_MAX_KEY)
+        return KRB5_KDB_NOENTRY;
+
+    v.env = env;
+    v.txn = txn;
+    v.meta = &txn->meta;
+    memset(&op, 0, sizeof(op));
+    op.del = TRUE;
+    op.key = key;
+    ret = tree_modify(&v, tree, &op);
+    /* A missing key is found before anything is changed. */
+    if (ret == KRB5_KDB_NOENTRY)
+        return ret;
+    txn->modified = TRUE;
+    if (ret)
+        txn->failed = ret;
+    return ret;
+}
+
+krb5_error_code
+mvcc_env_retire(mvcc_env *env)
+{
+    krb5_error_code ret;
+
+    ret = mvcc_begin(env);
+    if (ret)
+        return ret;
+    env->txn->meta.flags |= META_REPLACED;
+    env->txn->modified = TRUE;
+    return mvcc_commit(env);
+}
@@ -64,12 +64,16 @@
  * Key values are generated using a hash of the kvno, enctype, salt type, and
  * principal name.  This module does not use master key encryption, so it
  * serves as a partial test of the DAL's ability to avoid that.
+ *
+ * Asynchronous lookups are answered from a zero-length timeout on the event
+ * loop, so that the KDC's handling of deferred results is exercised.
  */
 
 #include "k5-int.h"
 #include "kdb5.h"
 #include "adm_proto.h"
 #include <ctype.h>
+#include <verto.h>
 
 #define TEST_AD_TYPE -456
 
@@ -393,6 +397,44 @@ cleanup:
     return ret;
 }
 
+struct async_lookup {
+    krb5_context context;
+    krb5_error_code code;
+    krb5_db_entry *entry;
+    krb5_db_get_principal_cb respond;
+    void *arg;
+};
+
+static void
+async_lookup_done(verto_ctx *vctx, verto_ev *ev)
+{
+    struct async_lookup *lookup = verto_get_private(ev);
+
+    (*lookup->respond)(lookup->context, lookup->arg, lookup->code,
+                       lookup->entry);
+    free(lookup);
+}
+
+static void
+test_get_principal_async(krb5_context context, verto_ctx *vctx,
+                         krb5_const_principal search_for, unsigned int flags,
+                         krb5_db_get_principal_cb respond, void *arg)
+{
+    struct async_lookup *lookup;
+    verto_ev *ev;
+
+    lookup = ealloc(sizeof(*lookup));
+    lookup->context = context;
+    lookup->respond = respond;
+    lookup->arg = arg;
+    lookup->code = test_get_principal(context, search_for, flags,
+                                      &lookup->entry);
+    ev = verto_add_timeout(vctx, VERTO_EV_FLAG_NONE, async_lookup_done, 0);
+    if (ev == NULL)
+        abort();
+    verto_set_private(ev, lookup, NULL);
+}
+
 static krb5_error_code
 test_fetch_master_key(krb5_context context, krb5_principal mname,
                       krb5_keyblock *key_out, krb5_kvno *kvno_out,
@@ -505,7 +547,7 @@ test_check_allowed_to_delegate(krb5_context context,
 
 kdb_vftabl PLUGIN_SYMBOL_NAME(krb5_test, kdb_function_table) = {
     KRB5_KDB_DAL_MAJOR_VERSION,             /* major version number */
-    0,                                      /* minor version number 0 */
+    1,                                      /* minor version number 1 */
     test_init,
     test_cleanup,
     test_open,
@@ -539,5 +581,7 @@ kdb_vftabl PLUGIN_SYMBOL_NAME(krb5_test, kdb_function_table) = {
     NULL, /* check_policy_tgs */
     NULL, /* audit_as_req */
     NULL, /* refresh_config */
-    test_check_allowed_to_delegate
+    test_check_allowed_to_delegate,
+    /* Minor version 1 */
+    test_get_principal_async
 };
@@ -44,6 +44,12 @@
 #define DEFAULT_TIMEOUT 5
 #define DEFAULT_RETRIES 3
 #define MAX_SECRET_LEN 1024
+#define CONFIG_CACHE_SLOTS 1024
+
+#define TRACE_OTP_CONFIG_CACHED(c, princ)                               \
+    TRACE(c, "Using cached OTP token configuration for {princ}", princ)
+#define TRACE_OTP_CONFIG_DECODED(c, princ)                              \
+    TRACE(c, "Decoded OTP token configuration for {princ}", princ)
 
 typedef struct token_type_st {
     char *name;
@@ -61,8 +67,18 @@ typedef struct token_st {
     char **indicators;
 } token;
 
+/* The tokens decoded from a principal's configuration string, shared by the
+ * configuration cache and the requests using them. */
+typedef struct princ_config_st {
+    unsigned int refcount;
+    krb5_principal princ;
+    char *str;
+    token *tokens;
+} princ_config;
+
 typedef struct request_st {
     otp_state *state;
+    princ_config *pconf;
     token *tokens;
     ssize_t index;
     otp_cb cb;
@@ -75,6 +91,7 @@ struct otp_state_st {
     token_type *types;
     krad_client *radius;
     krad_attrset *attrs;
+    princ_config *cache[CONFIG_CACHE_SLOTS];
 };
 
 static void request_send(request *req);
@@ -546,6 +563,103 @@ cleanup:
     return retval;
 }
 
+/* Release a reference to a principal configuration, freeing it when the last
+ * reference is released. */
+static void
+princ_config_release(krb5_context ctx, princ_config *pconf)
+{
+    if (pconf == NULL || --pconf->refcount > 0)
+        return;
+
+    krb5_free_principal(ctx, pconf->princ);
+    free(pconf->str);
+    tokens_free(pconf->tokens);
+    free(pconf);
+}
+
+/* Hash a principal name for the configuration cache (FNV-1a). */
+static unsigned int
+princ_hash(krb5_const_principal princ)
+{
+    unsigned int h = 2166136261U;
+    krb5_int32 i;
+    unsigned int j;
+    const krb5_data *d;
+
+    for (i = -1; i < princ->length; i++) {
+        d = (i < 0) ? &princ->realm : &princ->data[i];
+        for (j = 0; j < d->length; j++)
+            h = (h ^ (unsigned char)d->data[j]) * 16777619U;
+        h = (h ^ '/') * 16777619U;
+    }
+    return h;
+}
+
+/* Return true if two possibly null configuration strings are the same. */
+static krb5_boolean
+config_str_equal(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* Get the tokens for princ from its configuration string.  Reuse the result
+ * of an earlier decoding for the principal if the string is unchanged. */
+static krb5_error_code
+princ_config_get(otp_state *state, krb5_const_principal princ,
+                 const char *config, princ_config **out)
+{
+    krb5_error_code retval;
+    princ_config *pconf, **slot;
+
+    *out = NULL;
+
+    slot = &state->cache[princ_hash(princ) % CONFIG_CACHE_SLOTS];
+    pconf = *slot;
+    if (pconf != NULL && config_str_equal(pconf->str, config) &&
+        krb5_principal_compare(state->ctx, pconf->princ, princ)) {
+        pconf->refcount++;
+        TRACE_OTP_CONFIG_CACHED(state->ctx, princ);
+        *out = pconf;
+        return 0;
+    }
+
+    pconf = k5alloc(sizeof(*pconf), &retval);
+    if (pconf == NULL)
+        return retval;
+    pconf->refcount = 1;
+
+    retval = tokens_decode(state->ctx, princ, state->types, config,
+                           &pconf->tokens);
+    if (retval != 0)
+        goto error;
+    TRACE_OTP_CONFIG_DECODED(state->ctx, princ);
+
+    retval = krb5_copy_principal(state->ctx, princ, &pconf->princ);
+    if (retval != 0)
+        goto error;
+
+    if (config != NULL) {
+        pconf->str = strdup(config);
+        if (pconf->str == NULL) {
+            retval = ENOMEM;
+            goto error;
+        }
+    }
+
+    /* Replace whatever was in the cache slot. */
+    princ_config_release(state->ctx, *slot);
+    pconf->refcount++;
+    *slot = pconf;
+    *out = pconf;
+    return 0;
+
+error:
+    princ_config_release(state->ctx, pconf);
+    return retval;
+}
+
 static void
 request_free(request *req)
 {
@@ -553,7 +667,7 @@ request_free(request *req)
         return;
 
     krad_attrset_free(req->attrs);
-    tokens_free(req->tokens);
+    princ_config_release(req->state->ctx, req->pconf);
     free(req);
 }
 
@@ -611,9 +725,13 @@ error:
 void
 otp_state_free(otp_state *self)
 {
+    size_t i;
+
     if (self == NULL)
         return;
 
+    for (i = 0; i < CONFIG_CACHE_SLOTS; i++)
+        princ_config_release(self->ctx, self->cache[i]);
     krad_attrset_free(self->attrs);
     token_types_free(self->types);
     free(self);
@@ -715,8 +833,7 @@ otp_state_verify(otp_state *state, verto_ctx *ctx, krb5_const_principal princ,
     if (retval != 0)
         goto error;
 
-    retval = tokens_decode(state->ctx, princ, state->types, config,
-                           &rqst->tokens);
+    retval = princ_config_get(state, princ, config, &rqst->pconf);
     if (retval != 0) {
         if (krb5_unparse_name(state->ctx, princ, &name) == 0) {
             com_err("otp", retval,
@@ -725,6 +842,7 @@ otp_state_verify(otp_state *state, verto_ctx *ctx, krb5_const_principal princ,
         }
         goto error;
     }
+    rqst->tokens = rqst->pconf->tokens;
 
     request_send(rqst);
     return;
@@ -61,6 +61,20 @@
 #define PKINIT_DEFAULT_DH_MIN_BITS  2048
 #define PKINIT_DH_MIN_CONFIG_BITS   1024
 
+/* Elliptic curve groups (RFC 5349) are represented by the finite field
+ * modulus size of comparable strength. */
+#define PKINIT_DH_P256_BITS         3072
+#define PKINIT_DH_P384_BITS         7680
+#define PKINIT_DH_P521_BITS         15360
+#define PKINIT_DH_IS_EC(bits)                                           \
+    ((bits) == PKINIT_DH_P256_BITS || (bits) == PKINIT_DH_P384_BITS ||  \
+     (bits) == PKINIT_DH_P521_BITS)
+
+/* The group a client uses in its first request.  This is a MODP group, which
+ * every KDC supports; an EC group would cost an extra round trip against KDCs
+ * without EC support. */
+#define PKINIT_DEFAULT_CLIENT_DH_BITS 2048
+
 #define KRB5_CONF_KDCDEFAULTS                   "kdcdefaults"
 #define KRB5_CONF_LIBDEFAULTS                   "libdefaults"
 #define KRB5_CONF_REALMS                        "realms"
@@ -74,9 +88,11 @@
 #define KRB5_CONF_PKINIT_IDENTITY               "pkinit_identity"
 #define KRB5_CONF_PKINIT_KDC_HOSTNAME           "pkinit_kdc_hostname"
 #define KRB5_CONF_PKINIT_KDC_OCSP               "pkinit_kdc_ocsp"
+#define KRB5_CONF_PKINIT_KEYPAIR_POOL_SIZE      "pkinit_keypair_pool_size"
 #define KRB5_CONF_PKINIT_POOL                   "pkinit_pool"
 #define KRB5_CONF_PKINIT_REQUIRE_CRL_CHECKING   "pkinit_require_crl_checking"
 #define KRB5_CONF_PKINIT_REVOKE                 "pkinit_revoke"
+#define KRB5_CONF_PKINIT_VERIFY_CACHE_TTL       "pkinit_verify_cache_ttl"
 
 /* Make pkiDebug(fmt,...) print, or not.  */
 #ifdef DEBUG
@@ -101,6 +117,7 @@ static inline void pkiDebug (const char *fmt, ...) { }
     (k5d)->length = (octd)->length; (k5d)->data = (char *)(octd)->data;
 
 extern const krb5_data dh_oid;
+extern const krb5_data ec_oid;
 
 /*
  * notes about crypto contexts:
@@ -148,6 +165,8 @@ typedef struct _pkinit_plg_opts {
     int dh_or_rsa;	    /* selects DH or RSA based pkinit */
     int require_crl_checking; /* require CRL for a CA (default is false) */
     int dh_min_bits;	    /* minimum DH modulus size allowed */
+    int verify_cache_ttl;   /* seconds to cache chain verifications */
+    int keypair_pool_size;  /* precomputed DH keypairs kept per group */
 } pkinit_plg_opts;
 
 /*
@@ -240,6 +259,9 @@ struct _pkinit_kdc_req_context {
     krb5_auth_pack *rcv_auth_pack;
     krb5_auth_pack_draft9 *rcv_auth_pack9;
     krb5_preauthtype pa_type;
+    unsigned char *server_key;  /* shared secret from key agreement */
+    unsigned int server_key_len;
+    krb5_data dh_signed_data;   /* signed KDCDHKeyInfo for the reply */
 };
 typedef struct _pkinit_kdc_req_context *pkinit_kdc_req_context;
 
@@ -338,6 +360,7 @@ void free_krb5_algorithm_identifier(krb5_algorithm_identifier *in);
 void free_krb5_kdc_dh_key_info(krb5_kdc_dh_key_info **in);
 void free_krb5_subject_pk_info(krb5_subject_pk_info **in);
 krb5_error_code pkinit_copy_krb5_data(krb5_data *dst, const krb5_data *src);
+int pkinit_parse_dh_min_bits(const char *str);
 
 
 /*
@@ -254,12 +254,12 @@ pkinit_as_req_create(krb5_context context,
     case DH_PROTOCOL:
         TRACE_PKINIT_CLIENT_REQ_DH(context);
         pkiDebug("as_req: DH key transport algorithm\n");
-        info.algorithm.algorithm = dh_oid;
 
         /* create client-side DH keys */
         retval = client_create_dh(context, plgctx->cryptoctx,
                                   reqctx->cryptoctx, reqctx->idctx,
-                                  reqctx->opts->dh_size, &dh_params,
+                                  reqctx->opts->dh_size,
+                                  &info.algorithm.algorithm, &dh_params,
                                   &dh_params_len, &dh_pubkey, &dh_pubkey_len);
         if (retval != 0) {
             pkiDebug("failed to create dh parameters\n");
@@ -890,7 +890,7 @@ pkinit_client_profile(krb5_context context,
                       const krb5_data *realm)
 {
     const char *configured_identity;
-    char *eku_string = NULL;
+    char *eku_string = NULL, *dh_min_bits = NULL;
 
     pkiDebug("pkinit_client_profile %p %p %p %p\n",
              context, plgctx, reqctx, realm);
@@ -899,16 +899,19 @@ pkinit_client_profile(krb5_context context,
                               KRB5_CONF_PKINIT_REQUIRE_CRL_CHECKING,
                               reqctx->opts->require_crl_checking,
                               &reqctx->opts->require_crl_checking);
-    pkinit_libdefault_integer(context, realm,
-                              KRB5_CONF_PKINIT_DH_MIN_BITS,
-                              reqctx->opts->dh_size,
-                              &reqctx->opts->dh_size);
-    if (reqctx->opts->dh_size != 1024 && reqctx->opts->dh_size != 2048
-        && reqctx->opts->dh_size != 4096) {
+    pkinit_libdefault_string(context, realm,
+                             KRB5_CONF_PKINIT_DH_MIN_BITS, &dh_min_bits);
+    if (dh_min_bits != NULL) {
+        reqctx->opts->dh_size = pkinit_parse_dh_min_bits(dh_min_bits);
+        free(dh_min_bits);
+    }
+    if (reqctx->opts->dh_size != 1024 && reqctx->opts->dh_size != 2048 &&
+        reqctx->opts->dh_size != 4096 &&
+        !PKINIT_DH_IS_EC(reqctx->opts->dh_size)) {
         pkiDebug("%s: invalid value (%d) for pkinit_dh_min_bits, "
                  "using default value (%d) instead\n", __FUNCTION__,
-                 reqctx->opts->dh_size, PKINIT_DEFAULT_DH_MIN_BITS);
-        reqctx->opts->dh_size = PKINIT_DEFAULT_DH_MIN_BITS;
+                 reqctx->opts->dh_size, PKINIT_DEFAULT_CLIENT_DH_BITS);
+        reqctx->opts->dh_size = PKINIT_DEFAULT_CLIENT_DH_BITS;
     }
     pkinit_libdefault_string(context, realm,
                              KRB5_CONF_PKINIT_EKU_CHECKING,
@@ -319,7 +319,11 @@ krb5_error_code client_create_dh
 	pkinit_req_crypto_context req_cryptoctx,	/* IN */
 	pkinit_identity_crypto_context id_cryptoctx,	/* IN */
 	int dh_size,					/* IN
-		    specifies the DH modulous, eg 1024, 2048, or 4096 */
+		    specifies the DH modulous, eg 1024, 2048, or 4096,
+		    or an elliptic curve group, eg PKINIT_DH_P256_BITS */
+	krb5_data *algorithm,				/* OUT
+		    receives the key agreement algorithm OID (not
+		    allocated) */
 	unsigned char **dh_paramas,			/* OUT
 		    contains DER encoded DH params */
 	unsigned int *dh_params_len,			/* OUT
@@ -358,8 +362,9 @@ krb5_error_code server_check_dh
 	pkinit_plg_crypto_context plg_cryptoctx,	/* IN */
 	pkinit_req_crypto_context req_cryptoctx,	/* IN */
 	pkinit_identity_crypto_context id_cryptoctx,	/* IN */
-	krb5_data *dh_params,				/* IN
-		    ???? */
+	krb5_algorithm_identifier *dh_alg,		/* IN
+		    contains the client's key agreement algorithm
+		    and DH parameters or elliptic curve */
 	int minbits);					/* IN
 		    the mininum number of key bits acceptable */
 
@@ -530,6 +535,33 @@ krb5_error_code crypto_cert_select_default
 	pkinit_req_crypto_context req_cryptoctx,	/* IN */
 	pkinit_identity_crypto_context id_cryptoctx);	/* IN */
 
+/*
+ * build a long-lived verification store from the trusted CAs loaded
+ * into id_cryptoctx, and cache successful client certificate chain
+ * verifications for up to ttl seconds if ttl is positive
+ */
+krb5_error_code crypto_init_verify_cache
+	(krb5_context context,				/* IN */
+	pkinit_plg_crypto_context plg_cryptoctx,	/* IN */
+	pkinit_identity_crypto_context id_cryptoctx,	/* IN/OUT */
+	int ttl);					/* IN */
+
+/*
+ * keep up to size precomputed ephemeral keypairs for each key
+ * agreement group used by clients, refilled by a background thread,
+ * if size is positive
+ */
+krb5_error_code crypto_init_keypair_pool
+	(krb5_context context,				/* IN */
+	pkinit_plg_crypto_context plg_cryptoctx,	/* IN/OUT */
+	int size);					/* IN */
+
+/*
+ * return true if the crypto library may be used from several threads
+ * at once
+ */
+krb5_boolean crypto_thread_safe(void);
+
 /*
  * process the values from idopts and obtain the anchor or
  * intermediate certificates, or crls specified by idtype,
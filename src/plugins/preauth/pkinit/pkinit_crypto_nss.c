@@ -1444,7 +1444,7 @@ client_create_dh(krb5_context context,
                  pkinit_plg_crypto_context plg_cryptoctx,
                  pkinit_req_crypto_context req_cryptoctx,
                  pkinit_identity_crypto_context id_cryptoctx,
-                 int dh_size_bits,
+                 int dh_size_bits, krb5_data *algorithm,
                  unsigned char **dh_params,
                  unsigned int *dh_params_len,
                  unsigned char **dh_pubkey, unsigned int *dh_pubkey_len)
@@ -1457,6 +1457,11 @@ client_create_dh(krb5_context context,
     struct domain_parameters *params;
     SECItem encoded;
 
+    /* Elliptic curve groups are not implemented for NSS; use MODP. */
+    if (PKINIT_DH_IS_EC(dh_size_bits))
+        dh_size_bits = 2048;
+    *algorithm = dh_oid;
+
     pool = PORT_NewArena(sizeof(double));
     if (pool == NULL)
         return ENOMEM;
@@ -1631,10 +1636,14 @@ server_check_dh(krb5_context context,
                 pkinit_plg_crypto_context plg_cryptoctx,
                 pkinit_req_crypto_context req_cryptoctx,
                 pkinit_identity_crypto_context id_cryptoctx,
-                krb5_data *dh_params, int minbits)
+                krb5_algorithm_identifier *dh_alg, int minbits)
 {
     PLArenaPool *pool;
     SECItem item;
+    krb5_data *dh_params = &dh_alg->parameters;
+
+    if (!data_eq(dh_alg->algorithm, dh_oid))
+        return KRB5KDC_ERR_DH_KEY_PARAMETERS_NOT_ACCEPTED;
 
     pool = PORT_NewArena(sizeof(double));
     if (pool == NULL)
@@ -3491,6 +3500,31 @@ crypto_cert_select_default(krb5_context context,
     return 0;
 }
 
+/* NSS keeps trusted roots in its certificate database, and does its own
+ * caching of certificate verification results. */
+krb5_error_code
+crypto_init_verify_cache(krb5_context context,
+                         pkinit_plg_crypto_context plg_cryptoctx,
+                         pkinit_identity_crypto_context id_cryptoctx,
+                         int ttl)
+{
+    return 0;
+}
+
+/* Precomputed keypairs are not implemented for NSS. */
+krb5_error_code
+crypto_init_keypair_pool(krb5_context context,
+                         pkinit_plg_crypto_context plg_cryptoctx, int size)
+{
+    return 0;
+}
+
+krb5_boolean
+crypto_thread_safe(void)
+{
+    return TRUE;
+}
+
 krb5_error_code
 crypto_load_cas_and_crls(krb5_context context,
                          pkinit_plg_crypto_context plg_cryptoctx,
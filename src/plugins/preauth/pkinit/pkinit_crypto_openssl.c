@@ -31,6 +31,7 @@
 
 #include "pkinit_crypto_openssl.h"
 #include "k5-buf.h"
+#include "k5-thread.h"
 #include <dlfcn.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -77,6 +78,8 @@ static int prepare_enc_data
 
 static int openssl_callback (int, X509_STORE_CTX *);
 static int openssl_callback_ignore_crls (int, X509_STORE_CTX *);
+static void free_verify_cache(pkinit_verify_cache cache);
+static void free_keypair_pool(pkinit_keypair_pool pool);
 
 static int pkcs7_decrypt
 (krb5_context context, pkinit_identity_crypto_context id_cryptoctx,
@@ -195,6 +198,7 @@ pkinit_pkcs11_code_to_text(int err);
 #define EVP_MD_CTX_new EVP_MD_CTX_create
 #define EVP_MD_CTX_free EVP_MD_CTX_destroy
 #define ASN1_STRING_get0_data ASN1_STRING_data
+#define X509_CRL_get0_nextUpdate X509_CRL_get_nextUpdate
 
 /* 1.1 makes many handle types opaque and adds accessors.  Add compatibility
  * versions of the new accessors we use for pre-1.1. */
@@ -567,6 +571,7 @@ pkinit_fini_plg_crypto(pkinit_plg_crypto_context cryptoctx)
 
     if (cryptoctx == NULL)
         return;
+    free_keypair_pool(cryptoctx->keypair_pool);
     pkinit_fini_pkinit_oids(cryptoctx);
     pkinit_fini_dh_params(cryptoctx);
     free(cryptoctx);
@@ -617,6 +622,8 @@ pkinit_fini_identity_crypto(pkinit_identity_crypto_context idctx)
     free(idctx->identity);
     pkinit_fini_certs(idctx);
     pkinit_fini_pkcs11(idctx);
+    X509_STORE_free(idctx->verify_store);
+    free_verify_cache(idctx->verify_cache);
     free(idctx);
 }
 
@@ -632,6 +639,7 @@ pkinit_init_req_crypto(pkinit_req_crypto_context *cryptoctx)
     memset(ctx, 0, sizeof(*ctx));
 
     ctx->dh = NULL;
+    ctx->ec = NULL;
     ctx->received_cert = NULL;
 
     *cryptoctx = ctx;
@@ -654,6 +662,8 @@ pkinit_fini_req_crypto(pkinit_req_crypto_context req_cryptoctx)
     pkiDebug("%s: freeing ctx at %p\n", __FUNCTION__, req_cryptoctx);
     if (req_cryptoctx->dh != NULL)
         DH_free(req_cryptoctx->dh);
+    if (req_cryptoctx->ec != NULL)
+        EC_KEY_free(req_cryptoctx->ec);
     if (req_cryptoctx->received_cert != NULL)
         X509_free(req_cryptoctx->received_cert);
 
@@ -1435,6 +1445,384 @@ cleanup:
     return retval;
 }
 
+/*
+ * Successful verifications of client certificate chains are cached in a
+ * direct-mapped table indexed by a SHA-256 digest of the end-entity
+ * certificate and the certificates and CRLs accompanying it.  An entry is
+ * kept for the configured lifetime, but no longer than any certificate in the
+ * verified chain remains valid or any CRL used to check it is current.
+ */
+#define VERIFY_CACHE_SLOTS 1024
+
+struct verify_cache_entry {
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    time_t expires;
+    STACK_OF(X509) *chain;
+};
+
+struct _pkinit_verify_cache {
+    k5_mutex_t lock;
+    time_t ttl;
+    struct verify_cache_entry entries[VERIFY_CACHE_SLOTS];
+};
+
+static krb5_error_code
+digest_x509(EVP_MD_CTX *ctx, X509 *x)
+{
+    unsigned char *der = NULL;
+    int len;
+
+    len = i2d_X509(x, &der);
+    if (len < 0)
+        return ENOMEM;
+    EVP_DigestUpdate(ctx, der, len);
+    OPENSSL_free(der);
+    return 0;
+}
+
+static krb5_error_code
+digest_x509_crl(EVP_MD_CTX *ctx, X509_CRL *crl)
+{
+    unsigned char *der = NULL;
+    int len;
+
+    len = i2d_X509_CRL(crl, &der);
+    if (len < 0)
+        return ENOMEM;
+    EVP_DigestUpdate(ctx, der, len);
+    OPENSSL_free(der);
+    return 0;
+}
+
+/* Compute the cache key for the end-entity certificate x, accompanied by the
+ * certificates certs and CRLs crls from a CMS message. */
+static krb5_error_code
+verify_cache_key(X509 *x, STACK_OF(X509) *certs, STACK_OF(X509_CRL) *crls,
+                 int require_crl_checking, unsigned char *key_out)
+{
+    krb5_error_code ret = ENOMEM;
+    EVP_MD_CTX *ctx;
+    unsigned char flag = require_crl_checking ? 1 : 0;
+    int i;
+
+    ctx = EVP_MD_CTX_new();
+    if (ctx == NULL)
+        return ENOMEM;
+    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+        goto cleanup;
+    EVP_DigestUpdate(ctx, &flag, 1);
+    ret = digest_x509(ctx, x);
+    for (i = 0; ret == 0 && i < sk_X509_num(certs); i++)
+        ret = digest_x509(ctx, sk_X509_value(certs, i));
+    for (i = 0; ret == 0 && i < sk_X509_CRL_num(crls); i++)
+        ret = digest_x509_crl(ctx, sk_X509_CRL_value(crls, i));
+    if (ret)
+        goto cleanup;
+    if (!EVP_DigestFinal_ex(ctx, key_out, NULL))
+        ret = ENOMEM;
+
+cleanup:
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+static STACK_OF(X509) *
+dup_chain(STACK_OF(X509) *chain)
+{
+    STACK_OF(X509) *copy;
+    X509 *x;
+    int i;
+
+    copy = sk_X509_new_null();
+    if (copy == NULL)
+        return NULL;
+    for (i = 0; i < sk_X509_num(chain); i++) {
+        x = X509_dup(sk_X509_value(chain, i));
+        if (x == NULL || !sk_X509_push(copy, x)) {
+            X509_free(x);
+            sk_X509_pop_free(copy, X509_free);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+/* Reduce *limit to the number of seconds until the time t, or to -1 if t is
+ * in the past. */
+static void
+limit_to_time(const ASN1_TIME *t, long *limit)
+{
+    int days, secs;
+    long remaining;
+
+    if (t == NULL)
+        return;
+    if (!ASN1_TIME_diff(&days, &secs, NULL, t)) {
+        *limit = -1;
+        return;
+    }
+    remaining = (long)days * 86400 + secs;
+    if (remaining <= 0)
+        *limit = -1;
+    else if (remaining < *limit)
+        *limit = remaining;
+}
+
+/* Return a copy of the verified chain cached under key, or NULL if there is
+ * no current entry. */
+static STACK_OF(X509) *
+verify_cache_get(pkinit_verify_cache cache, const unsigned char *key)
+{
+    struct verify_cache_entry *ent;
+    STACK_OF(X509) *chain = NULL;
+
+    ent = &cache->entries[load_16_be(key) % VERIFY_CACHE_SLOTS];
+    k5_mutex_lock(&cache->lock);
+    if (ent->chain != NULL && memcmp(ent->key, key, sizeof(ent->key)) == 0) {
+        if (time(NULL) < ent->expires) {
+            chain = dup_chain(ent->chain);
+        } else {
+            sk_X509_pop_free(ent->chain, X509_free);
+            ent->chain = NULL;
+        }
+    }
+    k5_mutex_unlock(&cache->lock);
+    if (chain != NULL)
+        pkiDebug("%s: using cached certificate verification\n", __FUNCTION__);
+    return chain;
+}
+
+/* Cache the verified chain under key, for no longer than the chain and the
+ * CRLs in crls remain valid. */
+static void
+verify_cache_put(pkinit_verify_cache cache, const unsigned char *key,
+                 STACK_OF(X509) *chain, STACK_OF(X509_CRL) *crls)
+{
+    struct verify_cache_entry *ent;
+    STACK_OF(X509) *copy;
+    long lifetime = cache->ttl;
+    int i;
+
+    for (i = 0; i < sk_X509_num(chain); i++)
+        limit_to_time(X509_get_notAfter(sk_X509_value(chain, i)), &lifetime);
+    for (i = 0; i < sk_X509_CRL_num(crls); i++)
+        limit_to_time(X509_CRL_get0_nextUpdate(sk_X509_CRL_value(crls, i)),
+                      &lifetime);
+    if (lifetime <= 0)
+        return;
+    copy = dup_chain(chain);
+    if (copy == NULL)
+        return;
+
+    ent = &cache->entries[load_16_be(key) % VERIFY_CACHE_SLOTS];
+    k5_mutex_lock(&cache->lock);
+    if (ent->chain != NULL)
+        sk_X509_pop_free(ent->chain, X509_free);
+    memcpy(ent->key, key, sizeof(ent->key));
+    ent->expires = time(NULL) + lifetime;
+    ent->chain = copy;
+    k5_mutex_unlock(&cache->lock);
+}
+
+static void
+free_verify_cache(pkinit_verify_cache cache)
+{
+    int i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < VERIFY_CACHE_SLOTS; i++) {
+        if (cache->entries[i].chain != NULL)
+            sk_X509_pop_free(cache->entries[i].chain, X509_free);
+    }
+    k5_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+krb5_error_code
+crypto_init_verify_cache(krb5_context context,
+                         pkinit_plg_crypto_context plg_cryptoctx,
+                         pkinit_identity_crypto_context id_cryptoctx,
+                         int ttl)
+{
+    krb5_error_code retval;
+    X509_STORE *store = NULL;
+    pkinit_verify_cache cache = NULL;
+    int i;
+
+    if (id_cryptoctx->trustedCAs == NULL)
+        return 0;
+
+    /* Build a store of the trusted CAs to be shared by all verifications.
+     * Intermediate CAs stay in the untrusted stack so they do not become
+     * trust anchors. */
+    retval = ENOMEM;
+    store = X509_STORE_new();
+    if (store == NULL)
+        goto cleanup;
+    X509_STORE_set_flags(store,
+                         X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+    for (i = 0; i < sk_X509_num(id_cryptoctx->trustedCAs); i++) {
+        if (!X509_STORE_add_cert(store,
+                                 sk_X509_value(id_cryptoctx->trustedCAs, i)))
+            goto cleanup;
+    }
+
+    if (ttl > 0) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            goto cleanup;
+        retval = k5_mutex_init(&cache->lock);
+        if (retval) {
+            free(cache);
+            cache = NULL;
+            goto cleanup;
+        }
+        cache->ttl = ttl;
+    }
+
+    id_cryptoctx->verify_store = store;
+    id_cryptoctx->verify_cache = cache;
+    store = NULL;
+    retval = 0;
+
+cleanup:
+    X509_STORE_free(store);
+    return retval;
+}
+
+/*
+ * Verify the certificate x received in a CMS message against the trusted CAs
+ * in idctx, using the certificates in intermediateCAs to build the chain and
+ * the CRLs in revoked to check it.  On success, set *chain_out to the
+ * verified chain.  On failure, set reqctx->received_cert to the problem
+ * certificate.
+ */
+static krb5_error_code
+verify_signer_cert(krb5_context context, pkinit_req_crypto_context reqctx,
+                   pkinit_identity_crypto_context idctx, X509_STORE *store,
+                   int require_crl_checking, X509 *x,
+                   STACK_OF(X509) *intermediateCAs,
+                   STACK_OF(X509_CRL) *revoked, STACK_OF(X509) *signerCerts,
+                   STACK_OF(X509) **chain_out)
+{
+    krb5_error_code retval = KRB5KDC_ERR_PREAUTH_FAILED;
+    X509_STORE_CTX *cert_ctx;
+    int i;
+    char buf[DN_BUF_LEN];
+#ifdef DEBUG_CERTCHAIN
+    unsigned int size;
+#endif
+
+    *chain_out = NULL;
+
+    /* initialize x509 context with the received certificate and
+     * trusted and intermediate CA chains and CRLs
+     */
+    cert_ctx = X509_STORE_CTX_new();
+    if (cert_ctx == NULL)
+        return retval;
+    if (!X509_STORE_CTX_init(cert_ctx, store, x, intermediateCAs))
+        goto cleanup;
+
+    X509_STORE_CTX_set0_crls(cert_ctx, revoked);
+    if (require_crl_checking)
+        X509_STORE_CTX_set_verify_cb(cert_ctx, openssl_callback);
+    else
+        X509_STORE_CTX_set_verify_cb(cert_ctx,
+                                     openssl_callback_ignore_crls);
+
+    /* add trusted CAs certificates for cert verification, unless they
+     * are already in the long-lived store */
+    if (idctx->verify_store == NULL) {
+        if (idctx->trustedCAs != NULL)
+            X509_STORE_CTX_trusted_stack(cert_ctx, idctx->trustedCAs);
+        else {
+            pkiDebug("unable to find any trusted CAs\n");
+            goto cleanup;
+        }
+    }
+#ifdef DEBUG_CERTCHAIN
+    if (intermediateCAs != NULL) {
+        size = sk_X509_num(intermediateCAs);
+        pkiDebug("untrusted cert chain of size %d\n", size);
+        for (i = 0; i < size; i++) {
+            X509_NAME_oneline(X509_get_subject_name(
+                                  sk_X509_value(intermediateCAs, i)), buf, sizeof(buf));
+            pkiDebug("cert #%d: %s\n", i, buf);
+        }
+    }
+    if (idctx->trustedCAs != NULL) {
+        size = sk_X509_num(idctx->trustedCAs);
+        pkiDebug("trusted cert chain of size %d\n", size);
+        for (i = 0; i < size; i++) {
+            X509_NAME_oneline(X509_get_subject_name(
+                                  sk_X509_value(idctx->trustedCAs, i)), buf, sizeof(buf));
+            pkiDebug("cert #%d: %s\n", i, buf);
+        }
+    }
+    if (revoked != NULL) {
+        size = sk_X509_CRL_num(revoked);
+        pkiDebug("CRL chain of size %d\n", size);
+        for (i = 0; i < size; i++) {
+            X509_CRL *crl = sk_X509_CRL_value(revoked, i);
+            X509_NAME_oneline(X509_CRL_get_issuer(crl), buf, sizeof(buf));
+            pkiDebug("crls by CA #%d: %s\n", i , buf);
+        }
+    }
+#endif
+
+    i = X509_verify_cert(cert_ctx);
+    if (i <= 0) {
+        int j = X509_STORE_CTX_get_error(cert_ctx);
+        X509 *cert;
+
+        cert = X509_STORE_CTX_get_current_cert(cert_ctx);
+        reqctx->received_cert = X509_dup(cert);
+        switch(j) {
+        case X509_V_ERR_CERT_REVOKED:
+            retval = KRB5KDC_ERR_REVOKED_CERTIFICATE;
+            break;
+        case X509_V_ERR_UNABLE_TO_GET_CRL:
+            retval = KRB5KDC_ERR_REVOCATION_STATUS_UNKNOWN;
+            break;
+        case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
+        case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
+            retval = KRB5KDC_ERR_CANT_VERIFY_CERTIFICATE;
+            break;
+        default:
+            retval = KRB5KDC_ERR_INVALID_CERTIFICATE;
+        }
+        (void)oerr_cert(context, retval, cert_ctx,
+                        _("Failed to verify received certificate"));
+        if (reqctx->received_cert == NULL)
+            strlcpy(buf, "(none)", sizeof(buf));
+        else
+            X509_NAME_oneline(X509_get_subject_name(reqctx->received_cert),
+                              buf, sizeof(buf));
+        pkiDebug("problem with cert DN = %s (error=%d) %s\n", buf, j,
+                 X509_verify_cert_error_string(j));
+#ifdef DEBUG_CERTCHAIN
+        size = sk_X509_num(signerCerts);
+        pkiDebug("received cert chain of size %d\n", size);
+        for (j = 0; j < size; j++) {
+            X509 *tmp_cert = sk_X509_value(signerCerts, j);
+            X509_NAME_oneline(X509_get_subject_name(tmp_cert), buf, sizeof(buf));
+            pkiDebug("cert #%d: %s\n", j, buf);
+        }
+#endif
+    } else {
+        /* retrieve verified certificate chain */
+        *chain_out = X509_STORE_CTX_get1_chain(cert_ctx);
+        if (*chain_out != NULL)
+            retval = 0;
+    }
+
+cleanup:
+    X509_STORE_CTX_free(cert_ctx);
+    return retval;
+}
+
 krb5_error_code
 cms_signeddata_verify(krb5_context context,
                       pkinit_plg_crypto_context plgctx,
@@ -1468,8 +1856,7 @@ cms_signeddata_verify(krb5_context context,
     STACK_OF(CMS_SignerInfo) *si_sk = NULL;
     CMS_SignerInfo *si = NULL;
     X509 *x = NULL;
-    X509_STORE *store = NULL;
-    X509_STORE_CTX *cert_ctx;
+    X509_STORE *store = NULL, *verify_store;
     STACK_OF(X509) *signerCerts = NULL;
     STACK_OF(X509) *intermediateCAs = NULL;
     STACK_OF(X509_CRL) *signerRevoked = NULL;
@@ -1480,7 +1867,8 @@ cms_signeddata_verify(krb5_context context,
     ASN1_OCTET_STRING **octets;
     krb5_external_principal_identifier **krb5_verified_chain = NULL;
     krb5_data *authz = NULL;
-    char buf[DN_BUF_LEN];
+    unsigned char cache_key[SHA256_DIGEST_LENGTH];
+    int use_cache = 0;
 
 #ifdef DEBUG_ASN1
     print_buffer_bin(signed_data, signed_data_len,
@@ -1536,17 +1924,17 @@ cms_signeddata_verify(krb5_context context,
         }
     }
 
-    /* setup to verify X509 certificate used to sign CMS message */
-    if (!(store = X509_STORE_new()))
-        goto cleanup;
-
-    /* check if we are inforcing CRL checking */
-    vflags = X509_V_FLAG_CRL_CHECK|X509_V_FLAG_CRL_CHECK_ALL;
-    if (require_crl_checking)
-        X509_STORE_set_verify_cb(store, openssl_callback);
-    else
-        X509_STORE_set_verify_cb(store, openssl_callback_ignore_crls);
-    X509_STORE_set_flags(store, vflags);
+    /* setup to verify X509 certificate used to sign CMS message, using the
+     * long-lived store of trusted CAs if we have one */
+    if (idctx->verify_store != NULL) {
+        verify_store = idctx->verify_store;
+    } else {
+        if (!(store = X509_STORE_new()))
+            goto cleanup;
+        vflags = X509_V_FLAG_CRL_CHECK|X509_V_FLAG_CRL_CHECK_ALL;
+        X509_STORE_set_flags(store, vflags);
+        verify_store = store;
+    }
 
     /*
      * Get the signer's information from the CMS message.  Match signer ID
@@ -1613,105 +2001,31 @@ cms_signeddata_verify(krb5_context context,
             }
         }
 
-        /* initialize x509 context with the received certificate and
-         * trusted and intermediate CA chains and CRLs
-         */
-        cert_ctx = X509_STORE_CTX_new();
-        if (cert_ctx == NULL)
-            goto cleanup;
-        if (!X509_STORE_CTX_init(cert_ctx, store, x, intermediateCAs))
-            goto cleanup;
-
-        X509_STORE_CTX_set0_crls(cert_ctx, revoked);
-
-        /* add trusted CAs certificates for cert verification */
-        if (idctx->trustedCAs != NULL)
-            X509_STORE_CTX_trusted_stack(cert_ctx, idctx->trustedCAs);
-        else {
-            pkiDebug("unable to find any trusted CAs\n");
-            goto cleanup;
-        }
-#ifdef DEBUG_CERTCHAIN
-        if (intermediateCAs != NULL) {
-            size = sk_X509_num(intermediateCAs);
-            pkiDebug("untrusted cert chain of size %d\n", size);
-            for (i = 0; i < size; i++) {
-                X509_NAME_oneline(X509_get_subject_name(
-                                      sk_X509_value(intermediateCAs, i)), buf, sizeof(buf));
-                pkiDebug("cert #%d: %s\n", i, buf);
-            }
-        }
-        if (idctx->trustedCAs != NULL) {
-            size = sk_X509_num(idctx->trustedCAs);
-            pkiDebug("trusted cert chain of size %d\n", size);
-            for (i = 0; i < size; i++) {
-                X509_NAME_oneline(X509_get_subject_name(
-                                      sk_X509_value(idctx->trustedCAs, i)), buf, sizeof(buf));
-                pkiDebug("cert #%d: %s\n", i, buf);
-            }
+        /* Use a cached verification of this certificate and chain if we
+         * have one; otherwise verify it against the trusted CAs. */
+        if (idctx->verify_cache != NULL &&
+            verify_cache_key(x, signerCerts, signerRevoked,
+                             require_crl_checking, cache_key) == 0) {
+            use_cache = 1;
+            verified_chain = verify_cache_get(idctx->verify_cache, cache_key);
         }
-        if (revoked != NULL) {
-            size = sk_X509_CRL_num(revoked);
-            pkiDebug("CRL chain of size %d\n", size);
-            for (i = 0; i < size; i++) {
-                X509_CRL *crl = sk_X509_CRL_value(revoked, i);
-                X509_NAME_oneline(X509_CRL_get_issuer(crl), buf, sizeof(buf));
-                pkiDebug("crls by CA #%d: %s\n", i , buf);
-            }
-        }
-#endif
-
-        i = X509_verify_cert(cert_ctx);
-        if (i <= 0) {
-            int j = X509_STORE_CTX_get_error(cert_ctx);
-            X509 *cert;
-
-            cert = X509_STORE_CTX_get_current_cert(cert_ctx);
-            reqctx->received_cert = X509_dup(cert);
-            switch(j) {
-            case X509_V_ERR_CERT_REVOKED:
-                retval = KRB5KDC_ERR_REVOKED_CERTIFICATE;
-                break;
-            case X509_V_ERR_UNABLE_TO_GET_CRL:
-                retval = KRB5KDC_ERR_REVOCATION_STATUS_UNKNOWN;
-                break;
-            case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT:
-            case X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT_LOCALLY:
-                retval = KRB5KDC_ERR_CANT_VERIFY_CERTIFICATE;
-                break;
-            default:
-                retval = KRB5KDC_ERR_INVALID_CERTIFICATE;
-            }
-            (void)oerr_cert(context, retval, cert_ctx,
-                            _("Failed to verify received certificate"));
-            if (reqctx->received_cert == NULL)
-                strlcpy(buf, "(none)", sizeof(buf));
-            else
-                X509_NAME_oneline(X509_get_subject_name(reqctx->received_cert),
-                                  buf, sizeof(buf));
-            pkiDebug("problem with cert DN = %s (error=%d) %s\n", buf, j,
-                     X509_verify_cert_error_string(j));
-#ifdef DEBUG_CERTCHAIN
-            size = sk_X509_num(signerCerts);
-            pkiDebug("received cert chain of size %d\n", size);
-            for (j = 0; j < size; j++) {
-                X509 *tmp_cert = sk_X509_value(signerCerts, j);
-                X509_NAME_oneline(X509_get_subject_name(tmp_cert), buf, sizeof(buf));
-                pkiDebug("cert #%d: %s\n", j, buf);
+        if (verified_chain == NULL) {
+            retval = verify_signer_cert(context, reqctx, idctx,
+                                        verify_store, require_crl_checking, x,
+                                        intermediateCAs, revoked, signerCerts,
+                                        &verified_chain);
+            if (retval)
+                goto cleanup;
+            if (use_cache) {
+                verify_cache_put(idctx->verify_cache, cache_key,
+                                 verified_chain, revoked);
             }
-#endif
-        } else {
-            /* retrieve verified certificate chain */
-            if (cms_msg_type == CMS_SIGN_CLIENT || cms_msg_type == CMS_SIGN_DRAFT9)
-                verified_chain = X509_STORE_CTX_get1_chain(cert_ctx);
+            retval = KRB5KDC_ERR_PREAUTH_FAILED;
         }
-        X509_STORE_CTX_free(cert_ctx);
-        if (i <= 0)
-            goto cleanup;
         out = BIO_new(BIO_s_mem());
         if (cms_msg_type == CMS_SIGN_DRAFT9)
             flags |= CMS_NOATTR;
-        if (CMS_verify(cms, NULL, store, NULL, out, flags) == 0) {
+        if (CMS_verify(cms, NULL, verify_store, NULL, out, flags) == 0) {
             unsigned long err = ERR_peek_error();
             switch(ERR_GET_REASON(err)) {
             case PKCS7_R_DIGEST_FAILURE:
@@ -2665,12 +2979,189 @@ compute_dh(unsigned char *buf, int size, BIGNUM *server_pub_key, DH *dh)
     }
 }
 
+/* Return the OpenSSL curve NID for a PKINIT elliptic curve group strength, or
+ * NID_undef if bits does not denote one. */
+static int
+ec_group_nid(int bits)
+{
+    switch (bits) {
+    case PKINIT_DH_P256_BITS:
+        return NID_X9_62_prime256v1;
+    case PKINIT_DH_P384_BITS:
+        return NID_secp384r1;
+    case PKINIT_DH_P521_BITS:
+        return NID_secp521r1;
+    default:
+        return NID_undef;
+    }
+}
+
+/* Return the PKINIT group strength for the curve nid, or 0 if the curve is not
+ * one we support. */
+static int
+ec_group_bits(int nid)
+{
+    switch (nid) {
+    case NID_X9_62_prime256v1:
+        return PKINIT_DH_P256_BITS;
+    case NID_secp384r1:
+        return PKINIT_DH_P384_BITS;
+    case NID_secp521r1:
+        return PKINIT_DH_P521_BITS;
+    default:
+        return 0;
+    }
+}
+
+/* Encode the ECParameters (a named curve OID) for the curve nid. */
+static krb5_error_code
+encode_ec_params(int nid, uint8_t **buf, unsigned int *buf_len)
+{
+    ASN1_OBJECT *obj;
+    unsigned char *p;
+    int len;
+
+    *buf = NULL;
+    *buf_len = 0;
+    obj = OBJ_nid2obj(nid);
+    if (obj == NULL)
+        return ENOMEM;
+    len = i2d_ASN1_OBJECT(obj, NULL);
+    if (len <= 0)
+        return ENOMEM;
+    p = *buf = malloc(len);
+    if (*buf == NULL)
+        return ENOMEM;
+    i2d_ASN1_OBJECT(obj, &p);
+    *buf_len = len;
+    return 0;
+}
+
+/* Decode ECParameters and return the curve NID, or NID_undef if they are not a
+ * named curve. */
+static int
+decode_ec_params(const uint8_t *params, unsigned int len)
+{
+    ASN1_OBJECT *obj;
+    const unsigned char *p = params;
+    int nid;
+
+    obj = d2i_ASN1_OBJECT(NULL, &p, len);
+    if (obj == NULL)
+        return NID_undef;
+    nid = (p == params + len) ? OBJ_obj2nid(obj) : NID_undef;
+    ASN1_OBJECT_free(obj);
+    return nid;
+}
+
+/* Encode the public key of ec as an uncompressed ECPoint, which RFC 5349 uses
+ * directly as the contents of the subjectPublicKey bit string. */
+static krb5_error_code
+encode_ec_pubkey(EC_KEY *ec, unsigned char **buf, unsigned int *buf_len)
+{
+    const EC_GROUP *group = EC_KEY_get0_group(ec);
+    const EC_POINT *pub = EC_KEY_get0_public_key(ec);
+    size_t len;
+
+    *buf = NULL;
+    *buf_len = 0;
+    len = EC_POINT_point2oct(group, pub, POINT_CONVERSION_UNCOMPRESSED, NULL,
+                             0, NULL);
+    if (len == 0)
+        return KRB5KDC_ERR_PREAUTH_FAILED;
+    *buf = malloc(len);
+    if (*buf == NULL)
+        return ENOMEM;
+    if (EC_POINT_point2oct(group, pub, POINT_CONVERSION_UNCOMPRESSED, *buf,
+                           len, NULL) != len) {
+        free(*buf);
+        *buf = NULL;
+        return KRB5KDC_ERR_PREAUTH_FAILED;
+    }
+    *buf_len = len;
+    return 0;
+}
+
+/* Compute the ECDH shared secret (the x-coordinate of the shared point) from
+ * our key ec and the peer's encoded public point. */
+static krb5_error_code
+compute_ecdh(EC_KEY *ec, const unsigned char *peer, unsigned int peer_len,
+             unsigned char **secret_out, unsigned int *secret_len_out)
+{
+    krb5_error_code retval = KRB5KDC_ERR_PREAUTH_FAILED;
+    const EC_GROUP *group = EC_KEY_get0_group(ec);
+    EC_POINT *point = NULL;
+    unsigned char *secret = NULL;
+    int len;
+
+    *secret_out = NULL;
+    *secret_len_out = 0;
+
+    point = EC_POINT_new(group);
+    if (point == NULL)
+        goto cleanup;
+    if (!EC_POINT_oct2point(group, point, peer, peer_len, NULL) ||
+        EC_POINT_is_at_infinity(group, point) ||
+        EC_POINT_is_on_curve(group, point, NULL) != 1) {
+        pkiDebug("received an invalid elliptic curve public key\n");
+        goto cleanup;
+    }
+
+    len = (EC_GROUP_get_degree(group) + 7) / 8;
+    secret = malloc(len);
+    if (secret == NULL) {
+        retval = ENOMEM;
+        goto cleanup;
+    }
+    if (ECDH_compute_key(secret, len, point, ec, NULL) != len)
+        goto cleanup;
+
+    *secret_out = secret;
+    *secret_len_out = len;
+    secret = NULL;
+    retval = 0;
+
+cleanup:
+    EC_POINT_free(point);
+    free(secret);
+    return retval;
+}
+
+/* The client's half of ECDH: generate a key on the curve for dh_size. */
+static krb5_error_code
+client_create_ec(pkinit_req_crypto_context cryptoctx, int dh_size,
+                 unsigned char **dh_params, unsigned int *dh_params_len,
+                 unsigned char **dh_pubkey, unsigned int *dh_pubkey_len)
+{
+    krb5_error_code retval;
+    int nid = ec_group_nid(dh_size);
+
+    if (cryptoctx->ec == NULL) {
+        cryptoctx->ec = EC_KEY_new_by_curve_name(nid);
+        if (cryptoctx->ec == NULL)
+            return ENOMEM;
+    }
+    if (!EC_KEY_generate_key(cryptoctx->ec))
+        return KRB5KDC_ERR_PREAUTH_FAILED;
+
+    retval = encode_ec_params(nid, dh_params, dh_params_len);
+    if (retval)
+        return retval;
+    retval = encode_ec_pubkey(cryptoctx->ec, dh_pubkey, dh_pubkey_len);
+    if (retval) {
+        free(*dh_params);
+        *dh_params = NULL;
+    }
+    return retval;
+}
+
 krb5_error_code
 client_create_dh(krb5_context context,
                  pkinit_plg_crypto_context plg_cryptoctx,
                  pkinit_req_crypto_context cryptoctx,
                  pkinit_identity_crypto_context id_cryptoctx,
                  int dh_size,
+                 krb5_data *algorithm,
                  unsigned char **dh_params,
                  unsigned int *dh_params_len,
                  unsigned char **dh_pubkey,
@@ -2682,6 +3173,15 @@ client_create_dh(krb5_context context,
     ASN1_INTEGER *pub_key = NULL;
     const BIGNUM *pubkey_bn, *p, *q, *g;
 
+    /* Use an elliptic curve group unless the KDC sent us DH parameters to
+     * use instead. */
+    if (cryptoctx->dh == NULL && PKINIT_DH_IS_EC(dh_size)) {
+        *algorithm = ec_oid;
+        return client_create_ec(cryptoctx, dh_size, dh_params, dh_params_len,
+                                dh_pubkey, dh_pubkey_len);
+    }
+    *algorithm = dh_oid;
+
     if (cryptoctx->dh == NULL) {
         if (dh_size == 1024)
             cryptoctx->dh = make_oakley_dh(oakley_1024, sizeof(oakley_1024));
@@ -2781,6 +3281,12 @@ client_process_dh(krb5_context context,
     ASN1_INTEGER *pub_key = NULL;
     const unsigned char *p = NULL;
 
+    if (cryptoctx->ec != NULL) {
+        return compute_ecdh(cryptoctx->ec, subjectPublicKey_data,
+                            subjectPublicKey_length, client_key,
+                            client_key_len);
+    }
+
     *client_key_len = DH_size(cryptoctx->dh);
     if ((*client_key = malloc(*client_key_len)) == NULL) {
         retval = ENOMEM;
@@ -2847,18 +3353,49 @@ check_dh_wellknown(pkinit_plg_crypto_context cryptoctx, DH *dh, int nbits)
     return 0;
 }
 
+/* The KDC's check of the client's elliptic curve group. */
+static krb5_error_code
+server_check_ec(pkinit_req_crypto_context req_cryptoctx, const uint8_t *params,
+                unsigned int params_len, int minbits)
+{
+    int nid, bits;
+
+    nid = decode_ec_params(params, params_len);
+    bits = ec_group_bits(nid);
+    if (bits == 0) {
+        pkiDebug("client sent unsupported elliptic curve parameters\n");
+        return KRB5KDC_ERR_DH_KEY_PARAMETERS_NOT_ACCEPTED;
+    }
+    if (minbits && bits < minbits) {
+        pkiDebug("client sent an elliptic curve group of strength %d, we "
+                 "require %d\n", bits, minbits);
+        return KRB5KDC_ERR_DH_KEY_PARAMETERS_NOT_ACCEPTED;
+    }
+    req_cryptoctx->ec = EC_KEY_new_by_curve_name(nid);
+    if (req_cryptoctx->ec == NULL)
+        return ENOMEM;
+    return 0;
+}
+
 krb5_error_code
 server_check_dh(krb5_context context,
                 pkinit_plg_crypto_context cryptoctx,
                 pkinit_req_crypto_context req_cryptoctx,
                 pkinit_identity_crypto_context id_cryptoctx,
-                krb5_data *dh_params,
+                krb5_algorithm_identifier *dh_alg,
                 int minbits)
 {
     DH *dh = NULL;
     const BIGNUM *p;
     int dh_prime_bits;
     krb5_error_code retval = KRB5KDC_ERR_DH_KEY_PARAMETERS_NOT_ACCEPTED;
+    krb5_data *dh_params = &dh_alg->parameters;
+
+    if (dh_alg->algorithm.length == ec_oid.length &&
+        memcmp(dh_alg->algorithm.data, ec_oid.data, ec_oid.length) == 0) {
+        return server_check_ec(req_cryptoctx, (uint8_t *)dh_params->data,
+                               dh_params->length, minbits);
+    }
 
     dh = decode_dh_params((uint8_t *)dh_params->data, dh_params->length);
     if (dh == NULL) {
@@ -2911,6 +3448,283 @@ dup_dh_params(const DH *src)
     return dh;
 }
 
+/*
+ * The KDC can keep a pool of precomputed ephemeral keypairs for each key
+ * agreement group, so that an AS request only has to compute the shared
+ * secret.  A pool for a group is filled only once a client has used that
+ * group.  Each keypair is used for one request only.
+ */
+
+#ifdef HAVE_PTHREAD
+
+#define POOL_NGROUPS 6
+
+struct pool_group {
+    int bits;                   /* group strength, as for dh_min_bits */
+    krb5_boolean wanted;        /* a client has used this group */
+    unsigned int count;
+    DH **dh;                    /* keypairs for a MODP group */
+    EC_KEY **ec;                /* keypairs for an elliptic curve group */
+};
+
+struct _pkinit_keypair_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    pid_t pid;                  /* process which tried to start the thread */
+    krb5_boolean running;
+    krb5_boolean stopping;
+    unsigned int size;
+    unsigned long takes;        /* requests for a keypair in this process */
+    unsigned long hits;         /* requests answered from the pool */
+    pkinit_plg_crypto_context plgctx;
+    struct pool_group groups[POOL_NGROUPS];
+};
+
+static const int pool_group_bits[POOL_NGROUPS] = {
+    1024, 2048, 4096,
+    PKINIT_DH_P256_BITS, PKINIT_DH_P384_BITS, PKINIT_DH_P521_BITS
+};
+
+/* Generate a keypair in the group of strength bits.  Either *dh_out or *ec_out
+ * is set on success; both are NULL on failure. */
+static void
+generate_keypair(pkinit_plg_crypto_context plgctx, int bits, DH **dh_out,
+                 EC_KEY **ec_out)
+{
+    DH *dh;
+    EC_KEY *ec;
+
+    *dh_out = NULL;
+    *ec_out = NULL;
+    if (PKINIT_DH_IS_EC(bits)) {
+        ec = EC_KEY_new_by_curve_name(ec_group_nid(bits));
+        if (ec != NULL && !EC_KEY_generate_key(ec)) {
+            EC_KEY_free(ec);
+            ec = NULL;
+        }
+        *ec_out = ec;
+    } else {
+        dh = dup_dh_params((bits == 1024) ? plgctx->dh_1024 :
+                           (bits == 2048) ? plgctx->dh_2048 :
+                           plgctx->dh_4096);
+        if (dh != NULL && !DH_generate_key(dh)) {
+            DH_free(dh);
+            dh = NULL;
+        }
+        *dh_out = dh;
+    }
+}
+
+/* Return the wanted group with the fewest keypairs, if it is not full. */
+static struct pool_group *
+group_to_fill(pkinit_keypair_pool pool)
+{
+    struct pool_group *g, *best = NULL;
+    int i;
+
+    for (i = 0; i < POOL_NGROUPS; i++) {
+        g = &pool->groups[i];
+        if (g->wanted && g->count < pool->size &&
+            (best == NULL || g->count < best->count))
+            best = g;
+    }
+    return best;
+}
+
+/* Keep the wanted groups full, generating keypairs without the lock held. */
+static void *
+keypair_pool_main(void *arg)
+{
+    pkinit_keypair_pool pool = arg;
+    struct pool_group *g;
+    DH *dh;
+    EC_KEY *ec;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        g = group_to_fill(pool);
+        if (g == NULL) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        generate_keypair(pool->plgctx, g->bits, &dh, &ec);
+        pthread_mutex_lock(&pool->lock);
+        if (dh == NULL && ec == NULL) {
+            /* Wait for the next request rather than spinning. */
+            if (!pool->stopping)
+                pthread_cond_wait(&pool->cond, &pool->lock);
+        } else if (g->count < pool->size) {
+            if (dh != NULL)
+                g->dh[g->count++] = dh;
+            else
+                g->ec[g->count++] = ec;
+        } else {
+            DH_free(dh);
+            EC_KEY_free(ec);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Take a precomputed keypair for the group of strength bits from pool, or set
+ * *dh_out and *ec_out to NULL if none is available.  Start the refill thread
+ * on first use in this process, since the KDC may fork worker processes after
+ * loading its plugins.
+ */
+static void
+take_keypair(pkinit_keypair_pool pool, int bits, DH **dh_out, EC_KEY **ec_out)
+{
+    struct pool_group *g = NULL;
+    int i;
+
+    *dh_out = NULL;
+    *ec_out = NULL;
+    if (pool == NULL)
+        return;
+    for (i = 0; i < POOL_NGROUPS; i++) {
+        if (pool->groups[i].bits == bits)
+            g = &pool->groups[i];
+    }
+    if (g == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->pid != getpid()) {
+        pool->pid = getpid();
+        pool->running = (pthread_create(&pool->thread, NULL,
+                                        keypair_pool_main, pool) == 0);
+    }
+    g->wanted = TRUE;
+    pool->takes++;
+    if (g->count > 0) {
+        pool->hits++;
+        g->count--;
+        if (g->dh != NULL)
+            *dh_out = g->dh[g->count];
+        else
+            *ec_out = g->ec[g->count];
+    }
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+free_keypair_pool(pkinit_keypair_pool pool)
+{
+    struct pool_group *g;
+    unsigned int j;
+    int i;
+
+    if (pool == NULL)
+        return;
+    if (pool->takes > 0) {
+        com_err("pkinit", 0, _("keypair pool: %lu of %lu keypairs "
+                               "precomputed"), pool->hits, pool->takes);
+    }
+    if (pool->running && pool->pid == getpid()) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = TRUE;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_join(pool->thread, NULL);
+    }
+    for (i = 0; i < POOL_NGROUPS; i++) {
+        g = &pool->groups[i];
+        for (j = 0; j < g->count; j++) {
+            if (g->dh != NULL)
+                DH_free(g->dh[j]);
+            else
+                EC_KEY_free(g->ec[j]);
+        }
+        free(g->dh);
+        free(g->ec);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+krb5_error_code
+crypto_init_keypair_pool(krb5_context context,
+                         pkinit_plg_crypto_context plg_cryptoctx, int size)
+{
+    pkinit_keypair_pool pool;
+    struct pool_group *g;
+    int i;
+
+    if (size <= 0 || plg_cryptoctx->keypair_pool != NULL)
+        return 0;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return ENOMEM;
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return ENOMEM;
+    }
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return ENOMEM;
+    }
+    pool->size = size;
+    pool->plgctx = plg_cryptoctx;
+    for (i = 0; i < POOL_NGROUPS; i++) {
+        g = &pool->groups[i];
+        g->bits = pool_group_bits[i];
+        if (PKINIT_DH_IS_EC(g->bits))
+            g->ec = calloc(size, sizeof(*g->ec));
+        else
+            g->dh = calloc(size, sizeof(*g->dh));
+        if (g->ec == NULL && g->dh == NULL) {
+            free_keypair_pool(pool);
+            return ENOMEM;
+        }
+    }
+    plg_cryptoctx->keypair_pool = pool;
+    return 0;
+}
+
+#else /* not HAVE_PTHREAD */
+
+static void
+take_keypair(pkinit_keypair_pool pool, int bits, DH **dh_out, EC_KEY **ec_out)
+{
+    *dh_out = NULL;
+    *ec_out = NULL;
+}
+
+static void
+free_keypair_pool(pkinit_keypair_pool pool)
+{
+}
+
+/* Without threads there is nothing to refill the pool, so don't keep one. */
+krb5_error_code
+crypto_init_keypair_pool(krb5_context context,
+                         pkinit_plg_crypto_context plg_cryptoctx, int size)
+{
+    return 0;
+}
+
+#endif /* not HAVE_PTHREAD */
+
+/* OpenSSL before 1.1 relies on locking callbacks which only the application
+ * may install, and the KDC does not install them. */
+krb5_boolean
+crypto_thread_safe(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    return FALSE;
+#else
+    return TRUE;
+#endif
+}
+
 /* kdc's dh function */
 krb5_error_code
 server_process_dh(krb5_context context,
@@ -2926,19 +3740,54 @@ server_process_dh(krb5_context context,
 {
     krb5_error_code retval = ENOMEM;
     DH *dh = NULL, *dh_server = NULL;
+    EC_KEY *ec;
     unsigned char *p = NULL;
     ASN1_INTEGER *pub_key = NULL;
     BIGNUM *client_pubkey = NULL;
-    const BIGNUM *server_pubkey;
+    const BIGNUM *server_pubkey, *prime;
 
     *dh_pubkey = *server_key = NULL;
     *dh_pubkey_len = *server_key_len = 0;
 
-    /* get client's received DH parameters that we saved in server_check_dh */
+    if (cryptoctx->ec != NULL) {
+        /* Use a precomputed key on the client's curve (saved in
+         * server_check_dh) if we have one, and compute the shared secret. */
+        take_keypair(plg_cryptoctx->keypair_pool,
+                     ec_group_bits(EC_GROUP_get_curve_name(
+                                       EC_KEY_get0_group(cryptoctx->ec))),
+                     &dh_server, &ec);
+        if (ec != NULL) {
+            EC_KEY_free(cryptoctx->ec);
+            cryptoctx->ec = ec;
+        } else if (!EC_KEY_generate_key(cryptoctx->ec)) {
+            return KRB5KDC_ERR_PREAUTH_FAILED;
+        }
+        retval = compute_ecdh(cryptoctx->ec, data, data_len, server_key,
+                              server_key_len);
+        if (retval)
+            return retval;
+        retval = encode_ec_pubkey(cryptoctx->ec, dh_pubkey, dh_pubkey_len);
+        if (retval) {
+            free(*server_key);
+            *server_key = NULL;
+            *server_key_len = 0;
+        }
+        return retval;
+    }
+
+    /* get client's received DH parameters that we saved in server_check_dh,
+     * and a precomputed keypair for them if we have one */
     dh = cryptoctx->dh;
-    dh_server = dup_dh_params(dh);
-    if (dh_server == NULL)
-        goto cleanup;
+    DH_get0_pqg(dh, &prime, NULL, NULL);
+    take_keypair(plg_cryptoctx->keypair_pool, BN_num_bits(prime), &dh_server,
+                 &ec);
+    if (dh_server == NULL) {
+        dh_server = dup_dh_params(dh);
+        if (dh_server == NULL)
+            goto cleanup;
+        if (!DH_generate_key(dh_server))
+            goto cleanup;
+    }
 
     /* decode client's public key */
     p = data;
@@ -2950,8 +3799,6 @@ server_process_dh(krb5_context context,
         goto cleanup;
     ASN1_INTEGER_free(pub_key);
 
-    if (!DH_generate_key(dh_server))
-        goto cleanup;
     DH_get0_key(dh_server, &server_pubkey, NULL);
 
     /* generate DH session key */
@@ -3305,110 +4152,59 @@ pkinit_create_td_dh_parameters(krb5_context context,
                                pkinit_plg_opts *opts,
                                krb5_pa_data ***e_data_out)
 {
+    /*
+     * The groups we offer, in order.  The finite field groups come first
+     * because older clients give up at the first algorithm they do not
+     * recognize; newer clients pick an elliptic curve group if one is offered.
+     */
+    static const int groups[] = {
+        2048, 4096, 1024,
+        PKINIT_DH_P256_BITS, PKINIT_DH_P384_BITS, PKINIT_DH_P521_BITS
+    };
     krb5_error_code retval = ENOMEM;
-    unsigned int buf1_len = 0, buf2_len = 0, buf3_len = 0, i = 0;
-    unsigned char *buf1 = NULL, *buf2 = NULL, *buf3 = NULL;
+    unsigned int buf_len = 0;
+    unsigned char *buf = NULL;
+    size_t i, n = 0;
     krb5_pa_data **pa_data = NULL;
     krb5_data *encoded_algId = NULL;
-    krb5_algorithm_identifier **algId = NULL;
+    krb5_algorithm_identifier **algId = NULL, *alg;
     const BIGNUM *p, *q, *g;
+    DH *dh;
 
-    if (opts->dh_min_bits > 4096)
+    algId = calloc(sizeof(groups) / sizeof(*groups) + 1, sizeof(*algId));
+    if (algId == NULL)
         goto cleanup;
-
-    if (opts->dh_min_bits <= 1024) {
-        DH_get0_pqg(plg_cryptoctx->dh_1024, &p, &q, &g);
-        retval = pkinit_encode_dh_params(p, g, q, &buf1, &buf1_len);
-        if (retval)
+    for (i = 0; i < sizeof(groups) / sizeof(*groups); i++) {
+        if (groups[i] < opts->dh_min_bits)
+            continue;
+        alg = calloc(1, sizeof(*alg));
+        if (alg == NULL) {
+            retval = ENOMEM;
             goto cleanup;
-    }
-    if (opts->dh_min_bits <= 2048) {
-        DH_get0_pqg(plg_cryptoctx->dh_2048, &p, &q, &g);
-        retval = pkinit_encode_dh_params(p, g, q, &buf2, &buf2_len);
+        }
+        algId[n++] = alg;
+        if (PKINIT_DH_IS_EC(groups[i])) {
+            alg->algorithm = ec_oid;
+            retval = encode_ec_params(ec_group_nid(groups[i]), &buf,
+                                      &buf_len);
+        } else {
+            alg->algorithm = dh_oid;
+            dh = (groups[i] == 1024) ? plg_cryptoctx->dh_1024 :
+                (groups[i] == 2048) ? plg_cryptoctx->dh_2048 :
+                plg_cryptoctx->dh_4096;
+            DH_get0_pqg(dh, &p, &q, &g);
+            retval = pkinit_encode_dh_params(p, g, q, &buf, &buf_len);
+        }
         if (retval)
             goto cleanup;
+        alg->parameters.data = (char *)buf;
+        alg->parameters.length = buf_len;
     }
-    DH_get0_pqg(plg_cryptoctx->dh_4096, &p, &q, &g);
-    retval = pkinit_encode_dh_params(p, g, q, &buf3, &buf3_len);
-    if (retval)
+    if (n == 0) {
+        retval = KRB5KDC_ERR_DH_KEY_PARAMETERS_NOT_ACCEPTED;
         goto cleanup;
-
-    if (opts->dh_min_bits <= 1024) {
-        algId = malloc(4 * sizeof(krb5_algorithm_identifier *));
-        if (algId == NULL)
-            goto cleanup;
-        algId[3] = NULL;
-        algId[0] = malloc(sizeof(krb5_algorithm_identifier));
-        if (algId[0] == NULL)
-            goto cleanup;
-        algId[0]->parameters.data = malloc(buf2_len);
-        if (algId[0]->parameters.data == NULL)
-            goto cleanup;
-        memcpy(algId[0]->parameters.data, buf2, buf2_len);
-        algId[0]->parameters.length = buf2_len;
-        algId[0]->algorithm = dh_oid;
-
-        algId[1] = malloc(sizeof(krb5_algorithm_identifier));
-        if (algId[1] == NULL)
-            goto cleanup;
-        algId[1]->parameters.data = malloc(buf3_len);
-        if (algId[1]->parameters.data == NULL)
-            goto cleanup;
-        memcpy(algId[1]->parameters.data, buf3, buf3_len);
-        algId[1]->parameters.length = buf3_len;
-        algId[1]->algorithm = dh_oid;
-
-        algId[2] = malloc(sizeof(krb5_algorithm_identifier));
-        if (algId[2] == NULL)
-            goto cleanup;
-        algId[2]->parameters.data = malloc(buf1_len);
-        if (algId[2]->parameters.data == NULL)
-            goto cleanup;
-        memcpy(algId[2]->parameters.data, buf1, buf1_len);
-        algId[2]->parameters.length = buf1_len;
-        algId[2]->algorithm = dh_oid;
-
-    } else if (opts->dh_min_bits <= 2048) {
-        algId = malloc(3 * sizeof(krb5_algorithm_identifier *));
-        if (algId == NULL)
-            goto cleanup;
-        algId[2] = NULL;
-        algId[0] = malloc(sizeof(krb5_algorithm_identifier));
-        if (algId[0] == NULL)
-            goto cleanup;
-        algId[0]->parameters.data = malloc(buf2_len);
-        if (algId[0]->parameters.data == NULL)
-            goto cleanup;
-        memcpy(algId[0]->parameters.data, buf2, buf2_len);
-        algId[0]->parameters.length = buf2_len;
-        algId[0]->algorithm = dh_oid;
-
-        algId[1] = malloc(sizeof(krb5_algorithm_identifier));
-        if (algId[1] == NULL)
-            goto cleanup;
-        algId[1]->parameters.data = malloc(buf3_len);
-        if (algId[1]->parameters.data == NULL)
-            goto cleanup;
-        memcpy(algId[1]->parameters.data, buf3, buf3_len);
-        algId[1]->parameters.length = buf3_len;
-        algId[1]->algorithm = dh_oid;
-
-    } else if (opts->dh_min_bits <= 4096) {
-        algId = malloc(2 * sizeof(krb5_algorithm_identifier *));
-        if (algId == NULL)
-            goto cleanup;
-        algId[1] = NULL;
-        algId[0] = malloc(sizeof(krb5_algorithm_identifier));
-        if (algId[0] == NULL)
-            goto cleanup;
-        algId[0]->parameters.data = malloc(buf3_len);
-        if (algId[0]->parameters.data == NULL)
-            goto cleanup;
-        memcpy(algId[0]->parameters.data, buf3, buf3_len);
-        algId[0]->parameters.length = buf3_len;
-        algId[0]->algorithm = dh_oid;
-
     }
+
     retval = k5int_encode_krb5_td_dh_parameters((krb5_algorithm_identifier *const *)algId, &encoded_algId);
     if (retval)
         goto cleanup;
@@ -3435,16 +4231,12 @@ pkinit_create_td_dh_parameters(krb5_context context,
     retval = 0;
 cleanup:
 
-    free(buf1);
-    free(buf2);
-    free(buf3);
     free(encoded_algId);
 
     if (algId != NULL) {
-        while(algId[i] != NULL) {
+        for (i = 0; algId[i] != NULL; i++) {
             free(algId[i]->parameters.data);
             free(algId[i]);
-            i++;
         }
         free(algId);
     }
@@ -3515,18 +4307,38 @@ pkinit_process_td_dh_params(krb5_context context,
                             int *new_dh_size)
 {
     krb5_error_code retval = KRB5KDC_ERR_DH_KEY_PARAMETERS_NOT_ACCEPTED;
-    int i = 0, use_sent_dh = 0, ok = 0;
+    int i = 0, use_sent_dh = 0, ok = 0, bits;
 
     pkiDebug("dh parameters\n");
 
-    while (algId[i] != NULL) {
+    /* Prefer an elliptic curve group if the KDC offers one we support. */
+    for (i = 0; algId[i] != NULL; i++) {
+        if (algId[i]->algorithm.length != ec_oid.length ||
+            memcmp(algId[i]->algorithm.data, ec_oid.data, ec_oid.length))
+            continue;
+        bits = ec_group_bits(decode_ec_params((uint8_t *)
+                                              algId[i]->parameters.data,
+                                              algId[i]->parameters.length));
+        if (bits == 0 || bits < *new_dh_size)
+            continue;
+        pkiDebug("client sent %d DH bits server prefers EC group %d\n",
+                 *new_dh_size, bits);
+        *new_dh_size = bits;
+        DH_free(req_cryptoctx->dh);
+        req_cryptoctx->dh = NULL;
+        EC_KEY_free(req_cryptoctx->ec);
+        req_cryptoctx->ec = NULL;
+        return 0;
+    }
+
+    for (i = 0; algId[i] != NULL; i++) {
         DH *dh = NULL;
         const BIGNUM *p;
         int dh_prime_bits = 0;
 
         if (algId[i]->algorithm.length != dh_oid.length ||
             memcmp(algId[i]->algorithm.data, dh_oid.data, dh_oid.length))
-            goto cleanup;
+            continue;
 
         dh = decode_dh_params((uint8_t *)algId[i]->parameters.data,
                               algId[i]->parameters.length);
@@ -3558,11 +4370,12 @@ pkinit_process_td_dh_params(krb5_context context,
                 DH_free(req_cryptoctx->dh);
                 req_cryptoctx->dh = NULL;
             }
+            EC_KEY_free(req_cryptoctx->ec);
+            req_cryptoctx->ec = NULL;
             if (use_sent_dh)
                 req_cryptoctx->dh = dh;
             break;
         }
-        i++;
     }
 
     if (ok)
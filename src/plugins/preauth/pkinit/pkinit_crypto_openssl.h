@@ -42,6 +42,8 @@
 #include <openssl/x509v3.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/ecdh.h>
 #include <openssl/sha.h>
 #include <openssl/asn1.h>
 #include <openssl/pem.h>
@@ -66,6 +68,9 @@ struct _pkinit_cred_info {
 };
 typedef struct _pkinit_cred_info * pkinit_cred_info;
 
+typedef struct _pkinit_verify_cache *pkinit_verify_cache;
+typedef struct _pkinit_keypair_pool *pkinit_keypair_pool;
+
 struct _pkinit_identity_crypto_context {
     pkinit_cred_info creds[MAX_CREDS_ALLOWED+1];
     STACK_OF(X509) *my_certs;   /* available user certs */
@@ -93,6 +98,8 @@ struct _pkinit_identity_crypto_context {
 #endif
     krb5_boolean defer_id_prompt;
     pkinit_deferred_id *deferred_ids;
+    X509_STORE *verify_store;   /* long-lived store of trusted CAs */
+    pkinit_verify_cache verify_cache;  /* cached chain verifications */
 };
 
 struct _pkinit_plg_crypto_context {
@@ -108,11 +115,13 @@ struct _pkinit_plg_crypto_context {
     ASN1_OBJECT *id_pkinit_KPKdc;
     ASN1_OBJECT *id_ms_kp_sc_logon;
     ASN1_OBJECT *id_kp_serverAuth;
+    pkinit_keypair_pool keypair_pool;   /* precomputed KDC keypairs */
 };
 
 struct _pkinit_req_crypto_context {
     X509 *received_cert;
     DH *dh;
+    EC_KEY *ec;
 };
 
 #define CERT_MAGIC 0x53534c43
@@ -34,6 +34,7 @@
 #define FAKECERT
 
 const krb5_data dh_oid = { 0, 7, "\x2A\x86\x48\xce\x3e\x02\x01" };
+const krb5_data ec_oid = { 0, 7, "\x2A\x86\x48\xce\x3d\x02\x01" };
 
 
 krb5_error_code
@@ -52,7 +53,7 @@ pkinit_init_req_opts(pkinit_req_opts **reqopts)
     opts->allow_upn = 0;
     opts->dh_or_rsa = DH_PROTOCOL;
     opts->require_crl_checking = 0;
-    opts->dh_size = PKINIT_DEFAULT_DH_MIN_BITS;
+    opts->dh_size = PKINIT_DEFAULT_CLIENT_DH_BITS;
 
     *reqopts = opts;
 
@@ -84,6 +85,8 @@ pkinit_init_plg_opts(pkinit_plg_opts **plgopts)
     opts->require_crl_checking = 0;
 
     opts->dh_min_bits = PKINIT_DEFAULT_DH_MIN_BITS;
+    opts->verify_cache_ttl = 0;
+    opts->keypair_pool_size = 0;
 
     *plgopts = opts;
 
@@ -343,6 +346,29 @@ pkinit_copy_krb5_data(krb5_data *dst, const krb5_data *src)
     return 0;
 }
 
+/*
+ * Parse a pkinit_dh_min_bits value, which is either a modulus size or the name
+ * of an elliptic curve group, into a strength in bits.  Return 0 if str is not
+ * a valid value.
+ */
+int
+pkinit_parse_dh_min_bits(const char *str)
+{
+    char *endptr;
+    long n;
+
+    if (strcasecmp(str, "P-256") == 0)
+        return PKINIT_DH_P256_BITS;
+    if (strcasecmp(str, "P-384") == 0)
+        return PKINIT_DH_P384_BITS;
+    if (strcasecmp(str, "P-521") == 0)
+        return PKINIT_DH_P521_BITS;
+    n = strtol(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || n <= 0 || n > INT_MAX)
+        return 0;
+    return n;
+}
+
 /* debugging functions */
 void
 print_buffer(const unsigned char *buf, unsigned int len)
@@ -271,61 +271,115 @@ out:
     return retval;
 }
 
-static void
-pkinit_server_verify_padata(krb5_context context,
-                            krb5_data *req_pkt,
-                            krb5_kdc_req * request,
-                            krb5_enc_tkt_part * enc_tkt_reply,
-                            krb5_pa_data * data,
-                            krb5_kdcpreauth_callbacks cb,
-                            krb5_kdcpreauth_rock rock,
-                            krb5_kdcpreauth_moddata moddata,
-                            krb5_kdcpreauth_verify_respond_fn respond,
-                            void *arg)
+/* Generate the KDC's half of the key agreement for reqctx and sign it, saving
+ * the signed KDCDHKeyInfo and the shared secret in reqctx for return_padata. */
+static krb5_error_code
+make_dh_reply(krb5_context context, pkinit_kdc_context plgctx,
+              pkinit_kdc_req_context reqctx, krb5_int32 nonce)
+{
+    krb5_error_code retval;
+    krb5_subject_pk_info *client_pk = reqctx->rcv_auth_pack->clientPublicValue;
+    unsigned char *dh_pubkey = NULL, *server_key = NULL;
+    unsigned int dh_pubkey_len = 0, server_key_len = 0;
+    krb5_kdc_dh_key_info dhkey_info;
+    krb5_data *encoded_dhkey_info = NULL;
+
+    retval = server_process_dh(context, plgctx->cryptoctx, reqctx->cryptoctx,
+                               plgctx->idctx,
+                               (unsigned char *)
+                               client_pk->subjectPublicKey.data,
+                               client_pk->subjectPublicKey.length,
+                               &dh_pubkey, &dh_pubkey_len,
+                               &server_key, &server_key_len);
+    if (retval) {
+        pkiDebug("failed to process/create dh paramters\n");
+        goto cleanup;
+    }
+
+    dhkey_info.subjectPublicKey.length = dh_pubkey_len;
+    dhkey_info.subjectPublicKey.data = (char *)dh_pubkey;
+    dhkey_info.nonce = nonce;
+    dhkey_info.dhKeyExpiration = 0;
+
+    retval = k5int_encode_krb5_kdc_dh_key_info(&dhkey_info,
+                                               &encoded_dhkey_info);
+    if (retval) {
+        pkiDebug("encode_krb5_kdc_dh_key_info failed\n");
+        goto cleanup;
+    }
+#ifdef DEBUG_ASN1
+    print_buffer_bin((unsigned char *)encoded_dhkey_info->data,
+                     encoded_dhkey_info->length,
+                     "/tmp/kdc_dh_key_info");
+#endif
+
+    retval = cms_signeddata_create(context, plgctx->cryptoctx,
+                                   reqctx->cryptoctx, plgctx->idctx,
+                                   CMS_SIGN_SERVER, 1,
+                                   (unsigned char *)encoded_dhkey_info->data,
+                                   encoded_dhkey_info->length,
+                                   (unsigned char **)
+                                   &reqctx->dh_signed_data.data,
+                                   &reqctx->dh_signed_data.length);
+    if (retval) {
+        pkiDebug("failed to create pkcs7 signed data\n");
+        goto cleanup;
+    }
+
+    reqctx->server_key = server_key;
+    reqctx->server_key_len = server_key_len;
+    server_key = NULL;
+
+cleanup:
+    if (encoded_dhkey_info != NULL)
+        krb5_free_data(context, encoded_dhkey_info);
+    free(dh_pubkey);
+    free(server_key);
+    return retval;
+}
+
+/* The state of a verify_padata operation, which may be carried out on a KDC
+ * preauth thread. */
+struct verify_state {
+    krb5_context context;
+    krb5_kdc_req *request;
+    krb5_enc_tkt_part *enc_tkt_reply;
+    krb5_pa_data *data;
+    krb5_data *der_req;
+    krb5_kdcpreauth_callbacks cb;
+    krb5_kdcpreauth_rock rock;
+    krb5_kdcpreauth_verify_respond_fn respond;
+    void *arg;
+    pkinit_kdc_context plgctx;
+    pkinit_kdc_req_context reqctx;
+    int is_signed;
+    krb5_pa_data **e_data;
+};
+
+/*
+ * Verify the client's signed request and prepare the reply's key agreement.
+ * This does the expensive cryptographic work of verify_padata, and may run on
+ * a KDC preauth thread with its own context, so it must not use state->context
+ * or the callbacks.
+ */
+static krb5_error_code
+verify_request(krb5_context context, void *arg)
 {
+    struct verify_state *state = arg;
     krb5_error_code retval = 0;
+    krb5_kdc_req *request = state->request;
+    krb5_pa_data *data = state->data;
+    pkinit_kdc_context plgctx = state->plgctx;
+    pkinit_kdc_req_context reqctx = state->reqctx;
     krb5_data authp_data = {0, 0, NULL}, krb5_authz = {0, 0, NULL};
     krb5_pa_pk_as_req *reqp = NULL;
     krb5_pa_pk_as_req_draft9 *reqp9 = NULL;
     krb5_auth_pack *auth_pack = NULL;
     krb5_auth_pack_draft9 *auth_pack9 = NULL;
-    pkinit_kdc_context plgctx = NULL;
-    pkinit_kdc_req_context reqctx = NULL;
     krb5_checksum cksum = {0, 0, 0, NULL};
-    krb5_data *der_req = NULL;
     int valid_eku = 0, valid_san = 0;
     krb5_data k5data;
     int is_signed = 1;
-    krb5_pa_data **e_data = NULL;
-    krb5_kdcpreauth_modreq modreq = NULL;
-    char **sp;
-
-    pkiDebug("pkinit_verify_padata: entered!\n");
-    if (data == NULL || data->length <= 0 || data->contents == NULL) {
-        (*respond)(arg, EINVAL, NULL, NULL, NULL);
-        return;
-    }
-
-
-    if (moddata == NULL) {
-        (*respond)(arg, EINVAL, NULL, NULL, NULL);
-        return;
-    }
-
-    plgctx = pkinit_find_realm_context(context, moddata, request->server);
-    if (plgctx == NULL) {
-        (*respond)(arg, EINVAL, NULL, NULL, NULL);
-        return;
-    }
-
-#ifdef DEBUG_ASN1
-    print_buffer_bin(data->contents, data->length, "/tmp/kdc_as_req");
-#endif
-    /* create a per-request context */
-    retval = pkinit_init_kdc_req_context(context, &reqctx);
-    if (retval)
-        goto cleanup;
-    reqctx->pa_type = data->pa_type;
 
     PADATA_TO_KRB5DATA(data, &k5data);
 
@@ -439,7 +493,7 @@ pkinit_server_verify_padata(krb5_context context,
         if (auth_pack->clientPublicValue != NULL) {
             retval = server_check_dh(context, plgctx->cryptoctx,
                                      reqctx->cryptoctx, plgctx->idctx,
-                                     &auth_pack->clientPublicValue->algorithm.parameters,
+                                     &auth_pack->clientPublicValue->algorithm,
                                      plgctx->opts->dh_min_bits);
 
             if (retval) {
@@ -454,9 +508,8 @@ pkinit_server_verify_padata(krb5_context context,
                                      "value not supported."));
             goto cleanup;
         }
-        der_req = cb->request_body(context, rock);
         retval = krb5_c_make_checksum(context, CKSUMTYPE_NIST_SHA, NULL,
-                                      0, der_req, &cksum);
+                                      0, state->der_req, &cksum);
         if (retval) {
             pkiDebug("unable to calculate AS REQ checksum\n");
             goto cleanup;
@@ -468,8 +521,8 @@ pkinit_server_verify_padata(krb5_context context,
             pkiDebug("failed to match the checksum\n");
 #ifdef DEBUG_CKSUM
             pkiDebug("calculating checksum on buf size (%d)\n",
-                     req_pkt->length);
-            print_buffer(req_pkt->data, req_pkt->length);
+                     state->der_req->length);
+            print_buffer(state->der_req->data, state->der_req->length);
             pkiDebug("received checksum type=%d size=%d ",
                      auth_pack->pkAuthenticator.paChecksum.checksum_type,
                      auth_pack->pkAuthenticator.paChecksum.length);
@@ -501,6 +554,14 @@ pkinit_server_verify_padata(krb5_context context,
         /* remember the decoded auth_pack for verify_padata routine */
         reqctx->rcv_auth_pack = auth_pack;
         auth_pack = NULL;
+
+        /* Do the key agreement and sign it now, so that return_padata does
+         * not have to. */
+        if (reqctx->rcv_auth_pack->clientPublicValue != NULL) {
+            retval = make_dh_reply(context, plgctx, reqctx, request->nonce);
+            if (retval)
+                goto cleanup;
+        }
         break;
     case KRB5_PADATA_PK_AS_REP_OLD:
     case KRB5_PADATA_PK_AS_REQ_OLD:
@@ -512,7 +573,7 @@ pkinit_server_verify_padata(krb5_context context,
         if (auth_pack9->clientPublicValue != NULL) {
             retval = server_check_dh(context, plgctx->cryptoctx,
                                      reqctx->cryptoctx, plgctx->idctx,
-                                     &auth_pack9->clientPublicValue->algorithm.parameters,
+                                     &auth_pack9->clientPublicValue->algorithm,
                                      plgctx->opts->dh_min_bits);
 
             if (retval) {
@@ -526,25 +587,12 @@ pkinit_server_verify_padata(krb5_context context,
         break;
     }
 
-    if (is_signed && plgctx->auth_indicators != NULL) {
-        /* Assert configured authentication indicators. */
-        for (sp = plgctx->auth_indicators; *sp != NULL; sp++) {
-            retval = cb->add_auth_indicator(context, rock, *sp);
-            if (retval)
-                goto cleanup;
-        }
-    }
-
-    /* remember to set the PREAUTH flag in the reply */
-    enc_tkt_reply->flags |= TKT_FLG_PRE_AUTH;
-    modreq = (krb5_kdcpreauth_modreq)reqctx;
-    reqctx = NULL;
-
 cleanup:
     if (retval && data->pa_type == KRB5_PADATA_PK_AS_REQ) {
         pkiDebug("pkinit_verify_padata failed: creating e-data\n");
         if (pkinit_create_edata(context, plgctx->cryptoctx, reqctx->cryptoctx,
-                                plgctx->idctx, plgctx->opts, retval, &e_data))
+                                plgctx->idctx, plgctx->opts, retval,
+                                &state->e_data))
             pkiDebug("pkinit_create_edata failed\n");
     }
 
@@ -559,13 +607,130 @@ cleanup:
     }
     free(authp_data.data);
     free(krb5_authz.data);
-    if (reqctx != NULL)
-        pkinit_fini_kdc_req_context(context, reqctx);
     free_krb5_auth_pack(&auth_pack);
     free_krb5_auth_pack_draft9(context, &auth_pack9);
+    state->is_signed = is_signed;
+    return retval;
+}
 
-    (*respond)(arg, retval, modreq, e_data, NULL);
+/* Finish a verify_padata operation on the KDC's main thread. */
+static void
+verify_done(void *arg, krb5_error_code retval)
+{
+    struct verify_state *state = arg;
+    krb5_context context = state->context;
+    krb5_kdcpreauth_modreq modreq = NULL;
+    char **sp;
+
+    if (retval)
+        goto cleanup;
+
+    if (state->is_signed && state->plgctx->auth_indicators != NULL) {
+        /* Assert configured authentication indicators. */
+        for (sp = state->plgctx->auth_indicators; *sp != NULL; sp++) {
+            retval = state->cb->add_auth_indicator(context, state->rock, *sp);
+            if (retval)
+                goto cleanup;
+        }
+    }
+
+    /* remember to set the PREAUTH flag in the reply */
+    state->enc_tkt_reply->flags |= TKT_FLG_PRE_AUTH;
+    modreq = (krb5_kdcpreauth_modreq)state->reqctx;
+    state->reqctx = NULL;
+
+cleanup:
+    if (state->reqctx != NULL)
+        pkinit_fini_kdc_req_context(context, state->reqctx);
+    (*state->respond)(state->arg, retval, modreq, state->e_data, NULL);
+    free(state);
+}
+
+/* Return true if the KDC's identity may be used from more than one thread at
+ * a time.  PKCS#11 sessions may not be, nor may any identity if the crypto
+ * library isn't thread-safe. */
+static krb5_boolean
+identity_is_thread_safe(pkinit_kdc_context plgctx)
+{
+    int idtype = plgctx->idopts->idtype;
+
+    if (!crypto_thread_safe())
+        return FALSE;
+    return idtype == IDTYPE_FILE || idtype == IDTYPE_DIR ||
+        idtype == IDTYPE_PKCS12;
+}
+
+static void
+pkinit_server_verify_padata(krb5_context context,
+                            krb5_data *req_pkt,
+                            krb5_kdc_req * request,
+                            krb5_enc_tkt_part * enc_tkt_reply,
+                            krb5_pa_data * data,
+                            krb5_kdcpreauth_callbacks cb,
+                            krb5_kdcpreauth_rock rock,
+                            krb5_kdcpreauth_moddata moddata,
+                            krb5_kdcpreauth_verify_respond_fn respond,
+                            void *arg)
+{
+    krb5_error_code retval = 0;
+    pkinit_kdc_context plgctx = NULL;
+    pkinit_kdc_req_context reqctx = NULL;
+    struct verify_state *state;
+
+    pkiDebug("pkinit_verify_padata: entered!\n");
+    if (data == NULL || data->length <= 0 || data->contents == NULL) {
+        (*respond)(arg, EINVAL, NULL, NULL, NULL);
+        return;
+    }
+
+
+    if (moddata == NULL) {
+        (*respond)(arg, EINVAL, NULL, NULL, NULL);
+        return;
+    }
+
+    plgctx = pkinit_find_realm_context(context, moddata, request->server);
+    if (plgctx == NULL) {
+        (*respond)(arg, EINVAL, NULL, NULL, NULL);
+        return;
+    }
+
+#ifdef DEBUG_ASN1
+    print_buffer_bin(data->contents, data->length, "/tmp/kdc_as_req");
+#endif
+    /* create a per-request context */
+    retval = pkinit_init_kdc_req_context(context, &reqctx);
+    if (retval) {
+        (*respond)(arg, retval, NULL, NULL, NULL);
+        return;
+    }
+    reqctx->pa_type = data->pa_type;
+
+    state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        pkinit_fini_kdc_req_context(context, reqctx);
+        (*respond)(arg, ENOMEM, NULL, NULL, NULL);
+        return;
+    }
+    state->context = context;
+    state->request = request;
+    state->enc_tkt_reply = enc_tkt_reply;
+    state->data = data;
+    state->der_req = cb->request_body(context, rock);
+    state->cb = cb;
+    state->rock = rock;
+    state->respond = respond;
+    state->arg = arg;
+    state->plgctx = plgctx;
+    state->reqctx = reqctx;
+
+    /* Let the KDC run the cryptographic work on another thread if it can. */
+    if (cb->vers >= 4 && identity_is_thread_safe(plgctx))
+        cb->offload(context, rock, verify_request, verify_done, state);
+    else
+        verify_done(state, verify_request(context, state));
 }
+
 static krb5_error_code
 return_pkinit_kx(krb5_context context, krb5_kdc_req *request,
                  krb5_kdc_rep *reply, krb5_keyblock *encrypting_key,
@@ -686,9 +851,7 @@ pkinit_server_return_padata(krb5_context context,
     krb5_pa_pk_as_req_draft9 *reqp9 = NULL;
     int i = 0;
 
-    unsigned char *subjectPublicKey = NULL;
     unsigned char *dh_pubkey = NULL, *server_key = NULL;
-    unsigned int subjectPublicKey_len = 0;
     unsigned int server_key_len = 0, dh_pubkey_len = 0;
 
     krb5_kdc_dh_key_info dhkey_info;
@@ -778,42 +941,34 @@ pkinit_server_return_padata(krb5_context context,
 
     if (reqctx->rcv_auth_pack != NULL &&
         reqctx->rcv_auth_pack->clientPublicValue != NULL) {
-        subjectPublicKey = (unsigned char *)
-            reqctx->rcv_auth_pack->clientPublicValue->subjectPublicKey.data;
-        subjectPublicKey_len =
-            reqctx->rcv_auth_pack->clientPublicValue->subjectPublicKey.length;
         rep->choice = choice_pa_pk_as_rep_dhInfo;
     } else if (reqctx->rcv_auth_pack9 != NULL &&
                reqctx->rcv_auth_pack9->clientPublicValue != NULL) {
-        subjectPublicKey = (unsigned char *)
-            reqctx->rcv_auth_pack9->clientPublicValue->subjectPublicKey.data;
-        subjectPublicKey_len =
-            reqctx->rcv_auth_pack9->clientPublicValue->subjectPublicKey.length;
         rep9->choice = choice_pa_pk_as_rep_draft9_dhSignedData;
     }
 
-    /* if this DH, then process finish computing DH key */
-    if (rep != NULL && (rep->choice == choice_pa_pk_as_rep_dhInfo ||
-                        rep->choice == choice_pa_pk_as_rep_draft9_dhSignedData)) {
+    if (rep != NULL && rep->choice == choice_pa_pk_as_rep_dhInfo) {
         pkiDebug("received DH key delivery AS REQ\n");
-        retval = server_process_dh(context, plgctx->cryptoctx,
-                                   reqctx->cryptoctx, plgctx->idctx, subjectPublicKey,
-                                   subjectPublicKey_len, &dh_pubkey, &dh_pubkey_len,
-                                   &server_key, &server_key_len);
-        if (retval) {
-            pkiDebug("failed to process/create dh paramters\n");
-            goto cleanup;
-        }
-    }
-    if ((rep9 != NULL &&
-         rep9->choice == choice_pa_pk_as_rep_draft9_dhSignedData) ||
-        (rep != NULL && rep->choice == choice_pa_pk_as_rep_dhInfo)) {
 
         /*
-         * This is DH, so don't generate the key until after we
-         * encode the reply, because the encoded reply is needed
-         * to generate the key in some cases.
+         * verify_padata normally performs the key agreement and signs our
+         * public value.  This is DH, so don't generate the key until after
+         * we encode the reply, because the encoded reply is needed to
+         * generate the key in some cases.
          */
+        if (reqctx->server_key == NULL) {
+            retval = make_dh_reply(context, plgctx, reqctx, request->nonce);
+            if (retval)
+                goto cleanup;
+        }
+        rep->u.dh_Info.dhSignedData = reqctx->dh_signed_data;
+        reqctx->dh_signed_data = empty_data();
+        server_key = reqctx->server_key;
+        server_key_len = reqctx->server_key_len;
+        reqctx->server_key = NULL;
+    } else if (rep9 != NULL &&
+               rep9->choice == choice_pa_pk_as_rep_draft9_dhSignedData) {
+        pkiDebug("received DH key delivery AS REQ\n");
 
         dhkey_info.subjectPublicKey.length = dh_pubkey_len;
         dhkey_info.subjectPublicKey.data = (char *)dh_pubkey;
@@ -832,38 +987,18 @@ pkinit_server_return_padata(krb5_context context,
                          "/tmp/kdc_dh_key_info");
 #endif
 
-        switch ((int)padata->pa_type) {
-        case KRB5_PADATA_PK_AS_REQ:
-            retval = cms_signeddata_create(context, plgctx->cryptoctx,
-                                           reqctx->cryptoctx, plgctx->idctx, CMS_SIGN_SERVER, 1,
-                                           (unsigned char *)
-                                           encoded_dhkey_info->data,
-                                           encoded_dhkey_info->length,
-                                           (unsigned char **)
-                                           &rep->u.dh_Info.dhSignedData.data,
-                                           &rep->u.dh_Info.dhSignedData.length);
-            if (retval) {
-                pkiDebug("failed to create pkcs7 signed data\n");
-                goto cleanup;
-            }
-            break;
-        case KRB5_PADATA_PK_AS_REP_OLD:
-        case KRB5_PADATA_PK_AS_REQ_OLD:
-            retval = cms_signeddata_create(context, plgctx->cryptoctx,
-                                           reqctx->cryptoctx, plgctx->idctx, CMS_SIGN_DRAFT9, 1,
-                                           (unsigned char *)
-                                           encoded_dhkey_info->data,
-                                           encoded_dhkey_info->length,
-                                           (unsigned char **)
-                                           &rep9->u.dhSignedData.data,
-                                           &rep9->u.dhSignedData.length);
-            if (retval) {
-                pkiDebug("failed to create pkcs7 signed data\n");
-                goto cleanup;
-            }
-            break;
+        retval = cms_signeddata_create(context, plgctx->cryptoctx,
+                                       reqctx->cryptoctx, plgctx->idctx, CMS_SIGN_DRAFT9, 1,
+                                       (unsigned char *)
+                                       encoded_dhkey_info->data,
+                                       encoded_dhkey_info->length,
+                                       (unsigned char **)
+                                       &rep9->u.dhSignedData.data,
+                                       &rep9->u.dhSignedData.length);
+        if (retval) {
+            pkiDebug("failed to create pkcs7 signed data\n");
+            goto cleanup;
         }
-
     } else {
         pkiDebug("received RSA key delivery AS REQ\n");
 
@@ -1150,7 +1285,7 @@ static krb5_error_code
 pkinit_init_kdc_profile(krb5_context context, pkinit_kdc_context plgctx)
 {
     krb5_error_code retval;
-    char *eku_string = NULL;
+    char *eku_string = NULL, *dh_min_bits = NULL;
 
     pkiDebug("%s: entered for realm %s\n", __FUNCTION__, plgctx->realmname);
     retval = pkinit_kdcdefault_string(context, plgctx->realmname,
@@ -1187,10 +1322,12 @@ pkinit_init_kdc_profile(krb5_context context, pkinit_kdc_context plgctx)
                              KRB5_CONF_PKINIT_KDC_OCSP,
                              &plgctx->idopts->ocsp);
 
-    pkinit_kdcdefault_integer(context, plgctx->realmname,
-                              KRB5_CONF_PKINIT_DH_MIN_BITS,
-                              PKINIT_DEFAULT_DH_MIN_BITS,
-                              &plgctx->opts->dh_min_bits);
+    pkinit_kdcdefault_string(context, plgctx->realmname,
+                             KRB5_CONF_PKINIT_DH_MIN_BITS, &dh_min_bits);
+    if (dh_min_bits != NULL) {
+        plgctx->opts->dh_min_bits = pkinit_parse_dh_min_bits(dh_min_bits);
+        free(dh_min_bits);
+    }
     if (plgctx->opts->dh_min_bits < PKINIT_DH_MIN_CONFIG_BITS) {
         pkiDebug("%s: invalid value (%d < %d) for pkinit_dh_min_bits, "
                  "using default value (%d) instead\n", __FUNCTION__,
@@ -1207,6 +1344,14 @@ pkinit_init_kdc_profile(krb5_context context, pkinit_kdc_context plgctx)
                               KRB5_CONF_PKINIT_REQUIRE_CRL_CHECKING,
                               0, &plgctx->opts->require_crl_checking);
 
+    pkinit_kdcdefault_integer(context, plgctx->realmname,
+                              KRB5_CONF_PKINIT_VERIFY_CACHE_TTL,
+                              0, &plgctx->opts->verify_cache_ttl);
+
+    pkinit_kdcdefault_integer(context, plgctx->realmname,
+                              KRB5_CONF_PKINIT_KEYPAIR_POOL_SIZE,
+                              0, &plgctx->opts->keypair_pool_size);
+
     pkinit_kdcdefault_string(context, plgctx->realmname,
                              KRB5_CONF_PKINIT_EKU_CHECKING,
                              &eku_string);
@@ -1269,6 +1414,7 @@ pkinit_server_plugin_init_realm(krb5_context context, const char *realmname,
 {
     krb5_error_code retval = ENOMEM;
     pkinit_kdc_context plgctx = NULL;
+    int preauth_threads = 0;
 
     *pplgctx = NULL;
 
@@ -1317,6 +1463,34 @@ pkinit_server_plugin_init_realm(krb5_context context, const char *realmname,
     if (retval)
         goto errout;
 
+    retval = crypto_init_verify_cache(context, plgctx->cryptoctx,
+                                      plgctx->idctx,
+                                      plgctx->opts->verify_cache_ttl);
+    if (retval)
+        goto errout;
+
+    /* Both of these would use the crypto library from other threads. */
+    if (!crypto_thread_safe()) {
+        pkinit_kdcdefault_integer(context, realmname,
+                                  KRB5_CONF_KDC_PREAUTH_THREADS, 0,
+                                  &preauth_threads);
+        if (preauth_threads > 0) {
+            com_err("pkinit", 0, _("PKINIT requests will not use "
+                                   "kdc_preauth_threads: the crypto library "
+                                   "is not thread-safe"));
+        }
+        if (plgctx->opts->keypair_pool_size > 0) {
+            com_err("pkinit", 0, _("Ignoring pkinit_keypair_pool_size: the "
+                                   "crypto library is not thread-safe"));
+            plgctx->opts->keypair_pool_size = 0;
+        }
+    }
+
+    retval = crypto_init_keypair_pool(context, plgctx->cryptoctx,
+                                      plgctx->opts->keypair_pool_size);
+    if (retval)
+        goto errout;
+
     pkiDebug("%s: returning context at %p for realm '%s'\n",
              __FUNCTION__, plgctx, realmname);
     *pplgctx = plgctx;
@@ -1460,6 +1634,11 @@ pkinit_fini_kdc_req_context(krb5_context context, void *ctx)
         free_krb5_auth_pack(&reqctx->rcv_auth_pack);
     if (reqctx->rcv_auth_pack9 != NULL)
         free_krb5_auth_pack_draft9(context, &reqctx->rcv_auth_pack9);
+    if (reqctx->server_key != NULL) {
+        zap(reqctx->server_key, reqctx->server_key_len);
+        free(reqctx->server_key);
+    }
+    free(reqctx->dh_signed_data.data);
 
     free(reqctx);
 }
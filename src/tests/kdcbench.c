@@ -0,0 +1,526 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* tests/kdcbench.c - KDC load generator and throughput benchmark */
+/*
+ * Copyright (C) 2026 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program sends a stream of requests to a KDC and reports the throughput,
+ * latency percentiles, and errors observed.  It is run as:
+ *
+ *     kdcbench [-T] [-n count] [-c concurrency] [-r rate] [-w timeout]
+ *              [-k keytab] host port client [service]
+ *
+ * The client's keys are read from the keytab (or the default client keytab).
+ * If no service is given, the requests are AS-REQs for the client with
+ * encrypted timestamp padata.  If a service is given, kdcbench first obtains
+ * a TGT for the client and the requests are TGS-REQs for the service.  All
+ * requests are built before the first one is sent, so that client-side
+ * cryptography is not included in the measurement, and each request is
+ * distinct so that the KDC cannot answer it from its lookaside cache.
+ *
+ * Requests are sent over UDP, or over TCP with one connection per request if
+ * -T is given.  At most concurrency requests (default 1) are outstanding at a
+ * time.  If -r is given, requests are scheduled at the given rate per second
+ * and latency is measured from the scheduled send time, so that a KDC which
+ * falls behind is charged for the queueing delay it causes; otherwise each
+ * request is sent as soon as a previous one completes.  A request receiving no
+ * reply within timeout milliseconds (default 5000) is counted as timed out.
+ */
+
+#include "k5-int.h"
+#include "port-sockets.h"
+#include "socket-utils.h"
+#include <poll.h>
+#include <time.h>
+
+enum slot_state { IDLE, CONNECTING, RECEIVING };
+
+struct slot {
+    enum slot_state state;
+    int fd;
+    size_t req;                 /* Index of the outstanding request */
+    uint64_t start;             /* When the request was sent or scheduled */
+    unsigned char *buf;         /* Reply data */
+    size_t len;
+    size_t alloc;
+};
+
+static krb5_context ctx;
+static int use_tcp;
+static struct sockaddr_storage kdc_addr;
+static socklen_t kdc_addrlen;
+
+/* Outcome counts, indexed by KDC error code, plus transport failures. */
+static unsigned long err_counts[128], other_errors, timeouts, net_errors;
+static unsigned long succeeded;
+static uint64_t *latencies;
+static size_t nlatencies;
+
+static void
+check(krb5_error_code code)
+{
+    const char *errmsg;
+
+    if (code) {
+        errmsg = krb5_get_error_message(ctx, code);
+        fprintf(stderr, "%s\n", errmsg);
+        krb5_free_error_message(ctx, errmsg);
+        exit(1);
+    }
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: kdcbench [-T] [-n count] [-c concurrency] "
+            "[-r rate] [-w timeout]\n"
+            "                [-k keytab] host port client [service]\n");
+    exit(1);
+}
+
+/* Return the current time in microseconds from an arbitrary origin. */
+static uint64_t
+now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+/* Build count AS-REQs for client with optimistic encrypted timestamp
+ * padata. */
+static void
+make_as_reqs(krb5_principal client, krb5_keytab keytab, size_t count,
+             krb5_data *reqs)
+{
+    krb5_get_init_creds_opt *opt;
+    krb5_init_creds_context icc;
+    krb5_preauthtype pa_type = KRB5_PADATA_ENC_TIMESTAMP;
+    krb5_data empty = empty_data(), realm;
+    unsigned int flags;
+    size_t i;
+
+    check(krb5_get_init_creds_opt_alloc(ctx, &opt));
+    krb5_get_init_creds_opt_set_preauth_list(opt, &pa_type, 1);
+    for (i = 0; i < count; i++) {
+        check(krb5_init_creds_init(ctx, client, NULL, NULL, 0, opt, &icc));
+        check(krb5_init_creds_set_keytab(ctx, icc, keytab));
+        check(krb5_init_creds_step(ctx, icc, &empty, &reqs[i], &realm,
+                                   &flags));
+        krb5_free_data_contents(ctx, &realm);
+        krb5_init_creds_free(ctx, icc);
+    }
+    krb5_get_init_creds_opt_free(ctx, opt);
+}
+
+/* Obtain a TGT for client and build count TGS-REQs for server with it. */
+static void
+make_tgs_reqs(krb5_principal client, krb5_keytab keytab,
+              krb5_principal server, size_t count, krb5_data *reqs)
+{
+    krb5_ccache ccache;
+    krb5_creds tgt, in_creds;
+    krb5_tkt_creds_context tcc;
+    krb5_data empty = empty_data(), realm;
+    unsigned int flags;
+    size_t i;
+
+    check(krb5_get_init_creds_keytab(ctx, &tgt, client, keytab, 0, NULL,
+                                     NULL));
+    check(krb5_cc_new_unique(ctx, "MEMORY", NULL, &ccache));
+    check(krb5_cc_initialize(ctx, ccache, client));
+    check(krb5_cc_store_cred(ctx, ccache, &tgt));
+    krb5_free_cred_contents(ctx, &tgt);
+
+    memset(&in_creds, 0, sizeof(in_creds));
+    in_creds.client = client;
+    in_creds.server = server;
+    for (i = 0; i < count; i++) {
+        check(krb5_tkt_creds_init(ctx, ccache, &in_creds, 0, &tcc));
+        check(krb5_tkt_creds_step(ctx, tcc, &empty, &reqs[i], &realm,
+                                  &flags));
+        krb5_free_data_contents(ctx, &realm);
+        krb5_tkt_creds_free(ctx, tcc);
+    }
+    krb5_cc_destroy(ctx, ccache);
+}
+
+static void
+resolve_kdc(const char *host, const char *port)
+{
+    struct addrinfo hints, *ai;
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = use_tcp ? SOCK_STREAM : SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    ret = getaddrinfo(host, port, &hints, &ai);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(ret));
+        exit(1);
+    }
+    memcpy(&kdc_addr, ai->ai_addr, ai->ai_addrlen);
+    kdc_addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+}
+
+/* Record the outcome of the request in slot and make it idle again. */
+static void
+finish(struct slot *s, uint64_t now, krb5_boolean timed_out)
+{
+    krb5_data reply = make_data(s->buf, s->len);
+    krb5_error *err;
+
+    if (timed_out) {
+        timeouts++;
+    } else if (s->len == 0) {
+        net_errors++;
+    } else if (krb5_is_as_rep(&reply) || krb5_is_tgs_rep(&reply)) {
+        succeeded++;
+        latencies[nlatencies++] = now - s->start;
+    } else if (krb5_is_krb_error(&reply) &&
+               krb5_rd_error(ctx, &reply, &err) == 0) {
+        if (err->error >= 0 && err->error < 128)
+            err_counts[err->error]++;
+        else
+            other_errors++;
+        krb5_free_error(ctx, err);
+    } else {
+        other_errors++;
+    }
+
+    close(s->fd);
+    s->fd = -1;
+    s->len = 0;
+    s->state = IDLE;
+}
+
+/* Open a socket for req in slot s and, for UDP, send it. */
+static void
+start(struct slot *s, size_t req, const krb5_data *data, uint64_t when)
+{
+    s->req = req;
+    s->start = when;
+    s->len = 0;
+    s->fd = socket(kdc_addr.ss_family, use_tcp ? SOCK_STREAM : SOCK_DGRAM,
+                   0);
+    if (s->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (fcntl(s->fd, F_SETFL, O_NONBLOCK) != 0) {
+        perror("fcntl");
+        exit(1);
+    }
+    if (connect(s->fd, ss2sa(&kdc_addr), kdc_addrlen) != 0 &&
+        errno != EINPROGRESS) {
+        s->state = RECEIVING;
+        finish(s, now_us(), FALSE);
+        return;
+    }
+    if (use_tcp) {
+        s->state = CONNECTING;
+        return;
+    }
+    s->state = RECEIVING;
+    if (send(s->fd, data->data, data->length, 0) != (ssize_t)data->length)
+        finish(s, now_us(), FALSE);
+}
+
+/* Send the length-prefixed request on a connected TCP socket.  Requests are
+ * small enough to fit in the socket buffer of a fresh connection. */
+static void
+send_tcp(struct slot *s, const krb5_data *data)
+{
+    unsigned char lenbuf[4];
+    struct iovec iov[2];
+    ssize_t len;
+
+    store_32_be(data->length, lenbuf);
+    iov[0].iov_base = lenbuf;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = data->data;
+    iov[1].iov_len = data->length;
+    len = writev(s->fd, iov, 2);
+    s->state = RECEIVING;
+    if (len != (ssize_t)data->length + 4)
+        finish(s, now_us(), FALSE);
+}
+
+/* Read reply data into slot s, finishing the request if the reply is
+ * complete or the read fails. */
+static void
+receive(struct slot *s)
+{
+    ssize_t len;
+    size_t need;
+
+    if (s->alloc - s->len < 4096) {
+        s->alloc = s->alloc * 2 + 4096;
+        s->buf = realloc(s->buf, s->alloc);
+        if (s->buf == NULL)
+            abort();
+    }
+    len = recv(s->fd, s->buf + s->len, s->alloc - s->len, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (len <= 0) {
+        s->len = 0;
+        finish(s, now_us(), FALSE);
+        return;
+    }
+    s->len += len;
+    if (!use_tcp) {
+        finish(s, now_us(), FALSE);
+        return;
+    }
+
+    /* Wait for the whole length-prefixed reply, then strip the prefix. */
+    if (s->len < 4)
+        return;
+    need = load_32_be(s->buf);
+    if (s->len - 4 < need)
+        return;
+    memmove(s->buf, s->buf + 4, need);
+    s->len = need;
+    finish(s, now_us(), FALSE);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Return the latency at or below which frac of the successful requests
+ * completed. */
+static uint64_t
+percentile(double frac)
+{
+    size_t i;
+
+    if (nlatencies == 0)
+        return 0;
+    i = (size_t)(frac * nlatencies);
+    return latencies[(i < nlatencies) ? i : nlatencies - 1];
+}
+
+static void
+report(size_t count, uint64_t elapsed)
+{
+    const char *msg;
+    int i;
+
+    qsort(latencies, nlatencies, sizeof(*latencies), cmp_u64);
+    printf("requests: %lu\n", (unsigned long)count);
+    printf("succeeded: %lu\n", succeeded);
+    printf("elapsed: %.3f s\n", elapsed / 1e6);
+    printf("throughput: %.1f requests/s\n",
+           elapsed ? succeeded * 1e6 / elapsed : 0.0);
+    printf("latency p50: %lu us\n", (unsigned long)percentile(0.50));
+    printf("latency p99: %lu us\n", (unsigned long)percentile(0.99));
+    printf("latency p999: %lu us\n", (unsigned long)percentile(0.999));
+    printf("latency max: %lu us\n",
+           (unsigned long)(nlatencies ? latencies[nlatencies - 1] : 0));
+    for (i = 0; i < 128; i++) {
+        if (err_counts[i] == 0)
+            continue;
+        msg = krb5_get_error_message(ctx, ERROR_TABLE_BASE_krb5 + i);
+        printf("error %d: %lu (%s)\n", i, err_counts[i], msg);
+        krb5_free_error_message(ctx, msg);
+    }
+    if (other_errors)
+        printf("malformed replies: %lu\n", other_errors);
+    if (net_errors)
+        printf("network errors: %lu\n", net_errors);
+    if (timeouts)
+        printf("timeouts: %lu\n", timeouts);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_principal client, server = NULL;
+    krb5_keytab keytab;
+    krb5_data *reqs;
+    struct slot *slots;
+    struct pollfd *pfds;
+    const char *ktname = NULL;
+    size_t count = 100, next = 0, done = 0, i;
+    unsigned long concurrency = 1;
+    double rate = 0;
+    uint64_t timeout = 5000000, begin, now, when, wait, deadline;
+    int c, npfds, *pfd_slot;
+
+    while ((c = getopt(argc, argv, "Tn:c:r:w:k:")) != -1) {
+        switch (c) {
+        case 'T':
+            use_tcp = 1;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            concurrency = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        case 'w':
+            timeout = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'k':
+            ktname = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 3 && argc != 4)
+        usage();
+    if (count == 0 || concurrency == 0 || rate < 0)
+        usage();
+
+    check(krb5_init_context(&ctx));
+    check(krb5_parse_name(ctx, argv[2], &client));
+    if (argc == 4)
+        check(krb5_parse_name(ctx, argv[3], &server));
+    if (ktname != NULL)
+        check(krb5_kt_resolve(ctx, ktname, &keytab));
+    else
+        check(krb5_kt_client_default(ctx, &keytab));
+    resolve_kdc(argv[0], argv[1]);
+
+    reqs = calloc(count, sizeof(*reqs));
+    latencies = calloc(count, sizeof(*latencies));
+    slots = calloc(concurrency, sizeof(*slots));
+    pfds = calloc(concurrency, sizeof(*pfds));
+    pfd_slot = calloc(concurrency, sizeof(*pfd_slot));
+    if (reqs == NULL || latencies == NULL || slots == NULL || pfds == NULL ||
+        pfd_slot == NULL)
+        abort();
+    if (server != NULL)
+        make_tgs_reqs(client, keytab, server, count, reqs);
+    else
+        make_as_reqs(client, keytab, count, reqs);
+    for (i = 0; i < concurrency; i++)
+        slots[i].fd = -1;
+
+    begin = now_us();
+    while (done < count) {
+        now = now_us();
+
+        /* Start requests which are due, as far as the free slots allow. */
+        for (i = 0; i < concurrency && next < count; i++) {
+            if (slots[i].state != IDLE)
+                continue;
+            when = (rate > 0) ? begin + (uint64_t)(next * 1e6 / rate) : now;
+            if (when > now)
+                break;
+            start(&slots[i], next, &reqs[next], when);
+            next++;
+            if (slots[i].state == IDLE)
+                done++;
+        }
+
+        /* Time out requests, and wait for the rest or for the next scheduled
+         * send time. */
+        wait = timeout;
+        if (rate > 0 && next < count) {
+            when = begin + (uint64_t)(next * 1e6 / rate);
+            wait = (when > now) ? when - now : 0;
+        }
+        npfds = 0;
+        for (i = 0; i < concurrency; i++) {
+            if (slots[i].state == IDLE)
+                continue;
+            deadline = slots[i].start + timeout;
+            if (deadline <= now) {
+                finish(&slots[i], now, TRUE);
+                done++;
+                continue;
+            }
+            if (deadline - now < wait)
+                wait = deadline - now;
+            pfds[npfds].fd = slots[i].fd;
+            pfds[npfds].events = (slots[i].state == CONNECTING) ? POLLOUT :
+                POLLIN;
+            pfd_slot[npfds++] = i;
+        }
+        if (npfds == 0 && wait == timeout)
+            continue;
+        if (poll(pfds, npfds, (wait + 999) / 1000) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+
+        for (c = 0; c < npfds; c++) {
+            struct slot *s = &slots[pfd_slot[c]];
+
+            if (pfds[c].revents == 0)
+                continue;
+            if (s->state == CONNECTING)
+                send_tcp(s, &reqs[s->req]);
+            else
+                receive(s);
+            if (s->state == IDLE)
+                done++;
+        }
+    }
+    report(count, now_us() - begin);
+
+    for (i = 0; i < count; i++)
+        krb5_free_data_contents(ctx, &reqs[i]);
+    for (i = 0; i < concurrency; i++)
+        free(slots[i].buf);
+    free(reqs);
+    free(latencies);
+    free(slots);
+    free(pfds);
+    free(pfd_slot);
+    krb5_kt_close(ctx, keytab);
+    krb5_free_principal(ctx, client);
+    krb5_free_principal(ctx, server);
+    krb5_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#!/usr/bin/python
+from k5test import *
+
+# Parse the kdcbench report into a dictionary.
+def parse(out):
+    report = {}
+    for line in out.splitlines():
+        key, value = line.split(': ', 1)
+        report[key] = value
+    return report
+
+def bench(realm, args, expected_ok, service=None):
+    cmd = ['./kdcbench', '-k', keytab] + args
+    cmd += ['127.0.0.1', str(realm.portbase), realm.user_princ]
+    if service is not None:
+        cmd.append(service)
+    report = parse(realm.run(cmd))
+    if report['succeeded'] != str(expected_ok):
+        fail('kdcbench succeeded count %s, expected %d' %
+             (report['succeeded'], expected_ok))
+    for key in ('throughput', 'latency p50', 'latency p99', 'latency p999'):
+        if key not in report:
+            fail('kdcbench report is missing %s' % key)
+    return report
+
+realm = K5Realm(get_creds=False)
+keytab = os.path.join(realm.testdir, 'user.keytab')
+realm.run([kadminl, 'ktadd', '-k', keytab, '-norandkey', realm.user_princ])
+realm.run([kadminl, 'modprinc', '+requires_preauth', realm.user_princ])
+
+# AS and TGS requests, closed-loop over UDP and TCP.
+bench(realm, ['-n', '50'], 50)
+bench(realm, ['-n', '50', '-c', '4', '-T'], 50)
+bench(realm, ['-n', '50', '-c', '4'], 50, realm.host_princ)
+bench(realm, ['-n', '50', '-T'], 50, realm.host_princ)
+
+# Rate-limited requests against worker processes.
+realm.stop_kdc()
+realm.start_kdc(['-w', '2'])
+bench(realm, ['-n', '40', '-c', '8', '-r', '200'], 40)
+
+# KDC errors are reported by code.
+realm.run([kadminl, 'modprinc', '+disallow_svr', realm.host_princ])
+report = bench(realm, ['-n', '10'], 0, realm.host_princ)
+if not report.get('error 27', '').startswith('10 '):
+    fail('kdcbench did not report KDC_ERR_MUST_USE_USER2USER')
+
+success('kdcbench')
@@ -0,0 +1,27 @@
+#!/usr/bin/python
+from k5test import *
+
+# With keep_open, the KDC keeps its DB2 handle open between lookups.
+# Make sure that it still sees changes made by other processes, both
+# in place and by replacing the database file.
+conf = {'dbmodules': {'db': {'keep_open': 'true'}}}
+realm = K5Realm(krb5_conf=conf)
+
+def check_kvno(n):
+    realm.kinit(realm.user_princ, password('user'))
+    output = realm.run([kvno, realm.host_princ])
+    if ('kvno = %d' % n) not in output:
+        fail('Expected kvno %d' % n)
+
+check_kvno(1)
+realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+check_kvno(2)
+
+dumpfile = os.path.join(realm.testdir, 'dump')
+realm.run([kdb5_util, 'dump', dumpfile])
+realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+check_kvno(3)
+realm.run([kdb5_util, 'load', dumpfile])
+check_kvno(2)
+
+success('DB2 keep_open')
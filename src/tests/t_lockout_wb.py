@@ -0,0 +1,59 @@
+#!/usr/bin/python
+from k5test import *
+
+# With lockout_flush_interval, the KDC holds lockout and last success
+# updates in memory and writes them out in batches.  Make sure that
+# lockout decisions still see the held-back failures, and that the
+# updates reach the database when the KDC exits.
+conf = {'dbmodules': {'db': {'lockout_flush_interval': '1h'}}}
+realm = K5Realm(krb5_conf=conf, create_host=False)
+
+def getprinc(princ, msg):
+    out = realm.run([kadminl, 'getprinc', princ])
+    if msg not in out:
+        fail('Expected output not seen: ' + msg)
+
+realm.run([kadminl, 'addpol', '-maxfailure', '3', '-failurecountinterval',
+           '5m', 'lockout'])
+realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+           'user'])
+
+# Failures below the threshold are held back.
+for i in range(2):
+    realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+getprinc('user', 'Failed password attempts: 0\n')
+
+# Reaching the threshold writes the failures out immediately.
+realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+getprinc('user', 'Failed password attempts: 3\n')
+out = realm.kinit(realm.user_princ, password('user'), expected_code=1)
+if 'credentials have been revoked' not in out:
+    fail('Expected lockout')
+realm.stop_kdc()
+getprinc('user', 'Failed password attempts: 3\n')
+
+# An administrative unlock takes effect despite the held-back failure
+# count, and a success afterwards is recorded at exit.
+realm.start_kdc()
+realm.run([kadminl, 'modprinc', '-unlock', 'user'])
+realm.kinit(realm.user_princ, password('user'))
+getprinc('user', 'Last successful authentication: [never]')
+realm.stop_kdc()
+getprinc('user', 'Failed password attempts: 0\n')
+out = realm.run([kadminl, 'getprinc', 'user'])
+if 'Last successful authentication: [never]' in out:
+    fail('Last successful authentication not recorded')
+
+# With worker processes, failures held back by each worker are added to
+# the stored count rather than replacing it.
+realm.addprinc('wuser', 'pw')
+realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+           'wuser'])
+realm.start_kdc(['-w', '2'])
+for i in range(2):
+    realm.kinit('wuser', 'wrong', expected_code=1)
+getprinc('wuser', 'Failed password attempts: 0\n')
+realm.stop_kdc()
+getprinc('wuser', 'Failed password attempts: 2\n')
+
+success('DB2 lockout write-behind')
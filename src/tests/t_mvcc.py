@@ -0,0 +1,105 @@
+#!/usr/bin/python
+from k5test import *
+
+conf = {'dbmodules': {'db': {'db_library': 'mvcc'}}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False)
+realm.start_kdc(['-t', '4'])
+
+def check_kvno(n):
+    realm.kinit(realm.user_princ, password('user'))
+    output = realm.run([kvno, realm.host_princ])
+    if ('kvno = %d' % n) not in output:
+        fail('Expected kvno %d' % n)
+
+def expect(args, msg, code=0, **kw):
+    out = realm.run(args, expected_code=code, **kw)
+    if msg not in out:
+        fail('Expected output not seen: ' + msg)
+
+def listprincs():
+    out = realm.run([kadminl, 'listprincs'])
+    return [l.split('@')[0] for l in out.splitlines() if l.startswith('p')]
+
+check_kvno(1)
+realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+check_kvno(2)
+
+# Add enough principals to split leaf and branch pages, then make sure
+# iteration returns all of them in order.
+n = 3000
+names = ['p%05d' % i for i in range(n)]
+realm.run([kadminl], input=''.join('addprinc -nokey %s\n' % p for p in names))
+if listprincs() != names:
+    fail('listprincs after bulk add')
+expect([kadminl, 'getprinc', 'p01234'], 'Principal: p01234@')
+
+# A value too large for a leaf page is stored in overflow pages.
+bigval = 'x' * 9000
+realm.run([kadminl, 'setstr', 'p00010', 'big', bigval])
+expect([kadminl, 'getstrs', 'p00010'], bigval)
+realm.run([kadminl, 'setstr', 'p00010', 'big', 'small'])
+expect([kadminl, 'getstrs', 'p00010'], 'big: small')
+
+# Remove most of the principals so that pages merge and the tree
+# shrinks, and make sure the remaining ones are intact.
+keep = names[::7]
+realm.run([kadminl], input=''.join('delprinc -force %s\n' % p
+                                   for p in names if p not in keep))
+if listprincs() != keep:
+    fail('listprincs after bulk delete')
+expect([kadminl, 'getprinc', 'p00001'], 'Principal does not exist', 1)
+expect([kadminl, 'getstrs', 'p00007'], '(No string')
+
+# Policies live in their own tree.
+realm.run([kadminl, 'addpol', '-minlength', '5', 'pol1'])
+expect([kadminl, 'addpol', 'pol1'], 'already exists', 1)
+realm.run([kadminl, 'modpol', '-minlength', '7', 'pol1'])
+expect([kadminl, 'getpol', 'pol1'], 'Minimum password length: 7')
+realm.run([kadminl, 'addpol', 'pol2'])
+out = realm.run([kadminl, 'listpols'])
+if out.split() != ['pol1', 'pol2']:
+    fail('listpols')
+realm.run([kadminl, 'delpol', 'pol2'])
+expect([kadminl, 'getpol', 'pol2'], 'Policy does not exist', 1)
+
+# Account lockout is recorded through the module.
+realm.run([kadminl, 'addpol', '-maxfailure', '2', '-failurecountinterval',
+           '5m', 'lockout'])
+realm.run([kadminl, 'modprinc', '+requires_preauth', '-policy', 'lockout',
+           'user'])
+for i in range(2):
+    realm.kinit(realm.user_princ, 'wrong', expected_code=1)
+out = realm.kinit(realm.user_princ, password('user'), expected_code=1)
+if 'credentials have been revoked' not in out:
+    fail('Expected lockout')
+realm.run([kadminl, 'modprinc', '-unlock', 'user'])
+realm.kinit(realm.user_princ, password('user'))
+
+# The KDC holds the file open across a load, which replaces it.
+dumpfile = os.path.join(realm.testdir, 'dump')
+realm.run([kdb5_util, 'dump', dumpfile])
+realm.run([kadminl, 'cpw', '-randkey', '-keepold', realm.host_princ])
+check_kvno(3)
+realm.run([kdb5_util, 'load', dumpfile])
+dump2 = os.path.join(realm.testdir, 'dump2')
+realm.run([kdb5_util, 'dump', dump2])
+if open(dumpfile).read() != open(dump2).read():
+    fail('dump differs after load')
+check_kvno(2)
+
+# An incremental load updates the database in one transaction.
+realm.run([kadminl, 'delprinc', '-force', 'p00014'])
+realm.run([kdb5_util, 'load', '-update', dumpfile])
+expect([kadminl, 'getprinc', 'p00014'], 'Principal: p00014@')
+
+# The database survives the KDC reading it concurrently with many
+# writes.
+realm.run([kadminl], input=''.join('cpw -randkey -keepold %s\n' %
+                                   realm.host_princ for i in range(20)))
+check_kvno(22)
+
+realm.stop_kdc()
+realm.run([kdb5_util, 'destroy', '-f'])
+realm.run([kadminl, 'listprincs'], expected_code=1)
+
+success('MVCC KDB module')
@@ -179,6 +179,18 @@ queue = Queue()
 
 realm = K5Realm(kdc_conf=conf)
 realm.run([kadminl, 'modprinc', '+requires_preauth', realm.user_princ])
+
+# Trace the KDC, to see whether it decodes the string attribute or uses
+# its cached decoding.
+kdc_trace = os.path.join(realm.testdir, 'kdc.trace')
+kdc_env = realm.env.copy()
+kdc_env['KRB5_TRACE'] = kdc_trace
+realm.stop_kdc()
+realm.start_kdc(env=kdc_env)
+
+def trace_count(msg):
+    with open(kdc_trace) as f:
+        return f.read().count(msg)
 flags = ['-T', realm.ccache]
 server_addr = '127.0.0.1:' + str(realm.portbase + 9)
 
@@ -203,6 +215,19 @@ out = realm.run(['./adata', realm.krbtgt_princ])
 if '+97: [indotp1, indotp2]' not in out:
     fail('auth indicators not seen in OTP ticket')
 
+# Repeat with the same string attribute, which the KDC should not need to
+# decode again.
+decoded = trace_count('Decoded OTP token configuration')
+daemon = UDPRadiusDaemon(args=(server_addr, secret_file, 'accept', queue))
+daemon.start()
+queue.get()
+realm.kinit(realm.user_princ, 'accept', flags=flags)
+verify(daemon, queue, True, realm.user_princ.split('@')[0], 'accept')
+if trace_count('Decoded OTP token configuration') != decoded:
+    fail('OTP token configuration decoded again')
+if trace_count('Using cached OTP token configuration') != 1:
+    fail('Cached OTP token configuration not used')
+
 # Repeat with an indicators override in the string attribute.
 daemon = UDPRadiusDaemon(args=(server_addr, secret_file, 'accept', queue))
 daemon.start()
@@ -211,6 +236,8 @@ oconf = otpconfig('udp', indicators=['indtok1', 'indtok2'])
 realm.run([kadminl, 'setstr', realm.user_princ, 'otp', oconf])
 realm.kinit(realm.user_princ, 'accept', flags=flags)
 verify(daemon, queue, True, realm.user_princ.split('@')[0], 'accept')
+if trace_count('Decoded OTP token configuration') != decoded + 1:
+    fail('Changed OTP token configuration not decoded')
 realm.extract_keytab(realm.krbtgt_princ, realm.keytab)
 out = realm.run(['./adata', realm.krbtgt_princ])
 if '+97: [indtok1, indtok2]' not in out:
@@ -1,4 +1,5 @@
 #!/usr/bin/python
+import re
 from k5test import *
 
 # Skip this test if pkinit wasn't built.
@@ -117,6 +118,98 @@ realm.kinit(realm.user_princ,
                    '-X', 'flag_RSA_PROTOCOL=yes'])
 realm.klist(realm.user_princ)
 
+# Try each of the MODP and elliptic curve groups on the client.
+for bits in ('4096', 'P-256', 'P-384', 'P-521'):
+    group_krb5_conf = {'realms': {'$realm': {'pkinit_dh_min_bits': bits}}}
+    group_env = realm.special_env('group', False, krb5_conf=group_krb5_conf)
+    realm.kinit(realm.user_princ,
+                flags=['-X', 'X509_user_identity=%s' % file_identity],
+                env=group_env)
+    realm.klist(realm.user_princ)
+
+# Require a stronger group on the KDC than the client offers at first; the
+# client should retry with a group from the KDC's TD-DH-PARAMETERS.
+group_kdc_conf = {'realms': {'$realm': {'pkinit_dh_min_bits': 'P-384'}}}
+group_env = realm.special_env('kdcgroup', True, kdc_conf=group_kdc_conf)
+realm.stop_kdc()
+realm.start_kdc(env=group_env)
+realm.kinit(realm.user_princ,
+            flags=['-X', 'X509_user_identity=%s' % file_identity])
+ec_krb5_conf = {'realms': {'$realm': {'pkinit_dh_min_bits': 'P-256'}}}
+ec_env = realm.special_env('ec', False, krb5_conf=ec_krb5_conf)
+realm.kinit(realm.user_princ,
+            flags=['-X', 'X509_user_identity=%s' % file_identity],
+            env=ec_env)
+realm.klist(realm.user_princ)
+realm.stop_kdc()
+realm.start_kdc()
+
+# Authenticate twice with the KDC caching client certificate chain
+# verifications; the second request should be satisfied from the cache.
+cache_kdc_conf = {'realms': {'$realm': {'pkinit_verify_cache_ttl': '300'}}}
+cache_env = realm.special_env('vcache', True, kdc_conf=cache_kdc_conf)
+realm.stop_kdc()
+realm.start_kdc(env=cache_env)
+realm.kinit(realm.user_princ,
+            flags=['-X', 'X509_user_identity=%s' % file_identity])
+realm.kinit(realm.user_princ,
+            flags=['-X', 'X509_user_identity=%s' % file_identity])
+realm.klist(realm.user_princ)
+realm.run([kvno, realm.host_princ])
+realm.stop_kdc()
+realm.start_kdc()
+
+# Authenticate several times with a pool of precomputed KDC keypairs, using
+# both MODP and elliptic curve groups.
+pool_kdc_conf = {'realms': {'$realm': {'pkinit_keypair_pool_size': '2'}}}
+pool_env = realm.special_env('kpool', True, kdc_conf=pool_kdc_conf)
+realm.stop_kdc()
+realm.start_kdc(env=pool_env)
+for i in range(4):
+    realm.kinit(realm.user_princ,
+                flags=['-X', 'X509_user_identity=%s' % file_identity])
+    realm.kinit(realm.user_princ,
+                flags=['-X', 'X509_user_identity=%s' % file_identity],
+                env=ec_env)
+realm.klist(realm.user_princ)
+realm.run([kvno, realm.host_princ])
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    m = re.findall(r'keypair pool: (\d+) of (\d+) keypairs', f.read())
+if not m or m[-1][1] != '8' or int(m[-1][0]) == 0:
+    fail('PKINIT keypair pool not used')
+realm.start_kdc()
+
+# Authenticate with PKINIT verification offloaded to KDC preauth threads,
+# including a request which fails verification.
+threads_kdc_conf = {'kdcdefaults': {'kdc_preauth_threads': '2'}}
+threads_env = realm.special_env('pathreads', True, kdc_conf=threads_kdc_conf)
+realm.stop_kdc()
+realm.start_kdc(env=threads_env)
+for i in range(3):
+    realm.kinit(realm.user_princ,
+                flags=['-X', 'X509_user_identity=%s' % file_identity])
+    realm.kinit(realm.user_princ,
+                flags=['-X', 'X509_user_identity=%s' % file_identity],
+                env=ec_env)
+out = realm.kinit(realm.host_princ,
+                  flags=['-X', 'X509_user_identity=%s' % file_identity],
+                  expected_code=1)
+if 'Client name mismatch' not in out:
+    fail('Expected error not seen for mismatched client name')
+realm.kinit(realm.user_princ,
+            flags=['-X', 'X509_user_identity=%s' % file_identity])
+realm.klist(realm.user_princ)
+realm.run([kvno, realm.host_princ])
+out = realm.run(['./adata', realm.host_princ])
+if '+97: [indpkinit1, indpkinit2]' not in out:
+    fail('auth indicators not seen in offloaded PKINIT ticket')
+realm.stop_kdc()
+with open(os.path.join(realm.testdir, 'kdc.log')) as f:
+    if 'created 2 preauth threads' not in f.read():
+        fail('KDC preauth threads not started')
+realm.start_kdc()
+
 # Run the basic test - PKINIT with FILE: identity, with a password on the key,
 # supplied by the prompter.
 # Expect failure if the responder does nothing, and we have no prompter.
@@ -147,6 +147,13 @@ Scripts may use the following functions and variables:
 * password(name): Return a weakly random password based on name.  The
   password will be consistent across calls with the same name.
 
+* der(tag, contents): Return a DER encoding of the byte string
+  contents with the given tag byte.
+
+* as_req(cname, realm): Return a minimal unauthenticated AS-REQ message
+  for the single-component client name cname in realm, suitable for
+  sending to the KDC directly over UDP.
+
 * stop_daemon(proc): Stop a daemon process started with
   realm.start_server() or realm.start_in_inetd().  Only necessary if
   the port needs to be reused; daemon processes will be stopped
@@ -425,6 +432,52 @@ def password(name):
     return name + str(os.getpid())
 
 
+def der(tag, contents):
+    """Return a DER encoding of contents with the given tag."""
+    n = len(contents)
+    if n < 128:
+        lenbytes = chr(n)
+    else:
+        lenbytes = ''
+        while n > 0:
+            lenbytes = chr(n & 0xFF) + lenbytes
+            n >>= 8
+        lenbytes = chr(0x80 | len(lenbytes)) + lenbytes
+    return chr(tag) + lenbytes + contents
+
+
+def _der_context(n, contents):
+    return der(0xA0 + n, contents)
+
+
+def _der_seq(*items):
+    return der(0x30, ''.join(items))
+
+
+def _der_integer(n):
+    return der(0x02, chr(n))
+
+
+def _der_princ(nametype, *comps):
+    names = _der_seq(*[der(0x1B, c) for c in comps])
+    return _der_seq(_der_context(0, _der_integer(nametype)),
+                    _der_context(1, names))
+
+
+def as_req(cname, realm):
+    """Return a minimal AS-REQ for the given client name in realm."""
+    body = _der_seq(_der_context(0, der(0x03, '\0\0\0\0\0')),
+                    _der_context(1, _der_princ(1, cname)),
+                    _der_context(2, der(0x1B, realm)),
+                    _der_context(3, _der_princ(2, 'krbtgt', realm)),
+                    _der_context(5, der(0x18, '20370101000000Z')),
+                    _der_context(7, _der_integer(42)),
+                    _der_context(8, _der_seq(_der_integer(18))))
+    return der(0x6A, _der_seq(_der_context(1, _der_integer(5)),
+                              _der_context(2, _der_integer(10)),
+                              _der_context(4, body)))
+
+
 # Exit handler which ensures processes are cleaned up and, on failure,
 # prints messages to help developers debug the problem.
 def _onexit():
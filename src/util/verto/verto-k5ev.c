@@ -45,6 +45,11 @@
 #ifdef HAVE_POLL_H
 #define EV_USE_POLL 1
 #endif
+/* Prefer epoll() where available; its cost does not grow with the number of
+ * file descriptors being watched. */
+#ifdef HAVE_SYS_EPOLL_H
+#define EV_USE_EPOLL 1
+#endif
 /* ev.c explicitly disables poll() on Mac or FreeBSD; fall back to select(). */
 #define EV_USE_SELECT 1
 #include "ev.c"